@@ -20,6 +20,9 @@
 #include "common/darktable.h" // for CLAMPS, dt_alloc_align, dt_free_align
 #include <glib.h>             // for MIN, MAX
 #include <math.h>             // for roundf
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 #include <stdlib.h>           // for size_t, free, malloc, NULL
 #include <string.h>           // for memset
 
@@ -30,6 +33,23 @@
 #define DT_COMMON_BILATERAL_MAX_RES_S 6000
 #define DT_COMMON_BILATERAL_MAX_RES_R 50
 
+// grid row (the lower one of the two splatted to) for image row j
+static inline int grid_row(const int size_y, const float sigma_s, const int j)
+{
+  const float y = CLAMPS(j / sigma_s, 0, size_y - 1);
+  return MIN((int)y, size_y - 2);
+}
+
+// grid rows y0 .. y0+sy-1 touched while splatting the band of image rows of thread t out of nthreads
+static inline void slab_rows(const int size_y, const float sigma_s, const int height, const int t,
+                             const int nthreads, int *y0, int *sy)
+{
+  const int j0 = (size_t)t * height / nthreads;
+  const int j1 = (size_t)(t + 1) * height / nthreads;
+  *y0 = grid_row(size_y, sigma_s, j0);
+  *sy = grid_row(size_y, sigma_s, j1 - 1) + 2 - *y0;
+}
+
 #ifndef HAVE_OPENCL
 // function definition on opencl path takes precedence
 size_t dt_bilateral_memory_use(const int width,     // width of input image
@@ -44,7 +64,19 @@ size_t dt_bilateral_memory_use(const int width,     // width of input image
   size_t size_y = CLAMPS((int)_y, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
   size_t size_z = CLAMPS((int)_z, 4, DT_COMMON_BILATERAL_MAX_RES_R) + 1;
 
-  return size_x * size_y * size_z * sizeof(float);
+  // the grid plus the per-thread slabs used while splatting, partitioned exactly as in
+  // dt_bilateral_splat(). every slab has at least two grid rows, so with many threads
+  // on a small grid they add up to much more than the grid itself.
+  const float sigma = MAX(height / (size_y - 1.0f), width / (size_x - 1.0f));
+  const int nthreads = CLAMPS(dt_get_num_threads(), 1, height);
+  size_t slabs = 0;
+  for(int t = 0; t < nthreads; t++)
+  {
+    int y0, sy;
+    slab_rows(size_y, sigma, height, t, nthreads, &y0, &sy);
+    slabs += (size_t)sy * size_x * size_z;
+  }
+  return (size_x * size_y * size_z + slabs) * sizeof(float);
 }
 
 // for the CPU path this is just an alias as no additional temp buffer is needed
@@ -120,18 +152,17 @@ dt_bilateral_t *dt_bilateral_init(const int width,     // width of input image
   return b;
 }
 
-void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
+// splat image rows j0 .. j1-1 into buf, which holds grid rows y0 .. y0+sy-1 for all z
+static void splat_rows(const dt_bilateral_t *const b, const float *const in, const int j0, const int j1,
+                       float *const buf, const int y0, const int sy)
 {
   const int ox = 1;
   const int oy = b->size_x;
-  const int oz = b->size_y * b->size_x;
-// splat into downsampled grid
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(b)
-#endif
-  for(int j = 0; j < b->height; j++)
+  const int oz = sy * b->size_x;
+  const float norm = 100.0f / (b->sigma_s * b->sigma_s);
+  for(int j = j0; j < j1; j++)
   {
-    size_t index = 4 * j * b->width;
+    size_t index = (size_t)4 * j * b->width;
     for(int i = 0; i < b->width; i++)
     {
       float x, y, z;
@@ -144,7 +175,7 @@ void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
       const float yf = y - yi;
       const float zf = z - zi;
       // nearest neighbour splatting:
-      const size_t grid_index = xi + b->size_x * (yi + b->size_y * zi);
+      const size_t grid_index = xi + b->size_x * ((yi - y0) + sy * zi);
       // sum up payload here, doesn't have to be same as edge stopping data
       // for cross bilateral applications.
       // also note that this is not clipped (as L->z is), so potentially hdr/out of gamut
@@ -153,17 +184,83 @@ void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
       {
         const size_t ii = grid_index + ((k & 1) ? ox : 0) + ((k & 2) ? oy : 0) + ((k & 4) ? oz : 0);
         const float contrib = ((k & 1) ? xf : (1.0f - xf)) * ((k & 2) ? yf : (1.0f - yf))
-                              * ((k & 4) ? zf : (1.0f - zf)) * 100.0f / (b->sigma_s * b->sigma_s);
-#ifdef _OPENMP
-#pragma omp atomic
-#endif
-        b->buf[ii] += contrib;
+                              * ((k & 4) ? zf : (1.0f - zf)) * norm;
+        buf[ii] += contrib;
       }
       index += 4;
     }
   }
 }
 
+void dt_bilateral_splat(dt_bilateral_t *b, const float *const in)
+{
+  // every thread splats a band of image rows into its own slab of grid rows, so no
+  // synchronisation is needed. neighbouring bands only share the grid rows at their
+  // borders, so all slabs together exceed the grid by about two rows per thread.
+  const int nthreads = CLAMPS(dt_get_num_threads(), 1, b->height);
+  int *const slab_y = malloc(sizeof(int) * 2 * nthreads);
+  size_t *const slab_offset = malloc(sizeof(size_t) * (nthreads + 1));
+  float *slabs = NULL;
+
+  if(slab_y && slab_offset)
+  {
+    slab_offset[0] = 0;
+    for(int t = 0; t < nthreads; t++)
+    {
+      slab_rows(b->size_y, b->sigma_s, b->height, t, nthreads, slab_y + 2 * t, slab_y + 2 * t + 1);
+      slab_offset[t + 1] = slab_offset[t] + (size_t)slab_y[2 * t + 1] * b->size_x * b->size_z;
+    }
+    slabs = dt_alloc_align(16, slab_offset[nthreads] * sizeof(float));
+  }
+
+  if(!slabs)
+  {
+    // not enough memory for the slabs, splat directly into the grid
+    splat_rows(b, in, 0, b->height, b->buf, 0, b->size_y);
+    free(slab_y);
+    free(slab_offset);
+    return;
+  }
+
+  memset(slabs, 0, slab_offset[nthreads] * sizeof(float));
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(b, slabs) schedule(static, 1)
+#endif
+  for(int t = 0; t < nthreads; t++)
+  {
+    const int j0 = (size_t)t * b->height / nthreads;
+    const int j1 = (size_t)(t + 1) * b->height / nthreads;
+    splat_rows(b, in, j0, j1, slabs + slab_offset[t], slab_y[2 * t], slab_y[2 * t + 1]);
+  }
+
+  // merge the slabs into the grid, one grid row (all x for given y and z) at a time
+  const int size_x = b->size_x;
+  const int size_y = b->size_y;
+  const int size_z = b->size_z;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(b, slabs) schedule(static)
+#endif
+  for(int zy = 0; zy < size_z * size_y; zy++)
+  {
+    const int z = zy / size_y;
+    const int y = zy - z * size_y;
+    float *const row = b->buf + (size_t)zy * size_x;
+    for(int t = 0; t < nthreads; t++)
+    {
+      const int y0 = slab_y[2 * t];
+      const int sy = slab_y[2 * t + 1];
+      if(y < y0 || y >= y0 + sy) continue;
+      const float *const slab_row = slabs + slab_offset[t] + ((size_t)z * sy + (y - y0)) * size_x;
+      for(int x = 0; x < size_x; x++) row[x] += slab_row[x];
+    }
+  }
+
+  dt_free_align(slabs);
+  free(slab_y);
+  free(slab_offset);
+}
+
 static void blur_line_z(float *buf, const int offset1, const int offset2, const int offset3, const int size1,
                         const int size2, const int size3)
 {
@@ -241,30 +338,111 @@ static void blur_line(float *buf, const int offset1, const int offset2, const in
 }
 
 
+// same filters as blur_line() (sign = 1) and blur_line_z() (w0 = 0, sign = -1), but for
+// lines along a strided direction offset3 whose neighbours are adjacent in memory: every
+// one of the size1 planes consists of size3 rows of size2 contiguous values. whole rows
+// are filtered at once, which keeps memory access sequential and vectorises well.
+static void blur_line_planar(float *buf, const int offset1, const int offset3, const int size1,
+                             const int size2, const int size3, const float w0, const float w1,
+                             const float w2, const float sign)
+{
+  // per thread: two rows of history and one row of zeros for the border
+  const int nthreads = dt_get_num_threads();
+  float *const scratch = dt_alloc_align(16, (size_t)3 * size2 * nthreads * sizeof(float));
+  if(!scratch)
+  {
+    // fall back to the line by line version
+    if(sign > 0.0f)
+      blur_line(buf, offset1, 1, offset3, size1, size2, size3);
+    else
+      blur_line_z(buf, offset1, 1, offset3, size1, size2, size3);
+    return;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(buf) schedule(static)
+#endif
+  for(int k = 0; k < size1; k++)
+  {
+    float *tmp1 = scratch + (size_t)3 * size2 * dt_get_thread_num();
+    float *tmp2 = tmp1 + size2;
+    float *const zero = tmp2 + size2;
+    memset(tmp1, 0, (size_t)3 * size2 * sizeof(float));
+
+    for(int i = 0; i < size3; i++)
+    {
+      float *const row = buf + (size_t)k * offset1 + (size_t)i * offset3;
+      const float *const next1 = (i + 1 < size3) ? row + offset3 : zero;
+      const float *const next2 = (i + 2 < size3) ? row + 2 * offset3 : zero;
+      for(int j = 0; j < size2; j++)
+      {
+        const float tmp3 = row[j];
+        row[j] = w0 * tmp3 + w1 * (next1[j] + sign * tmp2[j]) + w2 * (next2[j] + sign * tmp1[j]);
+        tmp1[j] = tmp3;
+      }
+      // the oldest history row now holds the current one
+      float *const t = tmp1;
+      tmp1 = tmp2;
+      tmp2 = t;
+    }
+  }
+
+  dt_free_align(scratch);
+}
+
 void dt_bilateral_blur(dt_bilateral_t *b)
 {
+  // gaussian up to 3 sigma, one x line per (y, z) pair
+  blur_line(b->buf, b->size_x, b->size_x, 1, b->size_y * b->size_z, 1, b->size_x);
   // gaussian up to 3 sigma
-  blur_line(b->buf, b->size_x * b->size_y, b->size_x, 1, b->size_z, b->size_y, b->size_x);
-  // gaussian up to 3 sigma
-  blur_line(b->buf, b->size_x * b->size_y, 1, b->size_x, b->size_z, b->size_x, b->size_y);
+  blur_line_planar(b->buf, b->size_x * b->size_y, b->size_x, b->size_z, b->size_x, b->size_y, 6.f / 16.f,
+                   4.f / 16.f, 1.f / 16.f, 1.0f);
   // -2 derivative of the gaussian up to 3 sigma: x*exp(-x*x)
-  blur_line_z(b->buf, 1, b->size_x, b->size_x * b->size_y, b->size_x, b->size_y, b->size_z);
+  blur_line_planar(b->buf, b->size_x, b->size_x * b->size_y, b->size_y, b->size_x, b->size_z, 0.0f,
+                   4.f / 16.f, 2.f / 16.f, -1.0f);
 }
 
 
+// trilinear lookup of the grid cell starting at gi, with fractional coordinates xf, yf, zf
+static inline float grid_lookup(const dt_bilateral_t *const b, const size_t gi, const float xf, const float yf,
+                                const float zf)
+{
+  const int oy = b->size_x;
+  const int oz = b->size_y * b->size_x;
+#if defined(__SSE__)
+  // the four (x, y) corners of both z planes, as two pairs of adjacent values each
+  const __m128 v0 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(b->buf + gi)),
+                                 (const __m64 *)(b->buf + gi + oy));
+  const __m128 v1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(b->buf + gi + oz)),
+                                 (const __m64 *)(b->buf + gi + oy + oz));
+  const __m128 v = _mm_add_ps(v0, _mm_mul_ps(_mm_set1_ps(zf), _mm_sub_ps(v1, v0)));
+  const __m128 w = _mm_mul_ps(_mm_set_ps(xf, 1.0f - xf, xf, 1.0f - xf), _mm_set_ps(yf, yf, 1.0f - yf, 1.0f - yf));
+  const __m128 s = _mm_mul_ps(v, w);
+  const __m128 s2 = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  return _mm_cvtss_f32(_mm_add_ss(s2, _mm_shuffle_ps(s2, s2, _MM_SHUFFLE(1, 1, 1, 1))));
+#else
+  const int ox = 1;
+  return b->buf[gi] * (1.0f - xf) * (1.0f - yf) * (1.0f - zf)
+         + b->buf[gi + ox] * (xf) * (1.0f - yf) * (1.0f - zf)
+         + b->buf[gi + oy] * (1.0f - xf) * (yf) * (1.0f - zf)
+         + b->buf[gi + ox + oy] * (xf) * (yf) * (1.0f - zf)
+         + b->buf[gi + oz] * (1.0f - xf) * (1.0f - yf) * (zf)
+         + b->buf[gi + ox + oz] * (xf) * (1.0f - yf) * (zf)
+         + b->buf[gi + oy + oz] * (1.0f - xf) * (yf) * (zf)
+         + b->buf[gi + ox + oy + oz] * (xf) * (yf) * (zf);
+#endif
+}
+
 void dt_bilateral_slice(const dt_bilateral_t *const b, const float *const in, float *out, const float detail)
 {
   // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
   const float norm = -detail * b->sigma_r * 0.04f;
-  const int ox = 1;
-  const int oy = b->size_x;
-  const int oz = b->size_y * b->size_x;
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(out)
 #endif
   for(int j = 0; j < b->height; j++)
   {
-    size_t index = 4 * j * b->width;
+    size_t index = (size_t)4 * j * b->width;
     for(int i = 0; i < b->width; i++)
     {
       float x, y, z;
@@ -278,15 +456,7 @@ void dt_bilateral_slice(const dt_bilateral_t *const b, const float *const in, fl
       const float yf = y - yi;
       const float zf = z - zi;
       const size_t gi = xi + b->size_x * (yi + b->size_y * zi);
-      const float Lout = L
-                         + norm * (b->buf[gi] * (1.0f - xf) * (1.0f - yf) * (1.0f - zf)
-                                   + b->buf[gi + ox] * (xf) * (1.0f - yf) * (1.0f - zf)
-                                   + b->buf[gi + oy] * (1.0f - xf) * (yf) * (1.0f - zf)
-                                   + b->buf[gi + ox + oy] * (xf) * (yf) * (1.0f - zf)
-                                   + b->buf[gi + oz] * (1.0f - xf) * (1.0f - yf) * (zf)
-                                   + b->buf[gi + ox + oz] * (xf) * (1.0f - yf) * (zf)
-                                   + b->buf[gi + oy + oz] * (1.0f - xf) * (yf) * (zf)
-                                   + b->buf[gi + ox + oy + oz] * (xf) * (yf) * (zf));
+      const float Lout = L + norm * grid_lookup(b, gi, xf, yf, zf);
       out[index] = Lout;
       // and copy color and mask
       out[index + 1] = in[index + 1];
@@ -302,15 +472,12 @@ void dt_bilateral_slice_to_output(const dt_bilateral_t *const b, const float *co
 {
   // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
   const float norm = -detail * b->sigma_r * 0.04f;
-  const int ox = 1;
-  const int oy = b->size_x;
-  const int oz = b->size_y * b->size_x;
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(out)
 #endif
   for(int j = 0; j < b->height; j++)
   {
-    size_t index = 4 * j * b->width;
+    size_t index = (size_t)4 * j * b->width;
     for(int i = 0; i < b->width; i++)
     {
       float x, y, z;
@@ -324,14 +491,7 @@ void dt_bilateral_slice_to_output(const dt_bilateral_t *const b, const float *co
       const float yf = y - yi;
       const float zf = z - zi;
       const size_t gi = xi + b->size_x * (yi + b->size_y * zi);
-      const float Lout = norm * (b->buf[gi] * (1.0f - xf) * (1.0f - yf) * (1.0f - zf)
-                                 + b->buf[gi + ox] * (xf) * (1.0f - yf) * (1.0f - zf)
-                                 + b->buf[gi + oy] * (1.0f - xf) * (yf) * (1.0f - zf)
-                                 + b->buf[gi + ox + oy] * (xf) * (yf) * (1.0f - zf)
-                                 + b->buf[gi + oz] * (1.0f - xf) * (1.0f - yf) * (zf)
-                                 + b->buf[gi + ox + oz] * (xf) * (1.0f - yf) * (zf)
-                                 + b->buf[gi + oy + oz] * (1.0f - xf) * (yf) * (zf)
-                                 + b->buf[gi + ox + oy + oz] * (xf) * (yf) * (zf));
+      const float Lout = norm * grid_lookup(b, gi, xf, yf, zf);
       out[index] = MAX(0.0f, out[index] + Lout);
       index += 4;
     }
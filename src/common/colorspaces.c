@@ -30,6 +30,10 @@
 #include "colord-gtk.h"
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #if 0
 #include <ApplicationServices/ApplicationServices.h>
 #include <Carbon/Carbon.h>
@@ -1190,6 +1194,7 @@ dt_colorspaces_t *dt_colorspaces_init()
   dt_colorspaces_t *res = (dt_colorspaces_t *)calloc(1, sizeof(dt_colorspaces_t));
 
   pthread_rwlock_init(&res->xprofile_lock, NULL);
+  dt_pthread_mutex_init(&res->clut_lock, NULL);
 
   int in_pos = -1,
       out_pos = -1,
@@ -1369,6 +1374,23 @@ dt_colorspaces_t *dt_colorspaces_init()
   return res;
 }
 
+typedef struct dt_colorspaces_clut_cache_entry_t
+{
+  gchar *checksum;
+  float *table;
+} dt_colorspaces_clut_cache_entry_t;
+
+// number of cluts kept around, to cover the pipes of a couple of images at the same time
+#define DT_COLORSPACES_CLUT_CACHE_SIZE 8
+
+static void _clut_cache_entry_free(gpointer data)
+{
+  dt_colorspaces_clut_cache_entry_t *entry = (dt_colorspaces_clut_cache_entry_t *)data;
+  g_free(entry->checksum);
+  dt_free_align(entry->table);
+  free(entry);
+}
+
 void dt_colorspaces_cleanup(dt_colorspaces_t *self)
 {
   // remember display profile and softproof/gama checking from conf
@@ -1393,6 +1415,9 @@ void dt_colorspaces_cleanup(dt_colorspaces_t *self)
   }
   g_list_free_full(self->profiles, free);
 
+  g_list_free_full(self->cluts, _clut_cache_entry_free);
+  dt_pthread_mutex_destroy(&self->clut_lock);
+
   pthread_rwlock_destroy(&self->xprofile_lock);
   g_free(self->colord_profile_file);
   g_free(self->xprofile_data);
@@ -1828,6 +1853,247 @@ void dt_colorspaces_rgb_to_cygm(float *out, int num, double RGB_to_CAM[4][3])
   }
 }
 
+#define CLUT_N DT_COLORSPACES_CLUT_SIZE
+#define CLUT_NODES ((size_t)CLUT_N * CLUT_N * CLUT_N)
+
+static gchar *_clut_checksum(const cmsHPROFILE *const profiles, const int num_profiles,
+                             const void *const settings, const size_t settings_size, const float min[3],
+                             const float max[3])
+{
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_MD5);
+  for(int k = 0; k < num_profiles; k++)
+  {
+    cmsUInt32Number size = 0;
+    if(!profiles[k] || !cmsSaveProfileToMem(profiles[k], NULL, &size) || size == 0)
+    {
+      g_checksum_free(checksum);
+      return NULL;
+    }
+    uint8_t *buf = malloc(size);
+    if(!buf || !cmsSaveProfileToMem(profiles[k], buf, &size))
+    {
+      free(buf);
+      g_checksum_free(checksum);
+      return NULL;
+    }
+    g_checksum_update(checksum, buf, size);
+    free(buf);
+  }
+  g_checksum_update(checksum, (const guchar *)settings, settings_size);
+  g_checksum_update(checksum, (const guchar *)min, 3 * sizeof(float));
+  g_checksum_update(checksum, (const guchar *)max, 3 * sizeof(float));
+  gchar *res = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  return res;
+}
+
+int dt_colorspaces_clut_init(dt_colorspaces_clut_t *clut, const cmsHPROFILE *const profiles,
+                             const int num_profiles, const void *const settings, const size_t settings_size,
+                             const float min[3], const float max[3], dt_colorspaces_clut_sample_t sample,
+                             const void *const data)
+{
+  dt_colorspaces_clut_cleanup(clut);
+  for(int c = 0; c < 3; c++)
+  {
+    clut->min[c] = min[c];
+    clut->max[c] = max[c];
+  }
+  clut->min[3] = clut->max[3] = 0.0f;
+
+  float *table = dt_alloc_align(16, sizeof(float) * 4 * CLUT_NODES);
+  if(!table) return 1;
+
+  gchar *checksum = _clut_checksum(profiles, num_profiles, settings, settings_size, min, max);
+  dt_colorspaces_t *cs = darktable.color_profiles;
+
+  if(checksum)
+  {
+    dt_pthread_mutex_lock(&cs->clut_lock);
+    for(GList *iter = cs->cluts; iter; iter = g_list_next(iter))
+    {
+      dt_colorspaces_clut_cache_entry_t *entry = (dt_colorspaces_clut_cache_entry_t *)iter->data;
+      if(!strcmp(entry->checksum, checksum))
+      {
+        memcpy(table, entry->table, sizeof(float) * 4 * CLUT_NODES);
+        // most recently used go first
+        cs->cluts = g_list_remove_link(cs->cluts, iter);
+        cs->cluts = g_list_concat(iter, cs->cluts);
+        dt_pthread_mutex_unlock(&cs->clut_lock);
+        g_free(checksum);
+        clut->table = table;
+        return 0;
+      }
+    }
+    dt_pthread_mutex_unlock(&cs->clut_lock);
+  }
+
+  // fill in the grid and let the caller transform it, one row of nodes at a time
+  const float step[3] = { (max[0] - min[0]) / (CLUT_N - 1), (max[1] - min[1]) / (CLUT_N - 1),
+                          (max[2] - min[2]) / (CLUT_N - 1) };
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(table, sample, min, max) schedule(static)
+#endif
+  for(int row = 0; row < CLUT_N * CLUT_N; row++)
+  {
+    float *px = table + (size_t)4 * CLUT_N * row;
+    const int j = row % CLUT_N, k = row / CLUT_N;
+    for(int i = 0; i < CLUT_N; i++)
+    {
+      px[4 * i + 0] = min[0] + i * step[0];
+      px[4 * i + 1] = min[1] + j * step[1];
+      px[4 * i + 2] = min[2] + k * step[2];
+      px[4 * i + 3] = 0.0f;
+    }
+    sample(data, px, CLUT_N);
+  }
+  clut->table = table;
+
+  if(checksum)
+  {
+    dt_colorspaces_clut_cache_entry_t *entry = malloc(sizeof(dt_colorspaces_clut_cache_entry_t));
+    float *copy = dt_alloc_align(16, sizeof(float) * 4 * CLUT_NODES);
+    if(entry && copy)
+    {
+      memcpy(copy, table, sizeof(float) * 4 * CLUT_NODES);
+      entry->checksum = checksum;
+      entry->table = copy;
+      dt_pthread_mutex_lock(&cs->clut_lock);
+      cs->cluts = g_list_prepend(cs->cluts, entry);
+      if(g_list_length(cs->cluts) > DT_COLORSPACES_CLUT_CACHE_SIZE)
+      {
+        GList *last = g_list_last(cs->cluts);
+        _clut_cache_entry_free(last->data);
+        cs->cluts = g_list_delete_link(cs->cluts, last);
+      }
+      dt_pthread_mutex_unlock(&cs->clut_lock);
+    }
+    else
+    {
+      free(entry);
+      dt_free_align(copy);
+      g_free(checksum);
+    }
+  }
+  return 0;
+}
+
+void dt_colorspaces_clut_cleanup(dt_colorspaces_clut_t *clut)
+{
+  dt_free_align(clut->table);
+  clut->table = NULL;
+}
+
+// position of an input value in the grid: index of the node below and fraction towards the next one
+static inline int _clut_node(const float v, const float min, const float max, float *frac)
+{
+  const float x = CLAMPS((v - min) / (max - min), 0.0f, 1.0f) * (CLUT_N - 1);
+  const int i = MIN((int)x, CLUT_N - 2);
+  *frac = x - i;
+  return i;
+}
+
+// walks the cube from node 0 to node 7 along the edges of the tetrahedron containing the point: the
+// axes are taken in order of decreasing fraction, with weights 1-f1, f1-f2, f2-f3 and f3.
+static inline void _clut_tetrahedron(const float *const in, const float *const min, const float *const max,
+                                     size_t *offset, size_t *o1, size_t *o2, float w[4])
+{
+  const size_t stride[3] = { 4, 4 * CLUT_N, 4 * CLUT_N * CLUT_N };
+  float f[3];
+  *offset = 0;
+  for(int c = 0; c < 3; c++) *offset += stride[c] * _clut_node(in[c], min[c], max[c], f + c);
+
+  // sort the axes, a has the largest fraction and c the smallest
+  int a = 0, b = 1, c = 2;
+  if(f[a] < f[b])
+  {
+    const int t = a;
+    a = b;
+    b = t;
+  }
+  if(f[b] < f[c])
+  {
+    const int t = b;
+    b = c;
+    c = t;
+  }
+  if(f[a] < f[b])
+  {
+    const int t = a;
+    a = b;
+    b = t;
+  }
+
+  *o1 = stride[a];
+  *o2 = stride[a] + stride[b];
+  w[0] = 1.0f - f[a];
+  w[1] = f[a] - f[b];
+  w[2] = f[b] - f[c];
+  w[3] = f[c];
+}
+
+static void _clut_apply_plain(const dt_colorspaces_clut_t *const clut, const float *const in, float *const out,
+                              const size_t n)
+{
+  const size_t o3 = 4 + 4 * CLUT_N + 4 * CLUT_N * CLUT_N;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(size_t k = 0; k < n; k++)
+  {
+    const float *const px = in + 4 * k;
+    size_t offset, o1, o2;
+    float w[4];
+    _clut_tetrahedron(px, clut->min, clut->max, &offset, &o1, &o2, w);
+    const float *const v = clut->table + offset;
+    const float alpha = px[3];
+    for(int c = 0; c < 3; c++)
+      out[4 * k + c] = w[0] * v[c] + w[1] * v[o1 + c] + w[2] * v[o2 + c] + w[3] * v[o3 + c];
+    out[4 * k + 3] = alpha;
+  }
+}
+
+#if defined(__SSE2__)
+static void _clut_apply_sse2(const dt_colorspaces_clut_t *const clut, const float *const in, float *const out,
+                             const size_t n)
+{
+  const size_t o3 = 4 + 4 * CLUT_N + 4 * CLUT_N * CLUT_N;
+  const __m128 rgbmask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(size_t k = 0; k < n; k++)
+  {
+    const float *const px = in + 4 * k;
+    size_t offset, o1, o2;
+    float w[4];
+    _clut_tetrahedron(px, clut->min, clut->max, &offset, &o1, &o2, w);
+    const float *const v = clut->table + offset;
+    const __m128 alpha = _mm_andnot_ps(rgbmask, _mm_load_ps(px));
+    const __m128 res = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[0]), _mm_load_ps(v)),
+                                             _mm_mul_ps(_mm_set1_ps(w[1]), _mm_load_ps(v + o1))),
+                                  _mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[2]), _mm_load_ps(v + o2)),
+                                             _mm_mul_ps(_mm_set1_ps(w[3]), _mm_load_ps(v + o3))));
+    _mm_store_ps(out + 4 * k, _mm_or_ps(_mm_and_ps(rgbmask, res), alpha));
+  }
+}
+#endif
+
+void dt_colorspaces_clut_apply(const dt_colorspaces_clut_t *const clut, const float *const in, float *const out,
+                               const size_t n)
+{
+  if(darktable.codepath.OPENMP_SIMD)
+    _clut_apply_plain(clut, in, out, n);
+#if defined(__SSE2__)
+  else if(darktable.codepath.SSE2)
+    _clut_apply_sse2(clut, in, out, n);
+#endif
+  else
+    dt_unreachable_codepath();
+}
+
+#undef CLUT_N
+#undef CLUT_NODES
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
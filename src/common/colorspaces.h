@@ -90,6 +90,10 @@ typedef struct dt_colorspaces_t
 
   cmsHTRANSFORM transform_srgb_to_display, transform_adobe_rgb_to_display;
 
+  // recently sampled 3d luts, see dt_colorspaces_clut_init()
+  GList *cluts;
+  dt_pthread_mutex_t clut_lock;
+
 } dt_colorspaces_t;
 
 typedef struct dt_colorspaces_color_profile_t
@@ -200,6 +204,34 @@ void dt_colorspaces_cygm_to_rgb(float *out, int num, double CAM_to_RGB[3][4]);
 /** convert RGB buffer to CYGM */
 void dt_colorspaces_rgb_to_cygm(float *out, int num, double RGB_to_CAM[4][3]);
 
+/** nodes per dimension of the 3d luts standing in for lcms2 transforms */
+#define DT_COLORSPACES_CLUT_SIZE 33
+
+/** a color transform sampled on a regular grid over a box of input values */
+typedef struct dt_colorspaces_clut_t
+{
+  float min[4], max[4]; // the box of input values, everything outside is clamped to it
+  float *table;         // 4 floats per node, first input channel runs fastest
+} dt_colorspaces_clut_t;
+
+/** transforms n pixels of 4 floats in place */
+typedef void (*dt_colorspaces_clut_sample_t)(const void *data, float *pixels, const int n);
+
+/** samples sample() over min..max into the clut. profiles and the settings blob identify the transform,
+ * a clut sampled for the same ones before is copied from a small cache instead. */
+int dt_colorspaces_clut_init(dt_colorspaces_clut_t *clut, const cmsHPROFILE *const profiles,
+                             const int num_profiles, const void *const settings, const size_t settings_size,
+                             const float min[3], const float max[3], dt_colorspaces_clut_sample_t sample,
+                             const void *const data);
+
+/** frees the table of the clut */
+void dt_colorspaces_clut_cleanup(dt_colorspaces_clut_t *clut);
+
+/** tetrahedral interpolation of the clut for n pixels of 4 floats, alpha is copied. in and out may be the
+ * same buffer. */
+void dt_colorspaces_clut_apply(const dt_colorspaces_clut_t *const clut, const float *const in, float *const out,
+                               const size_t n);
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
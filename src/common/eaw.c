@@ -0,0 +1,434 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2009--2017 johannes hanika.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/eaw.h"
+#include "common/darktable.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+static const float filter[5] = { 1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f };
+
+typedef union floatint_t
+{
+  float f;
+  uint32_t i;
+} floatint_t;
+
+// very fast approximation for 2^-x (returns 0 for x > 126)
+static inline float fast_mexp2f(const float x)
+{
+  const float i1 = (float)0x3f800000u; // 2^0
+  const float i2 = (float)0x3f000000u; // 2^-1
+  const float k0 = i1 + x * (i2 - i1);
+  floatint_t k;
+  k.i = k0 >= (float)0x800000u ? k0 : 0;
+  return k.f;
+}
+
+// weights of the equalizer: (wl, wc, wc, 1)
+static inline void weight(const float *c1, const float *c2, const float sharpen, float *weight)
+{
+  float diff[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  for(int c = 0; c < 4; c++) diff[c] = c1[c] - c2[c];
+  float square[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  for(int c = 0; c < 4; c++) square[c] = diff[c] * diff[c];
+
+  const float wl = dt_fast_expf(-sharpen * square[0]);
+  const float wc = dt_fast_expf(-sharpen * (square[1] + square[2]));
+
+  weight[0] = wl;
+  weight[1] = wc;
+  weight[2] = wc;
+  weight[3] = 1.0f;
+}
+
+// weight of the denoiser, one for all channels
+static inline float dn_weight(const float *c1, const float *c2, const float inv_sigma2)
+{
+  // 3d distance based on color
+  float diff[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  for(int c = 0; c < 4; c++) diff[c] = c1[c] - c2[c];
+
+  float sqr[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  for(int c = 0; c < 4; c++) sqr[c] = diff[c] * diff[c];
+
+  const float dot = (sqr[0] + sqr[1] + sqr[2]) * inv_sigma2;
+  const float var
+      = 0.02f; // FIXME: this should ideally depend on the image before noise stabilizing transforms!
+  const float off2 = 9.0f; // (3 sigma)^2
+  return fast_mexp2f(MAX(0, dot * var - off2));
+}
+
+#if defined(__SSE2__)
+/* SSE intrinsics version of dt_fast_expf defined in darktable.h */
+static inline __m128 dt_fast_expf_sse2(const __m128 x)
+{
+  const __m128 fone = _mm_set1_ps((float)0x3f800000u);
+  const __m128 femo = _mm_set1_ps((float)0x00adf880u);
+  __m128 f = _mm_add_ps(fone, _mm_mul_ps(x, femo)); // f(n) = i1 + x(n)*(i2-i1)
+  __m128i i = _mm_cvtps_epi32(f);                   // i(n) = int(f(n))
+  __m128i mask = _mm_srai_epi32(i, 31);             // mask(n) = 0xffffffff if i(n) < 0
+  i = _mm_andnot_si128(mask, i);                    // i(n) = 0 if i(n) < 0
+  return _mm_castsi128_ps(i);                       // return *(float*)&i
+}
+
+// same as fast_mexp2f() for four values
+static inline __m128 fast_mexp2f_sse2(const __m128 x)
+{
+  const __m128 i1 = _mm_set1_ps((float)0x3f800000u); // 2^0
+  const __m128 i2 = _mm_set1_ps((float)0x3f000000u); // 2^-1
+  const __m128 k0 = _mm_add_ps(i1, _mm_mul_ps(x, _mm_sub_ps(i2, i1)));
+  const __m128 valid = _mm_cmpge_ps(k0, _mm_set1_ps((float)0x800000u));
+  return _mm_and_ps(valid, _mm_castsi128_ps(_mm_cvttps_epi32(k0)));
+}
+
+/* Computes the vector
+ * (wl, wc, wc, 1)
+ *
+ * where:
+ * wl = exp(-sharpen*SQR(c1[0] - c2[0]))
+ *    = exp(-s*d1) (as noted in code comments below)
+ * wc = exp(-sharpen*(SQR(c1[1] - c2[1]) + SQR(c1[2] - c2[2]))
+ *    = exp(-s*(d2+d3)) (as noted in code comments below)
+ */
+static inline __m128 weight_sse2(const __m128 *c1, const __m128 *c2, const float sharpen)
+{
+  const __m128 ooo1 = _mm_set_ps(1.f, 0.f, 0.f, 0.f);
+  const __m128 vsharpen = _mm_set1_ps(-sharpen); // (-s, -s, -s, -s)
+  __m128 diff = _mm_sub_ps(*c1, *c2);
+  __m128 square = _mm_mul_ps(diff, diff);                                   // (?, d3, d2, d1)
+  __m128 square2 = _mm_shuffle_ps(square, square, _MM_SHUFFLE(3, 1, 2, 0)); // (?, d2, d3, d1)
+  __m128 added = _mm_add_ps(square, square2);                               // (?, d2+d3, d2+d3, 2*d1)
+  added = _mm_sub_ss(added, square);                                        // (?, d2+d3, d2+d3, d1)
+  __m128 sharpened = _mm_mul_ps(added, vsharpen);                   // (?, -s*(d2+d3), -s*(d2+d3), -s*d1)
+  __m128 exp = dt_fast_expf_sse2(sharpened);                        // (?, wc, wc, wl)
+  exp = _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(exp), 4)); // (wc, wc, wl, 0)
+  exp = _mm_castsi128_ps(_mm_srli_si128(_mm_castps_si128(exp), 4)); // (0, wc, wc, wl)
+  exp = _mm_or_ps(exp, ooo1);                                       // (1, wc, wc, wl)
+  return exp;
+}
+#endif
+
+/* every pixel gathers the 5x5 taps at the rows and columns 0, +-mult, +-2mult around it. the
+ * taps are clamped to the image, i.e. nearest pixel interpolation, which is only needed for the
+ * 2*mult pixels along the borders. the row pointers are clamped once per row and the columns once
+ * per pixel, so there are no tests left in the 25 taps. */
+static inline void sum_taps(const float *const px, const float *const *const rows, const int *const col,
+                            const float sharpen, float *const sum, float *const wgt)
+{
+  for(int jj = 0; jj < 5; jj++)
+  {
+    for(int ii = 0; ii < 5; ii++)
+    {
+      const float *px2 = rows[jj] + col[ii];
+      const float f = filter[ii] * filter[jj];
+      float wp[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      weight(px, px2, sharpen, wp);
+      for(int c = 0; c < 4; c++)
+      {
+        const float w = f * wp[c];
+        sum[c] += w * px2[c];
+        wgt[c] += w;
+      }
+    }
+  }
+}
+
+static inline void dn_sum_taps(const float *const px, const float *const *const rows, const int *const col,
+                               const float inv_sigma2, float *const sum, float *const wgt)
+{
+  for(int jj = 0; jj < 5; jj++)
+  {
+    for(int ii = 0; ii < 5; ii++)
+    {
+      const float *px2 = rows[jj] + col[ii];
+      const float w = filter[ii] * filter[jj] * dn_weight(px, px2, inv_sigma2);
+      for(int c = 0; c < 4; c++) sum[c] += w * px2[c];
+      for(int c = 0; c < 4; c++) wgt[c] += w;
+    }
+  }
+}
+
+static inline void decompose(float *const out, const float *const in, float *const detail, const int scale,
+                             const float param, const int32_t width, const int32_t height, const int dn)
+{
+  const int mult = 1 << scale;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    const float *rows[5];
+    for(int jj = 0; jj < 5; jj++)
+      rows[jj] = in + (size_t)4 * width * CLAMPS(j + mult * (jj - 2), 0, height - 1);
+    const float *px = in + (size_t)4 * j * width;
+    float *pdetail = detail + (size_t)4 * j * width;
+    float *pcoarse = out + (size_t)4 * j * width;
+
+    for(int i = 0; i < width; i++)
+    {
+      int col[5];
+      for(int ii = 0; ii < 5; ii++) col[ii] = 4 * CLAMPS(i + mult * (ii - 2), 0, width - 1);
+
+      float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      float wgt[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      if(dn)
+        dn_sum_taps(px, rows, col, param, sum, wgt);
+      else
+        sum_taps(px, rows, col, param, sum, wgt);
+      for(int c = 0; c < 4; c++) sum[c] /= wgt[c];
+
+      for(int c = 0; c < 4; c++) pdetail[c] = (px[c] - sum[c]);
+      for(int c = 0; c < 4; c++) pcoarse[c] = sum[c];
+      px += 4;
+      pdetail += 4;
+      pcoarse += 4;
+    }
+  }
+}
+
+void eaw_decompose(float *const out, const float *const in, float *const detail, const int scale,
+                   const float sharpen, const int32_t width, const int32_t height)
+{
+  decompose(out, in, detail, scale, sharpen, width, height, 0);
+}
+
+void eaw_dn_decompose(float *const out, const float *const in, float *const detail, const int scale,
+                      const float inv_sigma2, const int32_t width, const int32_t height)
+{
+  decompose(out, in, detail, scale, inv_sigma2, width, height, 1);
+}
+
+#if defined(__SSE2__)
+// one pixel with clamped taps, for the borders
+static inline void decompose_px_sse2(const __m128 *const px, const __m128 *const *const rows, const int i,
+                                     const int mult, const int32_t width, const float param, const int dn,
+                                     float *const pdetail, float *const pcoarse)
+{
+  int col[5];
+  for(int ii = 0; ii < 5; ii++) col[ii] = CLAMPS(i + mult * (ii - 2), 0, width - 1);
+
+  __m128 sum = _mm_setzero_ps();
+  __m128 wgt = _mm_setzero_ps();
+  for(int jj = 0; jj < 5; jj++)
+  {
+    for(int ii = 0; ii < 5; ii++)
+    {
+      const __m128 *px2 = rows[jj] + col[ii];
+      const __m128 f = _mm_set1_ps(filter[ii] * filter[jj]);
+      const __m128 wp = dn ? _mm_set1_ps(dn_weight((const float *)px, (const float *)px2, param))
+                           : weight_sse2(px, px2, param);
+      const __m128 w = _mm_mul_ps(f, wp);
+      sum = _mm_add_ps(sum, _mm_mul_ps(w, *px2));
+      wgt = _mm_add_ps(wgt, w);
+    }
+  }
+  sum = _mm_div_ps(sum, wgt);
+
+  _mm_stream_ps(pdetail, _mm_sub_ps(*px, sum));
+  _mm_stream_ps(pcoarse, sum);
+}
+
+/* four neighbouring pixels away from the borders. the squared colour differences of the four
+ * pixels to their taps are transposed, so the weights of one tap are evaluated for all of
+ * them in one go, with one exp for the denoiser and two (luma, chroma) for the equalizer. */
+static inline void decompose_px4_sse2(const __m128 *const px, const __m128 *const *const rows, const int i,
+                                      const int mult, const float param, const int dn, float *const pdetail,
+                                      float *const pcoarse)
+{
+  const __m128 mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  const __m128 ooo1 = _mm_set_ps(1.f, 0.f, 0.f, 0.f);
+  const __m128 vparam = _mm_set1_ps(dn ? param : -param);
+  __m128 sum[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+  __m128 wgt[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+  for(int jj = 0; jj < 5; jj++)
+  {
+    for(int ii = 0; ii < 5; ii++)
+    {
+      const __m128 *q = rows[jj] + i + mult * (ii - 2);
+      const __m128 f = _mm_set1_ps(filter[ii] * filter[jj]);
+      __m128 d0 = _mm_sub_ps(px[0], q[0]), d1 = _mm_sub_ps(px[1], q[1]);
+      __m128 d2 = _mm_sub_ps(px[2], q[2]), d3 = _mm_sub_ps(px[3], q[3]);
+      d0 = _mm_mul_ps(d0, d0);
+      d1 = _mm_mul_ps(d1, d1);
+      d2 = _mm_mul_ps(d2, d2);
+      d3 = _mm_mul_ps(d3, d3);
+      // now d0..d2 hold the squared differences of channel 0..2, one pixel per lane
+      _MM_TRANSPOSE4_PS(d0, d1, d2, d3);
+      __m128 w[4];
+      if(dn)
+      {
+        const __m128 dot = _mm_mul_ps(_mm_add_ps(_mm_add_ps(d0, d1), d2), vparam);
+        const __m128 var = _mm_set1_ps(0.02f);
+        const __m128 off2 = _mm_set1_ps(9.0f);
+        const __m128 wp
+            = fast_mexp2f_sse2(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_mul_ps(dot, var), off2)));
+        const __m128 fw = _mm_mul_ps(f, wp);
+        w[0] = _mm_shuffle_ps(fw, fw, _MM_SHUFFLE(0, 0, 0, 0));
+        w[1] = _mm_shuffle_ps(fw, fw, _MM_SHUFFLE(1, 1, 1, 1));
+        w[2] = _mm_shuffle_ps(fw, fw, _MM_SHUFFLE(2, 2, 2, 2));
+        w[3] = _mm_shuffle_ps(fw, fw, _MM_SHUFFLE(3, 3, 3, 3));
+      }
+      else
+      {
+        const __m128 wl = dt_fast_expf_sse2(_mm_mul_ps(d0, vparam));
+        const __m128 wc = dt_fast_expf_sse2(_mm_mul_ps(_mm_add_ps(d1, d2), vparam));
+        // (wl, wc, wc, 1) per pixel
+        const __m128 lo = _mm_unpacklo_ps(wl, wc), hi = _mm_unpackhi_ps(wl, wc);
+        w[0] = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 1, 1, 0));
+        w[1] = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(3, 3, 3, 2));
+        w[2] = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 1, 1, 0));
+        w[3] = _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(3, 3, 3, 2));
+        for(int k = 0; k < 4; k++) w[k] = _mm_mul_ps(f, _mm_or_ps(_mm_and_ps(w[k], mask), ooo1));
+      }
+      for(int k = 0; k < 4; k++)
+      {
+        sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(w[k], q[k]));
+        wgt[k] = _mm_add_ps(wgt[k], w[k]);
+      }
+    }
+  }
+  for(int k = 0; k < 4; k++)
+  {
+    sum[k] = _mm_div_ps(sum[k], wgt[k]);
+    _mm_stream_ps(pdetail + 4 * k, _mm_sub_ps(px[k], sum[k]));
+    _mm_stream_ps(pcoarse + 4 * k, sum[k]);
+  }
+}
+
+/* same as decompose() above, the pixels away from the borders four at a time. */
+static inline void decompose_sse2(float *const out, const float *const in, float *const detail,
+                                  const int scale, const float param, const int32_t width,
+                                  const int32_t height, const int dn)
+{
+  const int mult = 1 << scale;
+  // pixels [i0, i1) don't need clamping in x
+  const int i0 = MIN(2 * mult, width);
+  const int i1 = MAX(i0, width - 2 * mult);
+  const int i4 = i0 + ((i1 - i0) & ~3);
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    const __m128 *rows[5];
+    for(int jj = 0; jj < 5; jj++)
+      rows[jj] = (const __m128 *)in + (size_t)width * CLAMPS(j + mult * (jj - 2), 0, height - 1);
+    const __m128 *px = (const __m128 *)in + (size_t)j * width;
+    float *pdetail = detail + (size_t)4 * j * width;
+    float *pcoarse = out + (size_t)4 * j * width;
+
+    for(int i = 0; i < i0; i++)
+      decompose_px_sse2(px + i, rows, i, mult, width, param, dn, pdetail + 4 * i, pcoarse + 4 * i);
+    for(int i = i0; i < i4; i += 4)
+      decompose_px4_sse2(px + i, rows, i, mult, param, dn, pdetail + 4 * i, pcoarse + 4 * i);
+    for(int i = i4; i < width; i++)
+      decompose_px_sse2(px + i, rows, i, mult, width, param, dn, pdetail + 4 * i, pcoarse + 4 * i);
+  }
+
+  _mm_sfence();
+}
+
+void eaw_decompose_sse2(float *const out, const float *const in, float *const detail, const int scale,
+                        const float sharpen, const int32_t width, const int32_t height)
+{
+  decompose_sse2(out, in, detail, scale, sharpen, width, height, 0);
+}
+
+void eaw_dn_decompose_sse2(float *const out, const float *const in, float *const detail, const int scale,
+                           const float inv_sigma2, const int32_t width, const int32_t height)
+{
+  decompose_sse2(out, in, detail, scale, inv_sigma2, width, height, 1);
+}
+#endif
+
+/* instead of one pass over the whole image per scale, every row goes through all scales at once.
+ * this reads each detail buffer once and writes the output once, without intermediate buffers. */
+void eaw_synthesize(float *const out, const float *const coarse, float *const *const detail,
+                    float (*const thrs)[4], float (*const boost)[4], const int max_scale, const int32_t width,
+                    const int32_t height)
+{
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    // the row of the output stays in cache while the details of all scales are added
+    const size_t row = (size_t)4 * j * width;
+    float *const pout = out + row;
+    if(out != coarse) memcpy(pout, coarse + row, sizeof(float) * 4 * width);
+    for(int scale = max_scale - 1; scale >= 0; scale--)
+    {
+      const float *const pdetail = detail[scale] + row;
+      const float threshold[4] = { thrs[scale][0], thrs[scale][1], thrs[scale][2], thrs[scale][3] };
+      const float amp[4] = { boost[scale][0], boost[scale][1], boost[scale][2], boost[scale][3] };
+      for(int k = 0; k < 4 * width; k += 4)
+      {
+        for(int c = 0; c < 4; c++)
+        {
+          const float absamt = MAX(0.0f, (fabsf(pdetail[k + c]) - threshold[c]));
+          const float amount = copysignf(absamt, pdetail[k + c]);
+          pout[k + c] += amp[c] * amount;
+        }
+      }
+    }
+  }
+}
+
+#if defined(__SSE2__)
+void eaw_synthesize_sse2(float *const out, const float *const coarse, float *const *const detail,
+                         float (*const thrs)[4], float (*const boost)[4], const int max_scale,
+                         const int32_t width, const int32_t height)
+{
+  const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000u));
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    const size_t row = (size_t)j * width;
+    for(int i = 0; i < width; i++)
+    {
+      __m128 v = ((const __m128 *)coarse)[row + i];
+      for(int scale = max_scale - 1; scale >= 0; scale--)
+      {
+        const __m128 d = ((const __m128 *)detail[scale])[row + i];
+        const __m128 absamt = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_andnot_ps(mask, d),
+                                                                      _mm_loadu_ps(thrs[scale])));
+        const __m128 amount = _mm_or_ps(_mm_and_ps(d, mask), absamt);
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(boost[scale]), amount));
+      }
+      // out may be coarse, so no streaming stores here
+      _mm_store_ps(out + 4 * (row + i), v);
+    }
+  }
+}
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
@@ -0,0 +1,64 @@
+#pragma once
+/*
+    This file is part of darktable,
+    copyright (c) 2009--2017 johannes hanika.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+// edge-avoiding a-trous wavelet transform on 4-channel float buffers, as used by the
+// equalizer (atrous.c) and the wavelet mode of denoise (profiled).
+
+// one scale of the decomposition: blurs `in' with the 5x5 a-trous kernel spread by 2^scale
+// into the coarse buffer `out' and stores in - out to `detail'.
+typedef void((*eaw_decompose_t)(float *const out, const float *const in, float *const detail, const int scale,
+                                const float sharpen, const int32_t width, const int32_t height));
+
+// edge weights per channel from the distance in L and in chroma, scaled by `sharpen'
+void eaw_decompose(float *const out, const float *const in, float *const detail, const int scale,
+                   const float sharpen, const int32_t width, const int32_t height);
+#if defined(__SSE2__)
+void eaw_decompose_sse2(float *const out, const float *const in, float *const detail, const int scale,
+                        const float sharpen, const int32_t width, const int32_t height);
+#endif
+
+// one edge weight for all channels from the 3d colour distance of noise stabilized input,
+// `inv_sigma2' is the inverse noise variance of the scale.
+void eaw_dn_decompose(float *const out, const float *const in, float *const detail, const int scale,
+                      const float inv_sigma2, const int32_t width, const int32_t height);
+#if defined(__SSE2__)
+void eaw_dn_decompose_sse2(float *const out, const float *const in, float *const detail, const int scale,
+                           const float inv_sigma2, const int32_t width, const int32_t height);
+#endif
+
+// all scales of the reconstruction in one go: out = coarse + sum of the soft thresholded and
+// boosted details, from the coarsest scale max_scale-1 down to 0. out may be the same buffer as coarse.
+typedef void((*eaw_synthesize_t)(float *const out, const float *const coarse, float *const *const detail,
+                                 float (*const thrs)[4], float (*const boost)[4], const int max_scale,
+                                 const int32_t width, const int32_t height));
+
+void eaw_synthesize(float *const out, const float *const coarse, float *const *const detail,
+                    float (*const thrs)[4], float (*const boost)[4], const int max_scale, const int32_t width,
+                    const int32_t height);
+#if defined(__SSE2__)
+void eaw_synthesize_sse2(float *const out, const float *const coarse, float *const *const detail,
+                         float (*const thrs)[4], float (*const boost)[4], const int max_scale,
+                         const int32_t width, const int32_t height);
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
@@ -155,7 +155,7 @@ error:
 }
 
 
-void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
+static void dt_gaussian_blur_plain(dt_gaussian_t *g, const float *const in, float *const out)
 {
 
   const int width = g->width;
@@ -319,6 +319,170 @@ void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
 
 
 #if defined(__SSE__)
+// recursive filter over a single column of a 1-channel image with row stride width, in -> out
+static inline void gauss_column_1c(const float *const in, float *const out, const int width, const int height,
+                                   const int i, const float Lmin, const float Lmax, const float a0,
+                                   const float a1, const float a2, const float a3, const float b1,
+                                   const float b2, const float coefp, const float coefn)
+{
+  // forward filter
+  float xp = CLAMPF(in[i], Lmin, Lmax);
+  float yb = xp * coefp;
+  float yp = yb;
+
+  for(int j = 0; j < height; j++)
+  {
+    const size_t offset = (size_t)j * width + i;
+    const float xc = CLAMPF(in[offset], Lmin, Lmax);
+    const float yc = (a0 * xc) + (a1 * xp) - (b1 * yp) - (b2 * yb);
+
+    out[offset] = yc;
+
+    xp = xc;
+    yb = yp;
+    yp = yc;
+  }
+
+  // backward filter
+  float xn = CLAMPF(in[(size_t)(height - 1) * width + i], Lmin, Lmax);
+  float xa = xn;
+  float yn = xn * coefn;
+  float ya = yn;
+
+  for(int j = height - 1; j > -1; j--)
+  {
+    const size_t offset = (size_t)j * width + i;
+    const float xc = CLAMPF(in[offset], Lmin, Lmax);
+    const float yc = (a2 * xn) + (a3 * xa) - (b1 * yn) - (b2 * ya);
+
+    xa = xn;
+    xn = xc;
+    ya = yn;
+    yn = yc;
+
+    out[offset] += yc;
+  }
+}
+
+// same as gauss_column_1c() but for four adjacent columns i .. i+3 at once
+static inline void gauss_column_1c_sse(const float *const in, float *const out, const int width,
+                                       const int height, const int i, const __m128 Lmin, const __m128 Lmax,
+                                       const float a0, const float a1, const float a2, const float a3,
+                                       const float b1, const float b2, const float coefp, const float coefn)
+{
+  // forward filter
+  __m128 xp = MMCLAMPPS(_mm_loadu_ps(in + i), Lmin, Lmax);
+  __m128 yb = _mm_mul_ps(_mm_set_ps1(coefp), xp);
+  __m128 yp = yb;
+
+  for(int j = 0; j < height; j++)
+  {
+    const size_t offset = (size_t)j * width + i;
+
+    const __m128 xc = MMCLAMPPS(_mm_loadu_ps(in + offset), Lmin, Lmax);
+
+    const __m128 yc = _mm_add_ps(
+        _mm_mul_ps(xc, _mm_set_ps1(a0)),
+        _mm_sub_ps(_mm_mul_ps(xp, _mm_set_ps1(a1)),
+                   _mm_add_ps(_mm_mul_ps(yp, _mm_set_ps1(b1)), _mm_mul_ps(yb, _mm_set_ps1(b2)))));
+
+    _mm_storeu_ps(out + offset, yc);
+
+    xp = xc;
+    yb = yp;
+    yp = yc;
+  }
+
+  // backward filter
+  __m128 xn = MMCLAMPPS(_mm_loadu_ps(in + (size_t)(height - 1) * width + i), Lmin, Lmax);
+  __m128 xa = xn;
+  __m128 yn = _mm_mul_ps(_mm_set_ps1(coefn), xn);
+  __m128 ya = yn;
+
+  for(int j = height - 1; j > -1; j--)
+  {
+    const size_t offset = (size_t)j * width + i;
+
+    const __m128 xc = MMCLAMPPS(_mm_loadu_ps(in + offset), Lmin, Lmax);
+
+    const __m128 yc = _mm_add_ps(
+        _mm_mul_ps(xn, _mm_set_ps1(a2)),
+        _mm_sub_ps(_mm_mul_ps(xa, _mm_set_ps1(a3)),
+                   _mm_add_ps(_mm_mul_ps(yn, _mm_set_ps1(b1)), _mm_mul_ps(ya, _mm_set_ps1(b2)))));
+
+    xa = xn;
+    xn = xc;
+    ya = yn;
+    yn = yc;
+
+    _mm_storeu_ps(out + offset, _mm_add_ps(_mm_loadu_ps(out + offset), yc));
+  }
+}
+
+// vertical blur of a 1-channel image, in -> out. columns are processed in strips of four,
+// which keeps reads and writes contiguous within each row.
+static void gauss_vertical_1c_sse(const float *const in, float *const out, const int width, const int height,
+                                  const float Lmin, const float Lmax, const float a0, const float a1,
+                                  const float a2, const float a3, const float b1, const float b2,
+                                  const float coefp, const float coefn)
+{
+  const __m128 Lminv = _mm_set_ps1(Lmin);
+  const __m128 Lmaxv = _mm_set_ps1(Lmax);
+  const int width4 = width & ~3;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int i = 0; i < width4; i += 4)
+    gauss_column_1c_sse(in, out, width, height, i, Lminv, Lmaxv, a0, a1, a2, a3, b1, b2, coefp, coefn);
+
+  for(int i = width4; i < width; i++)
+    gauss_column_1c(in, out, width, height, i, Lmin, Lmax, a0, a1, a2, a3, b1, b2, coefp, coefn);
+}
+
+// cache blocked transposition of a 1-channel image of width x height, in -> out
+static void gauss_transpose_1c(const float *const in, float *const out, const int width, const int height)
+{
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j0 = 0; j0 < height; j0 += BLOCKSIZE)
+  {
+    const int jmax = MIN(j0 + BLOCKSIZE, height);
+    for(int i0 = 0; i0 < width; i0 += BLOCKSIZE)
+    {
+      const int imax = MIN(i0 + BLOCKSIZE, width);
+      for(int j = j0; j < jmax; j++)
+        for(int i = i0; i < imax; i++) out[(size_t)i * height + j] = in[(size_t)j * width + i];
+    }
+  }
+}
+
+static void dt_gaussian_blur_1c_sse(dt_gaussian_t *g, const float *const in, float *const out)
+{
+  const int width = g->width;
+  const int height = g->height;
+
+  assert(g->channels == 1);
+
+  float a0, a1, a2, a3, b1, b2, coefp, coefn;
+
+  compute_gauss_params(g->sigma, g->order, &a0, &a1, &a2, &a3, &b1, &b2, &coefp, &coefn);
+
+  const float Lmax = g->max[0];
+  const float Lmin = g->min[0];
+
+  float *temp = g->buf;
+
+  // the horizontal pass runs as a vertical pass on the transposed image. out serves as
+  // intermediate buffer, which is fine as in is not accessed anymore after the first pass:
+  // in -> temp (vertical) -> out (transposed) -> temp (horizontal) -> out (transposed back)
+  gauss_vertical_1c_sse(in, temp, width, height, Lmin, Lmax, a0, a1, a2, a3, b1, b2, coefp, coefn);
+  gauss_transpose_1c(temp, out, width, height);
+  gauss_vertical_1c_sse(out, temp, height, width, Lmin, Lmax, a0, a1, a2, a3, b1, b2, coefp, coefn);
+  gauss_transpose_1c(temp, out, height, width);
+}
+
 static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, float *const out)
 {
 
@@ -338,71 +502,75 @@ static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, flo
   float *temp = g->buf;
 
 
-// vertical blur column by column
+// vertical blur column by column. four adjacent columns, i.e. one cache line per row, are
+// processed together to make better use of the memory bandwidth.
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(temp, a0, a1, a2, a3, b1, b2, coefp, coefn) schedule(static)
 #endif
-  for(int i = 0; i < width; i++)
+  for(int i0 = 0; i0 < width; i0 += 4)
   {
-    __m128 xp = _mm_setzero_ps();
-    __m128 yb = _mm_setzero_ps();
-    __m128 yp = _mm_setzero_ps();
-    __m128 xc = _mm_setzero_ps();
-    __m128 yc = _mm_setzero_ps();
-    __m128 xn = _mm_setzero_ps();
-    __m128 xa = _mm_setzero_ps();
-    __m128 yn = _mm_setzero_ps();
-    __m128 ya = _mm_setzero_ps();
+    const int n = MIN(4, width - i0);
 
-    // forward filter
-    xp = MMCLAMPPS(_mm_load_ps(in + i * ch), Labmin, Labmax);
-    yb = _mm_mul_ps(_mm_set_ps1(coefp), xp);
-    yp = yb;
+    __m128 xp[4], yb[4], yp[4], xn[4], xa[4], yn[4], ya[4];
 
+    // forward filter
+    for(int k = 0; k < n; k++)
+    {
+      xp[k] = MMCLAMPPS(_mm_load_ps(in + (size_t)(i0 + k) * ch), Labmin, Labmax);
+      yb[k] = _mm_mul_ps(_mm_set_ps1(coefp), xp[k]);
+      yp[k] = yb[k];
+    }
 
     for(int j = 0; j < height; j++)
     {
-      size_t offset = ((size_t)j * width + i) * ch;
-
-      xc = MMCLAMPPS(_mm_load_ps(in + offset), Labmin, Labmax);
+      const size_t offset = ((size_t)j * width + i0) * ch;
 
+      for(int k = 0; k < n; k++)
+      {
+        const __m128 xc = MMCLAMPPS(_mm_load_ps(in + offset + k * ch), Labmin, Labmax);
 
-      yc = _mm_add_ps(
-          _mm_mul_ps(xc, _mm_set_ps1(a0)),
-          _mm_sub_ps(_mm_mul_ps(xp, _mm_set_ps1(a1)),
-                     _mm_add_ps(_mm_mul_ps(yp, _mm_set_ps1(b1)), _mm_mul_ps(yb, _mm_set_ps1(b2)))));
+        const __m128 yc = _mm_add_ps(
+            _mm_mul_ps(xc, _mm_set_ps1(a0)),
+            _mm_sub_ps(_mm_mul_ps(xp[k], _mm_set_ps1(a1)),
+                       _mm_add_ps(_mm_mul_ps(yp[k], _mm_set_ps1(b1)), _mm_mul_ps(yb[k], _mm_set_ps1(b2)))));
 
-      _mm_store_ps(temp + offset, yc);
+        _mm_store_ps(temp + offset + k * ch, yc);
 
-      xp = xc;
-      yb = yp;
-      yp = yc;
+        xp[k] = xc;
+        yb[k] = yp[k];
+        yp[k] = yc;
+      }
     }
 
     // backward filter
-    xn = MMCLAMPPS(_mm_load_ps(in + ((size_t)(height - 1) * width + i) * ch), Labmin, Labmax);
-    xa = xn;
-    yn = _mm_mul_ps(_mm_set_ps1(coefn), xn);
-    ya = yn;
+    for(int k = 0; k < n; k++)
+    {
+      xn[k] = MMCLAMPPS(_mm_load_ps(in + ((size_t)(height - 1) * width + i0 + k) * ch), Labmin, Labmax);
+      xa[k] = xn[k];
+      yn[k] = _mm_mul_ps(_mm_set_ps1(coefn), xn[k]);
+      ya[k] = yn[k];
+    }
 
     for(int j = height - 1; j > -1; j--)
     {
-      size_t offset = ((size_t)j * width + i) * ch;
-
-      xc = MMCLAMPPS(_mm_load_ps(in + offset), Labmin, Labmax);
+      const size_t offset = ((size_t)j * width + i0) * ch;
 
-      yc = _mm_add_ps(
-          _mm_mul_ps(xn, _mm_set_ps1(a2)),
-          _mm_sub_ps(_mm_mul_ps(xa, _mm_set_ps1(a3)),
-                     _mm_add_ps(_mm_mul_ps(yn, _mm_set_ps1(b1)), _mm_mul_ps(ya, _mm_set_ps1(b2)))));
+      for(int k = 0; k < n; k++)
+      {
+        const __m128 xc = MMCLAMPPS(_mm_load_ps(in + offset + k * ch), Labmin, Labmax);
 
+        const __m128 yc = _mm_add_ps(
+            _mm_mul_ps(xn[k], _mm_set_ps1(a2)),
+            _mm_sub_ps(_mm_mul_ps(xa[k], _mm_set_ps1(a3)),
+                       _mm_add_ps(_mm_mul_ps(yn[k], _mm_set_ps1(b1)), _mm_mul_ps(ya[k], _mm_set_ps1(b2)))));
 
-      xa = xn;
-      xn = xc;
-      ya = yn;
-      yn = yc;
+        xa[k] = xn[k];
+        xn[k] = xc;
+        ya[k] = yn[k];
+        yn[k] = yc;
 
-      _mm_store_ps(temp + offset, _mm_add_ps(_mm_load_ps(temp + offset), yc));
+        _mm_store_ps(temp + offset + k * ch, _mm_add_ps(_mm_load_ps(temp + offset + k * ch), yc));
+      }
     }
   }
 
@@ -476,9 +644,23 @@ static void dt_gaussian_blur_4c_sse(dt_gaussian_t *g, const float *const in, flo
 }
 #endif
 
+void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
+{
+#if defined(__SSE__)
+  if(!darktable.codepath.OPENMP_SIMD && darktable.codepath.SSE2)
+  {
+    if(g->channels == 1)
+      return dt_gaussian_blur_1c_sse(g, in, out);
+    else if(g->channels == 4 && dt_is_aligned(in, 16) && dt_is_aligned(out, 16))
+      return dt_gaussian_blur_4c_sse(g, in, out);
+  }
+#endif
+  dt_gaussian_blur_plain(g, in, out);
+}
+
 void dt_gaussian_blur_4c(dt_gaussian_t *g, const float *const in, float *const out)
 {
-  if(darktable.codepath.OPENMP_SIMD) return dt_gaussian_blur(g, in, out);
+  if(darktable.codepath.OPENMP_SIMD) return dt_gaussian_blur_plain(g, in, out);
 #if defined(__SSE__)
   else if(darktable.codepath.SSE2)
     return dt_gaussian_blur_4c_sse(g, in, out);
@@ -46,8 +46,9 @@ inline static void histogram_helper_cs_RAW(const dt_dev_histogram_collection_par
                                            const void *pixel, uint32_t *histogram, int j)
 {
   const dt_histogram_roi_t *roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
   const float *input = (float *)pixel + roi->width * j + roi->crop_x;
-  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i++, input++)
+  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i += step, input += step)
   {
     histogram_helper_cs_RAW_helper_process_pixel_float(histogram_params, input, histogram);
   }
@@ -67,16 +68,17 @@ inline void dt_histogram_helper_cs_RAW_uint16(const dt_dev_histogram_collection_
                                               const void *pixel, uint32_t *histogram, int j)
 {
   const dt_histogram_roi_t *roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
   uint16_t *in = (uint16_t *)pixel + roi->width * j + roi->crop_x;
 
   // process pixels
-  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i++, in++)
+  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i += step, in += step)
     histogram_helper_cs_RAW_helper_process_pixel_uint16(histogram_params, in, histogram);
 }
 
 //------------------------------------------------------------------------------
 
-inline static void __attribute__((__unused__)) histogram_helper_cs_rgb_helper_process_pixel_float(
+inline static void histogram_helper_cs_rgb_helper_process_pixel_float(
     const dt_dev_histogram_collection_params_t *const histogram_params, const float *pixel, uint32_t *histogram)
 {
   const uint32_t R = PS(pixel[0], histogram_params);
@@ -88,13 +90,10 @@ inline static void __attribute__((__unused__)) histogram_helper_cs_rgb_helper_pr
 }
 
 #if defined(__SSE2__)
-inline static void histogram_helper_cs_rgb_helper_process_pixel_m128(
-    const dt_dev_histogram_collection_params_t *const histogram_params, const float *pixel, uint32_t *histogram)
+inline static void histogram_helper_cs_rgb_helper_process_pixel_m128(const __m128 scale, const __m128 val_min,
+                                                                     const __m128 val_max, const float *pixel,
+                                                                     uint32_t *histogram)
 {
-  const __m128 scale = _mm_set1_ps(histogram_params->mul);
-  const __m128 val_min = _mm_setzero_ps();
-  const __m128 val_max = _mm_set1_ps(histogram_params->bins_count - 1);
-
   assert(dt_is_aligned(pixel, 16));
   const __m128 input = _mm_load_ps(pixel);
   const __m128 scaled = _mm_mul_ps(input, scale);
@@ -117,25 +116,34 @@ inline static void histogram_helper_cs_rgb(const dt_dev_histogram_collection_par
                                            const void *pixel, uint32_t *histogram, int j)
 {
   const dt_histogram_roi_t *roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
   float *in = (float *)pixel + 4 * (roi->width * j + roi->crop_x);
 
-  // process aligned pixels with SSE
-  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i++, in += 4)
-  {
-    if(darktable.codepath.OPENMP_SIMD)
-      histogram_helper_cs_rgb_helper_process_pixel_float(histogram_params, in, histogram);
+  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i += step, in += 4 * step)
+    histogram_helper_cs_rgb_helper_process_pixel_float(histogram_params, in, histogram);
+}
+
 #if defined(__SSE2__)
-    else if(darktable.codepath.SSE2)
-      histogram_helper_cs_rgb_helper_process_pixel_m128(histogram_params, in, histogram);
-#endif
-    else
-      dt_unreachable_codepath();
-  }
+inline static void histogram_helper_cs_rgb_sse2(const dt_dev_histogram_collection_params_t *const histogram_params,
+                                                const void *pixel, uint32_t *histogram, int j)
+{
+  const dt_histogram_roi_t *roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
+  float *in = (float *)pixel + 4 * (roi->width * j + roi->crop_x);
+
+  const __m128 scale = _mm_set1_ps(histogram_params->mul);
+  const __m128 val_min = _mm_setzero_ps();
+  const __m128 val_max = _mm_set1_ps(histogram_params->bins_count - 1);
+
+  // process aligned pixels with SSE
+  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i += step, in += 4 * step)
+    histogram_helper_cs_rgb_helper_process_pixel_m128(scale, val_min, val_max, in, histogram);
 }
+#endif
 
 //------------------------------------------------------------------------------
 
-inline static void __attribute__((__unused__)) histogram_helper_cs_Lab_helper_process_pixel_float(
+inline static void histogram_helper_cs_Lab_helper_process_pixel_float(
     const dt_dev_histogram_collection_params_t *const histogram_params, const float *pixel, uint32_t *histogram)
 {
   const float Lv = pixel[0];
@@ -151,16 +159,10 @@ inline static void __attribute__((__unused__)) histogram_helper_cs_Lab_helper_pr
 }
 
 #if defined(__SSE2__)
-inline static void histogram_helper_cs_Lab_helper_process_pixel_m128(
-    const dt_dev_histogram_collection_params_t *const histogram_params, const float *pixel, uint32_t *histogram)
+inline static void histogram_helper_cs_Lab_helper_process_pixel_m128(const __m128 shift, const __m128 scale,
+                                                                     const __m128 val_min, const __m128 val_max,
+                                                                     const float *pixel, uint32_t *histogram)
 {
-  const float fscale = histogram_params->mul;
-
-  const __m128 shift = _mm_set_ps(0.0f, 128.0f, 128.0f, 0.0f);
-  const __m128 scale = _mm_set_ps(fscale / 1.0f, fscale / 256.0f, fscale / 256.0f, fscale / 100.0f);
-  const __m128 val_min = _mm_setzero_ps();
-  const __m128 val_max = _mm_set1_ps(histogram_params->bins_count - 1);
-
   assert(dt_is_aligned(pixel, 16));
   const __m128 input = _mm_load_ps(pixel);
   const __m128 shifted = _mm_add_ps(input, shift);
@@ -184,21 +186,32 @@ inline static void histogram_helper_cs_Lab(const dt_dev_histogram_collection_par
                                            const void *pixel, uint32_t *histogram, int j)
 {
   const dt_histogram_roi_t *roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
   float *in = (float *)pixel + 4 * (roi->width * j + roi->crop_x);
 
-  // process aligned pixels with SSE
-  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i++, in += 4)
-  {
-    if(darktable.codepath.OPENMP_SIMD)
-      histogram_helper_cs_Lab_helper_process_pixel_float(histogram_params, in, histogram);
+  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i += step, in += 4 * step)
+    histogram_helper_cs_Lab_helper_process_pixel_float(histogram_params, in, histogram);
+}
+
 #if defined(__SSE2__)
-    else if(darktable.codepath.SSE2)
-      histogram_helper_cs_Lab_helper_process_pixel_m128(histogram_params, in, histogram);
-#endif
-    else
-      dt_unreachable_codepath();
-  }
+inline static void histogram_helper_cs_Lab_sse2(const dt_dev_histogram_collection_params_t *const histogram_params,
+                                                const void *pixel, uint32_t *histogram, int j)
+{
+  const dt_histogram_roi_t *roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
+  float *in = (float *)pixel + 4 * (roi->width * j + roi->crop_x);
+
+  const float fscale = histogram_params->mul;
+  const __m128 shift = _mm_set_ps(0.0f, 128.0f, 128.0f, 0.0f);
+  const __m128 scale = _mm_set_ps(fscale / 1.0f, fscale / 256.0f, fscale / 256.0f, fscale / 100.0f);
+  const __m128 val_min = _mm_setzero_ps();
+  const __m128 val_max = _mm_set1_ps(histogram_params->bins_count - 1);
+
+  // process aligned pixels with SSE
+  for(int i = 0; i < roi->width - roi->crop_width - roi->crop_x; i += step, in += 4 * step)
+    histogram_helper_cs_Lab_helper_process_pixel_m128(shift, scale, val_min, val_max, in, histogram);
 }
+#endif
 
 //==============================================================================
 
@@ -215,11 +228,12 @@ void dt_histogram_worker(dt_dev_histogram_collection_params_t *const histogram_p
   if(histogram_params->mul == 0) histogram_params->mul = (double)(histogram_params->bins_count - 1);
 
   const dt_histogram_roi_t *const roi = histogram_params->roi;
+  const int step = MAX(1, histogram_params->sample_step);
 
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static) default(none) shared(partial_hists)
 #endif
-  for(int j = roi->crop_y; j < roi->height - roi->crop_height; j++)
+  for(int j = roi->crop_y; j < roi->height - roi->crop_height; j += step)
   {
     uint32_t *thread_hist = (uint32_t *)partial_hists + bins_total * omp_get_thread_num();
     Worker(histogram_params, pixel, thread_hist, j);
@@ -246,8 +260,18 @@ void dt_histogram_worker(dt_dev_histogram_collection_params_t *const histogram_p
   free(partial_hists);
 
   histogram_stats->bins_count = histogram_params->bins_count;
-  histogram_stats->pixels = (roi->width - roi->crop_width - roi->crop_x)
-                            * (roi->height - roi->crop_height - roi->crop_y);
+  histogram_stats->pixels = ((roi->width - roi->crop_width - roi->crop_x + step - 1) / step)
+                            * ((roi->height - roi->crop_height - roi->crop_y + step - 1) / step);
+}
+
+//------------------------------------------------------------------------------
+
+uint32_t dt_histogram_sample_step(const dt_histogram_roi_t *const roi)
+{
+  const size_t pixels = (size_t)(roi->width - roi->crop_width - roi->crop_x)
+                        * (roi->height - roi->crop_height - roi->crop_y);
+  if(pixels <= DT_HISTOGRAM_MAX_SAMPLES) return 1;
+  return (uint32_t)ceilf(sqrtf((float)pixels / DT_HISTOGRAM_MAX_SAMPLES));
 }
 
 //------------------------------------------------------------------------------
@@ -264,13 +288,27 @@ void dt_histogram_helper(dt_dev_histogram_collection_params_t *histogram_params,
       break;
 
     case iop_cs_rgb:
-      dt_histogram_worker(histogram_params, histogram_stats, pixel, histogram, histogram_helper_cs_rgb);
+      if(darktable.codepath.OPENMP_SIMD)
+        dt_histogram_worker(histogram_params, histogram_stats, pixel, histogram, histogram_helper_cs_rgb);
+#if defined(__SSE2__)
+      else if(darktable.codepath.SSE2)
+        dt_histogram_worker(histogram_params, histogram_stats, pixel, histogram, histogram_helper_cs_rgb_sse2);
+#endif
+      else
+        dt_unreachable_codepath();
       histogram_stats->ch = 3u;
       break;
 
     case iop_cs_Lab:
     default:
-      dt_histogram_worker(histogram_params, histogram_stats, pixel, histogram, histogram_helper_cs_Lab);
+      if(darktable.codepath.OPENMP_SIMD)
+        dt_histogram_worker(histogram_params, histogram_stats, pixel, histogram, histogram_helper_cs_Lab);
+#if defined(__SSE2__)
+      else if(darktable.codepath.SSE2)
+        dt_histogram_worker(histogram_params, histogram_stats, pixel, histogram, histogram_helper_cs_Lab_sse2);
+#endif
+      else
+        dt_unreachable_codepath();
       histogram_stats->ch = 3u;
       break;
   }
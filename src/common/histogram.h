@@ -35,6 +35,9 @@ typedef struct dt_histogram_roi_t
   int width, height, crop_x, crop_y, crop_width, crop_height;
 } dt_histogram_roi_t;
 
+// histograms which are only displayed don't need to look at more pixels than this
+#define DT_HISTOGRAM_MAX_SAMPLES (1024 * 1024)
+
 void dt_histogram_helper_cs_RAW_uint16(const dt_dev_histogram_collection_params_t *histogram_params,
                                        const void *pixel, uint32_t *histogram, int j);
 
@@ -49,6 +52,9 @@ void dt_histogram_helper(dt_dev_histogram_collection_params_t *histogram_params,
                          dt_dev_histogram_stats_t *histogram_stats, dt_iop_colorspace_type_t cst,
                          const void *pixel, uint32_t **histogram);
 
+/** sampling step which keeps the number of pixels in roi looked at below DT_HISTOGRAM_MAX_SAMPLES */
+uint32_t dt_histogram_sample_step(const dt_histogram_roi_t *const roi);
+
 void dt_histogram_max_helper(const dt_dev_histogram_stats_t *const histogram_stats,
                              dt_iop_colorspace_type_t cst, uint32_t **histogram, uint32_t *histogram_max);
 
@@ -16,11 +16,15 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "common/image_compression.h"
+#include "common/darktable.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef union
 {
@@ -28,68 +32,149 @@ typedef union
   uint32_t i;
 } dt_image_float_int_t;
 
-void dt_image_uncompress(const uint8_t *in, float *out, const int32_t width, const int32_t height)
+// decode the 16 luma values of a block to 16 bit half float style
+static inline int uncompress_luma(const uint8_t *block, uint16_t *L16)
+{
+  const int32_t Lbias = (block[0] >> 3) << 10;
+  const int32_t n_zeroes = block[0] & 0x7;
+  const int shift = 14 - n_zeroes - 4 + 1;
+
+  for(int k = 0; k < 8; k++)
+  {
+    L16[2 * k] = ((int)(block[1 + k] >> 4) << shift) + Lbias;
+    L16[2 * k + 1] = ((int)(block[1 + k] & 0xf) << shift) + Lbias;
+  }
+  return shift;
+}
+
+// decode the four chroma pairs of a block and premultiply them by the channel weights
+static inline void uncompress_chroma(const uint8_t *block, float chrom[4][3])
 {
-  dt_image_float_int_t L[16];
-  float chrom[4][3];
   const float fac[3] = { 4., 2., 4. };
-  uint16_t L16[16];
-  int32_t n_zeroes, Lbias;
   uint8_t r[4], b[4];
-  const uint8_t *block = in;
+  r[0] = block[9] >> 1;
+  b[0] = ((block[9] & 0x01) << 6) | (block[10] >> 2);
+  r[1] = ((block[10] & 0x03) << 5) | (block[11] >> 3);
+  b[1] = ((block[11] & 0x07) << 4) | (block[12] >> 4);
+  r[2] = ((block[12] & 0x0f) << 3) | (block[13] >> 5);
+  b[2] = ((block[13] & 0x1f) << 2) | (block[14] >> 6);
+  r[3] = ((block[14] & 0x3f) << 1) | (block[15] >> 7);
+  b[3] = block[15] & 0x7f;
+
+  for(int q = 0; q < 4; q++)
+  {
+    float c[3];
+    c[0] = r[q] * (1. / 127.);
+    c[2] = b[q] * (1. / 127.);
+    c[1] = 1. - c[0] - c[2];
+    // fac is a power of two, so (L * fac) * c == L * (fac * c)
+    for(int k = 0; k < 3; k++) chrom[q][k] = fac[k] * c[k];
+  }
+}
+
+static void dt_image_uncompress_plain(const uint8_t *in, float *out, const int32_t width, const int32_t height)
+{
+  const size_t blocks_per_row = (width + 3) / 4;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(in, out) schedule(static)
+#endif
   for(int j = 0; j < height; j += 4)
   {
-    for(int i = 0; i < width; i += 4)
+    const uint8_t *block = in + 16 * blocks_per_row * (j / 4);
+    for(int i = 0; i < width; i += 4, block += 16 * sizeof(uint8_t))
     {
-      // luma
-      Lbias = (block[0] >> 3) << 10;
-      n_zeroes = block[0] & 0x7;
-      const int shift = 14 - n_zeroes - 4 + 1;
+      uint16_t L16[16];
+      dt_image_float_int_t L[16];
+      float chrom[4][3];
 
-      for(int k = 0; k < 8; k++)
-      {
-        L16[2 * k] = ((int)(block[1 + k] >> 4) << shift) + Lbias;
-        L16[2 * k + 1] = ((int)(block[1 + k] & 0xf) << shift) + Lbias;
-      }
+      uncompress_luma(block, L16);
       for(int k = 0; k < 16; k++)
       {
         L[k].i = (((int)(L16[k]) >> 10) - (15 - 127)) << (23);
         L[k].i |= (L16[k] & 0x3ff) << 13;
       }
-      // chroma
-      r[0] = block[9] >> 1;
-      b[0] = ((block[9] & 0x01) << 6) | (block[10] >> 2);
-      r[1] = ((block[10] & 0x03) << 5) | (block[11] >> 3);
-      b[1] = ((block[11] & 0x07) << 4) | (block[12] >> 4);
-      r[2] = ((block[12] & 0x0f) << 3) | (block[13] >> 5);
-      b[2] = ((block[13] & 0x1f) << 2) | (block[14] >> 6);
-      r[3] = ((block[14] & 0x3f) << 1) | (block[15] >> 7);
-      b[3] = block[15] & 0x7f;
+      uncompress_chroma(block, chrom);
 
-      for(int q = 0; q < 4; q++)
-      {
-        chrom[q][0] = r[q] * (1. / 127.);
-        chrom[q][2] = b[q] * (1. / 127.);
-        chrom[q][1] = 1. - chrom[q][0] - chrom[q][2];
-      }
       for(int k = 0; k < 16; k++)
         for(int c = 0; c < 3; c++)
-          out[3 * (i + (k & 3) + width * (j + (k >> 2))) + c] = L[k].f * fac[c]
-                                                                * chrom[((k >> 3) << 1) | ((k & 3) >> 1)][c];
-      block += 16 * sizeof(uint8_t);
+          out[3 * (i + (k & 3) + (size_t)width * (j + (k >> 2))) + c]
+              = L[k].f * chrom[((k >> 3) << 1) | ((k & 3) >> 1)][c];
+    }
+  }
+}
+
+#if defined(__SSE2__)
+static void dt_image_uncompress_sse2(const uint8_t *in, float *out, const int32_t width, const int32_t height)
+{
+  const size_t blocks_per_row = (width + 3) / 4;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(in, out) schedule(static)
+#endif
+  for(int j = 0; j < height; j += 4)
+  {
+    const uint8_t *block = in + 16 * blocks_per_row * (j / 4);
+    // exponent bias of half vs. single precision, already in place
+    const __m128i bias = _mm_set1_epi32((127 - 15) << 23);
+    for(int i = 0; i < width; i += 4, block += 16 * sizeof(uint8_t))
+    {
+      uint16_t L16[16];
+      float chrom[4][3];
+
+      uncompress_luma(block, L16);
+      uncompress_chroma(block, chrom);
+
+      // every row of the block holds 4 rgb pixels = 12 floats = 3 vectors. the left two
+      // pixels use one chroma value and the right two the other one, so the weights for
+      // each of the 3 vectors only change every two rows.
+      for(int r = 0; r < 4; r++)
+      {
+        const float *ca = chrom[(r >> 1) << 1], *cb = chrom[((r >> 1) << 1) | 1];
+        const __m128 m0 = _mm_set_ps(ca[0], ca[2], ca[1], ca[0]);
+        const __m128 m1 = _mm_set_ps(cb[1], cb[0], ca[2], ca[1]);
+        const __m128 m2 = _mm_set_ps(cb[2], cb[1], cb[0], cb[2]);
+
+        // the mantissa and exponent of the half float just move up by 13 bits, the
+        // exponent bias is added on top (same as shifting and or-ing in the scalar path)
+        const __m128i l16 = _mm_set_epi32(L16[4 * r + 3], L16[4 * r + 2], L16[4 * r + 1], L16[4 * r]);
+        const __m128 L = _mm_castsi128_ps(_mm_add_epi32(_mm_slli_epi32(l16, 13), bias));
+
+        float *o = out + 3 * (i + (size_t)width * (j + r));
+        _mm_storeu_ps(o, _mm_mul_ps(_mm_shuffle_ps(L, L, _MM_SHUFFLE(1, 0, 0, 0)), m0));
+        _mm_storeu_ps(o + 4, _mm_mul_ps(_mm_shuffle_ps(L, L, _MM_SHUFFLE(2, 2, 1, 1)), m1));
+        _mm_storeu_ps(o + 8, _mm_mul_ps(_mm_shuffle_ps(L, L, _MM_SHUFFLE(3, 3, 3, 2)), m2));
+      }
     }
   }
 }
+#endif
+
+void dt_image_uncompress(const uint8_t *in, float *out, const int32_t width, const int32_t height)
+{
+  if(darktable.codepath.OPENMP_SIMD)
+    dt_image_uncompress_plain(in, out, width, height);
+#if defined(__SSE2__)
+  else if(darktable.codepath.SSE2)
+    dt_image_uncompress_sse2(in, out, width, height);
+#endif
+  else
+    dt_unreachable_codepath();
+}
 
 void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const int32_t height)
 {
-  dt_image_float_int_t L[16];
-  int16_t Lmin, Lmax, n_zeroes, L16[16];
-  uint8_t *block = out, r[4], b[4];
+  // blocks are independent, every row of blocks goes to its own thread
+  const size_t blocks_per_row = (width + 3) / 4;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(in, out) schedule(static)
+#endif
   for(int j = 0; j < height; j += 4)
   {
+    uint8_t *block = out + 16 * blocks_per_row * (j / 4);
     for(int i = 0; i < width; i += 4)
     {
+      dt_image_float_int_t L[16];
+      int16_t Lmin, Lmax, n_zeroes, L16[16];
+      uint8_t r[4], b[4];
       Lmin = 0x7fff;
       for(int q = 0; q < 4; q++)
       {
@@ -100,10 +185,10 @@ void dt_image_compress(const float *in, uint8_t *out, const int32_t width, const
           {
             const int io = (pi + ((q & 1) << 1)), jo = (pj + (q & 2));
             const int ii = i + io, jj = j + jo;
+            const float *px = in + 3 * (ii + (size_t)width * jj);
 
-            L[io + 4 * jo].f = (in[3 * (ii + width * jj) + 0] + 2 * in[3 * (ii + width * jj) + 1]
-                                + in[3 * (ii + width * jj) + 2]) * .25;
-            for(int k = 0; k < 3; k++) chrom[k] += L[io + 4 * jo].f * in[3 * (ii + width * jj) + k];
+            L[io + 4 * jo].f = (px[0] + 2 * px[1] + px[2]) * .25;
+            for(int k = 0; k < 3; k++) chrom[k] += L[io + 4 * jo].f * px[k];
             L16[io + 4 * jo] = (L[io + 4 * jo].i >> 13) & 0x3ff;
             int e = ((L[io + 4 * jo].i >> (23)) - (127 - 15));
             e = e > 0 ? e : 0;
@@ -29,6 +29,9 @@
 #include <xmmintrin.h>
 #endif
 
+#define max_levels 30
+#define num_gamma 6
+
 // downsample width/height to given level
 static inline int dl(int size, const int level)
 {
@@ -113,12 +116,29 @@ static inline void gauss_expand(
     const int wd,             // fine res
     const int ht)
 {
+  // same as ll_expand_gaussian() for every pixel, but exploiting that the stencil
+  // is separable: a vertical pass with 1 6 1 (even j) or 4 4 (odd j) weights over
+  // the coarse rows into a scratch row, then the same horizontally depending on i.
+  const int cw = (wd-1)/2+1;
+  float *const rowbuf = dt_alloc_align(16, sizeof(float)*cw*dt_get_num_threads());
 #ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) collapse(2)
+#pragma omp parallel for default(none) schedule(static)
 #endif
   for(int j=1;j<((ht-1)&~1);j++)  // even ht: two px boundary. odd ht: one px.
-    for(int i=1;i<((wd-1)&~1);i++)
-      fine[j*wd+i] = ll_expand_gaussian(input, i, j, wd, ht);
+  {
+    float *const row = rowbuf + (size_t)cw*dt_get_thread_num();
+    const float *const c0 = input + (size_t)(j/2)*cw;
+    if(j & 1)
+      for(int i=0;i<cw;i++) row[i] = 0.5f*(c0[i] + c0[i+cw]);
+    else
+      for(int i=0;i<cw;i++) row[i] = 0.125f*(c0[i-cw] + 6.0f*c0[i] + c0[i+cw]);
+
+    float *const out = fine + (size_t)j*wd;
+    const int end = (wd-1)&~1;
+    for(int c=0;2*c+1<end;c++) out[2*c+1] = 0.5f*(row[c] + row[c+1]);
+    for(int c=1;2*c<end;c++)   out[2*c]   = 0.125f*(row[c-1] + 6.0f*row[c] + row[c+1]);
+  }
+  dt_free_align(rowbuf);
   ll_fill_boundary2(fine, wd, ht);
 }
 
@@ -132,79 +152,47 @@ static inline void gauss_reduce_sse2(
   // blur, store only coarse res
   const int cw = (wd-1)/2+1, ch = (ht-1)/2+1;
 
-  // this version is inspired by opencv's pyrDown_ :
-  // - allocate 5 rows of ring buffer (aligned)
-  // - for coarse res y
-  //   - fill 5 coarse-res row buffers with 1 4 6 4 1 weights (reuse some from last time)
-  //   - do vertical convolution via sse and write to coarse output buf
-
-  const int stride = ((cw+8)&~7); // assure sse alignment of rows
-  float *ringbuf = dt_alloc_align(16, sizeof(*ringbuf)*stride*5);
-  float *rows[5] = {0};
-  int rowj = 0; // we initialised this many rows so far
-
-  for(int j=1;j<ch-1;j++)
-  {
-    // horizontal pass, convolve with 1 4 6 4 1 kernel and decimate
-    for(;rowj<=2*j+2;rowj++)
-    {
-      float *const row = ringbuf + (rowj % 5)*stride;
-      const float *const in = input + rowj*wd;
-#ifdef _OPENMP
-#pragma omp parallel for schedule(static) default(none)
-#endif
-      for(int i=1;i<cw-1;i++)
-        row[i] = 6*in[2*i] + 4*(in[2*i-1]+in[2*i+1]) + in[2*i-2] + in[2*i+2];
-    }
+  // every coarse row is computed on its own, so rows can go to different threads:
+  // - vertical pass over the five contributing fine rows with 1 4 6 4 1 weights via sse,
+  //   written to a scratch row at fine res
+  // - horizontal pass, convolve the scratch row with the same kernel and decimate
+  const int stride = (wd+3)&~3; // assure sse alignment of rows
+  float *const rowbuf = dt_alloc_align(16, sizeof(float)*stride*dt_get_num_threads());
 
-    // init row pointers
-    for(int k=0;k<5;k++)
-      rows[k] = ringbuf + ((2*j-2+k)%5)*stride;
-
-    // vertical pass, convolve and decimate using SIMD:
-    // note that we're ignoring the (1..cw-1) buffer limit, we'll pull in
-    // garbage and fix it later by border filling.
-    float *const out = coarse + j*cw;
-    const float *const row0 = rows[0], *const row1 = rows[1],
-                *const row2 = rows[2], *const row3 = rows[3], *const row4 = rows[4];
-    const __m128 four = _mm_set1_ps(4.f), scale = _mm_set1_ps(1.f/256.f);
 #ifdef _OPENMP
-#pragma omp parallel for schedule(static) default(none)
+#pragma omp parallel for default(none) schedule(static)
 #endif
-    for(int i=0;i<=cw-8;i+=8)
+  for(int j=1;j<ch-1;j++)
+  {
+    float *const row = rowbuf + (size_t)stride*dt_get_thread_num();
+    const float *const row0 = input + (size_t)(2*j-2)*wd;
+    const float *const row1 = row0 + wd, *const row2 = row1 + wd,
+                *const row3 = row2 + wd, *const row4 = row3 + wd;
+    const __m128 four = _mm_set1_ps(4.f);
+
+    int i = 0;
+    for(;i<=wd-4;i+=4)
     {
-      __m128 r0, r1, r2, r3, r4, t0, t1;
-      r0 = _mm_load_ps(row0 + i);
-      r1 = _mm_load_ps(row1 + i);
-      r2 = _mm_load_ps(row2 + i);
-      r3 = _mm_load_ps(row3 + i);
-      r4 = _mm_load_ps(row4 + i);
-      r0 = _mm_add_ps(r0, r4);
-      r1 = _mm_add_ps(_mm_add_ps(r1, r3), r2);
-      r0 = _mm_add_ps(r0, _mm_add_ps(r2, r2));
-      t0 = _mm_add_ps(r0, _mm_mul_ps(r1, four));
-
-      r0 = _mm_load_ps(row0 + i + 4);
-      r1 = _mm_load_ps(row1 + i + 4);
-      r2 = _mm_load_ps(row2 + i + 4);
-      r3 = _mm_load_ps(row3 + i + 4);
-      r4 = _mm_load_ps(row4 + i + 4);
+      __m128 r0, r1, r2, r3, r4;
+      r0 = _mm_loadu_ps(row0 + i);
+      r1 = _mm_loadu_ps(row1 + i);
+      r2 = _mm_loadu_ps(row2 + i);
+      r3 = _mm_loadu_ps(row3 + i);
+      r4 = _mm_loadu_ps(row4 + i);
       r0 = _mm_add_ps(r0, r4);
       r1 = _mm_add_ps(_mm_add_ps(r1, r3), r2);
       r0 = _mm_add_ps(r0, _mm_add_ps(r2, r2));
-      t1 = _mm_add_ps(r0, _mm_mul_ps(r1, four));
-
-      t0 = _mm_mul_ps(t0, scale);
-      t1 = _mm_mul_ps(t1, scale);
-
-      _mm_storeu_ps(out + i, t0);
-      _mm_storeu_ps(out + i + 4, t1);
+      _mm_store_ps(row + i, _mm_add_ps(r0, _mm_mul_ps(r1, four)));
     }
     // process the rest
-    for(int i=cw&~7;i<cw-1;i++)
-      out[i] = (6*row2[i] + 4*(row1[i] + row3[i]) + row0[i] + row4[i])*(1.0f/256.0f);
+    for(;i<wd;i++)
+      row[i] = 6*row2[i] + 4*(row1[i] + row3[i]) + row0[i] + row4[i];
+
+    float *const out = coarse + (size_t)j*cw;
+    for(int i=1;i<cw-1;i++)
+      out[i] = (6*row[2*i] + 4*(row[2*i-1]+row[2*i+1]) + row[2*i-2] + row[2*i+2])*(1.0f/256.0f);
   }
-  dt_free_align(ringbuf);
+  dt_free_align(rowbuf);
   ll_fill_boundary1(coarse, cw, ch);
 }
 #endif
@@ -471,8 +459,6 @@ void local_laplacian_internal(
     const float clarity,        // user param: increase clarity/local contrast
     const int use_sse2)         // flag whether to use SSE version
 {
-#define max_levels 30
-#define num_gamma 6
   // don't divide by 2 more often than we can:
   const int num_levels = MIN(max_levels, 31-__builtin_clz(MIN(wd,ht)));
   const int max_supp = 1<<(num_levels-1);
@@ -510,10 +496,14 @@ void local_laplacian_internal(
   for(int k=0;k<num_gamma;k++) gamma[k] = (k+.5f)/(float)num_gamma;
   // for(int k=0;k<num_gamma;k++) gamma[k] = k/(num_gamma-1.0f);
 
-  // allocate memory for intermediate laplacian pyramids
-  float *buf[num_gamma][max_levels] = {{0}};
-  for(int k=0;k<num_gamma;k++) for(int l=0;l<num_levels;l++)
-    buf[k][l] = dt_alloc_align(16, sizeof(float)*dl(w,l)*dl(h,l));
+  // only the intermediate pyramid of the gamma value currently processed is kept.
+  // its laplacian coefficients are accumulated into the finer levels of the output
+  // pyramid right away, so memory does not grow with the number of gamma samples.
+  float *buf[max_levels] = {0};
+  for(int l=0;l<num_levels;l++)
+    buf[l] = dt_alloc_align(16, sizeof(float)*dl(w,l)*dl(h,l));
+  for(int l=0;l<num_levels-1;l++)
+    memset(output[l], 0, sizeof(float)*dl(w,l)*dl(h,l));
 
   // the paper says remapping only level 3 not 0 does the trick, too
   // (but i really like the additional octave of sharpness we get,
@@ -522,47 +512,61 @@ void local_laplacian_internal(
   { // process images
 #if defined(__SSE2__)
     if(use_sse2)
-      apply_curve_sse2(buf[k][0], padded[0], w, h, max_supp, gamma[k], sigma, shadows, highlights, clarity);
+      apply_curve_sse2(buf[0], padded[0], w, h, max_supp, gamma[k], sigma, shadows, highlights, clarity);
     else // brackets in next line needed for silly gcc warning:
 #endif
-    {apply_curve(buf[k][0], padded[0], w, h, max_supp, gamma[k], sigma, shadows, highlights, clarity);}
+    {apply_curve(buf[0], padded[0], w, h, max_supp, gamma[k], sigma, shadows, highlights, clarity);}
 
     // create gaussian pyramids
     for(int l=1;l<num_levels;l++)
 #if defined(__SSE2__)
       if(use_sse2)
-        gauss_reduce_sse2(buf[k][l-1], buf[k][l], dl(w,l-1), dl(h,l-1));
+        gauss_reduce_sse2(buf[l-1], buf[l], dl(w,l-1), dl(h,l-1));
       else
 #endif
-        gauss_reduce(buf[k][l-1], buf[k][l], dl(w,l-1), dl(h,l-1));
+        gauss_reduce(buf[l-1], buf[l], dl(w,l-1), dl(h,l-1));
+
+    // go through all coefficients and add those of this gamma value to the
+    // output wherever it is one of the two closest to the input brightness:
+    for(int l=0;l<num_levels-1;l++)
+    {
+      const int pw = dl(w,l), ph = dl(h,l);
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static) collapse(2) shared(buf,output,l,k,gamma,padded)
+#endif
+      for(int j=0;j<ph;j++) for(int i=0;i<pw;i++)
+      {
+        const float v = padded[l][j*pw+i];
+        int hi = 1;
+        for(;hi<num_gamma-1 && gamma[hi] <= v;hi++);
+        const int lo = hi-1;
+        if(lo != k && hi != k) continue;
+        const float a = CLAMPS((v - gamma[lo])/(gamma[hi]-gamma[lo]), 0.0f, 1.0f);
+        const float lap = ll_laplacian(buf[l+1], buf[l], i, j, pw, ph);
+        output[l][j*pw+i] += lap * (lo == k ? 1.0f-a : a);
+        // we could do this to save on memory (no need for finest buf[][]).
+        // unfortunately it results in a quite noticable loss of sharpness, i think
+        // the extra level is worth it.
+        // else if(l == 0) // use finest scale from input to not amplify noise (and use less memory)
+        //   output[l][j*pw+i] += ll_laplacian(padded[l+1], padded[l], i, j, pw, ph);
+      }
+    }
   }
 
-  // assemble output pyramid coarse to fine
+  // assemble output pyramid coarse to fine. the intermediate pyramid is
+  // not needed anymore and holds the upsampled coarser levels.
   for(int l=num_levels-2;l >= 0; l--)
   {
     const int pw = dl(w,l), ph = dl(h,l);
+    float *const coeff = output[l];
+    float *const upsampled = buf[l];
 
-    gauss_expand(output[l+1], output[l], pw, ph);
-    // go through all coefficients in the upsampled gauss buffer:
+    gauss_expand(output[l+1], upsampled, pw, ph);
 #ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) collapse(2) shared(w,h,buf,output,l,gamma,padded)
+#pragma omp parallel for default(none) schedule(static)
 #endif
-    for(int j=0;j<ph;j++) for(int i=0;i<pw;i++)
-    {
-      const float v = padded[l][j*pw+i];
-      int hi = 1;
-      for(;hi<num_gamma-1 && gamma[hi] <= v;hi++);
-      int lo = hi-1;
-      const float a = CLAMPS((v - gamma[lo])/(gamma[hi]-gamma[lo]), 0.0f, 1.0f);
-      const float l0 = ll_laplacian(buf[lo][l+1], buf[lo][l], i, j, pw, ph);
-      const float l1 = ll_laplacian(buf[hi][l+1], buf[hi][l], i, j, pw, ph);
-      output[l][j*pw+i] += l0 * (1.0f-a) + l1 * a;
-      // we could do this to save on memory (no need for finest buf[][]).
-      // unfortunately it results in a quite noticable loss of sharpness, i think
-      // the extra level is worth it.
-      // else if(l == 0) // use finest scale from input to not amplify noise (and use less memory)
-      //   output[l][j*pw+i] += ll_laplacian(padded[l+1], padded[l], i, j, pw, ph);
-    }
+    for(size_t k=0;k<(size_t)pw*ph;k++)
+      coeff[k] += upsampled[k];
   }
 #ifdef _OPENMP
 #pragma omp parallel for default(none) schedule(dynamic) collapse(2) shared(w,output,buf)
@@ -578,9 +582,39 @@ void local_laplacian_internal(
   {
     dt_free_align(padded[l]);
     dt_free_align(output[l]);
-    for(int k = 0; k < num_gamma; k++) dt_free_align(buf[k][l]);
+    dt_free_align(buf[l]);
   }
-#undef num_levels
-#undef num_gamma
 }
 
+#ifndef HAVE_OPENCL
+// function definition on opencl path takes precedence
+size_t local_laplacian_memory_use(const int width,  // width of input image
+                                  const int height) // height of input image
+{
+  const int num_levels = MIN(max_levels, 31-__builtin_clz(MIN(width,height)));
+  const int max_supp = 1<<(num_levels-1);
+  const int paddwd = width  + 2*max_supp;
+  const int paddht = height + 2*max_supp;
+
+  size_t memory_use = 0;
+  for(int l=0;l<num_levels;l++)
+    memory_use += sizeof(float) * dl(paddwd, l) * dl(paddht, l);
+
+  // pyramids of the padded input, the output and the gamma value in process
+  return 3 * memory_use;
+}
+
+size_t local_laplacian_singlebuffer_size(const int width,  // width of input image
+                                         const int height) // height of input image
+{
+  const int num_levels = MIN(max_levels, 31-__builtin_clz(MIN(width,height)));
+  const int max_supp = 1<<(num_levels-1);
+  const int paddwd = width  + 2*max_supp;
+  const int paddht = height + 2*max_supp;
+
+  return sizeof(float) * paddwd * paddht;
+}
+#endif
+
+#undef max_levels
+#undef num_gamma
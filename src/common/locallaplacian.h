@@ -17,6 +17,15 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
+
+// memory footprint of local_laplacian() and its largest single buffer, for tiling
+size_t local_laplacian_memory_use(const int width,   // width of input image
+                                  const int height); // height of input image
+
+size_t local_laplacian_singlebuffer_size(const int width,   // width of input image
+                                         const int height); // height of input image
+
 void local_laplacian_internal(
     const float *const input,   // input buffer in some Labx or yuvx format
     float *const out,           // output buffer with colour
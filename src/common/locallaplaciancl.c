@@ -31,6 +31,35 @@ static inline uint64_t dl(uint64_t size, const int level)
   return size;
 }
 
+// these take precedence over the cpu versions as the opencl path keeps
+// the pyramids of all gamma values on the device at the same time
+size_t local_laplacian_memory_use(const int width,  // width of input image
+                                  const int height) // height of input image
+{
+  const int num_levels = MIN(max_levels, 31-__builtin_clz(MIN(width,height)));
+  const int max_supp = 1<<(num_levels-1);
+  const int paddwd = width  + 2*max_supp;
+  const int paddht = height + 2*max_supp;
+
+  size_t memory_use = 0;
+  for(int l=0;l<num_levels;l++)
+    memory_use += sizeof(float) * dl(paddwd, l) * dl(paddht, l);
+
+  // padded input, output and one pyramid per gamma value
+  return (2 + num_gamma) * memory_use;
+}
+
+size_t local_laplacian_singlebuffer_size(const int width,  // width of input image
+                                         const int height) // height of input image
+{
+  const int num_levels = MIN(max_levels, 31-__builtin_clz(MIN(width,height)));
+  const int max_supp = 1<<(num_levels-1);
+  const int paddwd = width  + 2*max_supp;
+  const int paddht = height + 2*max_supp;
+
+  return sizeof(float) * paddwd * paddht;
+}
+
 dt_local_laplacian_cl_global_t *dt_local_laplacian_init_cl_global()
 {
   dt_local_laplacian_cl_global_t *g = (dt_local_laplacian_cl_global_t *)malloc(sizeof(dt_local_laplacian_cl_global_t));
@@ -1399,6 +1399,8 @@ void dt_iop_commit_params(dt_iop_module_t *module, dt_iop_params_t *params,
     // assume process_cl is ready, commit_params can overwrite this.
     if(module->process_cl) piece->process_cl_ready = 1;
     module->commit_params(module, params, pipe, piece);
+    // commit_params may put a hash of state into piece->hash which changes the output but is not in the params
+    if(piece->hash) hash = ((hash << 5) + hash) ^ piece->hash;
     for(int i = 0; i < length; i++) hash = ((hash << 5) + hash) ^ str[i];
     piece->hash = hash;
 
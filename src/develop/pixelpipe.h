@@ -40,7 +40,9 @@ typedef enum dt_dev_request_flags_t
 {
   DT_REQUEST_NONE = 0,
   DT_REQUEST_ON = 1 << 0,
-  DT_REQUEST_ONLY_IN_GUI = 1 << 1
+  DT_REQUEST_ONLY_IN_GUI = 1 << 1,
+  // the histogram is only drawn, nothing is computed from it: a subset of the pixels is enough
+  DT_REQUEST_SUBSAMPLE = 1 << 2
 } dt_dev_request_flags_t;
 
 // params to be used to collect histogram
@@ -52,6 +54,8 @@ typedef struct dt_dev_histogram_collection_params_t
   uint32_t bins_count;
   /** in most cases, bins_count-1. */
   float mul;
+  /** only every sample_step-th pixel of every sample_step-th row is looked at. 0 and 1 mean all. */
+  uint32_t sample_step;
 } dt_dev_histogram_collection_params_t;
 
 // params used to collect histogram during last histogram capture
@@ -359,6 +359,11 @@ static void histogram_collect(dt_dev_pixelpipe_iop_t *piece, const void *pixel,
     histogram_params.roi = &histogram_roi;
   }
 
+  // histograms which are only drawn can do with a subset of the pixels, which keeps the cost
+  // of collecting them independent of the roi size, i.e. of the zoom scale
+  if(piece->request_histogram & DT_REQUEST_SUBSAMPLE)
+    histogram_params.sample_step = dt_histogram_sample_step(histogram_params.roi);
+
   const dt_iop_colorspace_type_t cst = dt_iop_module_colorspace(piece->module);
 
   dt_histogram_helper(&histogram_params, &piece->histogram_stats, cst, pixel, histogram);
@@ -406,6 +411,11 @@ static void histogram_collect_cl(int devid, dt_dev_pixelpipe_iop_t *piece, cl_me
     histogram_params.roi = &histogram_roi;
   }
 
+  // histograms which are only drawn can do with a subset of the pixels, which keeps the cost
+  // of collecting them independent of the roi size, i.e. of the zoom scale
+  if(piece->request_histogram & DT_REQUEST_SUBSAMPLE)
+    histogram_params.sample_step = dt_histogram_sample_step(histogram_params.roi);
+
   const dt_iop_colorspace_type_t cst = dt_iop_module_colorspace(piece->module);
 
   dt_histogram_helper(&histogram_params, &piece->histogram_stats, cst, pixel, histogram);
@@ -39,6 +39,9 @@ DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
 
 /*******************************************************************
  * Hash table implementation for permutohedral lattice             *
@@ -60,7 +63,8 @@ public:
     capacity = 1 << 15;
     capacity_bits = 0x7fff;
     filled = 0;
-    entries = new Entry[capacity];
+    entries = new int[capacity];
+    memset(entries, 0xff, sizeof(int) * capacity);
     keys = new short[KD * capacity / 2];
     values = new float[VD * capacity / 2];
     memset(values, 0, sizeof(float) * VD * capacity / 2);
@@ -96,41 +100,44 @@ public:
    *       h: hash of the position vector.
    *  create: a flag specifying whether an entry should be created,
    *          should an entry with the given key not found.
+   *
+   * the table is open addressed with linear probing and only holds the index of the
+   * vertex, which is the same for its key and value vectors. so probing touches a
+   * single int per bucket, and lookups without create never modify the table, which
+   * makes them safe to be done from several threads at once.
    */
   int lookupOffset(const short *key, size_t h, bool create = true)
   {
-
     // Double hash table size if necessary
-    if(filled >= (capacity / 2) - 1)
+    if(create && filled >= (capacity / 2) - 1)
     {
       grow();
+      h = hash(key) & capacity_bits;
     }
 
     // Find the entry with the given key
     while(1)
     {
-      Entry e = entries[h];
+      const int e = entries[h];
       // check if the cell is empty
-      if(e.keyIdx == -1)
+      if(e == -1)
       {
         if(!create) return -1; // Return not found.
         // need to create an entry. Store the given key.
         for(int i = 0; i < KD; i++) keys[filled * KD + i] = key[i];
-        e.keyIdx = filled * KD;
-        e.valueIdx = filled * VD;
-        entries[h] = e;
+        entries[h] = filled;
         filled++;
-        return e.valueIdx;
+        return (filled - 1) * VD;
       }
 
       // check if the cell has a matching key
+      const short *k = keys + (size_t)e * KD;
       bool match = true;
-      for(int i = 0; i < KD && match; i++) match = keys[e.keyIdx + i] == key[i];
-      if(match) return e.valueIdx;
+      for(int i = 0; i < KD && match; i++) match = k[i] == key[i];
+      if(match) return e * VD;
 
       // increment the bucket with wraparound
-      h++;
-      if(h == capacity) h = 0;
+      h = (h + 1) & capacity_bits;
     }
   }
 
@@ -164,7 +171,6 @@ private:
   /* Grows the size of the hash table */
   void grow()
   {
-    size_t oldCapacity = capacity;
     capacity *= 2;
     capacity_bits = (capacity_bits << 1) | 1;
 
@@ -181,37 +187,21 @@ private:
     delete[] keys;
     keys = newKeys;
 
-    Entry *newEntries = new Entry[capacity];
-
-    // Migrate the table of indices.
-    for(size_t i = 0; i < oldCapacity; i++)
-    {
-      if(entries[i].keyIdx == -1) continue;
-      size_t h = hash(keys + entries[i].keyIdx) & capacity_bits;
-      while(newEntries[h].keyIdx != -1)
-      {
-        h++;
-        if(h == capacity) h = 0;
-      }
-      newEntries[h] = entries[i];
-    }
+    // Rebuild the table of indices, vertices are stored densely so just walk them.
     delete[] entries;
-    entries = newEntries;
-  }
-
-  // Private struct for the hash table entries.
-  struct Entry
-  {
-    Entry() : keyIdx(-1), valueIdx(-1)
+    entries = new int[capacity];
+    memset(entries, 0xff, sizeof(int) * capacity);
+    for(size_t i = 0; i < filled; i++)
     {
+      size_t h = hash(keys + i * KD) & capacity_bits;
+      while(entries[h] != -1) h = (h + 1) & capacity_bits;
+      entries[h] = i;
     }
-    int keyIdx;
-    int valueIdx;
-  };
+  }
 
   short *keys;
   float *values;
-  Entry *entries;
+  int *entries;
   size_t capacity, filled;
   unsigned long capacity_bits;
 };
@@ -413,8 +403,15 @@ public:
     }
 
     /* Rewrite the offsets in the replay structure from the above generated table. */
-    for(int i = 0; i < nData * (D + 1); i++)
-      if(replay[i].table > 0) replay[i].offset = offset_remap[replay[i].table][replay[i].offset / VD];
+#ifdef _OPENMP
+#pragma omp parallel for shared(offset_remap) schedule(static)
+#endif
+    for(size_t i = 0; i < (size_t)nData * (D + 1); i++)
+      if(replay[i].table > 0)
+      {
+        replay[i].offset = offset_remap[replay[i].table][replay[i].offset / VD];
+        replay[i].table = 0;
+      }
 
     for(int i = 1; i < nThreads; i++) delete[] offset_remap[i];
 
@@ -427,14 +424,24 @@ public:
    */
   void slice(float *col, size_t replay_index)
   {
-    float *base = hashTables[0].getValues();
+    const float *base = hashTables[0].getValues();
+    const ReplayEntry *r = replay + replay_index * (D + 1);
+#if defined(__SSE2__)
+    if(VD == 4)
+    {
+      __m128 sum = _mm_setzero_ps();
+      for(int i = 0; i <= D; i++)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(r[i].weight), _mm_loadu_ps(base + r[i].offset)));
+      _mm_storeu_ps(col, sum);
+      return;
+    }
+#endif
     for(int j = 0; j < VD; j++) col[j] = 0;
     for(int i = 0; i <= D; i++)
     {
-      ReplayEntry r = replay[replay_index * (D + 1) + i];
       for(int j = 0; j < VD; j++)
       {
-        col[j] += r.weight * base[r.offset + j];
+        col[j] += r[i].weight * base[r[i].offset + j];
       }
     }
   }
@@ -454,7 +461,7 @@ public:
     for(int j = 0; j <= D; j++)
     {
 #ifdef _OPENMP
-#pragma omp parallel for shared(j, oldValue, newValue, hashTableBase, zero)
+#pragma omp parallel for shared(j, oldValue, newValue, hashTableBase, zero) schedule(static)
 #endif
       // For each vertex in the lattice,
       for(int i = 0; i < hashTables[0].size(); i++) // blur point i in dimension j
@@ -488,6 +495,16 @@ public:
           vp1 = zero;
 
         // Mix values of the three vertices
+#if defined(__SSE2__)
+        if(VD == 4)
+        {
+          const __m128 quarter = _mm_set1_ps(0.25f), half = _mm_set1_ps(0.5f);
+          _mm_storeu_ps(newVal, _mm_add_ps(_mm_add_ps(_mm_mul_ps(quarter, _mm_loadu_ps(vm1)),
+                                                      _mm_mul_ps(half, _mm_loadu_ps(oldVal))),
+                                           _mm_mul_ps(quarter, _mm_loadu_ps(vp1))));
+          continue;
+        }
+#endif
         for(int k = 0; k < VD; k++) newVal[k] = (0.25f * vm1[k] + 0.5f * oldVal[k] + 0.25f * vp1[k]);
       }
       float *tmp = newValue;
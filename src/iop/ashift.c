@@ -67,13 +67,16 @@
 #define LSD_DENSITY_TH 0.7                  // LSD: minimal density of region points in rectangle
 #define LSD_N_BINS 1024                     // LSD: number of bins in pseudo-ordering of gradient modulus
 #define LSD_GAMMA 0.45                      // gamma correction to apply on raw images prior to line detection
+#define LSD_PYRAMID_SIZE 1000               // LSD: max. size of the coarsest level for coarse to fine line detection
+#define LSD_PYRAMID_LINES 40                // LSD: relevant lines a coarse level needs to skip the finer levels
 #define RANSAC_RUNS 400                     // how many interations to run in ransac
 #define RANSAC_EPSILON 2                    // starting value for ransac epsilon (in -log10 units)
 #define RANSAC_EPSILON_STEP 1               // step size of epsilon optimization (log10 units)
 #define RANSAC_ELIMINATION_RATIO 60         // percentage of lines we try to eliminate as outliers
 #define RANSAC_OPTIMIZATION_STEPS 5         // home many steps to optimize epsilon
 #define RANSAC_OPTIMIZATION_DRY_RUNS 50     // how man runs per optimization steps
-#define RANSAC_HURDLE 5                     // hurdle rate: the number of lines below which we do a complete permutation instead of random sampling
+#define RANSAC_HURDLE 5                     // hurdle rate: the number of lines below which we try all pairs of lines instead of random sampling
+#define RANSAC_SEED 42                      // seed of the random sampling in ransac, results are reproducible
 #define MINIMUM_FITLINES 4                  // minimum number of lines needed for automatic parameter fit
 #define NMS_EPSILON 1e-3                    // break criterion for Nelder-Mead simplex
 #define NMS_SCALE 1.0                       // scaling factor for Nelder-Mead simplex
@@ -1049,8 +1052,8 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 }
 
 // simple conversion of rgb image into greyscale variant suitable for line segment detection
-// the lsd routines expect input as *double, roughly in the range [0.0; 256.0]
-static void rgb2grey256(const float *in, double *out, const int width, const int height)
+// the lsd routines expect input as *float, roughly in the range [0.0; 256.0]
+static void rgb2grey256(const float *in, float *out, const int width, const int height)
 {
   const int ch = 4;
 
@@ -1060,26 +1063,26 @@ static void rgb2grey256(const float *in, double *out, const int width, const int
   for(int j = 0; j < height; j++)
   {
     const float *inp = in + (size_t)ch * j * width;
-    double *outp = out + (size_t)j * width;
+    float *outp = out + (size_t)j * width;
     for(int i = 0; i < width; i++, inp += ch, outp++)
     {
-      *outp = (0.3f * inp[0] + 0.59f * inp[1] + 0.11f * inp[2]) * 256.0;
+      *outp = (0.3f * inp[0] + 0.59f * inp[1] + 0.11f * inp[2]) * 256.0f;
     }
   }
 }
 
 // sobel edge enhancement in one direction
-static void edge_enhance_1d(const double *in, double *out, const int width, const int height,
+static void edge_enhance_1d(const float *in, float *out, const int width, const int height,
                             dt_iop_ashift_enhance_t dir)
 {
   // Sobel kernels for both directions
-  const double hkernel[3][3] = { { 1.0, 0.0, -1.0 }, { 2.0, 0.0, -2.0 }, { 1.0, 0.0, -1.0 } };
-  const double vkernel[3][3] = { { 1.0, 2.0, 1.0 }, { 0.0, 0.0, 0.0 }, { -1.0, -2.0, -1.0 } };
+  const float hkernel[3][3] = { { 1.0f, 0.0f, -1.0f }, { 2.0f, 0.0f, -2.0f }, { 1.0f, 0.0f, -1.0f } };
+  const float vkernel[3][3] = { { 1.0f, 2.0f, 1.0f }, { 0.0f, 0.0f, 0.0f }, { -1.0f, -2.0f, -1.0f } };
   const int kwidth = 3;
   const int khwidth = kwidth / 2;
 
   // select kernel
-  const double *kernel = (dir == ASHIFT_ENHANCE_HORIZONTAL) ? (const double *)hkernel : (const double *)vkernel;
+  const float *kernel = (dir == ASHIFT_ENHANCE_HORIZONTAL) ? (const float *)hkernel : (const float *)vkernel;
 
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static) default(none) shared(in, out, kernel)
@@ -1087,11 +1090,11 @@ static void edge_enhance_1d(const double *in, double *out, const int width, cons
   // loop over image pixels and perform sobel convolution
   for(int j = khwidth; j < height - khwidth; j++)
   {
-    const double *inp = in + (size_t)j * width + khwidth;
-    double *outp = out + (size_t)j * width + khwidth;
+    const float *inp = in + (size_t)j * width + khwidth;
+    float *outp = out + (size_t)j * width + khwidth;
     for(int i = khwidth; i < width - khwidth; i++, inp++, outp++)
     {
-      double sum = 0.0f;
+      float sum = 0.0f;
       for(int jj = 0; jj < kwidth; jj++)
       {
         const int k = jj * kwidth;
@@ -1112,7 +1115,7 @@ static void edge_enhance_1d(const double *in, double *out, const int width, cons
   for(int j = 0; j < height; j++)
     for(int i = 0; i < width; i++)
     {
-      double val = out[j * width + i];
+      float val = out[j * width + i];
 
       if(j < khwidth)
         val = out[(khwidth - j) * width + i];
@@ -1131,15 +1134,15 @@ static void edge_enhance_1d(const double *in, double *out, const int width, cons
 }
 
 // edge enhancement in both directions
-static int edge_enhance(const double *in, double *out, const int width, const int height)
+static int edge_enhance(const float *in, float *out, const int width, const int height)
 {
-  double *Gx = NULL;
-  double *Gy = NULL;
+  float *Gx = NULL;
+  float *Gy = NULL;
 
-  Gx = malloc((size_t)width * height * sizeof(double));
+  Gx = malloc((size_t)width * height * sizeof(float));
   if(Gx == NULL) goto error;
 
-  Gy = malloc((size_t)width * height * sizeof(double));
+  Gy = malloc((size_t)width * height * sizeof(float));
   if(Gy == NULL) goto error;
 
   // perform edge enhancement in both directions
@@ -1152,7 +1155,7 @@ static int edge_enhance(const double *in, double *out, const int width, const in
 #endif
   for(size_t k = 0; k < (size_t)width * height; k++)
   {
-    out[k] = sqrt(Gx[k] * Gx[k] + Gy[k] * Gy[k]);
+    out[k] = sqrtf(Gx[k] * Gx[k] + Gy[k] * Gy[k]);
   }
 
   free(Gx);
@@ -1259,12 +1262,15 @@ static void gamma_correct(const float *in, float *out, const int width, const in
 }
 
 // do actual line_detection based on LSD algorithm and return results according
-// to this module's conventions
+// to this module's conventions.
+// detection runs coarse to fine on a pyramid of LSD scales: we start with the coarsest
+// level that is not larger than LSD_PYRAMID_SIZE and only go to the next finer level
+// if the coarse one did not deliver enough relevant lines for a fit
 static int line_detect(float *in, const int width, const int height, const int x_off, const int y_off,
                        const float scale, dt_iop_ashift_line_t **alines, int *lcount, int *vcount, int *hcount,
                        float *vweight, float *hweight, dt_iop_ashift_enhance_t enhance, const int is_raw)
 {
-  double *greyscale = NULL;
+  float *greyscale = NULL;
   double *lsd_lines = NULL;
   dt_iop_ashift_line_t *ashift_lines = NULL;
 
@@ -1272,6 +1278,8 @@ static int line_detect(float *in, const int width, const int height, const int x
   int horizontal_count = 0;
   float vertical_weight = 0.0f;
   float horizontal_weight = 0.0f;
+  int lines_count = 0;
+  int lct = 0;
 
   // apply gamma correction if image is raw
   if(is_raw)
@@ -1286,7 +1294,7 @@ static int line_detect(float *in, const int width, const int height, const int x
   }
 
   // allocate intermediate buffers
-  greyscale = malloc((size_t)width * height * sizeof(double));
+  greyscale = malloc((size_t)width * height * sizeof(float));
   if(greyscale == NULL) goto error;
 
   // convert to greyscale image
@@ -1298,20 +1306,34 @@ static int line_detect(float *in, const int width, const int height, const int x
     (void)edge_enhance(greyscale, greyscale, width, height);
   }
 
-  // call the line segment detector LSD;
-  // LSD stores the number of found lines in lines_count.
-  // it returns structural details as vector 'double lines[7 * lines_count]'
-  int lines_count;
-  lsd_lines = LineSegmentDetection(&lines_count, greyscale, width, height,
-                                   LSD_SCALE, LSD_SIGMA_SCALE, LSD_QUANT,
-                                   LSD_ANG_TH, LSD_LOG_EPS, LSD_DENSITY_TH,
-                                   LSD_N_BINS, NULL, NULL, NULL);
-
-  // we count the lines that we really want to use
-  int lct = 0;
+  // number of pyramid levels coarser than LSD_SCALE
+  int level = 0;
+  while(MAX(width, height) * LSD_SCALE / (1 << level) > LSD_PYRAMID_SIZE) level++;
 
-  if(lines_count > 0)
+  for(; level >= 0; level--)
   {
+    const double lsd_scale = LSD_SCALE / (1 << level);
+    // tolerance for lines along the image borders grows with the pixel size of the level
+    const float border = 1 << level;
+
+    free(lsd_lines);
+    free(ashift_lines);
+    lsd_lines = NULL;
+    ashift_lines = NULL;
+    vertical_count = horizontal_count = 0;
+    vertical_weight = horizontal_weight = 0.0f;
+    lct = 0;
+
+    // call the line segment detector LSD;
+    // LSD stores the number of found lines in lines_count.
+    // it returns structural details as vector 'double lines[7 * lines_count]'
+    lsd_lines = LineSegmentDetection(&lines_count, greyscale, width, height,
+                                     lsd_scale, LSD_SIGMA_SCALE, LSD_QUANT,
+                                     LSD_ANG_TH, LSD_LOG_EPS, LSD_DENSITY_TH,
+                                     LSD_N_BINS, NULL, NULL, NULL);
+
+    if(lines_count <= 0) continue;
+
     // aggregate lines data into our own structures
     ashift_lines = (dt_iop_ashift_line_t *)malloc((size_t)lines_count * sizeof(dt_iop_ashift_line_t));
     if(ashift_lines == NULL) goto error;
@@ -1326,10 +1348,10 @@ static int line_detect(float *in, const int width, const int height, const int x
       // check for lines running along image borders and skip them.
       // these would likely be false-positives which could result
       // from any kind of processing artifacts
-      if((fabs(x1 - x2) < 1 && fmax(x1, x2) < 2) ||
-         (fabs(x1 - x2) < 1 && fmin(x1, x2) > width - 3) ||
-         (fabs(y1 - y2) < 1 && fmax(y1, y2) < 2) ||
-         (fabs(y1 - y2) < 1 && fmin(y1, y2) > height - 3))
+      if((fabs(x1 - x2) < border && fmax(x1, x2) < 2 * border) ||
+         (fabs(x1 - x2) < border && fmin(x1, x2) > width - 1 - 2 * border) ||
+         (fabs(y1 - y2) < border && fmax(y1, y2) < 2 * border) ||
+         (fabs(y1 - y2) < border && fmin(y1, y2) > height - 1 - 2 * border))
         continue;
 
       // line position in absolute coordinates
@@ -1393,7 +1415,18 @@ static int line_detect(float *in, const int width, const int height, const int x
       // the next valid line
       lct++;
     }
+
+#ifdef ASHIFT_DEBUG
+    printf("pyramid level %d (scale %f): %d lines (vertical %d, horizontal %d)\n", level, lsd_scale, lines_count,
+           vertical_count, horizontal_count);
+#endif
+
+    // enough lines in both directions on this level?
+    if(vertical_count >= MINIMUM_FITLINES && horizontal_count >= MINIMUM_FITLINES
+       && vertical_count + horizontal_count >= LSD_PYRAMID_LINES)
+      break;
   }
+
 #ifdef ASHIFT_DEBUG
     printf("%d lines (vertical %d, horizontal %d, not relevant %d)\n", lines_count, vertical_count,
            horizontal_count, lct - vertical_count - horizontal_count);
@@ -1507,45 +1540,139 @@ error:
 }
 
 
-// swap two integer values
-static inline void swap(int *a, int *b)
+// random numbers for ransac: xorshift128+ (see common/points.h) with one state per run, seeded
+// from the run number. this way every run draws the same model no matter which thread it ends
+// up on and results are reproducible.
+typedef struct dt_iop_ashift_rng_t
 {
-  int tmp = *a;
-  *a = *b;
-  *b = tmp;
+  uint64_t state0;
+  uint64_t state1;
+} dt_iop_ashift_rng_t;
+
+static inline uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
 }
 
-// do complete permutations
-static int quickperm(int *a, int *p, const int N, int *i)
+static inline void rng_seed(dt_iop_ashift_rng_t *rng, const uint64_t seed)
 {
-  if(*i >= N) return FALSE;
+  uint64_t x = seed;
+  rng->state0 = splitmix64(&x);
+  rng->state1 = splitmix64(&x);
+}
 
-  p[*i]--;
-  int j = (*i % 2 == 1) ? p[*i] : 0;
-  swap(&a[j], &a[*i]);
-  *i = 1;
-  while(p[*i] == 0)
-  {
-    p[*i] = *i;
-    (*i)++;
-  }
-  return TRUE;
+static inline uint32_t rng_next(dt_iop_ashift_rng_t *rng)
+{
+  uint64_t s1 = rng->state0;
+  const uint64_t s0 = rng->state1;
+  rng->state0 = s0;
+  s1 ^= s1 << 23;
+  s1 ^= s1 >> 17;
+  s1 ^= s0;
+  s1 ^= s0 >> 26;
+  rng->state1 = s1;
+  return (uint32_t)((rng->state0 + rng->state1) >> 32);
 }
 
-// Fisher-Yates shuffle
-static void shuffle(int *a, const int N)
+// the two lines (indices into the set) that build the model of ransac run r. on small set sizes we
+// go through all pairs systematically, else we draw them at random
+static inline void ransac_pair(const int r, const int set_count, const int systematic, int *i1, int *i2)
 {
-  for(int i = 0; i < N; i++)
+  if(systematic)
   {
-    int j = i + rand() % (N - i);
-    swap(&a[j], &a[i]);
+    int a = 0, b = r + 1;
+    while(b >= set_count)
+    {
+      a++;
+      b = b - set_count + a + 1;
+    }
+    *i1 = a;
+    *i2 = b;
+  }
+  else
+  {
+    dt_iop_ashift_rng_t rng;
+    rng_seed(&rng, RANSAC_SEED + r);
+    const int a = rng_next(&rng) % set_count;
+    int b = rng_next(&rng) % (set_count - 1);
+    if(b >= a) b++;
+    *i1 = a;
+    *i2 = b;
   }
 }
 
-// factorial function
-static int fact(const int n)
+// evaluate the model made of lines i1 and i2 of the set with hurdle rate epsilon: returns the quality
+// of the model or -1 if it is not valid. the number of lines rejected as outliers is added to
+// eliminated, inout (if not NULL) receives good/bad qualification for each line.
+static float ransac_model(const dt_iop_ashift_line_t *lines, const int *index_set, const int set_count,
+                          const int i1, const int i2, const float epsilon, const float total_weight,
+                          const int xmin, const int xmax, const int ymin, const int ymax, int *inout,
+                          int *eliminated)
 {
-  return (n == 1 ? 1 : n * fact(n - 1));
+  const float *L1 = lines[index_set[i1]].L;
+  const float *L2 = lines[index_set[i2]].L;
+
+  // get intersection point (ideally a vantage point)
+  float V[3];
+  vec3prodn(V, L1, L2);
+
+  // catch special cases:
+  // a) L1 and L2 are identical -> V is NULL -> no valid vantage point
+  // b) vantage point lies inside image frame (no chance to correct for this case)
+  if(vec3isnull(V) ||
+     (fabs(V[2]) > 0.0f &&
+      V[0]/V[2] >= xmin &&
+      V[1]/V[2] >= ymin &&
+      V[0]/V[2] <= xmax &&
+      V[1]/V[2] <= ymax))
+    return -1.0f;
+
+  // normalize V so that x^2 + y^2 + z^2 = 1
+  vec3norm(V, V);
+
+  float quality = 0.0f;
+
+  // go through all remaining lines, check if they are within the model, and
+  // mark that fact in inout[].
+  // summarize a quality parameter for all lines within the model
+  for(int n = 0; n < set_count; n++)
+  {
+    // the two lines constituting the model are part of the set
+    if(n == i1 || n == i2)
+    {
+      if(inout) inout[n] = 1;
+      continue;
+    }
+
+    // L is normalized so that x^2 + y^2 = 1
+    const float *L3 = lines[index_set[n]].L;
+
+    // we take the absolute value of the dot product of V and L as a measure
+    // of the "distance" between point and line. Note that this is not the real euclidian
+    // distance but - with the given normalization - just a pragmatically selected number
+    // that goes to zero if V lies on L and increases the more V and L are apart
+    const float d = fabs(vec3scalar(V, L3));
+
+    // depending on d we either include or exclude the point from the set
+    const int in = (d < epsilon) ? 1 : 0;
+    if(inout) inout[n] = in;
+
+    if(in)
+    {
+      // a quality parameter that depends 1/3 on the number of lines within the model,
+      // 1/3 on their weight, and 1/3 on their weighted distance d to the vantage point
+      quality += 0.33f / (float)set_count
+                 + 0.33f * lines[index_set[n]].weight / total_weight
+                 + 0.33f * (1.0f - d / epsilon) * (float)set_count * lines[index_set[n]].weight / total_weight;
+    }
+    else
+      (*eliminated)++;
+  }
+
+  return quality;
 }
 
 // We use a pseudo-RANSAC algorithm to elminiate ouliers from our set of lines. The
@@ -1564,19 +1691,14 @@ static int fact(const int n)
 // note: the actual percentage of outliers removed in the final run will be lower because we
 // will finally look for the best quality model with the optimized epsilon and that quality value also
 // encloses the number of good lines
+// The runs of one self-tuning step and all final runs are independent of each other and
+// are evaluated in parallel. The best model wins, on equal quality the one of the lower run number.
 static void ransac(const dt_iop_ashift_line_t *lines, int *index_set, int *inout_set,
                   const int set_count, const float total_weight, const int xmin, const int xmax,
                   const int ymin, const int ymax)
 {
   if(set_count < 3) return;
 
-  const size_t set_size = set_count * sizeof(int);
-  int *best_set = malloc(set_size);
-  memcpy(best_set, index_set, set_size);
-  int *best_inout = calloc(1, set_size);
-
-  float best_quality = 0.0f;
-
   // hurdle value epsilon for rejecting a line as an outlier will be self-tuning
   // in a number of dry runs
   float epsilon = pow(10.0f, -RANSAC_EPSILON);
@@ -1585,153 +1707,113 @@ static void ransac(const dt_iop_ashift_line_t *lines, int *index_set, int *inout
   int lines_eliminated = 0;
   int valid_runs = 0;
 
-  // number of runs to optimize epsilon
-  const int optiruns = RANSAC_OPTIMIZATION_STEPS * RANSAC_OPTIMIZATION_DRY_RUNS;
-  // go for complete permutations on small set sizes, else for random sample consensus
-  const int riter = (set_count > RANSAC_HURDLE) ? RANSAC_RUNS : fact(set_count);
-
-  // some data needed for quickperm
-  int *perm = malloc((set_count + 1) * sizeof(int));
-  for(int n = 0; n < set_count + 1; n++) perm[n] = n;
-  int piter = 1;
-
-  // inout holds good/bad qualification for each line
-  int *inout = malloc(set_size);
+  // go for all pairs of lines on small set sizes, else for random sample consensus
+  const int systematic = (set_count > RANSAC_HURDLE) ? 0 : 1;
+  const int riter = systematic ? set_count * (set_count - 1) / 2 : RANSAC_RUNS;
 
-  for(int r = 0; r < optiruns + riter; r++)
+  for(int step = 0; step < RANSAC_OPTIMIZATION_STEPS; step++)
   {
-    // get random or systematic variation of index set
-    if(set_count > RANSAC_HURDLE || r < optiruns)
-      shuffle(index_set, set_count);
-    else
-      (void)quickperm(index_set, perm, set_count, &piter);
-
-    // summed quality evaluation of this run
-    float quality = 0.0f;
-
-    // we build a model ouf of the first two lines
-    const float *L1 = lines[index_set[0]].L;
-    const float *L2 = lines[index_set[1]].L;
-
-    // get intersection point (ideally a vantage point)
-    float V[3];
-    vec3prodn(V, L1, L2);
-
-    // catch special cases:
-    // a) L1 and L2 are identical -> V is NULL -> no valid vantage point
-    // b) vantage point lies inside image frame (no chance to correct for this case)
-    if(vec3isnull(V) ||
-       (fabs(V[2]) > 0.0f &&
-        V[0]/V[2] >= xmin &&
-        V[1]/V[2] >= ymin &&
-        V[0]/V[2] <= xmax &&
-        V[1]/V[2] <= ymax))
-    {
-      // no valid model
-      quality = 0.0f;
-    }
-    else
+    const int r0 = step * RANSAC_OPTIMIZATION_DRY_RUNS;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) shared(lines, index_set, epsilon) \
+    reduction(+ : lines_eliminated, valid_runs)
+#endif
+    for(int r = r0; r < r0 + RANSAC_OPTIMIZATION_DRY_RUNS; r++)
     {
-      // valid model
-
-      // normalize V so that x^2 + y^2 + z^2 = 1
-      vec3norm(V, V);
-
-      // the two lines constituting the model are part of the set
-      inout[0] = 1;
-      inout[1] = 1;
-
-      // go through all remaining lines, check if they are within the model, and
-      // mark that fact in inout[].
-      // summarize a quality parameter for all lines within the model
-      for(int n = 2; n < set_count; n++)
+      // dry runs draw behind the RANSAC_RUNS final runs so that both don't share their samples
+      int i1, i2;
+      ransac_pair(RANSAC_RUNS + r, set_count, 0, &i1, &i2);
+      int eliminated = 0;
+      if(ransac_model(lines, index_set, set_count, i1, i2, epsilon, total_weight, xmin, xmax, ymin, ymax, NULL,
+                      &eliminated) >= 0.0f)
       {
-        // L is normalized so that x^2 + y^2 = 1
-        const float *L3 = lines[index_set[n]].L;
-
-        // we take the absolute value of the dot product of V and L as a measure
-        // of the "distance" between point and line. Note that this is not the real euclidian
-        // distance but - with the given normalization - just a pragmatically selected number
-        // that goes to zero if V lies on L and increases the more V and L are apart
-        const float d = fabs(vec3scalar(V, L3));
-
-        // depending on d we either include or exclude the point from the set
-        inout[n] = (d < epsilon) ? 1 : 0;
-
-        float q;
-
-        if(inout[n] == 1)
-        {
-          // a quality parameter that depends 1/3 on the number of lines within the model,
-          // 1/3 on their weight, and 1/3 on their weighted distance d to the vantage point
-          q = 0.33f / (float)set_count
-              + 0.33f * lines[index_set[n]].weight / total_weight
-              + 0.33f * (1.0f - d / epsilon) * (float)set_count * lines[index_set[n]].weight / total_weight;
-        }
-        else
-        {
-          q = 0.0f;
-          lines_eliminated++;
-        }
-
-        quality += q;
+        lines_eliminated += eliminated;
+        valid_runs++;
       }
-      valid_runs++;
     }
 
-    if(r < optiruns)
+    // at the end of each self-tuning step
+    if(valid_runs > 0)
     {
-      // on last run of each self-tuning step
-      if((r % RANSAC_OPTIMIZATION_DRY_RUNS) == (RANSAC_OPTIMIZATION_DRY_RUNS - 1) && (valid_runs > 0))
-      {
 #ifdef ASHIFT_DEBUG
-        printf("ransac self-tuning (run %d): epsilon %f", r, epsilon);
+      printf("ransac self-tuning (run %d): epsilon %f", r0 + RANSAC_OPTIMIZATION_DRY_RUNS - 1, epsilon);
 #endif
-        // average ratio of lines that we eliminated with the given epsilon
-        float ratio = 100.0f * (float)lines_eliminated / ((float)set_count * valid_runs);
-        // adjust epsilon accordingly
-        if(ratio < RANSAC_ELIMINATION_RATIO)
-          epsilon = pow(10.0f, log10(epsilon) - epsilon_step);
-        else if(ratio > RANSAC_ELIMINATION_RATIO)
-          epsilon = pow(10.0f, log10(epsilon) + epsilon_step);
+      // average ratio of lines that we eliminated with the given epsilon
+      float ratio = 100.0f * (float)lines_eliminated / ((float)set_count * valid_runs);
+      // adjust epsilon accordingly
+      if(ratio < RANSAC_ELIMINATION_RATIO)
+        epsilon = pow(10.0f, log10(epsilon) - epsilon_step);
+      else if(ratio > RANSAC_ELIMINATION_RATIO)
+        epsilon = pow(10.0f, log10(epsilon) + epsilon_step);
 #ifdef ASHIFT_DEBUG
-        printf(" (elimination ratio %f) -> %f\n", ratio, epsilon);
+      printf(" (elimination ratio %f) -> %f\n", ratio, epsilon);
 #endif
-        // reduce step-size for next optimization round
-        epsilon_step /= 2.0f;
-        lines_eliminated = 0;
-        valid_runs = 0;
-      }
+      // reduce step-size for next optimization round
+      epsilon_step /= 2.0f;
+      lines_eliminated = 0;
+      valid_runs = 0;
     }
-    else
+  }
+
+  // in the "real" runs look for the best model
+  float best_quality = 0.0f;
+  int best_run = -1;
+  int best_i1 = 0, best_i2 = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel default(none) shared(lines, index_set, epsilon, best_quality, best_run, best_i1, best_i2)
+#endif
+  {
+    float quality = 0.0f;
+    int run = -1, i1 = 0, i2 = 0;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int r = 0; r < riter; r++)
     {
-      // in the "real" runs check against the best model found so far
-      if(quality > best_quality)
+      int j1, j2;
+      ransac_pair(r, set_count, systematic, &j1, &j2);
+      int eliminated = 0;
+      const float q = ransac_model(lines, index_set, set_count, j1, j2, epsilon, total_weight, xmin, xmax, ymin,
+                                   ymax, NULL, &eliminated);
+      if(q > quality)
       {
-        memcpy(best_set, index_set, set_size);
-        memcpy(best_inout, inout, set_size);
-        best_quality = quality;
+        quality = q;
+        run = r;
+        i1 = j1;
+        i2 = j2;
       }
     }
 
-#ifdef ASHIFT_DEBUG
-    // report some statistics
-    int count = 0, lastcount = 0;
-    for(int n = 0; n < set_count; n++) count += best_inout[n];
-    for(int n = 0; n < set_count; n++) lastcount += inout[n];
-    printf("ransac run %d: best qual %.6f, eps %.6f, line count %d of %d (this run: qual %.5f, count %d (%2f%%))\n", r,
-           best_quality, epsilon, count, set_count, quality, lastcount, 100.0f * lastcount / (float)set_count);
+#ifdef _OPENMP
+#pragma omp critical
 #endif
+    if(run >= 0 && (quality > best_quality || (quality == best_quality && run < best_run)))
+    {
+      best_quality = quality;
+      best_run = run;
+      best_i1 = i1;
+      best_i2 = i2;
+    }
   }
 
-  // store back best set
-  memcpy(index_set, best_set, set_size);
-  memcpy(inout_set, best_inout, set_size);
+  // store back good/bad qualification of the best model
+  memset(inout_set, 0, set_count * sizeof(int));
+  if(best_run >= 0)
+  {
+    int eliminated = 0;
+    (void)ransac_model(lines, index_set, set_count, best_i1, best_i2, epsilon, total_weight, xmin, xmax, ymin,
+                       ymax, inout_set, &eliminated);
+  }
 
-  free(inout);
-  free(perm);
-  free(best_inout);
-  free(best_set);
+#ifdef ASHIFT_DEBUG
+  // report some statistics
+  int count = 0;
+  for(int n = 0; n < set_count; n++) count += inout_set[n];
+  printf("ransac: best run %d, qual %.6f, eps %.6f, line count %d of %d\n", best_run, best_quality, epsilon, count,
+         set_count);
+#endif
 }
 
 
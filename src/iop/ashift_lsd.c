@@ -25,6 +25,10 @@
  *      catch (unlikely) division by zero near line 2035
  *      rename rad1 and rad2 to radius1 and radius2 in reduce_region_radius()
  *        to avoid naming conflict in windows build
+ *      keep image, gradient and angle planes in float (image_float instead
+ *        of image_double), all geometry and NFA computations stay double
+ *      gaussian_sampler() and the gradient loop of ll_angle() run row by row
+ *        with OpenMP, the sampling kernels are tabulated once per column/row
  *
  */
 
@@ -502,7 +506,7 @@ static image_int new_image_int_ini( unsigned int xsize, unsigned int ysize,
 }
 
 /*----------------------------------------------------------------------------*/
-/** double image data type
+/** float image data type
 
     The pixel value at (x,y) is accessed by:
 
@@ -510,37 +514,37 @@ static image_int new_image_int_ini( unsigned int xsize, unsigned int ysize,
 
     with x and y integer.
  */
-typedef struct image_double_s
+typedef struct image_float_s
 {
-  double * data;
+  float * data;
   unsigned int xsize,ysize;
-} * image_double;
+} * image_float;
 
 /*----------------------------------------------------------------------------*/
-/** Free memory used in image_double 'i'.
+/** Free memory used in image_float 'i'.
  */
-static void free_image_double(image_double i)
+static void free_image_float(image_float i)
 {
   if( i == NULL || i->data == NULL )
-    error("free_image_double: invalid input image.");
+    error("free_image_float: invalid input image.");
   free( (void *) i->data );
   free( (void *) i );
 }
 
 /*----------------------------------------------------------------------------*/
-/** Create a new image_double of size 'xsize' times 'ysize'.
+/** Create a new image_float of size 'xsize' times 'ysize'.
  */
-static image_double new_image_double(unsigned int xsize, unsigned int ysize)
+static image_float new_image_float(unsigned int xsize, unsigned int ysize)
 {
-  image_double image;
+  image_float image;
 
   /* check parameters */
-  if( xsize == 0 || ysize == 0 ) error("new_image_double: invalid image size.");
+  if( xsize == 0 || ysize == 0 ) error("new_image_float: invalid image size.");
 
   /* get memory */
-  image = (image_double) malloc( sizeof(struct image_double_s) );
+  image = (image_float) malloc( sizeof(struct image_float_s) );
   if( image == NULL ) error("not enough memory.");
-  image->data = (double *) calloc( (size_t) (xsize*ysize), sizeof(double) );
+  image->data = (float *) calloc( (size_t) (xsize*ysize), sizeof(float) );
   if( image->data == NULL ) error("not enough memory.");
 
   /* set image size */
@@ -551,21 +555,21 @@ static image_double new_image_double(unsigned int xsize, unsigned int ysize)
 }
 
 /*----------------------------------------------------------------------------*/
-/** Create a new image_double of size 'xsize' times 'ysize'
+/** Create a new image_float of size 'xsize' times 'ysize'
     with the data pointed by 'data'.
  */
-static image_double new_image_double_ptr( unsigned int xsize,
-                                          unsigned int ysize, double * data )
+static image_float new_image_float_ptr( unsigned int xsize,
+                                         unsigned int ysize, float * data )
 {
-  image_double image;
+  image_float image;
 
   /* check parameters */
   if( xsize == 0 || ysize == 0 )
-    error("new_image_double_ptr: invalid image size.");
-  if( data == NULL ) error("new_image_double_ptr: NULL data pointer.");
+    error("new_image_float_ptr: invalid image size.");
+  if( data == NULL ) error("new_image_float_ptr: NULL data pointer.");
 
   /* get memory */
-  image = (image_double) malloc( sizeof(struct image_double_s) );
+  image = (image_float) malloc( sizeof(struct image_float_s) );
   if( image == NULL ) error("not enough memory.");
 
   /* set image */
@@ -652,14 +656,16 @@ static void gaussian_kernel(ntuple_list kernel, double sigma, double mean)
     in the x axis, and then the combined Gaussian kernel and sampling
     in the y axis.
  */
-static image_double gaussian_sampler( image_double in, double scale,
-                                      double sigma_scale )
+static image_float gaussian_sampler( image_float in, double scale,
+                                     double sigma_scale )
 {
-  image_double aux,out;
+  image_float aux,out;
   ntuple_list kernel;
   unsigned int N,M,h,n,x,y,i;
   int xc,yc,j,double_x_size,double_y_size;
-  double sigma,xx,yy,sum,prec;
+  double sigma,xx,yy,prec;
+  float * kx, * ky;
+  int * jx, * jy;
 
   /* check parameters */
   if( in == NULL || in->data == NULL || in->xsize == 0 || in->ysize == 0 )
@@ -674,8 +680,8 @@ static image_double gaussian_sampler( image_double in, double scale,
     error("gaussian_sampler: the output image size exceeds the handled size.");
   N = (unsigned int) ceil( in->xsize * scale );
   M = (unsigned int) ceil( in->ysize * scale );
-  aux = new_image_double(N,in->ysize);
-  out = new_image_double(N,M);
+  aux = new_image_float(N,in->ysize);
+  out = new_image_float(N,M);
 
   /* sigma, kernel size and memory for the kernel */
   sigma = scale < 1.0 ? sigma_scale / scale : sigma_scale;
@@ -696,8 +702,16 @@ static image_double gaussian_sampler( image_double in, double scale,
   double_x_size = (int) (2 * in->xsize);
   double_y_size = (int) (2 * in->ysize);
 
-  /* First subsampling: x axis */
-  for(x=0;x<aux->xsize;x++)
+  /* the kernel and the source pixels of every output column and row,
+     tabulated once so that both passes can run row by row */
+  kx = (float *) malloc( (size_t) N * n * sizeof(float) );
+  jx = (int *) malloc( (size_t) N * n * sizeof(int) );
+  ky = (float *) malloc( (size_t) M * n * sizeof(float) );
+  jy = (int *) malloc( (size_t) M * n * sizeof(int) );
+  if( kx == NULL || jx == NULL || ky == NULL || jy == NULL )
+    error("not enough memory.");
+
+  for(x=0;x<N;x++)
     {
       /*
          x   is the coordinate in the new image.
@@ -712,61 +726,81 @@ static image_double gaussian_sampler( image_double in, double scale,
       /* the kernel must be computed for each x because the fine
          offset xx-xc is different in each case */
 
-      for(y=0;y<aux->ysize;y++)
+      for(i=0;i<n;i++)
         {
-          sum = 0.0;
-          for(i=0;i<kernel->dim;i++)
-            {
-              j = xc - h + i;
+          j = xc - h + i;
 
-              /* symmetry boundary condition */
-              while( j < 0 ) j += double_x_size;
-              while( j >= double_x_size ) j -= double_x_size;
-              if( j >= (int) in->xsize ) j = double_x_size-1-j;
+          /* symmetry boundary condition */
+          while( j < 0 ) j += double_x_size;
+          while( j >= double_x_size ) j -= double_x_size;
+          if( j >= (int) in->xsize ) j = double_x_size-1-j;
 
-              sum += in->data[ j + y * in->xsize ] * kernel->values[i];
-            }
-          aux->data[ x + y * aux->xsize ] = sum;
+          jx[ x * n + i ] = j;
+          kx[ x * n + i ] = (float) kernel->values[i];
         }
     }
 
-  /* Second subsampling: y axis */
-  for(y=0;y<out->ysize;y++)
+  for(y=0;y<M;y++)
     {
-      /*
-         y   is the coordinate in the new image.
-         yy  is the corresponding x-value in the original size image.
-         yc  is the integer value, the pixel coordinate of xx.
-       */
+      /* same for y, see above */
       yy = (double) y / scale;
-      /* coordinate (0.0,0.0) is in the center of pixel (0,0),
-         so the pixel with yc=0 get the values of yy from -0.5 to 0.5 */
       yc = (int) floor( yy + 0.5 );
       gaussian_kernel( kernel, sigma, (double) h + yy - (double) yc );
-      /* the kernel must be computed for each y because the fine
-         offset yy-yc is different in each case */
 
-      for(x=0;x<out->xsize;x++)
+      for(i=0;i<n;i++)
         {
-          sum = 0.0;
-          for(i=0;i<kernel->dim;i++)
-            {
-              j = yc - h + i;
+          j = yc - h + i;
 
-              /* symmetry boundary condition */
-              while( j < 0 ) j += double_y_size;
-              while( j >= double_y_size ) j -= double_y_size;
-              if( j >= (int) in->ysize ) j = double_y_size-1-j;
+          /* symmetry boundary condition */
+          while( j < 0 ) j += double_y_size;
+          while( j >= double_y_size ) j -= double_y_size;
+          if( j >= (int) in->ysize ) j = double_y_size-1-j;
 
-              sum += aux->data[ x + j * aux->xsize ] * kernel->values[i];
-            }
-          out->data[ x + y * out->xsize ] = sum;
+          jy[ y * n + i ] = j;
+          ky[ y * n + i ] = (float) kernel->values[i];
+        }
+    }
+
+  /* First subsampling: x axis */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) shared(in, aux, kx, jx, n, N)
+#endif
+  for(unsigned int yr=0;yr<in->ysize;yr++)
+    {
+      const float * const inrow = in->data + (size_t) yr * in->xsize;
+      float * const auxrow = aux->data + (size_t) yr * N;
+      for(unsigned int xr=0;xr<N;xr++)
+        {
+          const float * const k = kx + (size_t) xr * n;
+          const int * const jj = jx + (size_t) xr * n;
+          float sum = 0.0f;
+          for(unsigned int ir=0;ir<n;ir++) sum += inrow[ jj[ir] ] * k[ir];
+          auxrow[xr] = sum;
+        }
+    }
+
+  /* Second subsampling: y axis, accumulated over whole rows */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) shared(aux, out, ky, jy, n, N, M)
+#endif
+  for(unsigned int yr=0;yr<M;yr++)
+    {
+      float * const outrow = out->data + (size_t) yr * N;
+      for(unsigned int ir=0;ir<n;ir++)
+        {
+          const float * const auxrow = aux->data + (size_t) jy[ yr * n + ir ] * N;
+          const float k = ky[ yr * n + ir ];
+          for(unsigned int xr=0;xr<N;xr++) outrow[xr] += auxrow[xr] * k;
         }
     }
 
   /* free memory */
+  free( (void *) kx );
+  free( (void *) jx );
+  free( (void *) ky );
+  free( (void *) jy );
   free_ntuple_list(kernel);
-  free_image_double(aux);
+  free_image_float(aux);
 
   return out;
 }
@@ -780,8 +814,8 @@ static image_double gaussian_sampler( image_double in, double scale,
 /** Computes the direction of the level line of 'in' at each point.
 
     The result is:
-    - an image_double with the angle at each pixel, or NOTDEF if not defined.
-    - the image_double 'modgrad' (a pointer is passed as argument)
+    - an image_float with the angle at each pixel, or NOTDEF if not defined.
+    - the image_float 'modgrad' (a pointer is passed as argument)
       with the gradient magnitude at each point.
     - a list of pixels 'list_p' roughly ordered by decreasing
       gradient magnitude. (The order is made by classifying points
@@ -793,13 +827,13 @@ static image_double gaussian_sampler( image_double in, double scale,
     - a pointer 'mem_p' to the memory used by 'list_p' to be able to
       free the memory when it is not used anymore.
  */
-static image_double ll_angle( image_double in, double threshold,
-                              struct coorlist ** list_p, void ** mem_p,
-                              image_double * modgrad, unsigned int n_bins )
+static image_float ll_angle( image_float in, double threshold,
+                             struct coorlist ** list_p, void ** mem_p,
+                             image_float * modgrad, unsigned int n_bins )
 {
-  image_double g;
-  unsigned int n,p,x,y,adr,i;
-  double com1,com2,gx,gy,norm,norm2;
+  image_float g;
+  unsigned int n,p,x,y,i;
+  double norm;
   /* the rest of the variables are used for pseudo-ordering
      the gradient magnitude values */
   int list_count = 0;
@@ -824,10 +858,10 @@ static image_double ll_angle( image_double in, double threshold,
   p = in->xsize;
 
   /* allocate output image */
-  g = new_image_double(in->xsize,in->ysize);
+  g = new_image_float(in->xsize,in->ysize);
 
   /* get memory for the image of gradient modulus */
-  *modgrad = new_image_double(in->xsize,in->ysize);
+  *modgrad = new_image_float(in->xsize,in->ysize);
 
   /* get memory for "ordered" list of pixels */
   list = (struct coorlist *) calloc( (size_t) (n*p), sizeof(struct coorlist) );
@@ -844,11 +878,15 @@ static image_double ll_angle( image_double in, double threshold,
   for(x=0;x<p;x++) g->data[(n-1)*p+x] = NOTDEF;
   for(y=0;y<n;y++) g->data[p*y+p-1]   = NOTDEF;
 
-  /* compute gradient on the remaining pixels */
-  for(x=0;x<p-1;x++)
-    for(y=0;y<n-1;y++)
+  /* compute gradient on the remaining pixels, row by row */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) shared(in, g, modgrad, n, p, threshold) \
+  reduction(max : max_grad)
+#endif
+  for(unsigned int yr=0;yr<n-1;yr++)
+    for(unsigned int xr=0;xr<p-1;xr++)
       {
-        adr = y*p+x;
+        const size_t a = (size_t) yr*p+xr;
 
         /*
            Norm 2 computation using 2x2 pixel window:
@@ -861,25 +899,24 @@ static image_double ll_angle( image_double in, double threshold,
              gy = C+D - (A+B)   vertical difference
            com1 and com2 are just to avoid 2 additions.
          */
-        com1 = in->data[adr+p+1] - in->data[adr];
-        com2 = in->data[adr+1]   - in->data[adr+p];
+        const float c1 = in->data[a+p+1] - in->data[a];
+        const float c2 = in->data[a+1]   - in->data[a+p];
 
-        gx = com1+com2; /* gradient x component */
-        gy = com1-com2; /* gradient y component */
-        norm2 = gx*gx+gy*gy;
-        norm = sqrt( norm2 / 4.0 ); /* gradient norm */
+        const float dx = c1+c2; /* gradient x component */
+        const float dy = c1-c2; /* gradient y component */
+        const float nrm = sqrtf( (dx*dx+dy*dy) / 4.0f ); /* gradient norm */
 
-        (*modgrad)->data[adr] = norm; /* store gradient norm */
+        (*modgrad)->data[a] = nrm; /* store gradient norm */
 
-        if( norm <= threshold ) /* norm too small, gradient no defined */
-          g->data[adr] = NOTDEF; /* gradient angle not defined */
+        if( nrm <= threshold ) /* norm too small, gradient no defined */
+          g->data[a] = NOTDEF; /* gradient angle not defined */
         else
           {
             /* gradient angle computation */
-            g->data[adr] = atan2(gx,-gy);
+            g->data[a] = atan2f(dx,-dy);
 
             /* look for the maximum of the gradient */
-            if( norm > max_grad ) max_grad = norm;
+            if( nrm > max_grad ) max_grad = nrm;
           }
       }
 
@@ -934,7 +971,7 @@ static image_double ll_angle( image_double in, double threshold,
 /*----------------------------------------------------------------------------*/
 /** Is point (x,y) aligned to angle theta, up to precision 'prec'?
  */
-static int isaligned( int x, int y, image_double angles, double theta,
+static int isaligned( int x, int y, image_float angles, double theta,
                       double prec )
 {
   double a;
@@ -1540,7 +1577,7 @@ static rect_iter * ri_ini(struct rect * r)
 /*----------------------------------------------------------------------------*/
 /** Compute a rectangle's NFA value.
  */
-static double rect_nfa(struct rect * rec, image_double angles, double logNT)
+static double rect_nfa(struct rect * rec, image_float angles, double logNT)
 {
   rect_iter * i;
   int pts = 0;
@@ -1627,7 +1664,7 @@ static double rect_nfa(struct rect * rec, image_double angles, double logNT)
     get better numeric precision).
  */
 static double get_theta( struct point * reg, int reg_size, double x, double y,
-                         image_double modgrad, double reg_angle, double prec )
+                         image_float modgrad, double reg_angle, double prec )
 {
   double lambda,theta,weight;
   double Ixx = 0.0;
@@ -1670,7 +1707,7 @@ static double get_theta( struct point * reg, int reg_size, double x, double y,
 /** Computes a rectangle that covers a region of points.
  */
 static void region2rect( struct point * reg, int reg_size,
-                         image_double modgrad, double reg_angle,
+                         image_float modgrad, double reg_angle,
                          double prec, double p, struct rect * rec )
 {
   double x,y,dx,dy,l,w,theta,weight,sum,l_min,l_max,w_min,w_max;
@@ -1762,7 +1799,7 @@ static void region2rect( struct point * reg, int reg_size,
 /** Build a region of pixels that share the same angle, up to a
     tolerance 'prec', starting at point (x,y).
  */
-static void region_grow( int x, int y, image_double angles, struct point * reg,
+static void region_grow( int x, int y, image_float angles, struct point * reg,
                          int * reg_size, double * reg_angle, image_char used,
                          double prec )
 {
@@ -1814,7 +1851,7 @@ static void region_grow( int x, int y, image_double angles, struct point * reg,
 /** Try some rectangles variations to improve NFA value. Only if the
     rectangle is not meaningful (i.e., log_nfa <= log_eps).
  */
-static double rect_improve( struct rect * rec, image_double angles,
+static double rect_improve( struct rect * rec, image_float angles,
                             double logNT, double log_eps )
 {
   struct rect r;
@@ -1928,9 +1965,9 @@ static double rect_improve( struct rect * rec, image_double angles,
     density of region points or to discard the region if too small.
  */
 static int reduce_region_radius( struct point * reg, int * reg_size,
-                                 image_double modgrad, double reg_angle,
+                                 image_float modgrad, double reg_angle,
                                  double prec, double p, struct rect * rec,
-                                 image_char used, image_double angles,
+                                 image_char used, image_float angles,
                                  double density_th )
 {
   double density,radius1,radius2,rad,xc,yc;
@@ -2005,9 +2042,9 @@ static int reduce_region_radius( struct point * reg, int * reg_size,
     produce a rectangle with the right density of region points,
     'reduce_region_radius' is called to try to satisfy this condition.
  */
-static int refine( struct point * reg, int * reg_size, image_double modgrad,
+static int refine( struct point * reg, int * reg_size, image_float modgrad,
                    double reg_angle, double prec, double p, struct rect * rec,
-                   image_char used, image_double angles, double density_th )
+                   image_char used, image_float angles, double density_th )
 {
   double angle,ang_d,mean_angle,tau,density,xc,yc,ang_c,sum,s_sum;
   int i,n;
@@ -2089,16 +2126,16 @@ static int refine( struct point * reg, int * reg_size, image_double modgrad,
  */
 static
 double * LineSegmentDetection( int * n_out,
-                               double * img, int X, int Y,
+                               float * img, int X, int Y,
                                double scale, double sigma_scale, double quant,
                                double ang_th, double log_eps, double density_th,
                                int n_bins,
                                int ** reg_img, int * reg_x, int * reg_y )
 {
-  image_double image;
+  image_float image;
   ntuple_list out = new_ntuple_list(7);
   double * return_value;
-  image_double scaled_image,angles,modgrad;
+  image_float scaled_image,angles,modgrad;
   image_char used;
   image_int region = NULL;
   struct coorlist * list_p;
@@ -2130,13 +2167,13 @@ double * LineSegmentDetection( int * n_out,
 
 
   /* load and scale image (if necessary) and compute angle at each pixel */
-  image = new_image_double_ptr( (unsigned int) X, (unsigned int) Y, img );
+  image = new_image_float_ptr( (unsigned int) X, (unsigned int) Y, img );
   if( scale != 1.0 )
     {
       scaled_image = gaussian_sampler( image, scale, sigma_scale );
       angles = ll_angle( scaled_image, rho, &list_p, &mem_p,
                          &modgrad, (unsigned int) n_bins );
-      free_image_double(scaled_image);
+      free_image_float(scaled_image);
     }
   else
     angles = ll_angle( image, rho, &list_p, &mem_p, &modgrad,
@@ -2235,11 +2272,11 @@ double * LineSegmentDetection( int * n_out,
 
 
   /* free memory */
-  free( (void *) image );   /* only the double_image structure should be freed,
+  free( (void *) image );   /* only the float_image structure should be freed,
                                the data pointer was provided to this functions
                                and should not be destroyed.                 */
-  free_image_double(angles);
-  free_image_double(modgrad);
+  free_image_float(angles);
+  free_image_float(modgrad);
   free_image_char(used);
   free( (void *) reg );
   free( (void *) mem_p );
@@ -2277,7 +2314,7 @@ double * LineSegmentDetection( int * n_out,
  */
 static
 double * lsd_scale_region( int * n_out,
-                           double * img, int X, int Y, double scale,
+                           float * img, int X, int Y, double scale,
                            int ** reg_img, int * reg_x, int * reg_y )
 {
   /* LSD parameters */
@@ -2300,7 +2337,7 @@ double * lsd_scale_region( int * n_out,
 /** LSD Simple Interface with Scale.
  */
 static
-double * lsd_scale(int * n_out, double * img, int X, int Y, double scale)
+double * lsd_scale(int * n_out, float * img, int X, int Y, double scale)
 {
   return lsd_scale_region(n_out,img,X,Y,scale,NULL,NULL,NULL);
 }
@@ -2309,7 +2346,7 @@ double * lsd_scale(int * n_out, double * img, int X, int Y, double scale)
 /** LSD Simple Interface.
  */
 static
-double * lsd(int * n_out, double * img, int X, int Y)
+double * lsd(int * n_out, float * img, int X, int Y)
 {
   /* LSD parameters */
   double scale = 0.8;       /* Scale the image by Gaussian filter to 'scale'. */
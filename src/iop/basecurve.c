@@ -38,6 +38,9 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
 
 #define DT_GUI_CURVE_EDITOR_INSET DT_PIXEL_APPLY_DPI(5)
 #define DT_GUI_CURVE_INFL .3f
@@ -875,100 +878,119 @@ static inline void compute_features(
   }
 }
 
-static inline void gauss_blur(
-    const float *const input,
-    float *const output,
-    const size_t wd,
-    const size_t ht)
+// 5-tap binomial kernel of the fusion pyramids. at the borders it reflects at the first
+// and repeats the last pixel.
+static const float fusion_w[5] = { 1.f / 16.f, 4.f / 16.f, 6.f / 16.f, 4.f / 16.f, 1.f / 16.f };
+
+static inline int fusion_mirror(const int i, const int n)
 {
-  const float w[5] = {1./16., 4./16., 6./16., 4./16., 1./16.};
-  float *tmp = dt_alloc_align(64, (size_t)wd*ht*4*sizeof(float));
-  memset(tmp, 0, 4*wd*ht*sizeof(float));
-#ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) shared(tmp)
-#endif
-  for(int j=0;j<ht;j++)
-  { // horizontal pass
-    // left borders
-    for(int i=0;i<2;i++) for(int c=0;c<4;c++)
-      for(int ii=-2;ii<=2;ii++)
-        tmp[4*(j*wd+i)+c] += input[4*(j*wd+MAX(-i-ii,i+ii))+c] * w[ii+2];
-    // most pixels
-    for(int i=2;i<wd-2;i++) for(int c=0;c<4;c++)
-      for(int ii=-2;ii<=2;ii++)
-        tmp[4*(j*wd+i)+c] += input[4*(j*wd+i+ii)+c] * w[ii+2];
-    // right borders
-    for(int i=wd-2;i<wd;i++) for(int c=0;c<4;c++)
-      for(int ii=-2;ii<=2;ii++)
-        tmp[4*(j*wd+i)+c] += input[4*(j*wd+MIN(i+ii, wd-(i+ii-wd+1) ))+c] * w[ii+2];
+  return i < 0 ? -i : (i >= n ? 2 * n - i - 1 : i);
+}
+
+// out = sum of wt[t] * rows[t][] for n pixels of 4 channels
+static inline void blur_rows(float *const out, const float *const *const rows, const float *const wt, const int taps,
+                             const size_t n)
+{
+#if defined(__SSE2__)
+  for(size_t i = 0; i < n; i++)
+  {
+    __m128 sum = _mm_mul_ps(_mm_set1_ps(wt[0]), _mm_load_ps(rows[0] + 4 * i));
+    for(int t = 1; t < taps; t++)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(wt[t]), _mm_load_ps(rows[t] + 4 * i)));
+    _mm_store_ps(out + 4 * i, sum);
   }
-  memset(output, 0, 4*wd*ht*sizeof(float));
-#ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) shared(tmp)
-#endif
-  for(int i=0;i<wd;i++)
-  { // vertical pass
-    for(int j=0;j<2;j++) for(int c=0;c<4;c++)
-      for(int jj=-2;jj<=2;jj++)
-        output[4*(j*wd+i)+c] += tmp[4*(MAX(-j-jj,j+jj)*wd+i)+c] * w[jj+2];
-    for(int j=2;j<ht-2;j++) for(int c=0;c<4;c++)
-      for(int jj=-2;jj<=2;jj++)
-        output[4*(j*wd+i)+c] += tmp[4*((j+jj)*wd+i)+c] * w[jj+2];
-    for(int j=ht-2;j<ht;j++) for(int c=0;c<4;c++)
-      for(int jj=-2;jj<=2;jj++)
-        output[4*(j*wd+i)+c] += tmp[4*(MIN(j+jj, ht-(j+jj-ht+1))*wd+i)+c] * w[jj+2];
+#else
+  for(size_t k = 0; k < 4 * n; k++)
+  {
+    float sum = wt[0] * rows[0][k];
+    for(int t = 1; t < taps; t++) sum += wt[t] * rows[t][k];
+    out[k] = sum;
   }
-  dt_free_align(tmp);
+#endif
 }
 
-static inline void gauss_expand(
-    const float *const input, // coarse input
-    float *const fine,        // upsampled, blurry output
-    const size_t wd,          // fine res
-    const size_t ht)
+// one pixel out = sum of wt[t] * row[idx[t]]
+static inline void blur_px(float *const out, const float *const row, const int *const idx, const float *const wt,
+                           const int taps)
 {
-  const size_t cw = (wd-1)/2+1;
-  // fill numbers in even pixels, zero odd ones
-  memset(fine, 0, 4*wd*ht*sizeof(float));
-#ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) collapse(2)
+#if defined(__SSE2__)
+  __m128 sum = _mm_mul_ps(_mm_set1_ps(wt[0]), _mm_load_ps(row + 4 * idx[0]));
+  for(int t = 1; t < taps; t++) sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(wt[t]), _mm_load_ps(row + 4 * idx[t])));
+  _mm_store_ps(out, sum);
+#else
+  for(int c = 0; c < 4; c++)
+  {
+    float sum = wt[0] * row[4 * idx[0] + c];
+    for(int t = 1; t < taps; t++) sum += wt[t] * row[4 * idx[t] + c];
+    out[c] = sum;
+  }
 #endif
-  for(int j=0;j<ht;j+=2)
-    for(int i=0;i<wd;i+=2)
-      for(int c=0;c<4;c++)
-        fine[4*(j*wd+i)+c] = 4.0f * input[4*(j/2*cw + i/2)+c];
+}
+
+// row j of the coarse buffer upsampled to fine resolution wd x ht and blurred, as if
+// the coarse pixels were spread to the even fine pixels (times 4) with zeroes in between.
+// tmp needs room for one coarse row.
+static inline void expand_row(const float *const coarse, float *const fine, float *const tmp, const int j,
+                              const int wd, const int ht)
+{
+  const int cw = (wd - 1) / 2 + 1;
+  const float *rows[5];
+  float wt[5];
+  int idx[5];
+  int taps = 0;
+  // only even fine rows carry coarse samples
+  for(int t = 0; t < 5; t++)
+  {
+    const int y = fusion_mirror(j - 2 + t, ht);
+    if(y & 1) continue;
+    rows[taps] = coarse + 4ul * cw * (y / 2);
+    wt[taps++] = 4.0f * fusion_w[t];
+  }
+  blur_rows(tmp, rows, wt, taps, cw);
 
-  // convolve with same kernel weights mul by 4:
-  gauss_blur(fine, fine, wd, ht);
+  for(int i = 0; i < wd; i++)
+  {
+    taps = 0;
+    for(int t = 0; t < 5; t++)
+    {
+      const int x = fusion_mirror(i - 2 + t, wd);
+      if(x & 1) continue;
+      idx[taps] = x / 2;
+      wt[taps++] = fusion_w[t];
+    }
+    blur_px(fine + 4 * i, tmp, idx, wt, taps);
+  }
 }
 
 // XXX FIXME: we'll need to pad up the image to get a good boundary condition!
 // XXX FIXME: downsampling will not result in an energy conserving pattern (every 4 pixels one sample)
 // XXX FIXME: neither will a mirror boundary condition (mirrors in subsampled values at random density)
-// TODO: copy laplacian code from local laplacian filters, it's faster.
+// blurs and decimates, only the coarse pixels are computed. rowbuf holds 4*wd floats per thread.
 static inline void gauss_reduce(
     const float *const input, // fine input buffer
     float *const coarse,      // coarse scale, blurred input buf
-    float *const detail,      // detail/laplacian, fine scale, or 0
-    const size_t wd,
-    const size_t ht)
+    const int wd,
+    const int ht,
+    float *const rowbuf)
 {
-  // blur, store only coarse res
-  const size_t cw = (wd-1)/2+1, ch = (ht-1)/2+1;
-
-  float *blurred = dt_alloc_align(64, (size_t)wd*ht*4*sizeof(float));
-  gauss_blur(input, blurred, wd, ht);
-  for(size_t j=0;j<ch;j++) for(size_t i=0;i<cw;i++)
-    for(int c=0;c<4;c++) coarse[4*(j*cw+i)+c] = blurred[4*(2*j*wd+2*i)+c];
-  dt_free_align(blurred);
-
-  if(detail)
+  const int cw = (wd-1)/2+1, ch = (ht-1)/2+1;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j=0;j<ch;j++)
   {
-    // compute laplacian/details: expand coarse buffer into detail
-    // buffer subtract expanded buffer from input in place
-    gauss_expand(coarse, detail, wd, ht);
-    for(size_t k=0;k<wd*ht*4;k++)
-      detail[k] = input[k] - detail[k];
+    float *const row = rowbuf + 4ul*wd*dt_get_thread_num();
+    const float *rows[5];
+    for(int t=0;t<5;t++) rows[t] = input + 4ul*wd*fusion_mirror(2*j-2+t, ht);
+    blur_rows(row, rows, fusion_w, 5, wd);
+
+    float *const out = coarse + 4ul*cw*j;
+    for(int i=0;i<cw;i++)
+    {
+      int idx[5];
+      for(int t=0;t<5;t++) idx[t] = fusion_mirror(2*i-2+t, wd);
+      blur_px(out + 4*i, row, idx, fusion_w, 5);
+    }
   }
 }
 
@@ -986,17 +1008,18 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     // allocate temporary buffer for wavelet transform + blending
     const int wd = roi_in->width, ht = roi_in->height;
     int num_levels = 8;
-    float **col  = malloc(num_levels * sizeof(float*));
-    float **comb = malloc(num_levels * sizeof(float*));
+    float *col[8], *comb[8];
+    int lw[8], lh[8];
+    size_t offset[8], size = 0;
     int w = wd, h = ht;
     const int rad = MIN(wd, ceilf(256 * roi_in->scale / piece->iscale));
     int step = 1;
     for(int k=0;k<num_levels;k++)
     {
       // coarsest step is some % of image width.
-      col[k]  = dt_alloc_align(64, sizeof(float)*4ul*w*h);
-      comb[k] = dt_alloc_align(64, sizeof(float)*4ul*w*h);
-      memset(comb[k], 0, sizeof(float)*4*w*h);
+      lw[k] = w; lh[k] = h;
+      offset[k] = size;
+      size += (4ul*w*h + 15) & ~15ul;
       w = (w-1)/2+1; h = (h-1)/2+1;
       step *= 2;
       if(step > rad || w < 4 || h < 4)
@@ -1005,6 +1028,16 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
         break;
       }
     }
+    // all levels of both pyramids live in one block. every thread gets a scratch row
+    // of the finest level plus one coarse row to expand into.
+    float *const pyramids = dt_alloc_align(64, sizeof(float)*2*size);
+    float *const rowbuf = dt_alloc_align(64, sizeof(float)*8ul*wd*dt_get_num_threads());
+    for(int k=0;k<num_levels;k++)
+    {
+      col[k]  = pyramids + offset[k];
+      comb[k] = pyramids + size + offset[k];
+    }
+    memset(comb[0], 0, sizeof(float)*size);
 
     for(int e=0;e<d->exposure_fusion+1;e++)
     { // for every exposure fusion image:
@@ -1016,114 +1049,112 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
       // compute features
       compute_features(col[0], wd, ht);
 
-      // create gaussian pyramid of colour buffer
-      w = wd; h = ht;
-      gauss_reduce(col[0], col[1], out, w, h);
+      // local contrast from the finest laplacian, computed row by row
+      gauss_reduce(col[0], col[1], wd, ht, rowbuf);
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(col) schedule(static)
 #endif
-      for(size_t k=0;k<4ul*wd*ht;k+=4)
-        col[0][k+3] *= .1f + sqrtf(out[k]*out[k] + out[k+1]*out[k+1] + out[k+2]*out[k+2]);
+      for(int j=0;j<ht;j++)
+      {
+        float *const up = rowbuf + 8ul*wd*dt_get_thread_num();
+        expand_row(col[1], up, up + 4*wd, j, wd, ht);
+        float *const c0 = col[0] + 4ul*wd*j;
+        for(int i=0;i<4*wd;i+=4)
+        {
+          const float l0 = c0[i] - up[i], l1 = c0[i+1] - up[i+1], l2 = c0[i+2] - up[i+2];
+          c0[i+3] *= .1f + sqrtf(l0*l0 + l1*l1 + l2*l2);
+        }
+      }
 
 // #define DEBUG_VIS2
 #ifdef DEBUG_VIS2 // transform weights in channels
-      for(size_t k=0;k<4ul*w*h;k+=4)
+      for(size_t k=0;k<4ul*wd*ht;k+=4)
         col[0][k+e] = col[0][k+3];
 #endif
 
 // #define DEBUG_VIS
 #ifdef DEBUG_VIS // DEBUG visualise weight buffer
-      for(size_t k=0;k<4ul*w*h;k+=4)
+      for(size_t k=0;k<4ul*wd*ht;k+=4)
         comb[0][k+e] = col[0][k+3];
       continue;
 #endif
 
       for(int k=1;k<num_levels;k++)
-      {
-        gauss_reduce(col[k-1], col[k], 0, w, h);
-        w = (w-1)/2+1; h = (h-1)/2+1;
-      }
+        gauss_reduce(col[k-1], col[k], lw[k-1], lh[k-1], rowbuf);
 
-      // update pyramid coarse to fine
+      // blend into the output pyramid, the laplacians are expanded row by row on the fly
       for(int k=num_levels-1;k>=0;k--)
       {
-        w = wd; h = ht;
-        for(int i=0;i<k;i++) { w = (w-1)/2+1; h = (h-1)/2+1; }
-        // abuse output buffer as temporary memory:
-        if(k!=num_levels-1)
-          gauss_expand(col[k+1], out, w, h);
+        w = lw[k]; h = lh[k];
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(col,comb,w,h,num_levels,k) schedule(static)
 #endif
-        for(int j=0;j<h;j++) for(int i=0;i<w;i++)
+        for(int j=0;j<h;j++)
         {
-          const size_t x = 4ul*(w*j+i);
-          // blend images into output pyramid
-          if(k == num_levels-1) // blend gaussian base
+          float *const up = rowbuf + 8ul*wd*dt_get_thread_num();
+          if(k != num_levels-1) expand_row(col[k+1], up, up + 4*w, j, w, h);
+          const float *const c = col[k] + 4ul*w*j;
+          float *const o = comb[k] + 4ul*w*j;
+          for(int i=0;i<4*w;i+=4)
+          {
+            // blend images into output pyramid
+            if(k == num_levels-1) // blend gaussian base
 #ifdef DEBUG_VIS2
-            ;
+              ;
 #else
-            for(int c=0;c<3;c++)
-              comb[k][x+c] += col[k][x+3] * col[k][x+c];
+              for(int cc=0;cc<3;cc++)
+                o[i+cc] += c[i+3] * c[i+cc];
 #endif
-          else // laplacian
-            for(int c=0;c<3;c++) comb[k][x+c] +=
-              col[k][x+3] * (col[k][x+c] - out[x+c]);
-          comb[k][x+3] += col[k][x+3];
+            else // laplacian
+              for(int cc=0;cc<3;cc++)
+                o[i+cc] += c[i+3] * (c[i+cc] - up[i+cc]);
+            o[i+3] += c[i+3];
+          }
         }
       }
     }
 
-#ifndef DEBUG_VIS // DEBUG: switch off when visualising weight buf
-    // normalise and reconstruct output pyramid buffer coarse to fine
+    // normalise and reconstruct output pyramid buffer coarse to fine,
+    // the finest level goes to the output buffer directly
     for(int k=num_levels-1;k>=0;k--)
     {
-      w = wd; h = ht;
-      for(int i=0;i<k;i++) { w = (w-1)/2+1; h = (h-1)/2+1;}
-
-      // normalise both gaussian base and laplacians:
+      w = lw[k]; h = lh[k];
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(comb,w,h,k) schedule(static)
+#pragma omp parallel for default(none) shared(comb,w,h,k,num_levels) schedule(static)
 #endif
-      for(size_t i=0;i<(size_t)4*w*h;i+=4)
-        if(comb[k][i+3] > 1e-8f)
-          for(int c=0;c<3;c++) comb[k][i+c] /= comb[k][i+3];
-
-      if(k < num_levels-1)
-      { // reconstruct output image
-        gauss_expand(comb[k+1], out, w, h);
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(comb,w,h,k) schedule(static)
+      for(int j=0;j<h;j++)
+      {
+        float *const o = comb[k] + 4ul*w*j;
+#ifndef DEBUG_VIS // DEBUG: switch off when visualising weight buf
+        // normalise both gaussian base and laplacians:
+        for(int i=0;i<4*w;i+=4)
+          if(o[i+3] > 1e-8f)
+            for(int c=0;c<3;c++) o[i+c] /= o[i+3];
+
+        if(k < num_levels-1)
+        { // reconstruct output image
+          float *const up = rowbuf + 8ul*wd*dt_get_thread_num();
+          expand_row(comb[k+1], up, up + 4*w, j, w, h);
+          for(int i=0;i<4*w;i+=4)
+            for(int c=0;c<3;c++) o[i+c] += up[i+c];
+        }
 #endif
-        for(int j=0;j<h;j++) for(int i=0;i<w;i++)
-        {
-          const size_t x = 4ul*(w*j+i);
-          for(int c=0;c<3;c++) comb[k][x+c] += out[x+c];
+        if(k == 0)
+        { // copy output buffer
+          const size_t x = 4ul*wd*j;
+          for(int i=0;i<4*wd;i+=4)
+          {
+            out[x+i+0] = o[i+0];
+            out[x+i+1] = o[i+1];
+            out[x+i+2] = o[i+2];
+            out[x+i+3] = in[x+i+3]; // pass on 4th channel
+          }
         }
       }
     }
-#endif
 
-    // copy output buffer
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(comb) schedule(static)
-#endif
-    for(size_t k=0;k<4ul*wd*ht;k+=4)
-    {
-      out[k+0] = comb[0][k+0];
-      out[k+1] = comb[0][k+1];
-      out[k+2] = comb[0][k+2];
-      out[k+3] = in[k+3]; // pass on 4th channel
-    }
-
-    // free temp buffers
-    for(int k=0;k<num_levels;k++)
-    {
-      dt_free_align(col[k]);
-      dt_free_align(comb[k]);
-    }
-    free(col);
-    free(comb);
+    dt_free_align(pyramids);
+    dt_free_align(rowbuf);
     return;
   }
 
@@ -196,9 +196,17 @@ void tiling_callback(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t
 
   const size_t basebuffer = width * height * channels * sizeof(float);
 
-  tiling->factor = 2.0f + (float)dt_bilateral_memory_use(width, height, sigma_s, sigma_r) / basebuffer;
-  tiling->maxbuf
-      = fmax(1.0f, (float)dt_bilateral_singlebuffer_size(width, height, sigma_s, sigma_r) / basebuffer);
+  if(d->mode == s_mode_bilateral)
+  {
+    tiling->factor = 2.0f + (float)dt_bilateral_memory_use(width, height, sigma_s, sigma_r) / basebuffer;
+    tiling->maxbuf
+        = fmax(1.0f, (float)dt_bilateral_singlebuffer_size(width, height, sigma_s, sigma_r) / basebuffer);
+  }
+  else // s_mode_local_laplacian
+  {
+    tiling->factor = 2.0f + (float)local_laplacian_memory_use(width, height) / basebuffer;
+    tiling->maxbuf = fmax(1.0f, (float)local_laplacian_singlebuffer_size(width, height) / basebuffer);
+  }
   tiling->overhead = 0;
   tiling->overlap = ceilf(4 * sigma_s);
   tiling->xalign = 1;
@@ -179,6 +179,14 @@ static INLINE float intp(const float a, const float b, const float c)
   return a * (b - c) + c;
 }
 
+// pass one only keeps the interpolated G of the R/B sites (indexed like RawDataTmp), on green
+// sites the raw value is G already
+static INLINE float Gval(const float *const in, const float *const Gtmp, const int row, const int col,
+                         const int width, const uint32_t filters)
+{
+  return (FC(row, col, filters) & 1) ? in[row * width + col] : Gtmp[(row * width + col) >> 1];
+}
+
 ////////////////////////////////////////////////////////////////
 //
 //		Chromatic Aberration Auto-correction
@@ -338,8 +346,9 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
   const gboolean autoCA = (cared == 0 && cablue == 0);
   // local variables
   //   const int width = W, height = H;
-  // temporary array to store simple interpolation of G
-  float *Gtmp = (float(*))calloc((height) * (width), sizeof *Gtmp);
+  // temporary array to store simple interpolation of G, only every second pixel (the R/B sites) needs to be
+  // saved here
+  float *Gtmp = (float *)calloc(height * width / 2 + 4, sizeof *Gtmp);
 
   // temporary array to avoid race conflicts, only every second pixel needs to be saved here
   float *RawDataTmp = (float *)malloc(height * width * sizeof(float) / 2 + 4);
@@ -608,10 +617,15 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
 
             if(row > -1 && row < height)
             {
-              for(int col = MAX(left + 3, 0), indx = rr * ts + 3 - (left < 0 ? (left + 3) : 0);
-                  col < MIN(cc1 + left - 3, width); col++, indx++)
+              int col = MAX(left + 3, 0), indx = rr * ts + 3 - (left < 0 ? (left + 3) : 0);
+              if(FC(row, col, filters) & 1)
               {
-                Gtmp[row * width + col] = rgb[1][indx];
+                col++;
+                indx++;
+              }
+              for(; col < MIN(cc1 + left - 3, width); col += 2, indx += 2)
+              {
+                Gtmp[(row * width + col) >> 1] = rgb[1][indx];
               }
             }
           }
@@ -1112,7 +1126,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
 
               if((c & 1) == 0)
               {
-                rgb[1][indx1] = Gtmp[indx];
+                rgb[1][indx1] = Gtmp[indx >> 1];
               }
             }
 
@@ -1136,7 +1150,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               {
                 int c = FC(rr, cc, filters);
                 rgb[c][(rrmax + rr) * ts + cc] = (in[(height - rr - 2) * width + left + cc]);
-                rgb[1][(rrmax + rr) * ts + cc] = Gtmp[(height - rr - 2) * width + left + cc];
+                rgb[1][(rrmax + rr) * ts + cc] = Gval(in, Gtmp, height - rr - 2, left + cc, width, filters);
               }
           }
 
@@ -1158,7 +1172,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               {
                 int c = FC(rr, cc, filters);
                 rgb[c][rr * ts + ccmax + cc] = (in[(top + rr) * width + (width - cc - 2)]);
-                rgb[1][rr * ts + ccmax + cc] = Gtmp[(top + rr) * width + (width - cc - 2)];
+                rgb[1][rr * ts + ccmax + cc] = Gval(in, Gtmp, top + rr, width - cc - 2, width, filters);
               }
           }
 
@@ -1170,7 +1184,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               {
                 int c = FC(rr, cc, filters);
                 rgb[c][(rr)*ts + cc] = (in[(border2 - rr) * width + border2 - cc]);
-                rgb[1][(rr)*ts + cc] = Gtmp[(border2 - rr) * width + border2 - cc];
+                rgb[1][(rr)*ts + cc] = Gval(in, Gtmp, border2 - rr, border2 - cc, width, filters);
               }
           }
 
@@ -1181,7 +1195,8 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               {
                 int c = FC(rr, cc, filters);
                 rgb[c][(rrmax + rr) * ts + ccmax + cc] = (in[(height - rr - 2) * width + (width - cc - 2)]);
-                rgb[1][(rrmax + rr) * ts + ccmax + cc] = Gtmp[(height - rr - 2) * width + (width - cc - 2)];
+                rgb[1][(rrmax + rr) * ts + ccmax + cc]
+                    = Gval(in, Gtmp, height - rr - 2, width - cc - 2, width, filters);
               }
           }
 
@@ -1192,7 +1207,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               {
                 int c = FC(rr, cc, filters);
                 rgb[c][(rr)*ts + ccmax + cc] = (in[(border2 - rr) * width + (width - cc - 2)]);
-                rgb[1][(rr)*ts + ccmax + cc] = Gtmp[(border2 - rr) * width + (width - cc - 2)];
+                rgb[1][(rr)*ts + ccmax + cc] = Gval(in, Gtmp, border2 - rr, width - cc - 2, width, filters);
               }
           }
 
@@ -1203,7 +1218,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
               {
                 int c = FC(rr, cc, filters);
                 rgb[c][(rrmax + rr) * ts + cc] = (in[(height - rr - 2) * width + (border2 - cc)]);
-                rgb[1][(rrmax + rr) * ts + cc] = Gtmp[(height - rr - 2) * width + (border2 - cc)];
+                rgb[1][(rrmax + rr) * ts + cc] = Gval(in, Gtmp, height - rr - 2, border2 - cc, width, filters);
               }
           }
 
@@ -1242,9 +1257,9 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
                                  / (wtu + wtd + wtl + wtr);
                 }
 
-                if(row > -1 && row < height && col > -1 && col < width)
+                if(c != 1 && row > -1 && row < height && col > -1 && col < width)
                 {
-                  Gtmp[row * width + col] = rgb[1][indx];
+                  Gtmp[(row * width + col) >> 1] = rgb[1][indx];
                 }
               }
 
@@ -1350,11 +1365,68 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
           shiftvfrac[0] /= 2.f;
           shiftvfrac[2] /= 2.f;
 
-          // this loop does not deserve vectorization in mainly because the most expensive part with the
-          // divisions does not happen often (less than 1/10 in my tests)
+          // the expensive part with the divisions does not happen often (less than 1/10 in tests), so the
+          // vectorized version only computes it if one of the four pixels needs it
+#ifdef __SSE2__
+          const vfloat zd25v = F2V(0.25f);
+          const vfloat zd5v = F2V(0.5f);
+          const vfloat onev = F2V(1.f);
+          const vfloat epsv = F2V(eps);
+#endif
           for(int rr = 8; rr < rr1 - 8; rr++)
-            for(int cc = 8 + (FC(rr, 2, filters) & 1), c = FC(rr, cc, filters), indx = rr * ts + cc;
-                cc < cc1 - 8; cc += 2, indx += 2)
+          {
+            int cc = 8 + (FC(rr, 2, filters) & 1), c = FC(rr, cc, filters), indx = rr * ts + cc;
+#ifdef __SSE2__
+            const vfloat shifthfracv = F2V(shifthfrac[c]);
+            const vfloat shiftvfracv = F2V(shiftvfrac[c]);
+            const int ih = GRBdir[1][c] >> 1;
+            const int iv = (GRBdir[0][c] * ts) >> 1;
+            for(; cc < cc1 - 14; cc += 8, indx += 8)
+            {
+              const vfloat rgb1v = LC2VFU(&rgb[1][indx]);
+              const vfloat rgbcv = LC2VFU(&rgb[c][indx]);
+              const vfloat grbdiffoldv = rgb1v - rgbcv;
+
+              // interpolate colour difference from optical R/B locations to grid locations
+              const vfloat grbdiff0v = LVFU(grbdiff[indx >> 1]);
+              const vfloat grbdiff1v = LVFU(grbdiff[(indx >> 1) - ih]);
+              const vfloat grbdiff2v = LVFU(grbdiff[(indx >> 1) - iv]);
+              const vfloat grbdiff3v = LVFU(grbdiff[(indx >> 1) - iv - ih]);
+              const vfloat grbdiffinthfloorv = vintpf(shifthfracv, grbdiff1v, grbdiff0v);
+              const vfloat grbdiffinthceilv = vintpf(shifthfracv, grbdiff3v, grbdiff2v);
+              // grbdiffint is bilinear interpolation of G-R/G-B at grid point
+              vfloat grbdiffintv = vintpf(shiftvfracv, grbdiffinthceilv, grbdiffinthfloorv);
+
+              // now determine R/B at grid points using interpolated colour differences and interpolated G
+              // value at grid point
+              vfloat RBintv = rgb1v - grbdiffintv;
+              const vmask cmask = (vmask)_mm_cmplt_ps(vabsf(RBintv - rgbcv), zd25v * (RBintv + rgbcv));
+
+              if(_mm_movemask_ps((vfloat)cmask) != 15)
+              {
+                // gradient weights using difference from G at CA shift points and G at grid points
+                const vfloat p0v = onev / (epsv + vabsf(rgb1v - LVFU(gshift[indx >> 1])));
+                const vfloat p1v = onev / (epsv + vabsf(rgb1v - LVFU(gshift[(indx >> 1) - ih])));
+                const vfloat p2v = onev / (epsv + vabsf(rgb1v - LVFU(gshift[(indx >> 1) - iv])));
+                const vfloat p3v = onev / (epsv + vabsf(rgb1v - LVFU(gshift[(indx >> 1) - iv - ih])));
+                const vfloat grbdiffintwv
+                    = (p0v * grbdiff0v + p1v * grbdiff1v + p2v * grbdiff2v + p3v * grbdiff3v)
+                      / (p0v + p1v + p2v + p3v);
+                grbdiffintv = vself(cmask, grbdiffintv, grbdiffintwv);
+                RBintv = rgb1v - grbdiffintv;
+              }
+
+              // take the interpolated value if it reduces the colour difference
+              vfloat resultv
+                  = vself((vmask)_mm_cmpgt_ps(vabsf(grbdiffoldv), vabsf(grbdiffintv)), RBintv, rgbcv);
+
+              // if colour difference interpolation overshot the correction, just desaturate
+              resultv = vself((vmask)_mm_cmplt_ps(grbdiffoldv * grbdiffintv, ZEROV),
+                              rgb1v - zd5v * (grbdiffoldv + grbdiffintv), resultv);
+              STC2VFU(rgb[c][indx], resultv);
+            }
+#endif
+            for(; cc < cc1 - 8; cc += 2, indx += 2)
             {
 
               float grbdiffold = rgb[1][indx] - rgb[c][indx];
@@ -1409,6 +1481,7 @@ static void CA_correct(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pie
                 rgb[c][indx] = rgb[1][indx] - 0.5f * (grbdiffold + grbdiffint);
               }
             }
+          }
 
           // copy CA corrected results to temporary image matrix
           for(int rr = border; rr < rr1 - border; rr++)
@@ -34,7 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define CLIP(x) ((x < 0) ? 0.0 : (x > 1.0) ? 1.0 : x)
+#define CLIP(x) (((x) < 0.0f) ? 0.0f : ((x) > 1.0f) ? 1.0f : (x))
 
 #define ROUND_POSISTIVE(f) ((unsigned int)((f)+0.5))
 
@@ -79,159 +79,174 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 {
   dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
   const int ch = piece->colors;
+  const int width = roi_out->width, height = roi_out->height;
 
-  // PASS1: Get a luminance map of image...
-  float *luminance = (float *)malloc(((size_t)roi_out->width * roi_out->height) * sizeof(float));
-// double lsmax=0.0,lsmin=1.0;
+#define BINS (256)
+
+  // PASS1: Get a luminance map of image, we only ever need its histogram bin
+  uint16_t *const bin = dt_alloc_align(64, sizeof(uint16_t) * width * height);
 #ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) shared(luminance)
+#pragma omp parallel for default(none) schedule(static)
 #endif
-  for(int j = 0; j < roi_out->height; j++)
+  for(int j = 0; j < height; j++)
   {
-    float *in = (float *)ivoid + (size_t)j * roi_out->width * ch;
-    float *lm = luminance + (size_t)j * roi_out->width;
-    for(int i = 0; i < roi_out->width; i++)
+    const float *in = (const float *)ivoid + (size_t)j * width * ch;
+    uint16_t *b = bin + (size_t)j * width;
+    for(int i = 0; i < width; i++, in += ch)
     {
-      double pmax = CLIP(fmax(in[0], fmax(in[1], in[2]))); // Max value in RGB set
-      double pmin = CLIP(fmin(in[0], fmin(in[1], in[2]))); // Min value in RGB set
-      *lm = (pmax + pmin) / 2.0;                           // Pixel luminocity
-      in += ch;
-      lm++;
+      const float pmax = CLIP(fmaxf(in[0], fmaxf(in[1], in[2]))); // Max value in RGB set
+      const float pmin = CLIP(fminf(in[0], fminf(in[1], in[2]))); // Min value in RGB set
+      const float lum = (pmax + pmin) * 0.5f;                     // Pixel luminocity
+      b[i] = ROUND_POSISTIVE(lum * (float)BINS);
     }
   }
 
-
   // Params
   const int rad = data->radius * roi_in->scale / piece->iscale;
-
-#define BINS (256)
-
   const float slope = data->slope;
 
-  const size_t destbuf_size = roi_out->width;
-  float *const dest_buf = malloc(destbuf_size * sizeof(float) * dt_get_num_threads());
+  // every thread walks down a band of rows. it keeps the histograms of all columns over the rows of the
+  // window, these slide down by adding and removing one pixel per column and row, and the window
+  // histogram slides right by adding and removing one column histogram. so the cost per pixel does not
+  // depend on the radius.
+  const int nthreads = dt_get_num_threads();
+  const int band = (height + nthreads - 1) / nthreads;
+  const size_t colhist_size = (size_t)(BINS + 1) * width;
+  uint16_t *const colhist_buf = dt_alloc_align(64, sizeof(uint16_t) * colhist_size * nthreads);
+  float *const dest_buf = dt_alloc_align(64, sizeof(float) * width * nthreads);
 
 // CLAHE
 #ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) shared(luminance)
+#pragma omp parallel for default(none) schedule(static)
 #endif
-  for(int j = 0; j < roi_out->height; j++)
+  for(int t = 0; t < nthreads; t++)
   {
-    int yMin = fmax(0, j - rad);
-    int yMax = fmin(roi_in->height, j + rad + 1);
-    int h = yMax - yMin;
-
-    int xMin0 = fmax(0, 0 - rad);
-    int xMax0 = fmin(roi_in->width - 1, rad);
-
-    int hist[BINS + 1];
-    int clippedhist[BINS + 1];
-
-    float *dest = dest_buf + destbuf_size * dt_get_thread_num();
+    const int j0 = t * band, j1 = MIN(height, j0 + band);
+    uint16_t *const colhist = colhist_buf + colhist_size * t;
+    float *const dest = dest_buf + (size_t)width * t;
 
-    /* initially fill histogram */
-    memset(hist, 0, (BINS + 1) * sizeof(int));
-    for(int yi = yMin; yi < yMax; ++yi)
-      for(int xi = xMin0; xi < xMax0; ++xi)
-        ++hist[ROUND_POSISTIVE(luminance[(size_t)yi * roi_in->width + xi] * (float)BINS)];
-
-    // Destination row
-    memset(dest, 0, roi_out->width * sizeof(float));
-    float *ld = dest;
-
-    for(int i = 0; i < roi_out->width; i++)
+    if(j0 < j1)
     {
+      memset(colhist, 0, sizeof(uint16_t) * colhist_size);
+      for(int yi = MAX(0, j0 - rad); yi < MIN(height, j0 + rad + 1); yi++)
+        for(int xi = 0; xi < width; xi++) ++colhist[(size_t)(BINS + 1) * xi + bin[(size_t)yi * width + xi]];
+    }
 
-      int v = ROUND_POSISTIVE(luminance[(size_t)j * roi_in->width + i] * (float)BINS);
+    for(int j = j0; j < j1; j++)
+    {
+      // slide the column histograms down
+      if(j > j0)
+      {
+        const int yOut = j - rad - 1, yIn = j + rad;
+        if(yOut >= 0)
+          for(int xi = 0; xi < width; xi++) --colhist[(size_t)(BINS + 1) * xi + bin[(size_t)yOut * width + xi]];
+        if(yIn < height)
+          for(int xi = 0; xi < width; xi++) ++colhist[(size_t)(BINS + 1) * xi + bin[(size_t)yIn * width + xi]];
+      }
 
-      int xMin = fmax(0, i - rad);
-      int xMax = i + rad + 1;
-      int w = fmin(roi_in->width, xMax) - xMin;
-      int n = h * w;
+      const int yMin = MAX(0, j - rad);
+      const int yMax = MIN(height, j + rad + 1);
+      const int h = yMax - yMin;
 
-      int limit = (int)(slope * n / BINS + 0.5f);
+      int hist[BINS + 1];
+      int clippedhist[BINS + 1];
 
-      /* remove left behind values from histogram */
-      if(xMin > 0)
+      /* initially fill histogram */
+      memset(hist, 0, (BINS + 1) * sizeof(int));
+      for(int xi = 0; xi < MIN(width, rad); xi++)
       {
-        int xMin1 = xMin - 1;
-        for(int yi = yMin; yi < yMax; ++yi)
-          --hist[ROUND_POSISTIVE(luminance[(size_t)yi * roi_in->width + xMin1] * (float)BINS)];
+        const uint16_t *const c = colhist + (size_t)(BINS + 1) * xi;
+        for(int b = 0; b <= BINS; b++) hist[b] += c[b];
       }
 
-      /* add newly included values to histogram */
-      if(xMax <= roi_in->width)
+      for(int i = 0; i < width; i++)
       {
-        int xMax1 = xMax - 1;
-        for(int yi = yMin; yi < yMax; ++yi)
-          ++hist[ROUND_POSISTIVE(luminance[(size_t)yi * roi_in->width + xMax1] * (float)BINS)];
-      }
+        const int v = bin[(size_t)j * width + i];
 
-      /* clip histogram and redistribute clipped entries */
-      memcpy(clippedhist, hist, (BINS + 1) * sizeof(int));
-      int ce = 0, ceb = 0;
-      do
-      {
-        ceb = ce;
-        ce = 0;
-        for(int b = 0; b <= BINS; b++)
+        const int xMin = MAX(0, i - rad);
+        const int xMax = i + rad + 1;
+        const int w = MIN(width, xMax) - xMin;
+        const int n = h * w;
+
+        const int limit = (int)(slope * n / BINS + 0.5f);
+
+        /* remove left behind values from histogram */
+        if(xMin > 0)
         {
-          int d = clippedhist[b] - limit;
-          if(d > 0)
-          {
-            ce += d;
-            clippedhist[b] = limit;
-          }
+          const uint16_t *const c = colhist + (size_t)(BINS + 1) * (xMin - 1);
+          for(int b = 0; b <= BINS; b++) hist[b] -= c[b];
         }
 
-        int d = (ce / (float)(BINS + 1));
-        int m = ce % (BINS + 1);
-        for(int b = 0; b <= BINS; b++) clippedhist[b] += d;
-
-        if(m != 0)
+        /* add newly included values to histogram */
+        if(xMax <= width)
         {
-          int s = BINS / (float)m;
-          for(int b = 0; b <= BINS; b += s) ++clippedhist[b];
+          const uint16_t *const c = colhist + (size_t)(BINS + 1) * (xMax - 1);
+          for(int b = 0; b <= BINS; b++) hist[b] += c[b];
         }
-      } while(ce != ceb);
 
-      /* build cdf of clipped histogram */
-      unsigned int hMin = BINS;
-      for(int b = 0; b < hMin; b++)
-        if(clippedhist[b] != 0) hMin = b;
+        /* clip histogram and redistribute clipped entries */
+        memcpy(clippedhist, hist, (BINS + 1) * sizeof(int));
+        int ce = 0, ceb = 0;
+        do
+        {
+          ceb = ce;
+          ce = 0;
+          for(int b = 0; b <= BINS; b++)
+          {
+            const int d = clippedhist[b] - limit;
+            if(d > 0)
+            {
+              ce += d;
+              clippedhist[b] = limit;
+            }
+          }
 
-      int cdf = 0;
-      for(int b = hMin; b <= v; b++) cdf += clippedhist[b];
+          const int d = (ce / (float)(BINS + 1));
+          const int m = ce % (BINS + 1);
+          for(int b = 0; b <= BINS; b++) clippedhist[b] += d;
 
-      int cdfMax = cdf;
-      for(int b = v + 1; b <= BINS; b++) cdfMax += clippedhist[b];
+          if(m != 0)
+          {
+            const int s = BINS / (float)m;
+            for(int b = 0; b <= BINS; b += s) ++clippedhist[b];
+          }
+        } while(ce != ceb);
 
-      int cdfMin = clippedhist[hMin];
+        /* build cdf of clipped histogram */
+        int hMin = BINS;
+        for(int b = 0; b < hMin; b++)
+          if(clippedhist[b] != 0) hMin = b;
 
-      *ld = (cdf - cdfMin) / (float)(cdfMax - cdfMin);
+        int cdf = 0;
+        for(int b = hMin; b <= v; b++) cdf += clippedhist[b];
 
-      ld++;
-    }
+        int cdfMax = cdf;
+        for(int b = v + 1; b <= BINS; b++) cdfMax += clippedhist[b];
 
-    // Apply row
-    float *in = ((float *)ivoid) + (size_t)j * roi_out->width * ch;
-    float *out = ((float *)ovoid) + (size_t)j * roi_out->width * ch;
-    for(int r = 0; r < roi_out->width; r++)
-    {
-      float H, S, L;
-      rgb2hsl(in, &H, &S, &L);
-      // hsl2rgb(out,H,S,( L / dest[r] ) * (L-lsmin) + lsmin );
-      hsl2rgb(out, H, S, dest[r]);
-      out += ch;
-      in += ch;
-      ld++;
+        const int cdfMin = clippedhist[hMin];
+
+        dest[i] = (cdf - cdfMin) / (float)(cdfMax - cdfMin);
+      }
+
+      // Apply row
+      const float *in = ((const float *)ivoid) + (size_t)j * width * ch;
+      float *out = ((float *)ovoid) + (size_t)j * width * ch;
+      for(int r = 0; r < width; r++)
+      {
+        float H, S, L;
+        rgb2hsl(in, &H, &S, &L);
+        hsl2rgb(out, H, S, dest[r]);
+        out += ch;
+        in += ch;
+      }
     }
   }
 
-  free(dest_buf);
+  dt_free_align(dest_buf);
+  dt_free_align(colhist_buf);
 
   // Cleanup
-  free(luminance);
+  dt_free_align(bin);
 
 #undef BINS
 }
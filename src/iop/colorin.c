@@ -103,6 +103,7 @@ typedef struct dt_iop_colorin_data_t
   int blue_mapping;
   int nonlinearlut;
   dt_colorspaces_color_profile_type_t type;
+  dt_colorspaces_clut_t clut; // lcms2 transforms sampled to XYZ, if any
 } dt_iop_colorin_data_t;
 
 const char *name()
@@ -935,12 +936,49 @@ static void process_lcms2_proper(struct dt_iop_module_t *self, dt_dev_pixelpipe_
   }
 }
 
+static void process_clut(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
+                         void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
+{
+  const dt_iop_colorin_data_t *const d = (dt_iop_colorin_data_t *)piece->data;
+  const int blue_mapping = d->blue_mapping && piece->pipe->image.flags & DT_IMAGE_RAW;
+  const size_t npixels = (size_t)roi_out->width * roi_out->height;
+  const float *in = (const float *)ivoid;
+  float *const out = (float *)ovoid;
+
+  if(blue_mapping)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) shared(in)
+#endif
+    for(size_t k = 0; k < npixels; k++) apply_blue_mapping(in + 4 * k, out + 4 * k);
+    in = out;
+  }
+
+  // the lut holds XYZ, convert that to Lab
+  dt_colorspaces_clut_apply(&d->clut, in, out, npixels);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none)
+#endif
+  for(size_t k = 0; k < npixels; k++)
+  {
+    float Lab[4];
+    _dt_XYZ_to_Lab(out + 4 * k, Lab);
+    for(int c = 0; c < 3; c++) out[4 * k + c] = Lab[c];
+  }
+}
+
 static void process_lcms2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
                           void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
   const dt_iop_colorin_data_t *const d = (dt_iop_colorin_data_t *)piece->data;
   const int blue_mapping = d->blue_mapping && piece->pipe->image.flags & DT_IMAGE_RAW;
 
+  if(d->clut.table)
+  {
+    process_clut(self, piece, ivoid, ovoid, roi_in, roi_out);
+    return;
+  }
+
   // use general lcms2 fallback
   if(blue_mapping)
   {
@@ -1316,6 +1354,39 @@ static void process_sse2_lcms2_proper(struct dt_iop_module_t *self, dt_dev_pixel
   }
 }
 
+static void process_sse2_clut(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
+                              const void *const ivoid, void *const ovoid, const dt_iop_roi_t *const roi_in,
+                              const dt_iop_roi_t *const roi_out)
+{
+  const dt_iop_colorin_data_t *const d = (dt_iop_colorin_data_t *)piece->data;
+  const int blue_mapping = d->blue_mapping && piece->pipe->image.flags & DT_IMAGE_RAW;
+  const size_t npixels = (size_t)roi_out->width * roi_out->height;
+  const float *in = (const float *)ivoid;
+  float *const out = (float *)ovoid;
+
+  if(blue_mapping)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) shared(in)
+#endif
+    for(size_t k = 0; k < npixels; k++) apply_blue_mapping(in + 4 * k, out + 4 * k);
+    in = out;
+  }
+
+  // the lut holds XYZ, convert that to Lab and keep alpha
+  dt_colorspaces_clut_apply(&d->clut, in, out, npixels);
+  const __m128 alphamask = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none)
+#endif
+  for(size_t k = 0; k < npixels; k++)
+  {
+    const __m128 XYZ = _mm_load_ps(out + 4 * k);
+    _mm_store_ps(out + 4 * k,
+                 _mm_or_ps(_mm_andnot_ps(alphamask, dt_XYZ_to_Lab_sse2(XYZ)), _mm_and_ps(alphamask, XYZ)));
+  }
+}
+
 static void process_sse2_lcms2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
                                const void *const ivoid, void *const ovoid, const dt_iop_roi_t *const roi_in,
                                const dt_iop_roi_t *const roi_out)
@@ -1323,6 +1394,12 @@ static void process_sse2_lcms2(struct dt_iop_module_t *self, dt_dev_pixelpipe_io
   const dt_iop_colorin_data_t *const d = (dt_iop_colorin_data_t *)piece->data;
   const int blue_mapping = d->blue_mapping && piece->pipe->image.flags & DT_IMAGE_RAW;
 
+  if(d->clut.table)
+  {
+    process_sse2_clut(self, piece, ivoid, ovoid, roi_in, roi_out);
+    return;
+  }
+
   // use general lcms2 fallback
   if(blue_mapping)
   {
@@ -1369,6 +1446,32 @@ static void mat3mul(float *dst, const float *const m1, const float *const m2)
   }
 }
 
+// what process_lcms2_proper() does to a row, for sampling the 3d lut. that is done in XYZ, which is a lot
+// closer to linear in the camera values than Lab.
+static void _clut_sample(const void *data, float *pixels, const int n)
+{
+  const dt_iop_colorin_data_t *const d = (const dt_iop_colorin_data_t *)data;
+
+  if(!d->nrgb)
+  {
+    cmsDoTransform(d->xform_cam_Lab, pixels, pixels, n);
+  }
+  else
+  {
+    cmsDoTransform(d->xform_cam_nrgb, pixels, pixels, n);
+    for(int j = 0; j < n; j++)
+      for(int c = 0; c < 3; c++) pixels[4 * j + c] = CLAMP(pixels[4 * j + c], 0.0f, 1.0f);
+    cmsDoTransform(d->xform_nrgb_Lab, pixels, pixels, n);
+  }
+
+  for(int j = 0; j < n; j++)
+  {
+    float XYZ[3];
+    dt_Lab_to_XYZ(pixels + 4 * j, XYZ);
+    for(int c = 0; c < 3; c++) pixels[4 * j + c] = XYZ[c];
+  }
+}
+
 void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe,
                    dt_dev_pixelpipe_iop_t *piece)
 {
@@ -1421,6 +1524,7 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     d->xform_nrgb_Lab = NULL;
   }
 
+  dt_colorspaces_clut_cleanup(&d->clut);
   d->cmatrix[0] = d->nmatrix[0] = d->lmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -1605,6 +1709,17 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
 
   d->nonlinearlut = 0;
 
+  // profiles that can't be reduced to a matrix are lut based, and lcms2 clamps the input of those to
+  // [0,1] anyways. so sample the whole transform once instead of running it for every pixel.
+  if(isnan(d->cmatrix[0]) && d->xform_cam_Lab && (!d->nrgb || (d->xform_cam_nrgb && d->xform_nrgb_Lab)))
+  {
+    const cmsHPROFILE profiles[2] = { d->input, d->nrgb };
+    const int settings[2] = { p->intent, d->nrgb != NULL };
+    const float min[3] = { 0.0f, 0.0f, 0.0f }, max[3] = { 1.0f, 1.0f, 1.0f };
+    dt_colorspaces_clut_init(&d->clut, profiles, d->nrgb ? 2 : 1, settings, sizeof(settings), min, max,
+                             _clut_sample, d);
+  }
+
   // now try to initialize unbounded mode:
   // we do a extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -1635,6 +1750,7 @@ void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pi
   d->xform_cam_Lab = NULL;
   d->xform_cam_nrgb = NULL;
   d->xform_nrgb_Lab = NULL;
+  d->clut.table = NULL;
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
@@ -1657,6 +1773,7 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_colorspaces_clut_cleanup(&d->clut);
 
   free(piece->data);
   piece->data = NULL;
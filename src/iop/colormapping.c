@@ -41,6 +41,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
 
 /**
  * color transfer somewhat based on the glorious paper `color transfer between images'
@@ -59,6 +62,12 @@ DT_MODULE_INTROSPECTION(1, dt_iop_colormapping_params_t)
 #define HISTN (1 << 11)
 #define MAXN 5
 
+// the chroma transfer only depends on a and b. it is sampled on this grid in commit_params() and
+// interpolated bilinearly in process(), colors outside of the grid are mapped exactly.
+#define AB_LUT_MIN -128.0f
+#define AB_LUT_STEP 0.5f
+#define AB_LUT_SIZE 513
+
 typedef enum dt_iop_colormapping_flags_t
 {
   NEUTRAL = 0,
@@ -107,8 +116,22 @@ typedef struct dt_iop_colormapping_params_t
   float target_weight[MAXN];
 } dt_iop_colormapping_params_t;
 
-/** and pixelpipe data is just the same */
-typedef struct dt_iop_colormapping_params_t dt_iop_colormapping_data_t;
+typedef struct dt_iop_colormapping_data_t
+{
+  dt_iop_colormapping_flags_t flag;
+  int n;
+  float equalization;
+  float source_ihist[HISTN];
+  int target_hist[HISTN];
+  float source_mean[MAXN][2];
+  float target_mean[MAXN][2];
+  // mapping from input clusters to target clusters and the ratio of their std deviations
+  int mapio[MAXN];
+  float var_ratio[MAXN][2];
+  // transferred a/b for each node of the a/b grid
+  int ab_lut_valid;
+  float ab_lut[AB_LUT_SIZE * AB_LUT_SIZE][2];
+} dt_iop_colormapping_data_t;
 
 
 typedef struct dt_iop_colormapping_gui_data_t
@@ -434,6 +457,19 @@ static void kmeans(const float *col, const int width, const int height, const in
 
 #pragma GCC diagnostic pop
 
+// transfer a and b of Lab from the input clusters to the mapped target clusters
+static void transfer_ab(dt_iop_colormapping_data_t *const d, const float *const Lab, float *const ab)
+{
+  float weight[MAXN];
+  get_clusters(Lab, d->n, d->target_mean, weight);
+  ab[0] = ab[1] = 0.0f;
+  for(int c = 0; c < d->n; c++)
+  {
+    ab[0] += weight[c] * ((Lab[1] - d->target_mean[c][0]) * d->var_ratio[c][0] + d->source_mean[d->mapio[c]][0]);
+    ab[1] += weight[c] * ((Lab[2] - d->target_mean[c][1]) * d->var_ratio[c][1] + d->source_mean[d->mapio[c]][1]);
+  }
+}
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
              void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
@@ -471,25 +507,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   {
     // for all pixels: find input cluster, transfer to mapped target cluster and apply histogram
 
-    float dominance = data->dominance / 100.0f;
     float equalization = data->equalization / 100.0f;
 
-    // get mapping from input clusters to target clusters
-    int *const mapio = malloc(data->n * sizeof(int));
-
-    get_cluster_mapping(data->n, data->target_mean, data->target_weight, data->source_mean,
-                        data->source_weight, dominance, mapio);
-
-    float(*const var_ratio)[2] = malloc(2 * data->n * sizeof(float));
-
-    for(int i = 0; i < data->n; i++)
-    {
-      var_ratio[i][0]
-          = (data->target_var[i][0] > 0.0f) ? data->source_var[mapio[i]][0] / data->target_var[i][0] : 0.0f;
-      var_ratio[i][1]
-          = (data->target_var[i][1] > 0.0f) ? data->source_var[mapio[i]][1] / data->target_var[i][1] : 0.0f;
-    }
-
 // first get delta L of equalized L minus original image L, scaled to fit into [0 .. 100]
 #ifdef _OPENMP
 #pragma omp parallel for default(none) schedule(static) shared(data, in, out, equalization)
@@ -512,53 +531,57 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     {
       // bilateral blur of delta L to avoid artifacts caused by limited histogram resolution
       dt_bilateral_t *b = dt_bilateral_init(width, height, sigma_s, sigma_r);
-      if(!b)
-      {
-        free(var_ratio);
-        free(mapio);
-        return;
-      }
+      if(!b) return;
       dt_bilateral_splat(b, out);
       dt_bilateral_blur(b);
       dt_bilateral_slice(b, out, out, -1.0f);
       dt_bilateral_free(b);
     }
 
-    float *const weight_buf = malloc(data->n * dt_get_num_threads() * sizeof(float));
-
 #ifdef _OPENMP
-#pragma omp parallel for default(none) schedule(static) shared(data, in, out, equalization)
+#pragma omp parallel for default(none) schedule(static) shared(data, in, out)
 #endif
     for(int k = 0; k < height; k++)
     {
-      float *weight = weight_buf + data->n * dt_get_thread_num();
+      const float *const lut = (const float *)data->ab_lut;
       size_t j = (size_t)ch * width * k;
       for(int i = 0; i < width; i++)
       {
         const float L = in[j];
-        const float Lab[3] = { L, in[j + 1], in[j + 2] };
 
         // transfer back scaled and blurred delta L to output L
         out[j] = 2.0f * (out[j] - 50.0f) + L;
         out[j] = CLAMP(out[j], 0.0f, 100.0f);
 
-        get_clusters(in + j, data->n, data->target_mean, weight);
-        out[j + 1] = out[j + 2] = 0.0f;
-        for(int c = 0; c < data->n; c++)
+        const float fa = (in[j + 1] - AB_LUT_MIN) * (1.0f / AB_LUT_STEP);
+        const float fb = (in[j + 2] - AB_LUT_MIN) * (1.0f / AB_LUT_STEP);
+        if(fa >= 0.0f && fa < AB_LUT_SIZE - 1 && fb >= 0.0f && fb < AB_LUT_SIZE - 1)
         {
-          out[j + 1] += weight[c] * ((Lab[1] - data->target_mean[c][0]) * var_ratio[c][0]
-                                     + data->source_mean[mapio[c]][0]);
-          out[j + 2] += weight[c] * ((Lab[2] - data->target_mean[c][1]) * var_ratio[c][1]
-                                     + data->source_mean[mapio[c]][1]);
+          const int ia = fa, ib = fb;
+          const float wa = fa - ia, wb = fb - ib;
+          const float *const n0 = lut + 2 * (AB_LUT_SIZE * ib + ia);
+          const float *const n1 = n0 + 2 * AB_LUT_SIZE;
+#if defined(__SSE2__)
+          // a, b of the nodes (ia, ib) and (ia + 1, ib), then interpolated along b and a
+          const __m128 r0 = _mm_loadu_ps(n0);
+          const __m128 r = _mm_add_ps(r0, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n1), r0), _mm_set1_ps(wb)));
+          const __m128 ab = _mm_add_ps(r, _mm_mul_ps(_mm_sub_ps(_mm_movehl_ps(r, r), r), _mm_set1_ps(wa)));
+          _mm_storel_pi((__m64 *)(out + j + 1), ab);
+#else
+          for(int c = 0; c < 2; c++)
+          {
+            const float r0 = n0[c] + (n1[c] - n0[c]) * wb;
+            const float r1 = n0[c + 2] + (n1[c + 2] - n0[c + 2]) * wb;
+            out[j + 1 + c] = r0 + (r1 - r0) * wa;
+          }
+#endif
         }
+        else
+          transfer_ab(data, in + j, out + j + 1);
         out[j + 3] = in[j + 3];
         j += ch;
       }
     }
-
-    free(weight_buf);
-    free(var_ratio);
-    free(mapio);
   }
   // incomplete parameter set -> do nothing
   else
@@ -587,7 +610,6 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
   const float sigma_s = 50.0f / scale;
   const float sigma_r = 8.0f; // does not depend on scale
 
-  float dominance = data->dominance / 100.0f;
   float equalization = data->equalization / 100.0f;
 
   dt_bilateral_cl_t *b = NULL;
@@ -623,20 +645,6 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
   // process image if all mapping information is present in the parameter set
   if(data->flag & HAS_TARGET && data->flag & HAS_SOURCE)
   {
-    // get mapping from input clusters to target clusters
-    int mapio[MAXN];
-    get_cluster_mapping(data->n, data->target_mean, data->target_weight, data->source_mean,
-                        data->source_weight, dominance, mapio);
-
-    float var_ratio[MAXN][2];
-    for(int i = 0; i < data->n; i++)
-    {
-      var_ratio[i][0]
-          = (data->target_var[i][0] > 0.0f) ? data->source_var[mapio[i]][0] / data->target_var[i][0] : 0.0f;
-      var_ratio[i][1]
-          = (data->target_var[i][1] > 0.0f) ? data->source_var[mapio[i]][1] / data->target_var[i][1] : 0.0f;
-    }
-
     dev_tmp = dt_opencl_alloc_device(devid, width, height, 4 * sizeof(float));
     if(dev_tmp == NULL) goto error;
 
@@ -655,10 +663,10 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
         = dt_opencl_copy_host_to_device_constant(devid, sizeof(float) * MAXN * 2, data->source_mean);
     if(dev_source_mean == NULL) goto error;
 
-    dev_var_ratio = dt_opencl_copy_host_to_device_constant(devid, sizeof(float) * MAXN * 2, var_ratio);
+    dev_var_ratio = dt_opencl_copy_host_to_device_constant(devid, sizeof(float) * MAXN * 2, data->var_ratio);
     if(dev_var_ratio == NULL) goto error;
 
-    dev_mapio = dt_opencl_copy_host_to_device_constant(devid, sizeof(int) * MAXN, mapio);
+    dev_mapio = dt_opencl_copy_host_to_device_constant(devid, sizeof(int) * MAXN, data->mapio);
     if(dev_var_ratio == NULL) goto error;
 
     size_t sizes[3] = { ROUNDUPWD(width), ROUNDUPHT(height), 1 };
@@ -770,7 +778,47 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
   dt_iop_colormapping_params_t *p = (dt_iop_colormapping_params_t *)p1;
   dt_iop_colormapping_data_t *d = (dt_iop_colormapping_data_t *)piece->data;
 
-  memcpy(d, p, sizeof(dt_iop_colormapping_params_t));
+  // get mapping from input clusters to target clusters
+  int mapio[MAXN] = { 0 };
+  float var_ratio[MAXN][2] = { { 0.0f } };
+  get_cluster_mapping(p->n, p->target_mean, p->target_weight, p->source_mean, p->source_weight,
+                      p->dominance / 100.0f, mapio);
+
+  for(int i = 0; i < p->n; i++)
+  {
+    var_ratio[i][0] = (p->target_var[i][0] > 0.0f) ? p->source_var[mapio[i]][0] / p->target_var[i][0] : 0.0f;
+    var_ratio[i][1] = (p->target_var[i][1] > 0.0f) ? p->source_var[mapio[i]][1] / p->target_var[i][1] : 0.0f;
+  }
+
+  // the a/b grid only needs to be sampled again if the chroma transfer changed, not for equalization
+  const int ab_changed = !d->ab_lut_valid || d->n != p->n || memcmp(d->mapio, mapio, sizeof(mapio))
+                         || memcmp(d->var_ratio, var_ratio, sizeof(var_ratio))
+                         || memcmp(d->source_mean, p->source_mean, sizeof(float) * MAXN * 2)
+                         || memcmp(d->target_mean, p->target_mean, sizeof(float) * MAXN * 2);
+
+  d->flag = p->flag;
+  d->n = p->n;
+  d->equalization = p->equalization;
+  memcpy(d->source_ihist, p->source_ihist, sizeof(float) * HISTN);
+  memcpy(d->target_hist, p->target_hist, sizeof(int) * HISTN);
+  memcpy(d->source_mean, p->source_mean, sizeof(float) * MAXN * 2);
+  memcpy(d->target_mean, p->target_mean, sizeof(float) * MAXN * 2);
+  memcpy(d->mapio, mapio, sizeof(mapio));
+  memcpy(d->var_ratio, var_ratio, sizeof(var_ratio));
+
+  d->ab_lut_valid = (p->flag & HAS_TARGET) && (p->flag & HAS_SOURCE);
+  if(d->ab_lut_valid && ab_changed)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static) shared(d)
+#endif
+    for(int ib = 0; ib < AB_LUT_SIZE; ib++)
+      for(int ia = 0; ia < AB_LUT_SIZE; ia++)
+      {
+        const float Lab[3] = { 50.0f, AB_LUT_MIN + ia * AB_LUT_STEP, AB_LUT_MIN + ib * AB_LUT_STEP };
+        transfer_ab(d, Lab, d->ab_lut[AB_LUT_SIZE * ib + ia]);
+      }
+  }
 #ifdef HAVE_OPENCL
   if(d->equalization > 0.1f)
     piece->process_cl_ready = (piece->process_cl_ready && !(darktable.opencl->avoid_atomics));
@@ -843,7 +891,7 @@ static void acquire_target_button_pressed(GtkButton *button, dt_iop_module_t *se
 
 void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
-  piece->data = malloc(sizeof(dt_iop_colormapping_data_t));
+  piece->data = calloc(1, sizeof(dt_iop_colormapping_data_t));
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
@@ -53,6 +53,7 @@ typedef struct dt_iop_colorout_data_t
   float cmatrix[9];
   cmsHTRANSFORM *xform;
   float unbounded_coeffs[3][3]; // for extrapolation of shaper curves
+  dt_colorspaces_clut_t clut;   // xform sampled over Lab, if any
 } dt_iop_colorout_data_t;
 
 typedef struct dt_iop_colorout_global_data_t
@@ -441,6 +442,11 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 
     process_fastpath_apply_tonecurves(self, piece, ivoid, ovoid, roi_in, roi_out);
   }
+  else if(d->clut.table)
+  {
+    dt_colorspaces_clut_apply(&d->clut, (const float *)ivoid, (float *)ovoid,
+                              (size_t)roi_out->width * roi_out->height);
+  }
   else
   {
 // fprintf(stderr,"Using xform codepath\n");
@@ -515,6 +521,11 @@ void process_sse2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
 
     process_fastpath_apply_tonecurves(self, piece, ivoid, ovoid, roi_in, roi_out);
   }
+  else if(d->clut.table)
+  {
+    dt_colorspaces_clut_apply(&d->clut, (const float *)ivoid, (float *)ovoid,
+                              (size_t)roi_out->width * roi_out->height);
+  }
   else
   {
     // fprintf(stderr,"Using xform codepath\n");
@@ -571,6 +582,12 @@ static cmsHPROFILE _make_clipping_profile(cmsHPROFILE profile)
   return profile;
 }
 
+static void _clut_sample(const void *data, float *pixels, const int n)
+{
+  const dt_iop_colorout_data_t *const d = (const dt_iop_colorout_data_t *)data;
+  cmsDoTransform(d->xform, pixels, pixels, n);
+}
+
 void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe,
                    dt_dev_pixelpipe_iop_t *piece)
 {
@@ -600,6 +617,7 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_colorspaces_clut_cleanup(&d->clut);
   d->cmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -730,6 +748,16 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     }
   }
 
+  // profiles that can't be reduced to a matrix are lut based anyways, sample the transform once instead of
+  // running it for every pixel. softproofing, gamut check and the high quality export setting still
+  // go through lcms2 as these want it exact.
+  if(d->xform && d->mode == DT_PROFILE_NORMAL && !force_lcms2)
+  {
+    const int settings[1] = { out_intent };
+    const float min[3] = { 0.0f, -128.0f, -128.0f }, max[3] = { 100.0f, 128.0f, 128.0f };
+    dt_colorspaces_clut_init(&d->clut, &output, 1, settings, sizeof(settings), min, max, _clut_sample, d);
+  }
+
   if(out_type == DT_COLORSPACE_DISPLAY) pthread_rwlock_unlock(&darktable.color_profiles->xprofile_lock);
 
   // now try to initialize unbounded mode:
@@ -773,6 +801,7 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_colorspaces_clut_cleanup(&d->clut);
 
   free(piece->data);
   piece->data = NULL;
@@ -28,6 +28,9 @@
 #include <gtk/gtk.h>
 #include <math.h>
 #include <stdlib.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 DT_MODULE_INTROSPECTION(1, dt_iop_defringe_params_t)
 
@@ -45,7 +48,13 @@ typedef struct dt_iop_defringe_params_t
   dt_iop_defringe_mode_t op_mode;
 } dt_iop_defringe_params_t;
 
-typedef dt_iop_defringe_params_t dt_iop_defringe_data_t;
+typedef struct dt_iop_defringe_data_t
+{
+  float radius;
+  float thresh;
+  dt_iop_defringe_mode_t op_mode;
+  dt_gaussian_t *gauss; // kept for the next run as long as size and sigma stay the same
+} dt_iop_defringe_data_t;
 
 typedef struct dt_iop_defringe_gui_data_t
 {
@@ -152,10 +161,8 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
 
   const int radius = ceil(2.0 * ceilf(sigma));
 
-  // save the fibonacci lattices in them later
-  int *xy_avg = NULL;
-  int *xy_artifact = NULL;
-  int *xy_small = NULL;
+  // per thread row of the maximum edge chroma in the 3x3 neighbourhood
+  float *max9 = NULL;
 
   if(roi_out->width < 2 * radius + 1 || roi_out->height < 2 * radius + 1) goto ERROR_EXIT;
 
@@ -166,15 +173,19 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
   int width = roi_in->width;
   int height = roi_in->height;
 
-  dt_gaussian_t *gauss = NULL;
-  gauss = dt_gaussian_init(width, height, 4, Labmax, Labmin, sigma, order);
-  if(!gauss)
+  // the blur buffers only depend on size and sigma, so they survive from one run to the next (e.g. while
+  // tweaking the threshold)
+  if(!d->gauss || d->gauss->width != width || d->gauss->height != height || d->gauss->sigma != sigma)
+  {
+    dt_gaussian_free(d->gauss);
+    d->gauss = dt_gaussian_init(width, height, 4, Labmax, Labmin, sigma, order);
+  }
+  if(!d->gauss)
   {
     fprintf(stderr, "Error allocating memory for gaussian blur in: defringe module\n");
     goto ERROR_EXIT;
   }
-  dt_gaussian_blur_4c(gauss, in, out);
-  dt_gaussian_free(gauss);
+  dt_gaussian_blur_4c(d->gauss, in, out);
 
   int samples_wish = radius * radius;
   int sampleidx_avg;
@@ -214,37 +225,30 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
   // Pre-Compute Fibonacci Lattices
 
   // precompute all required fibonacci lattices:
-  if((xy_avg = malloc((size_t)2 * sizeof(int) * samples_avg)))
+  int xy_avg[2 * 144];
+  int xy_small[2 * 144];
+  for(int u = 0; u < samples_avg; u++) fib_latt(xy_avg + 2 * u, xy_avg + 2 * u + 1, avg_radius, u, sampleidx_avg);
+  for(int u = 0; u < samples_small; u++)
+    fib_latt(xy_small + 2 * u, xy_small + 2 * u + 1, small_radius, u, sampleidx_small);
+
+  // as buffer offsets, pixels further than ext_* away from the borders use these without clamping
+  ptrdiff_t off_avg[144], off_small[144];
+  int ext_avg = 0, ext_small = 0;
+  for(int u = 0; u < samples_avg; u++)
   {
-    int *tmp = xy_avg;
-    for(int u = 0; u < samples_avg; u++)
-    {
-      int dx, dy;
-      fib_latt(&dx, &dy, avg_radius, u, sampleidx_avg);
-      *tmp++ = dx;
-      *tmp++ = dy;
-    }
+    off_avg[u] = ((ptrdiff_t)xy_avg[2 * u + 1] * width + xy_avg[2 * u]) * ch;
+    ext_avg = MAX(ext_avg, MAX(abs(xy_avg[2 * u]), abs(xy_avg[2 * u + 1])));
   }
-  else
+  for(int u = 0; u < samples_small; u++)
   {
-    fprintf(stderr, "Error allocating memory for fibonacci lattice in: defringe module\n");
-    goto ERROR_EXIT;
+    off_small[u] = ((ptrdiff_t)xy_small[2 * u + 1] * width + xy_small[2 * u]) * ch;
+    ext_small = MAX(ext_small, MAX(abs(xy_small[2 * u]), abs(xy_small[2 * u + 1])));
   }
 
-  if((xy_small = malloc((size_t)2 * sizeof(int) * samples_small)))
-  {
-    int *tmp = xy_small;
-    for(int u = 0; u < samples_small; u++)
-    {
-      int dx, dy;
-      fib_latt(&dx, &dy, small_radius, u, sampleidx_small);
-      *tmp++ = dx;
-      *tmp++ = dy;
-    }
-  }
-  else
+  max9 = dt_alloc_align(64, sizeof(float) * width * dt_get_num_threads());
+  if(!max9)
   {
-    fprintf(stderr, "Error allocating memory for fibonacci lattice in: defringe module\n");
+    fprintf(stderr, "Error allocating memory for edge detection in: defringe module\n");
     goto ERROR_EXIT;
   }
 
@@ -254,20 +258,30 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
 #endif
   for(int v = 0; v < height; v++)
   {
+    float row_chroma = 0.0f;
     for(int t = 0; t < width; t++)
     {
+      const size_t k = ((size_t)v * width + t) * ch;
       // edge-detect on color channels
       // method: difference of original to gaussian blurred image:
-      float a = in[(size_t)v * width * ch + t * ch + 1] - out[(size_t)v * width * ch + t * ch + 1];
-      float b = in[(size_t)v * width * ch + t * ch + 2] - out[(size_t)v * width * ch + t * ch + 2];
-
-      float edge = (a * a + b * b); // range up to 2*(256)^2 -> approx. 0 to 131072
+#if defined(__SSE__)
+      __m128 diff = _mm_sub_ps(_mm_load_ps(in + k), _mm_load_ps(out + k));
+      diff = _mm_mul_ps(diff, diff);
+      const float edge = _mm_cvtss_f32(_mm_add_ss(_mm_shuffle_ps(diff, diff, _MM_SHUFFLE(1, 1, 1, 1)),
+                                                  _mm_shuffle_ps(diff, diff, _MM_SHUFFLE(2, 2, 2, 2))));
+#else
+      const float a = in[k + 1] - out[k + 1];
+      const float b = in[k + 2] - out[k + 2];
+
+      const float edge = (a * a + b * b); // range up to 2*(256)^2 -> approx. 0 to 131072
+#endif
 
       // save local edge chroma in out[.. +3] , this is later compared with threshold
-      out[(size_t)v * width * ch + t * ch + 3] = edge;
+      out[k + 3] = edge;
       // the average chroma of the edge-layer in the roi
-      if(MODE_GLOBAL_AVERAGE == d->op_mode) avg_edge_chroma += edge;
+      row_chroma += edge;
     }
+    if(MODE_GLOBAL_AVERAGE == d->op_mode) avg_edge_chroma += row_chroma;
   }
 
   float thresh;
@@ -286,47 +300,55 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
 #ifdef _OPENMP
 // dynamically/guided scheduled due to possible uneven edge-chroma distribution (thanks to rawtherapee code
 // for this hint!)
-#pragma omp parallel for default(none) shared(width, height, d, xy_small, xy_avg, xy_artifact)               \
-    firstprivate(thresh, avg_edge_chroma) schedule(guided, 32)
+#pragma omp parallel for default(none) shared(width, height, d, xy_small, xy_avg, off_small, off_avg, max9,   \
+                                              ext_small, ext_avg) firstprivate(thresh, avg_edge_chroma)        \
+    schedule(guided, 32)
 #endif
   for(int v = 0; v < height; v++)
   {
+    const float *const edge_m = out + (size_t)MAX(0, v - 1) * width * ch + 3;
+    const float *const edge_v = out + (size_t)v * width * ch + 3;
+    const float *const edge_p = out + (size_t)MIN(height - 1, v + 1) * width * ch + 3;
+
+    // maximum over the 3x3 neighbourhood, for the "region growing by 1 pixel" which reduces artifacts
+    float *const m = max9 + (size_t)width * dt_get_thread_num();
+    for(int t = 0; t < width; t++) m[t] = MAX(MAX(edge_m[t * ch], edge_v[t * ch]), edge_p[t * ch]);
+    float left = m[0];
     for(int t = 0; t < width; t++)
     {
+      const float right = m[MIN(width - 1, t + 1)];
+      const float center = m[t];
+      m[t] = MAX(MAX(left, center), right);
+      left = center;
+    }
+
+    for(int t = 0; t < width; t++)
+    {
+      const size_t k = ((size_t)v * width + t) * ch;
       float local_thresh = thresh;
       // think of compiler setting "-funswitch-loops" to maybe improve these things:
-      if(MODE_LOCAL_AVERAGE == d->op_mode && out[(size_t)v * width * ch + t * ch + 3] > thresh)
+      if(MODE_LOCAL_AVERAGE == d->op_mode && out[k + 3] > thresh)
       {
         float local_avg = 0.0;
         // use some and not all values from the neigbourhood to speed things up:
         const int *tmp = xy_avg;
-        for(int u = 0; u < samples_avg; u++)
-        {
-          int dx = *tmp++;
-          int dy = *tmp++;
-          int x = MAX(0, MIN(width - 1, t + dx));
-          int y = MAX(0, MIN(height - 1, v + dy));
-          local_avg += out[(size_t)y * width * ch + x * ch + 3];
-        }
+        if(t >= ext_avg && t < width - ext_avg && v >= ext_avg && v < height - ext_avg)
+          for(int u = 0; u < samples_avg; u++) local_avg += out[k + off_avg[u] + 3];
+        else
+          for(int u = 0; u < samples_avg; u++)
+          {
+            int dx = *tmp++;
+            int dy = *tmp++;
+            int x = MAX(0, MIN(width - 1, t + dx));
+            int y = MAX(0, MIN(height - 1, v + dy));
+            local_avg += out[(size_t)y * width * ch + x * ch + 3];
+          }
         avg_edge_chroma = fmax(0.01f, (float)local_avg / samples_avg);
         local_thresh = fmax(0.1f, 4.0 * d->thresh * avg_edge_chroma / MAGIC_THRESHOLD_COEFF);
       }
 
-      if(out[(size_t)v * width * ch + t * ch + 3] > local_thresh
-         // reduces artifacts ("region growing by 1 pixel"):
-         || out[(size_t)MAX(0, (v - 1)) * width * ch + MAX(0, (t - 1)) * ch + 3] > local_thresh
-         || out[(size_t)MAX(0, (v - 1)) * width * ch + t * ch + 3] > local_thresh
-         || out[(size_t)MAX(0, (v - 1)) * width * ch + MIN(width - 1, (t + 1)) * ch + 3] > local_thresh
-         || out[(size_t)v * width * ch + MAX(0, (t - 1)) * ch + 3] > local_thresh
-         || out[(size_t)v * width * ch + MIN(width - 1, (t + 1)) * ch + 3] > local_thresh
-         || out[(size_t)MIN(height - 1, (v + 1)) * width * ch + MAX(0, (t - 1)) * ch + 3] > local_thresh
-         || out[(size_t)MIN(height - 1, (v + 1)) * width * ch + t * ch + 3] > local_thresh
-         || out[(size_t)MIN(height - 1, (v + 1)) * width * ch + MIN(width - 1, (t + 1)) * ch + 3]
-            > local_thresh)
+      if(m[t] > local_thresh)
       {
-        float atot = 0, btot = 0;
-        float norm = 0;
-        float weight;
         // it seems better to use only some pixels from a larger window instead of all pixels from a smaller
         // window
         // we use a fibonacci lattice for that, samples amount need to be a fibonacci number, this can then be
@@ -335,17 +357,21 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
 
         // use some neighbourhood pixels for lowest chroma average
         const int *tmp = xy_small;
+        const int inner = (t >= ext_small && t < width - ext_small && v >= ext_small && v < height - ext_small);
+        float atot = 0, btot = 0;
+        float norm = 0;
         for(int u = 0; u < samples_small; u++)
         {
-          int dx = *tmp++;
-          int dy = *tmp++;
-          int x = MAX(0, MIN(width - 1, t + dx));
-          int y = MAX(0, MIN(height - 1, v + dy));
+          const int dx = *tmp++;
+          const int dy = *tmp++;
+          const size_t kk = inner ? k + off_small[u]
+                                  : ((size_t)MAX(0, MIN(height - 1, v + dy)) * width + MAX(0, MIN(width - 1, t + dx)))
+                                        * ch;
           // inverse chroma weighted average of neigbouring pixels inside window
           // also taking average edge chromaticity into account (either global or local average)
-          weight = 1.0 / (out[(size_t)y * width * ch + x * ch + 3] + avg_edge_chroma);
-          atot += weight * in[(size_t)y * width * ch + x * ch + 1];
-          btot += weight * in[(size_t)y * width * ch + x * ch + 2];
+          const float weight = 1.0f / (out[kk + 3] + avg_edge_chroma);
+          atot += weight * in[kk + 1];
+          btot += weight * in[kk + 2];
           norm += weight;
         }
         // here we could try using a "balance" between original and changed value, this could be used to
@@ -353,19 +379,19 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
         // but on first tries, results weren't very convincing, and there are blend settings available anyway
         // in dt
         // float balance = (out[v*width*ch +t*ch +3]-thresh)/out[v*width*ch +t*ch +3];
-        double a = (atot / norm); // *balance + in[v*width*ch + t*ch +1]*(1.0-balance);
-        double b = (btot / norm); // *balance + in[v*width*ch + t*ch +2]*(1.0-balance);
+        const float a = atot / norm; // *balance + in[v*width*ch + t*ch +1]*(1.0-balance);
+        const float b = btot / norm; // *balance + in[v*width*ch + t*ch +2]*(1.0-balance);
         // if (a < -128.0 || a > 127.0) CLIP(a,-128.0,127.0);
         // if (b < -128.0 || b > 127.0) CLIP(b,-128.0,127.0);
-        out[(size_t)v * width * ch + t * ch + 1] = a;
-        out[(size_t)v * width * ch + t * ch + 2] = b;
+        out[k + 1] = a;
+        out[k + 2] = b;
       }
       else
       {
-        out[(size_t)v * width * ch + t * ch + 1] = in[(size_t)v * width * ch + t * ch + 1];
-        out[(size_t)v * width * ch + t * ch + 2] = in[(size_t)v * width * ch + t * ch + 2];
+        out[k + 1] = in[k + 1];
+        out[k + 2] = in[k + 2];
       }
-      out[(size_t)v * width * ch + t * ch] = in[(size_t)v * width * ch + t * ch];
+      out[k] = in[k];
     }
   }
 
@@ -377,9 +403,31 @@ ERROR_EXIT:
   memcpy(o, i, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
 
 FINISH_PROCESS:
-  free(xy_artifact);
-  free(xy_small);
-  free(xy_avg);
+  dt_free_align(max9);
+}
+
+void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe,
+                   dt_dev_pixelpipe_iop_t *piece)
+{
+  dt_iop_defringe_params_t *p = (dt_iop_defringe_params_t *)p1;
+  dt_iop_defringe_data_t *d = (dt_iop_defringe_data_t *)piece->data;
+  d->radius = p->radius;
+  d->thresh = p->thresh;
+  d->op_mode = p->op_mode;
+}
+
+void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
+{
+  piece->data = calloc(1, sizeof(dt_iop_defringe_data_t));
+  self->commit_params(self, self->default_params, pipe, piece);
+}
+
+void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
+{
+  dt_iop_defringe_data_t *d = (dt_iop_defringe_data_t *)piece->data;
+  dt_gaussian_free(d->gauss);
+  free(piece->data);
+  piece->data = NULL;
 }
 
 void reload_defaults(dt_iop_module_t *module)
@@ -40,6 +40,9 @@
 #if defined(__SSE__)
 #include <xmmintrin.h>
 #endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 DT_MODULE_INTROSPECTION(3, dt_iop_demosaic_params_t)
 
@@ -142,6 +145,10 @@ typedef struct dt_iop_demosaic_data_t
   uint32_t yet_unused_data_specific_to_demosaicing_method;
   float median_thrs;
   double CAM_to_RGB[3][4];
+  // last amaze result of the full pipe, to only redo the newly visible parts when panning
+  float *amaze_cache;
+  dt_iop_roi_t amaze_cache_roi;
+  uint64_t amaze_cache_hash;
 } dt_iop_demosaic_data_t;
 
 void amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const float *const in,
@@ -573,13 +580,20 @@ static void xtrans_markesteijn_interpolate(float *out, const float *const in,
 
   // extra passes propagates out errors at edges, hence need more padding
   const int pad_tile = (passes == 1) ? 12 : 17;
+  // step through TSxTS cells of image, each tile overlapping the
+  // prior as interpolation needs a substantial border. all tiles
+  // are handed out to the threads one by one, so a thread finishing
+  // early just picks up the next one instead of a whole row of tiles.
+  const int tile_step = TS - (pad_tile*2);
+  const int tiles_x = (width + tile_step - 1) / tile_step;
+  const int tiles_y = (height + tile_step - 1) / tile_step;
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(sgrow, sgcol, allhex, out) schedule(dynamic)
 #endif
-  // step through TSxTS cells of image, each tile overlapping the
-  // prior as interpolation needs a substantial border
-  for(int top = -pad_tile; top < height - pad_tile; top += TS - (pad_tile*2))
+  for(int tile = 0; tile < tiles_x * tiles_y; tile++)
   {
+    const int top = -pad_tile + (tile / tiles_x) * tile_step;
+    const int left = -pad_tile + (tile % tiles_x) * tile_step;
     char *const buffer = all_buffers + dt_get_thread_num() * buffer_size;
     // rgb points to ndir TSxTS tiles of 3 channels (R, G, and B)
     float(*rgb)[TS][TS][3] = (float(*)[TS][TS][3])buffer;
@@ -599,383 +613,423 @@ static void xtrans_markesteijn_interpolate(float *out, const float *const in,
     uint8_t (*const homosum)[TS][TS] = (uint8_t(*)[TS][TS])(buffer + TS * TS * (ndir * 3) * sizeof(float)
                                                             + TS * TS * ndir * sizeof(uint8_t));
 
-    for(int left = -pad_tile; left < width - pad_tile; left += TS - (pad_tile*2))
-    {
-      int mrow = MIN(top + TS, height + pad_tile);
-      int mcol = MIN(left + TS, width + pad_tile);
+    int mrow = MIN(top + TS, height + pad_tile);
+    int mcol = MIN(left + TS, width + pad_tile);
 
-      // Copy current tile from in to image buffer. If border goes
-      // beyond edges of image, fill with mirrored/interpolated edges.
-      // The extra border avoids discontinuities at image edges.
-      for(int row = top; row < mrow; row++)
-        for(int col = left; col < mcol; col++)
+    // Copy current tile from in to image buffer. If border goes
+    // beyond edges of image, fill with mirrored/interpolated edges.
+    // The extra border avoids discontinuities at image edges.
+    for(int row = top; row < mrow; row++)
+      for(int col = left; col < mcol; col++)
+      {
+        float(*const pix) = rgb[0][row - top][col - left];
+        if((col >= 0) && (row >= 0) && (col < width) && (row < height))
         {
-          float(*const pix) = rgb[0][row - top][col - left];
-          if((col >= 0) && (row >= 0) && (col < width) && (row < height))
-          {
-            const int f = FCxtrans(row, col, roi_in, xtrans);
-            for(int c = 0; c < 3; c++) pix[c] = (c == f) ? in[roi_in->width * row + col] : 0.f;
-          }
-          else
-          {
-            // mirror a border pixel if beyond image edge
-            const int c = FCxtrans(row, col, roi_in, xtrans);
-            for(int cc = 0; cc < 3; cc++)
-              if(cc != c)
-                pix[cc] = 0.0f;
+          const int f = FCxtrans(row, col, roi_in, xtrans);
+          for(int c = 0; c < 3; c++) pix[c] = (c == f) ? in[roi_in->width * row + col] : 0.f;
+        }
+        else
+        {
+          // mirror a border pixel if beyond image edge
+          const int c = FCxtrans(row, col, roi_in, xtrans);
+          for(int cc = 0; cc < 3; cc++)
+            if(cc != c)
+              pix[cc] = 0.0f;
+            else
+            {
+#define TRANSLATE(n, size) ((n >= size) ? (2 * size - n - 2) : abs(n))
+              const int cy = TRANSLATE(row, height), cx = TRANSLATE(col, width);
+              if(c == FCxtrans(cy, cx, roi_in, xtrans))
+                pix[c] = in[roi_in->width * cy + cx];
               else
               {
-#define TRANSLATE(n, size) ((n >= size) ? (2 * size - n - 2) : abs(n))
-                const int cy = TRANSLATE(row, height), cx = TRANSLATE(col, width);
-                if(c == FCxtrans(cy, cx, roi_in, xtrans))
-                  pix[c] = in[roi_in->width * cy + cx];
-                else
-                {
-                  // interpolate if mirror pixel is a different color
-                  float sum = 0.0f;
-                  uint8_t count = 0;
-                  for(int y = row - 1; y <= row + 1; y++)
-                    for(int x = col - 1; x <= col + 1; x++)
+                // interpolate if mirror pixel is a different color
+                float sum = 0.0f;
+                uint8_t count = 0;
+                for(int y = row - 1; y <= row + 1; y++)
+                  for(int x = col - 1; x <= col + 1; x++)
+                  {
+                    const int yy = TRANSLATE(y, height), xx = TRANSLATE(x, width);
+                    const int ff = FCxtrans(yy, xx, roi_in, xtrans);
+                    if(ff == c)
                     {
-                      const int yy = TRANSLATE(y, height), xx = TRANSLATE(x, width);
-                      const int ff = FCxtrans(yy, xx, roi_in, xtrans);
-                      if(ff == c)
-                      {
-                        sum += in[roi_in->width * yy + xx];
-                        count++;
-                      }
+                      sum += in[roi_in->width * yy + xx];
+                      count++;
                     }
-                  pix[c] = sum / count;
-                }
+                  }
+                pix[c] = sum / count;
               }
-          }
+            }
         }
+      }
+
+    // duplicate rgb[0] to rgb[1], rgb[2], and rgb[3]
+    for(int c = 1; c <= 3; c++) memcpy(rgb[c], rgb[0], sizeof(*rgb));
 
-      // duplicate rgb[0] to rgb[1], rgb[2], and rgb[3]
-      for(int c = 1; c <= 3; c++) memcpy(rgb[c], rgb[0], sizeof(*rgb));
-
-      // note that successive calculations are inset within the tile
-      // so as to give enough border data, and there needs to be a 6
-      // pixel border initially to allow allhex to find neighboring
-      // pixels
-
-      /* Set green1 and green3 to the minimum and maximum allowed values:   */
-      // Run through each red/blue or blue/red pair, setting their g1
-      // and g3 values to the min/max of green pixels surrounding the
-      // pair. Use a 3 pixel border as gmin/gmax is used by
-      // interpolate green which has a 3 pixel border.
-      const int pad_g1_g3 = 3;
-      for(int row = top + pad_g1_g3; row < mrow - pad_g1_g3; row++)
+    // note that successive calculations are inset within the tile
+    // so as to give enough border data, and there needs to be a 6
+    // pixel border initially to allow allhex to find neighboring
+    // pixels
+
+    /* Set green1 and green3 to the minimum and maximum allowed values:   */
+    // Run through each red/blue or blue/red pair, setting their g1
+    // and g3 values to the min/max of green pixels surrounding the
+    // pair. Use a 3 pixel border as gmin/gmax is used by
+    // interpolate green which has a 3 pixel border.
+    const int pad_g1_g3 = 3;
+    for(int row = top + pad_g1_g3; row < mrow - pad_g1_g3; row++)
+    {
+      // setting max to 0.0f signifies that this is a new pair, which
+      // requires a new min/max calculation of its neighboring greens
+      float min = FLT_MAX, max = 0.0f;
+      for(int col = left + pad_g1_g3; col < mcol - pad_g1_g3; col++)
       {
-        // setting max to 0.0f signifies that this is a new pair, which
-        // requires a new min/max calculation of its neighboring greens
-        float min = FLT_MAX, max = 0.0f;
-        for(int col = left + pad_g1_g3; col < mcol - pad_g1_g3; col++)
+        // if in row of horizontal red & blue pairs (or processing
+        // vertical red & blue pairs near image bottom), reset min/max
+        // between each pair
+        if(FCxtrans(row, col, roi_in, xtrans) == 1)
         {
-          // if in row of horizontal red & blue pairs (or processing
-          // vertical red & blue pairs near image bottom), reset min/max
-          // between each pair
-          if(FCxtrans(row, col, roi_in, xtrans) == 1)
-          {
-            min = FLT_MAX, max = 0.0f;
-            continue;
-          }
-          // if at start of red & blue pair, calculate min/max of green
-          // pixels surrounding it; note that while normally using == to
-          // compare floats is suspect, here the check is if 0.0f has
-          // explicitly been assigned to max (which signifies a new
-          // red/blue pair)
-          if(max == 0.0f)
-          {
-            float (*const pix)[3] = &rgb[0][row - top][col - left];
-            const short *const hex = hexmap(row,col,allhex);
-            for(int c = 0; c < 6; c++)
-            {
-              const float val = pix[hex[c]][1];
-              if(min > val) min = val;
-              if(max < val) max = val;
-            }
-          }
-          gmin[row - top][col - left] = min;
-          gmax[row - top][col - left] = max;
-          // handle vertical red/blue pairs
-          switch((row - sgrow) % 3)
-          {
-            // hop down a row to second pixel in vertical pair
-            case 1:
-              if(row < mrow - 4) row++, col--;
-              break;
-            // then if not done with the row hop up and right to next
-            // vertical red/blue pair, resetting min/max
-            case 2:
-              min = FLT_MAX, max = 0.0f;
-              if((col += 2) < mcol - 4 && row > top + 3) row--;
-          }
+          min = FLT_MAX, max = 0.0f;
+          continue;
         }
-      }
-
-      /* Interpolate green horizontally, vertically, and along both diagonals: */
-      // need a 3 pixel border here as 3*hex[] can have a 3 unit offset
-      const int pad_g_interp = 3;
-      for(int row = top + pad_g_interp; row < mrow - pad_g_interp; row++)
-        for(int col = left + pad_g_interp; col < mcol - pad_g_interp; col++)
+        // if at start of red & blue pair, calculate min/max of green
+        // pixels surrounding it; note that while normally using == to
+        // compare floats is suspect, here the check is if 0.0f has
+        // explicitly been assigned to max (which signifies a new
+        // red/blue pair)
+        if(max == 0.0f)
         {
-          float color[8];
-          int f = FCxtrans(row, col, roi_in, xtrans);
-          if(f == 1) continue;
           float (*const pix)[3] = &rgb[0][row - top][col - left];
           const short *const hex = hexmap(row,col,allhex);
-          // TODO: these constants come from integer math constants in
-          // dcraw -- calculate them instead from interpolation math
-          color[0] = 0.6796875f * (pix[hex[1]][1] + pix[hex[0]][1])
-                     - 0.1796875f * (pix[2 * hex[1]][1] + pix[2 * hex[0]][1]);
-          color[1] = 0.87109375f * pix[hex[3]][1] + pix[hex[2]][1] * 0.13f
-                     + 0.359375f * (pix[0][f] - pix[-hex[2]][f]);
-          for(int c = 0; c < 2; c++)
-            color[2 + c] = 0.640625f * pix[hex[4 + c]][1] + 0.359375f * pix[-2 * hex[4 + c]][1]
-                           + 0.12890625f * (2 * pix[0][f] - pix[3 * hex[4 + c]][f] - pix[-3 * hex[4 + c]][f]);
-          for(int c = 0; c < 4; c++)
-            rgb[c ^ !((row - sgrow) % 3)][row - top][col - left][1]
-                = CLAMPS(color[c], gmin[row - top][col - left], gmax[row - top][col - left]);
+          for(int c = 0; c < 6; c++)
+          {
+            const float val = pix[hex[c]][1];
+            if(min > val) min = val;
+            if(max < val) max = val;
+          }
         }
-
-      for(int pass = 0; pass < passes; pass++)
-      {
-        if(pass == 1)
+        gmin[row - top][col - left] = min;
+        gmax[row - top][col - left] = max;
+        // handle vertical red/blue pairs
+        switch((row - sgrow) % 3)
         {
-          // if on second pass, copy rgb[0] to [3] into rgb[4] to [7],
-          // and process that second set of buffers
-          memcpy(rgb + 4, rgb, (size_t)4 * sizeof(*rgb));
-          rgb += 4;
+          // hop down a row to second pixel in vertical pair
+          case 1:
+            if(row < mrow - 4) row++, col--;
+            break;
+          // then if not done with the row hop up and right to next
+          // vertical red/blue pair, resetting min/max
+          case 2:
+            min = FLT_MAX, max = 0.0f;
+            if((col += 2) < mcol - 4 && row > top + 3) row--;
         }
+      }
+    }
 
-        /* Recalculate green from interpolated values of closer pixels: */
-        if(pass)
-        {
-          const int pad_g_recalc = 6;
-          for(int row = top + pad_g_recalc; row < mrow - pad_g_recalc; row++)
-            for(int col = left + pad_g_recalc; col < mcol - pad_g_recalc; col++)
-            {
-              int f = FCxtrans(row, col, roi_in, xtrans);
-              if(f == 1) continue;
-              const short *const hex = hexmap(row,col,allhex);
-              for(int d = 3; d < 6; d++)
-              {
-                float(*rfx)[3] = &rgb[(d - 2) ^ !((row - sgrow) % 3)][row - top][col - left];
-                float val = rfx[-2 * hex[d]][1] + 2 * rfx[hex[d]][1] - rfx[-2 * hex[d]][f]
-                            - 2 * rfx[hex[d]][f] + 3 * rfx[0][f];
-                rfx[0][1] = CLAMPS(val / 3.0f, gmin[row - top][col - left], gmax[row - top][col - left]);
-              }
-            }
-        }
+    /* Interpolate green horizontally, vertically, and along both diagonals: */
+    // need a 3 pixel border here as 3*hex[] can have a 3 unit offset
+    const int pad_g_interp = 3;
+    for(int row = top + pad_g_interp; row < mrow - pad_g_interp; row++)
+      for(int col = left + pad_g_interp; col < mcol - pad_g_interp; col++)
+      {
+        float color[8];
+        int f = FCxtrans(row, col, roi_in, xtrans);
+        if(f == 1) continue;
+        float (*const pix)[3] = &rgb[0][row - top][col - left];
+        const short *const hex = hexmap(row,col,allhex);
+        // TODO: these constants come from integer math constants in
+        // dcraw -- calculate them instead from interpolation math
+        color[0] = 0.6796875f * (pix[hex[1]][1] + pix[hex[0]][1])
+                   - 0.1796875f * (pix[2 * hex[1]][1] + pix[2 * hex[0]][1]);
+        color[1] = 0.87109375f * pix[hex[3]][1] + pix[hex[2]][1] * 0.13f
+                   + 0.359375f * (pix[0][f] - pix[-hex[2]][f]);
+        for(int c = 0; c < 2; c++)
+          color[2 + c] = 0.640625f * pix[hex[4 + c]][1] + 0.359375f * pix[-2 * hex[4 + c]][1]
+                         + 0.12890625f * (2 * pix[0][f] - pix[3 * hex[4 + c]][f] - pix[-3 * hex[4 + c]][f]);
+        for(int c = 0; c < 4; c++)
+          rgb[c ^ !((row - sgrow) % 3)][row - top][col - left][1]
+              = CLAMPS(color[c], gmin[row - top][col - left], gmax[row - top][col - left]);
+      }
 
-        /* Interpolate red and blue values for solitary green pixels:   */
-        const int pad_rb_g = (passes == 1) ? 6 : 5;
-        for(int row = (top - sgrow + pad_rb_g + 2) / 3 * 3 + sgrow; row < mrow - pad_rb_g; row += 3)
-          for(int col = (left - sgcol + pad_rb_g + 2) / 3 * 3 + sgcol; col < mcol - pad_rb_g; col += 3)
+    for(int pass = 0; pass < passes; pass++)
+    {
+      if(pass == 1)
+      {
+        // if on second pass, copy rgb[0] to [3] into rgb[4] to [7],
+        // and process that second set of buffers
+        memcpy(rgb + 4, rgb, (size_t)4 * sizeof(*rgb));
+        rgb += 4;
+      }
+
+      /* Recalculate green from interpolated values of closer pixels: */
+      if(pass)
+      {
+        const int pad_g_recalc = 6;
+        for(int row = top + pad_g_recalc; row < mrow - pad_g_recalc; row++)
+          for(int col = left + pad_g_recalc; col < mcol - pad_g_recalc; col++)
           {
-            float(*rfx)[3] = &rgb[0][row - top][col - left];
-            int h = FCxtrans(row, col + 1, roi_in, xtrans);
-            float diff[6] = { 0.0f };
-            // interplated color: first index is red/blue, second is
-            // pass, is double actual result
-            float color[2][6];
-            // Six passes, alternating hori/vert interp (i),
-            // starting with R or B (h) depending on which is closest.
-            // Passes 0,1 to rgb[0], rgb[1] of hori/vert interp. Pass
-            // 3,5 to rgb[2], rgb[3] of best of interp hori/vert
-            // results. Each pass which outputs moves on to the next
-            // rgb[] for input of interp greens.
-            for(int i = 1, d = 0; d < 6; d++, i ^= TS ^ 1, h ^= 2)
+            int f = FCxtrans(row, col, roi_in, xtrans);
+            if(f == 1) continue;
+            const short *const hex = hexmap(row,col,allhex);
+            for(int d = 3; d < 6; d++)
             {
-              // look 1 and 2 pixels distance from solitary green to
-              // red then blue or blue then red
-              for(int c = 0; c < 2; c++, h ^= 2)
-              {
-                // rate of change in greens between current pixel and
-                // interpolated pixels 1 or 2 distant: a quick
-                // derivative which will be divided by two later to be
-                // rate of luminance change for red/blue between known
-                // red/blue neighbors and the current unknown pixel
-                float g = 2 * rfx[0][1] - rfx[i << c][1] - rfx[-(i << c)][1];
-                // color is halved before being stored in rgb, hence
-                // this becomes green rate of change plus the average
-                // of the near red or blue pixels on current axis
-                color[h != 0][d] = g + rfx[i << c][h] + rfx[-(i << c)][h];
-                // Note that diff will become the slope for both red
-                // and blue differentials in the current direction.
-                // For 2nd and 3rd hori+vert passes, create a sum of
-                // steepness for both cardinal directions.
-                if(d > 1)
-                  diff[d] += SQR(rfx[i << c][1] - rfx[-(i << c)][1] - rfx[i << c][h] + rfx[-(i << c)][h])
-                             + SQR(g);
-              }
-              if((d < 2) || (d & 1))
-              { // output for passes 0, 1, 3, 5
-                // for 0, 1 just use hori/vert, for 3, 5 use best of x/y dir
-                const int d_out = d - ((d > 1) && (diff[d-1] < diff[d]));
-                rfx[0][0] = color[0][d_out] / 2.f;
-                rfx[0][2] = color[1][d_out] / 2.f;
-                rfx += TS * TS;
-              }
+              float(*rfx)[3] = &rgb[(d - 2) ^ !((row - sgrow) % 3)][row - top][col - left];
+              float val = rfx[-2 * hex[d]][1] + 2 * rfx[hex[d]][1] - rfx[-2 * hex[d]][f]
+                          - 2 * rfx[hex[d]][f] + 3 * rfx[0][f];
+              rfx[0][1] = CLAMPS(val / 3.0f, gmin[row - top][col - left], gmax[row - top][col - left]);
             }
           }
+      }
 
-        /* Interpolate red for blue pixels and vice versa:              */
-        const int pad_rb_br = (passes == 1) ? 6 : 5;
-        for(int row = top + pad_rb_br; row < mrow - pad_rb_br; row++)
-          for(int col = left + pad_rb_br; col < mcol - pad_rb_br; col++)
+      /* Interpolate red and blue values for solitary green pixels:   */
+      const int pad_rb_g = (passes == 1) ? 6 : 5;
+      for(int row = (top - sgrow + pad_rb_g + 2) / 3 * 3 + sgrow; row < mrow - pad_rb_g; row += 3)
+        for(int col = (left - sgcol + pad_rb_g + 2) / 3 * 3 + sgcol; col < mcol - pad_rb_g; col += 3)
+        {
+          float(*rfx)[3] = &rgb[0][row - top][col - left];
+          int h = FCxtrans(row, col + 1, roi_in, xtrans);
+          float diff[6] = { 0.0f };
+          // interplated color: first index is red/blue, second is
+          // pass, is double actual result
+          float color[2][6];
+          // Six passes, alternating hori/vert interp (i),
+          // starting with R or B (h) depending on which is closest.
+          // Passes 0,1 to rgb[0], rgb[1] of hori/vert interp. Pass
+          // 3,5 to rgb[2], rgb[3] of best of interp hori/vert
+          // results. Each pass which outputs moves on to the next
+          // rgb[] for input of interp greens.
+          for(int i = 1, d = 0; d < 6; d++, i ^= TS ^ 1, h ^= 2)
           {
-            int f = 2 - FCxtrans(row, col, roi_in, xtrans);
-            if(f == 1) continue;
-            float(*rfx)[3] = &rgb[0][row - top][col - left];
-            int c = (row - sgrow) % 3 ? TS : 1;
-            int h = 3 * (c ^ TS ^ 1);
-            for(int d = 0; d < 4; d++, rfx += TS * TS)
+            // look 1 and 2 pixels distance from solitary green to
+            // red then blue or blue then red
+            for(int c = 0; c < 2; c++, h ^= 2)
             {
-              int i = d > 1 || ((d ^ c) & 1) ||
-                ((fabsf(rfx[0][1]-rfx[c][1]) + fabsf(rfx[0][1]-rfx[-c][1])) <
-                 2.f*(fabsf(rfx[0][1]-rfx[h][1]) + fabsf(rfx[0][1]-rfx[-h][1]))) ? c:h;
-              rfx[0][f] = (rfx[i][f] + rfx[-i][f] + 2.f * rfx[0][1] - rfx[i][1] - rfx[-i][1]) / 2.f;
+              // rate of change in greens between current pixel and
+              // interpolated pixels 1 or 2 distant: a quick
+              // derivative which will be divided by two later to be
+              // rate of luminance change for red/blue between known
+              // red/blue neighbors and the current unknown pixel
+              float g = 2 * rfx[0][1] - rfx[i << c][1] - rfx[-(i << c)][1];
+              // color is halved before being stored in rgb, hence
+              // this becomes green rate of change plus the average
+              // of the near red or blue pixels on current axis
+              color[h != 0][d] = g + rfx[i << c][h] + rfx[-(i << c)][h];
+              // Note that diff will become the slope for both red
+              // and blue differentials in the current direction.
+              // For 2nd and 3rd hori+vert passes, create a sum of
+              // steepness for both cardinal directions.
+              if(d > 1)
+                diff[d] += SQR(rfx[i << c][1] - rfx[-(i << c)][1] - rfx[i << c][h] + rfx[-(i << c)][h])
+                           + SQR(g);
+            }
+            if((d < 2) || (d & 1))
+            { // output for passes 0, 1, 3, 5
+              // for 0, 1 just use hori/vert, for 3, 5 use best of x/y dir
+              const int d_out = d - ((d > 1) && (diff[d-1] < diff[d]));
+              rfx[0][0] = color[0][d_out] / 2.f;
+              rfx[0][2] = color[1][d_out] / 2.f;
+              rfx += TS * TS;
             }
           }
+        }
 
-        /* Fill in red and blue for 2x2 blocks of green:                */
-        const int pad_g22 = (passes == 1) ? 8 : 4;
-        for(int row = top + pad_g22; row < mrow - pad_g22; row++)
-          if((row - sgrow) % 3)
-            for(int col = left + pad_g22; col < mcol - pad_g22; col++)
-              if((col - sgcol) % 3)
-              {
-                float(*rfx)[3] = &rgb[0][row - top][col - left];
-                const short *const hex = hexmap(row,col,allhex);
-                for(int d = 0; d < ndir; d += 2, rfx += TS * TS)
-                  if(hex[d] + hex[d + 1])
-                  {
-                    float g = 3.f * rfx[0][1] - 2.f * rfx[hex[d]][1] - rfx[hex[d + 1]][1];
-                    for(int c = 0; c < 4; c += 2)
-                      rfx[0][c] = (g + 2.f * rfx[hex[d]][c] + rfx[hex[d + 1]][c]) / 3.f;
-                  }
-                  else
-                  {
-                    float g = 2.f * rfx[0][1] - rfx[hex[d]][1] - rfx[hex[d + 1]][1];
-                    for(int c = 0; c < 4; c += 2)
-                      rfx[0][c] = (g + rfx[hex[d]][c] + rfx[hex[d + 1]][c]) / 2.f;
-                  }
-              }
-      } // end of multipass loop
-
-      // jump back to the first set of rgb buffers (this is a nop
-      // unless on the second pass)
-      rgb = (float(*)[TS][TS][3])buffer;
-      // from here on out, mainly are working within the current tile
-      // rather than in reference to the image, so don't offset
-      // mrow/mcol by top/left of tile
-      mrow -= top;
-      mcol -= left;
-
-      /* Convert to perceptual colorspace and differentiate in all directions:  */
-      // Original dcraw algorithm uses CIELab as perceptual space
-      // (presumably coming from original AHD) and converts taking
-      // camera matrix into account. Now use YPbPr which requires much
-      // less code and is nearly indistinguishable. It assumes the
-      // camera RGB is roughly linear.
-      for(int d = 0; d < ndir; d++)
-      {
-        const int pad_yuv = (passes == 1) ? 8 : 13;
-        for(int row = pad_yuv; row < mrow - pad_yuv; row++)
-          for(int col = pad_yuv; col < mcol - pad_yuv; col++)
+      /* Interpolate red for blue pixels and vice versa:              */
+      const int pad_rb_br = (passes == 1) ? 6 : 5;
+      for(int row = top + pad_rb_br; row < mrow - pad_rb_br; row++)
+        for(int col = left + pad_rb_br; col < mcol - pad_rb_br; col++)
+        {
+          int f = 2 - FCxtrans(row, col, roi_in, xtrans);
+          if(f == 1) continue;
+          float(*rfx)[3] = &rgb[0][row - top][col - left];
+          int c = (row - sgrow) % 3 ? TS : 1;
+          int h = 3 * (c ^ TS ^ 1);
+          for(int d = 0; d < 4; d++, rfx += TS * TS)
           {
-            float *rx = rgb[d][row][col];
-            // use ITU-R BT.2020 YPbPr, which is great, but could use
-            // a better/simpler choice? note that imageop.h provides
-            // dt_iop_RGB_to_YCbCr which uses Rec. 601 conversion,
-            // which appears less good with specular highlights
-            float y = 0.2627f * rx[0] + 0.6780f * rx[1] + 0.0593f * rx[2];
-            yuv[0][row][col] = y;
-            yuv[1][row][col] = (rx[2] - y) * 0.56433f;
-            yuv[2][row][col] = (rx[0] - y) * 0.67815f;
+            int i = d > 1 || ((d ^ c) & 1) ||
+              ((fabsf(rfx[0][1]-rfx[c][1]) + fabsf(rfx[0][1]-rfx[-c][1])) <
+               2.f*(fabsf(rfx[0][1]-rfx[h][1]) + fabsf(rfx[0][1]-rfx[-h][1]))) ? c:h;
+            rfx[0][f] = (rfx[i][f] + rfx[-i][f] + 2.f * rfx[0][1] - rfx[i][1] - rfx[-i][1]) / 2.f;
           }
-        // Note that f can offset by a column (-1 or +1) and by a row
-        // (-TS or TS). The row-wise offsets cause the undefined
-        // behavior sanitizer to warn of an out of bounds index, but
-        // as yfx is multi-dimensional and there is sufficient
-        // padding, that is not actually so.
-        const int f = dir[d & 3];
-        const int pad_drv = (passes == 1) ? 9 : 14;
-        for(int row = pad_drv; row < mrow - pad_drv; row++)
-          for(int col = pad_drv; col < mcol - pad_drv; col++)
+        }
+
+      /* Fill in red and blue for 2x2 blocks of green:                */
+      const int pad_g22 = (passes == 1) ? 8 : 4;
+      for(int row = top + pad_g22; row < mrow - pad_g22; row++)
+        if((row - sgrow) % 3)
+          for(int col = left + pad_g22; col < mcol - pad_g22; col++)
+            if((col - sgcol) % 3)
+            {
+              float(*rfx)[3] = &rgb[0][row - top][col - left];
+              const short *const hex = hexmap(row,col,allhex);
+              for(int d = 0; d < ndir; d += 2, rfx += TS * TS)
+                if(hex[d] + hex[d + 1])
+                {
+                  float g = 3.f * rfx[0][1] - 2.f * rfx[hex[d]][1] - rfx[hex[d + 1]][1];
+                  for(int c = 0; c < 4; c += 2)
+                    rfx[0][c] = (g + 2.f * rfx[hex[d]][c] + rfx[hex[d + 1]][c]) / 3.f;
+                }
+                else
+                {
+                  float g = 2.f * rfx[0][1] - rfx[hex[d]][1] - rfx[hex[d + 1]][1];
+                  for(int c = 0; c < 4; c += 2)
+                    rfx[0][c] = (g + rfx[hex[d]][c] + rfx[hex[d + 1]][c]) / 2.f;
+                }
+            }
+    } // end of multipass loop
+
+    // jump back to the first set of rgb buffers (this is a nop
+    // unless on the second pass)
+    rgb = (float(*)[TS][TS][3])buffer;
+    // from here on out, mainly are working within the current tile
+    // rather than in reference to the image, so don't offset
+    // mrow/mcol by top/left of tile
+    mrow -= top;
+    mcol -= left;
+
+    /* Convert to perceptual colorspace and differentiate in all directions:  */
+    // Original dcraw algorithm uses CIELab as perceptual space
+    // (presumably coming from original AHD) and converts taking
+    // camera matrix into account. Now use YPbPr which requires much
+    // less code and is nearly indistinguishable. It assumes the
+    // camera RGB is roughly linear.
+    for(int d = 0; d < ndir; d++)
+    {
+      const int pad_yuv = (passes == 1) ? 8 : 13;
+      for(int row = pad_yuv; row < mrow - pad_yuv; row++)
+        for(int col = pad_yuv; col < mcol - pad_yuv; col++)
+        {
+          float *rx = rgb[d][row][col];
+          // use ITU-R BT.2020 YPbPr, which is great, but could use
+          // a better/simpler choice? note that imageop.h provides
+          // dt_iop_RGB_to_YCbCr which uses Rec. 601 conversion,
+          // which appears less good with specular highlights
+          float y = 0.2627f * rx[0] + 0.6780f * rx[1] + 0.0593f * rx[2];
+          yuv[0][row][col] = y;
+          yuv[1][row][col] = (rx[2] - y) * 0.56433f;
+          yuv[2][row][col] = (rx[0] - y) * 0.67815f;
+        }
+      // Note that f can offset by a column (-1 or +1) and by a row
+      // (-TS or TS). The row-wise offsets cause the undefined
+      // behavior sanitizer to warn of an out of bounds index, but
+      // as yfx is multi-dimensional and there is sufficient
+      // padding, that is not actually so.
+      const int f = dir[d & 3];
+      const int pad_drv = (passes == 1) ? 9 : 14;
+      for(int row = pad_drv; row < mrow - pad_drv; row++)
+      {
+        int col = pad_drv;
+#if defined(__SSE2__)
+        // yuv is stored planar, so four neighbouring columns are done at once
+        const __m128 two = _mm_set1_ps(2.0f);
+        for(; col < mcol - pad_drv - 3; col += 4)
+        {
+          __m128 sum = _mm_setzero_ps();
+          for(int c = 0; c < 3; c++)
           {
-            float(*yfx)[TS][TS] = (float(*)[TS][TS]) & yuv[0][row][col];
-            drv[d][row][col] = SQR(2 * yfx[0][0][0] - yfx[0][0][f] - yfx[0][0][-f])
-                               + SQR(2 * yfx[1][0][0] - yfx[1][0][f] - yfx[1][0][-f])
-                               + SQR(2 * yfx[2][0][0] - yfx[2][0][f] - yfx[2][0][-f]);
+            const float *const yfx = &yuv[c][row][col];
+            const __m128 v = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(two, _mm_loadu_ps(yfx)), _mm_loadu_ps(yfx + f)),
+                                        _mm_loadu_ps(yfx - f));
+            sum = c ? _mm_add_ps(sum, _mm_mul_ps(v, v)) : _mm_mul_ps(v, v);
           }
+          _mm_storeu_ps(&drv[d][row][col], sum);
+        }
+#endif
+        for(; col < mcol - pad_drv; col++)
+        {
+          float(*yfx)[TS][TS] = (float(*)[TS][TS]) & yuv[0][row][col];
+          drv[d][row][col] = SQR(2 * yfx[0][0][0] - yfx[0][0][f] - yfx[0][0][-f])
+                             + SQR(2 * yfx[1][0][0] - yfx[1][0][f] - yfx[1][0][-f])
+                             + SQR(2 * yfx[2][0][0] - yfx[2][0][f] - yfx[2][0][-f]);
+        }
       }
+    }
 
-      /* Build homogeneity maps from the derivatives:                   */
-      memset(homo, 0, (size_t)ndir * TS * TS * sizeof(uint8_t));
-      const int pad_homo = (passes == 1) ? 10 : 15;
-      for(int row = pad_homo; row < mrow - pad_homo; row++)
-        for(int col = pad_homo; col < mcol - pad_homo; col++)
+    /* Build homogeneity maps from the derivatives:                   */
+    memset(homo, 0, (size_t)ndir * TS * TS * sizeof(uint8_t));
+    const int pad_homo = (passes == 1) ? 10 : 15;
+    for(int row = pad_homo; row < mrow - pad_homo; row++)
+    {
+      int col = pad_homo;
+#if defined(__SSE2__)
+      // count the neighbours below the threshold for four pixels at once,
+      // a compare yields -1 in every lane which passes
+      for(; col < mcol - pad_homo - 3; col += 4)
+      {
+        __m128 tr = _mm_set1_ps(FLT_MAX);
+        for(int d = 0; d < ndir; d++) tr = _mm_min_ps(_mm_loadu_ps(&drv[d][row][col]), tr);
+        tr = _mm_mul_ps(tr, _mm_set1_ps(8.0f));
+        for(int d = 0; d < ndir; d++)
         {
-          float tr = FLT_MAX;
-          for(int d = 0; d < ndir; d++)
-            if(tr > drv[d][row][col]) tr = drv[d][row][col];
-          tr *= 8;
-          for(int d = 0; d < ndir; d++)
-            for(int v = -1; v <= 1; v++)
-              for(int h = -1; h <= 1; h++) homo[d][row][col] += ((drv[d][row + v][col + h] <= tr) ? 1 : 0);
+          __m128i count = _mm_setzero_si128();
+          for(int v = -1; v <= 1; v++)
+            for(int h = -1; h <= 1; h++)
+              count = _mm_sub_epi32(count,
+                                    _mm_castps_si128(_mm_cmple_ps(_mm_loadu_ps(&drv[d][row + v][col + h]), tr)));
+          int32_t c[4] __attribute__((aligned(16)));
+          _mm_store_si128((__m128i *)c, count);
+          for(int k = 0; k < 4; k++) homo[d][row][col + k] = c[k];
         }
+      }
+#endif
+      for(; col < mcol - pad_homo; col++)
+      {
+        float tr = FLT_MAX;
+        for(int d = 0; d < ndir; d++)
+          if(tr > drv[d][row][col]) tr = drv[d][row][col];
+        tr *= 8;
+        for(int d = 0; d < ndir; d++)
+          for(int v = -1; v <= 1; v++)
+            for(int h = -1; h <= 1; h++) homo[d][row][col] += ((drv[d][row + v][col + h] <= tr) ? 1 : 0);
+      }
+    }
 
-      /* Build 5x5 sum of homogeneity maps for each pixel & direction */
-      for(int d = 0; d < ndir; d++)
-        for(int row = pad_tile; row < mrow - pad_tile; row++)
+    /* Build 5x5 sum of homogeneity maps for each pixel & direction */
+    for(int d = 0; d < ndir; d++)
+      for(int row = pad_tile; row < mrow - pad_tile; row++)
+      {
+        // start before first column where homo[d][row][col+2] != 0,
+        // so can know v5sum and homosum[d][row][col] will be 0
+        int col = pad_tile-5;
+        uint8_t v5sum[5] = { 0 };
+        homosum[d][row][col] = 0;
+        // calculate by rolling through column sums
+        for(col++; col < mcol - pad_tile; col++)
         {
-          // start before first column where homo[d][row][col+2] != 0,
-          // so can know v5sum and homosum[d][row][col] will be 0
-          int col = pad_tile-5;
-          uint8_t v5sum[5] = { 0 };
-          homosum[d][row][col] = 0;
-          // calculate by rolling through column sums
-          for(col++; col < mcol - pad_tile; col++)
-          {
-            uint8_t colsum = 0;
-            for(int v = -2; v <= 2; v++) colsum += homo[d][row + v][col + 2];
-            homosum[d][row][col] = homosum[d][row][col - 1] - v5sum[col % 5] + colsum;
-            v5sum[col % 5] = colsum;
-          }
+          uint8_t colsum = 0;
+          for(int v = -2; v <= 2; v++) colsum += homo[d][row + v][col + 2];
+          homosum[d][row][col] = homosum[d][row][col - 1] - v5sum[col % 5] + colsum;
+          v5sum[col % 5] = colsum;
         }
+      }
 
-      /* Average the most homogenous pixels for the final result:       */
-      for(int row = pad_tile; row < mrow - pad_tile; row++)
-        for(int col = pad_tile; col < mcol - pad_tile; col++)
+    /* Average the most homogenous pixels for the final result:       */
+    for(int row = pad_tile; row < mrow - pad_tile; row++)
+      for(int col = pad_tile; col < mcol - pad_tile; col++)
+      {
+        uint8_t hm[8] = { 0 };
+        uint8_t maxval = 0;
+        for(int d = 0; d < ndir; d++)
         {
-          uint8_t hm[8] = { 0 };
-          uint8_t maxval = 0;
-          for(int d = 0; d < ndir; d++)
+          hm[d] = homosum[d][row][col];
+          maxval = (maxval < hm[d] ? hm[d] : maxval);
+        }
+        maxval -= maxval >> 3;
+        for(int d = 0; d < ndir - 4; d++)
+          if(hm[d] < hm[d + 4])
+            hm[d] = 0;
+          else if(hm[d] > hm[d + 4])
+            hm[d + 4] = 0;
+        float avg[4] = { 0.0f };
+        for(int d = 0; d < ndir; d++)
+          if(hm[d] >= maxval)
           {
-            hm[d] = homosum[d][row][col];
-            maxval = (maxval < hm[d] ? hm[d] : maxval);
+            for(int c = 0; c < 3; c++) avg[c] += rgb[d][row][col][c];
+            avg[3]++;
           }
-          maxval -= maxval >> 3;
-          for(int d = 0; d < ndir - 4; d++)
-            if(hm[d] < hm[d + 4])
-              hm[d] = 0;
-            else if(hm[d] > hm[d + 4])
-              hm[d + 4] = 0;
-          float avg[4] = { 0.0f };
-          for(int d = 0; d < ndir; d++)
-            if(hm[d] >= maxval)
-            {
-              for(int c = 0; c < 3; c++) avg[c] += rgb[d][row][col][c];
-              avg[3]++;
-            }
-          for(int c = 0; c < 3; c++)
-            out[4 * (width * (row + top) + col + left) + c] =
-              avg[c]/avg[3];
-        }
-    }
+        for(int c = 0; c < 3; c++)
+          out[4 * (width * (row + top) + col + left) + c] =
+            avg[c]/avg[3];
+      }
   }
   dt_free_align(all_buffers);
 }
@@ -1124,10 +1178,7 @@ static void vng_interpolate(float *out, const float *const in,
           +0, +1, +2, +0, 1, 0x60, +0, +1, +2, +1, 1, 0x20, +0, +1, +2, +2, 1, 0x10, +1, -2, +1, +0, 1, 0x80,
           +1, -1, +1, +1, 1, 0x88, +1, +0, +1, +2, 1, 0x08, +1, +0, +2, -1, 1, 0x40, +1, +0, +2, +1, 1, 0x10 },
       chood[] = { -1, -1, -1, 0, -1, +1, 0, +1, +1, +1, +1, 0, +1, -1, 0, -1 };
-  int *ip, *code[16][16];
-  // ring buffer pointing to three most recent rows procesed (brow[3]
-  // is only used for rotating the buffer
-  float(*brow[4])[4];
+  int *code[16][16];
   const int width = roi_out->width, height = roi_out->height;
   const int prow = (filters == 9) ? 6 : 8;
   const int pcol = (filters == 9) ? 6 : 2;
@@ -1147,20 +1198,27 @@ static void vng_interpolate(float *out, const float *const in,
   // if only linear interpolation is requested we can stop it here
   if(only_vng_linear) return;
 
-  char *buffer
-      = (char *)dt_alloc_align(16, (size_t)sizeof(**brow) * width * 3 + sizeof(*ip) * prow * pcol * 320);
+  // the rows are split into one band per thread. every band keeps a ring buffer of
+  // the three most recently processed rows, as each row is only written back once the
+  // rows below have been interpolated from the original values. the first and last two
+  // rows of a band are still needed by the neighbouring bands, so they are kept aside
+  // and written once all bands are done.
+  const int num_bands = MAX(1, MIN(dt_get_num_threads(), (height - 4) / 8));
+  const size_t band_rows = 3 + 4;
+  char *buffer = (char *)dt_alloc_align(16, (size_t)sizeof(float) * 4 * width * band_rows * num_bands
+                                                + sizeof(int) * prow * pcol * 320);
   if(!buffer)
   {
     fprintf(stderr, "[demosaic] not able to allocate VNG buffer\n");
     return;
   }
-  for(int row = 0; row < 3; row++) brow[row] = (float(*)[4])buffer + row * width;
-  ip = (int *)(buffer + (size_t)sizeof(**brow) * width * 3);
+  float *const band_buffers = (float *)buffer;
+  int *tp = (int *)(buffer + (size_t)sizeof(float) * 4 * width * band_rows * num_bands);
 
   for(int row = 0; row < prow; row++) /* Precalculate for VNG */
     for(int col = 0; col < pcol; col++)
     {
-      code[row][col] = ip;
+      code[row][col] = tp;
       const signed char *cp = terms;
       for(int t = 0; t < 64; t++)
       {
@@ -1175,91 +1233,116 @@ static void vng_interpolate(float *out, const float *const in,
                   ? 2
                   : 1;
         if(abs(y1 - y2) == diag && abs(x1 - x2) == diag) continue;
-        *ip++ = (y1 * width + x1) * 4 + color;
-        *ip++ = (y2 * width + x2) * 4 + color;
-        *ip++ = weight;
+        *tp++ = (y1 * width + x1) * 4 + color;
+        *tp++ = (y2 * width + x2) * 4 + color;
+        *tp++ = weight;
         for(int g = 0; g < 8; g++)
-          if(grads & 1 << g) *ip++ = g;
-        *ip++ = -1;
+          if(grads & 1 << g) *tp++ = g;
+        *tp++ = -1;
       }
-      *ip++ = INT_MAX;
+      *tp++ = INT_MAX;
       cp = chood;
       for(int g = 0; g < 8; g++)
       {
         int y = *cp++, x = *cp++;
-        *ip++ = (y * width + x) * 4;
+        *tp++ = (y * width + x) * 4;
         int color = fcol(row, col, filters4, xtrans);
         if(fcol(row + y, col + x, filters4, xtrans) != color
            && fcol(row + y * 2, col + x * 2, filters4, xtrans) == color)
-          *ip++ = (y * width + x) * 8 + color;
+          *tp++ = (y * width + x) * 8 + color;
         else
-          *ip++ = 0;
+          *tp++ = 0;
       }
     }
 
-  for(int row = 2; row < height - 2; row++) /* Do VNG interpolation */
-  {
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(row, code, brow, out, filters4) private(ip) schedule(static)
+#pragma omp parallel for default(none) shared(code, out, filters4) schedule(static)
 #endif
-    for(int col = 2; col < width - 2; col++)
+  for(int band = 0; band < num_bands; band++)
+  {
+    const int row_start = 2 + (int)((int64_t)(height - 4) * band / num_bands);
+    const int row_end = 2 + (int)((int64_t)(height - 4) * (band + 1) / num_bands);
+    float(*const brow)[4] = (float(*)[4])(band_buffers + (size_t)4 * width * band_rows * band);
+    for(int row = row_start; row < row_end; row++) /* Do VNG interpolation */
     {
-      int g;
-      float gval[8] = { 0.0f };
-      float *pix = out + 4 * (row * width + col);
-      ip = code[(row + roi_in->y) % prow][(col + roi_in->x) % pcol];
-      while((g = ip[0]) != INT_MAX) /* Calculate gradients */
-      {
-        float diff = fabsf(pix[g] - pix[ip[1]]) * ip[2];
-        gval[ip[3]] += diff;
-        ip += 5;
-        if((g = ip[-1]) == -1) continue;
-        gval[g] += diff;
-        while((g = *ip++) != -1) gval[g] += diff;
-      }
-      ip++;
-      float gmin = gval[0], gmax = gval[0]; /* Choose a threshold */
-      for(g = 1; g < 8; g++)
-      {
-        if(gmin > gval[g]) gmin = gval[g];
-        if(gmax < gval[g]) gmax = gval[g];
-      }
-      if(gmax == 0)
-      {
-        memcpy(brow[2][col], pix, (size_t)4 * sizeof(*out));
-        continue;
-      }
-      float thold = gmin + (gmax * 0.5f);
-      float sum[4] = { 0.0f };
-      int color = fcol(row + roi_in->y, col + roi_in->x, filters4, xtrans);
-      int num = 0;
-      for(g = 0; g < 8; g++, ip += 2) /* Average the neighbors */
+      // rows at the band edges go to their own slots, the others to the ring buffer
+      const int slot = (row - row_start < 2) ? row - row_start
+                                             : (row_end - row < 3) ? 4 - (row_end - row) : 4 + row % 3;
+      float(*const dst)[4] = brow + (size_t)width * slot;
+      for(int col = 2; col < width - 2; col++)
       {
-        if(gval[g] <= thold)
+        int g;
+        float gval[8] = { 0.0f };
+        float *pix = out + 4 * (row * width + col);
+        const int *ip = code[(row + roi_in->y) % prow][(col + roi_in->x) % pcol];
+        while((g = ip[0]) != INT_MAX) /* Calculate gradients */
         {
-          for(int c = 0; c < colors; c++)
-            if(c == color && ip[1])
-              sum[c] += (pix[c] + pix[ip[1]]) * 0.5f;
-            else
-              sum[c] += pix[ip[0] + c];
-          num++;
+          float diff = fabsf(pix[g] - pix[ip[1]]) * ip[2];
+          gval[ip[3]] += diff;
+          ip += 5;
+          if((g = ip[-1]) == -1) continue;
+          gval[g] += diff;
+          while((g = *ip++) != -1) gval[g] += diff;
+        }
+        ip++;
+        float gmin = gval[0], gmax = gval[0]; /* Choose a threshold */
+        for(g = 1; g < 8; g++)
+        {
+          if(gmin > gval[g]) gmin = gval[g];
+          if(gmax < gval[g]) gmax = gval[g];
+        }
+        if(gmax == 0)
+        {
+          memcpy(dst[col], pix, (size_t)4 * sizeof(*out));
+          continue;
+        }
+        float thold = gmin + (gmax * 0.5f);
+        float sum[4] = { 0.0f };
+        int color = fcol(row + roi_in->y, col + roi_in->x, filters4, xtrans);
+        int num = 0;
+        for(g = 0; g < 8; g++, ip += 2) /* Average the neighbors */
+        {
+          if(gval[g] <= thold)
+          {
+            for(int c = 0; c < colors; c++)
+              if(c == color && ip[1])
+                sum[c] += (pix[c] + pix[ip[1]]) * 0.5f;
+              else
+                sum[c] += pix[ip[0] + c];
+            num++;
+          }
+        }
+        for(int c = 0; c < colors; c++) /* Save to buffer */
+        {
+          float tot = pix[color];
+          if(c != color) tot += (sum[c] - sum[color]) / num;
+          dst[col][c] = tot;
         }
       }
-      for(int c = 0; c < colors; c++) /* Save to buffer */
-      {
-        float tot = pix[color];
-        if(c != color) tot += (sum[c] - sum[color]) / num;
-        brow[2][col][c] = tot;
-      }
+      // write back the row two above, which is no longer needed as input
+      const int done = row - 2;
+      if(done >= row_start + 2 && row_end - done > 2)
+        memcpy(out + 4 * (done * width + 2), brow[(size_t)width * (4 + done % 3) + 2],
+               (size_t)(width - 4) * 4 * sizeof(*out));
     }
-    if(row > 3) /* Write buffer to image */
-      memcpy(out + 4 * ((row - 2) * width + 2), brow[0] + 2, (size_t)(width - 4) * 4 * sizeof(*out));
-    // rotate ring buffer
-    for(int g = 0; g < 4; g++) brow[(g - 1) & 3] = brow[g];
-  }
-  // copy the final two rows to the image
-  memcpy(out + (4 * ((height - 4) * width + 2)), brow[0] + 2, (size_t)(width - 4) * 4 * sizeof(*out));
-  memcpy(out + (4 * ((height - 3) * width + 2)), brow[1] + 2, (size_t)(width - 4) * 4 * sizeof(*out));
+  }
+
+  // now copy the rows at the band edges to the image
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(out) schedule(static)
+#endif
+  for(int band = 0; band < num_bands; band++)
+  {
+    const int row_start = 2 + (int)((int64_t)(height - 4) * band / num_bands);
+    const int row_end = 2 + (int)((int64_t)(height - 4) * (band + 1) / num_bands);
+    const float(*const brow)[4] = (const float(*)[4])(band_buffers + (size_t)4 * width * band_rows * band);
+    for(int row = row_start; row < row_end; row++)
+    {
+      if(row - row_start >= 2 && row_end - row > 2) continue;
+      const int slot = (row - row_start < 2) ? row - row_start : 4 - (row_end - row);
+      memcpy(out + 4 * (row * width + 2), brow[(size_t)width * slot + 2], (size_t)(width - 4) * 4 * sizeof(*out));
+    }
+  }
   dt_free_align(buffer);
 
   if(filters != 9 && !FILTERS_ARE_4BAYER(filters)) // x-trans or CYGM/RGBE
@@ -1657,6 +1740,102 @@ static int demosaic_qual_flags(const dt_dev_pixelpipe_iop_t *const piece,
   return flags;
 }
 
+// amaze does not look further than this around a pixel
+#define AMAZE_HALO 32
+
+// demosaic a rectangle of the roi with amaze, as if the whole roi had been processed.
+// the rectangle is extended by the halo (but not beyond the roi) and copied out into
+// its own buffers, keeping an even offset so the bayer pattern stays the same.
+static void amaze_demosaic_rect(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const float *const in,
+                                float *out, const int width, const int height, const int x, const int y,
+                                const int w, const int h, const uint32_t filters)
+{
+  const int ex = MAX(0, x - AMAZE_HALO) & ~1, ey = MAX(0, y - AMAZE_HALO) & ~1;
+  const int ew = MIN(width, x + w + AMAZE_HALO) - ex, eh = MIN(height, y + h + AMAZE_HALO) - ey;
+  const dt_iop_roi_t eroi = { 0, 0, ew, eh, 1.0f };
+  float *const ein = (float *)dt_alloc_align(16, (size_t)ew * eh * sizeof(float));
+  float *const eout = (float *)dt_alloc_align(16, (size_t)ew * eh * 4 * sizeof(float));
+  if(!ein || !eout)
+  {
+    dt_free_align(ein);
+    dt_free_align(eout);
+    return;
+  }
+  for(int j = 0; j < eh; j++)
+    memcpy(ein + (size_t)j * ew, in + (size_t)(ey + j) * width + ex, sizeof(float) * ew);
+
+  amaze_demosaic_RT(self, piece, ein, eout, &eroi, &eroi, filters);
+
+  for(int j = y; j < y + h; j++)
+    memcpy(out + 4 * ((size_t)j * width + x), eout + 4 * ((size_t)(j - ey) * ew + x - ex), sizeof(float) * 4 * w);
+  dt_free_align(ein);
+  dt_free_align(eout);
+}
+
+// panning around in a 1:1 darkroom view requests a roi which is mostly covered by the
+// previous one. keep the last result around and only demosaic the newly exposed strips.
+// note that amaze output already depends a little on where its tiles start relative to
+// the roi, so the stitched result is as good as a complete run, though not bit identical.
+static void amaze_demosaic_cached(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
+                                  const float *const in, float *out, const dt_iop_roi_t *const roi_in,
+                                  const uint32_t filters)
+{
+  dt_iop_demosaic_data_t *d = (dt_iop_demosaic_data_t *)piece->data;
+  // the raw and the history of all modules up to and including this one, but not the roi
+  const dt_iop_roi_t no_roi = { 0 };
+  const uint64_t hash = dt_dev_pixelpipe_cache_hash(piece->pipe->image.id, &no_roi, piece->pipe,
+                                                    g_list_index(piece->pipe->nodes, piece) + 1);
+  const int width = roi_in->width, height = roi_in->height;
+  const dt_iop_roi_t *const old = &d->amaze_cache_roi;
+
+  // the part of the old result which does not depend on how its roi was bordered, in
+  // coordinates of the new roi. edges shared by both rois were mirrored the same way.
+  int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+  if(d->amaze_cache && d->amaze_cache_hash == hash)
+  {
+    x0 = MAX(0, old->x + (old->x != roi_in->x ? AMAZE_HALO : 0) - roi_in->x);
+    y0 = MAX(0, old->y + (old->y != roi_in->y ? AMAZE_HALO : 0) - roi_in->y);
+    x1 = MIN(width, old->x + old->width - (old->x + old->width != roi_in->x + width ? AMAZE_HALO : 0) - roi_in->x);
+    y1 = MIN(height, old->y + old->height - (old->y + old->height != roi_in->y + height ? AMAZE_HALO : 0) - roi_in->y);
+  }
+
+  if(x1 - x0 < width / 2 || y1 - y0 < height / 2)
+  {
+    // not much to gain, do it all over
+    const dt_iop_roi_t roo = { 0, 0, width, height, 1.0f };
+    amaze_demosaic_RT(self, piece, in, out, roi_in, &roo, filters);
+  }
+  else
+  {
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(d, out, x0, x1, y0, y1) schedule(static)
+#endif
+    for(int j = y0; j < y1; j++)
+      memcpy(out + 4 * ((size_t)j * width + x0),
+             d->amaze_cache + 4 * ((size_t)(j + roi_in->y - old->y) * old->width + x0 + roi_in->x - old->x),
+             sizeof(float) * 4 * (x1 - x0));
+    if(y0 > 0) amaze_demosaic_rect(self, piece, in, out, width, height, 0, 0, width, y0, filters);
+    if(y1 < height) amaze_demosaic_rect(self, piece, in, out, width, height, 0, y1, width, height - y1, filters);
+    if(x0 > 0) amaze_demosaic_rect(self, piece, in, out, width, height, 0, y0, x0, y1 - y0, filters);
+    if(x1 < width) amaze_demosaic_rect(self, piece, in, out, width, height, x1, y0, width - x1, y1 - y0, filters);
+  }
+
+  // remember the result for the next run
+  if(!d->amaze_cache || old->width != width || old->height != height)
+  {
+    dt_free_align(d->amaze_cache);
+    d->amaze_cache = (float *)dt_alloc_align(16, (size_t)width * height * 4 * sizeof(float));
+  }
+  if(d->amaze_cache)
+  {
+    memcpy(d->amaze_cache, out, (size_t)width * height * 4 * sizeof(float));
+    d->amaze_cache_roi = *roi_in;
+    d->amaze_cache_hash = hash;
+  }
+}
+
+#undef AMAZE_HALO
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const i, void *const o,
              const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
@@ -1747,6 +1926,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
       else if(demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
         demosaic_ppg(tmp, in, &roo, &roi, piece->pipe->dsc.filters,
                      data->median_thrs); // wanted ppg or zoomed out a lot and quality is limited to 1
+      else if(piece->pipe->type == DT_DEV_PIXELPIPE_FULL && !scaled && data->green_eq == DT_IOP_GREEN_EQ_NO)
+        amaze_demosaic_cached(self, piece, in, tmp, &roi, piece->pipe->dsc.filters);
       else
         amaze_demosaic_RT(self, piece, in, tmp, &roi, &roo, piece->pipe->dsc.filters);
 
@@ -3665,12 +3846,14 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *params, dt_dev
 
 void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
-  piece->data = malloc(sizeof(dt_iop_demosaic_data_t));
+  piece->data = calloc(1, sizeof(dt_iop_demosaic_data_t));
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
 void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
+  dt_iop_demosaic_data_t *d = (dt_iop_demosaic_data_t *)piece->data;
+  dt_free_align(d->amaze_cache);
   free(piece->data);
   piece->data = NULL;
 }
@@ -22,6 +22,9 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "bauhaus/bauhaus.h"
 #include "control/control.h"
@@ -81,6 +84,10 @@ typedef struct dt_iop_grain_data_t
   float strength;
   float midtones_bias;
   float grain_lut[GRAIN_LUT_SIZE * GRAIN_LUT_SIZE];
+  // noise field of the last run and what it was computed for, see process()
+  float *noise;
+  dt_iop_roi_t noise_roi;
+  double noise_key[5];
 } dt_iop_grain_data_t;
 
 
@@ -291,6 +298,92 @@ static double _simplex_noise(double xin, double yin, double zin)
 }
 
 
+#if defined(__SSE2__)
+// two lanes of _simplex_noise() for the same z, with the simplex corners selected by masks instead of
+// branches. only the gradient lookups are done per lane.
+static __m128d _simplex_noise_sse2(const __m128d xin, const __m128d yin, const double zin)
+{
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d zv = _mm_set1_pd(zin);
+  const __m128d G3 = _mm_set1_pd(1.0 / 6.0);
+  const __m128d s = _mm_mul_pd(_mm_add_pd(_mm_add_pd(xin, yin), zv), _mm_set1_pd(1.0 / 3.0));
+  const __m128d xs = _mm_add_pd(xin, s);
+  const __m128d ys = _mm_add_pd(yin, s);
+  const __m128d zs = _mm_add_pd(zv, s);
+  // FASTFLOOR
+  const __m128d i = _mm_sub_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(xs)), _mm_and_pd(_mm_cmple_pd(xs, zero), one));
+  const __m128d j = _mm_sub_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(ys)), _mm_and_pd(_mm_cmple_pd(ys, zero), one));
+  const __m128d k = _mm_sub_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(zs)), _mm_and_pd(_mm_cmple_pd(zs, zero), one));
+  const __m128d t = _mm_mul_pd(_mm_add_pd(_mm_add_pd(i, j), k), G3);
+  const __m128d x0 = _mm_sub_pd(xin, _mm_sub_pd(i, t));
+  const __m128d y0 = _mm_sub_pd(yin, _mm_sub_pd(j, t));
+  const __m128d z0 = _mm_sub_pd(zv, _mm_sub_pd(k, t));
+
+  // the six orderings of x0, y0, z0 from the three comparisons
+  const __m128d xy = _mm_cmpge_pd(x0, y0);
+  const __m128d xz = _mm_cmpge_pd(x0, z0);
+  const __m128d yz = _mm_cmpge_pd(y0, z0);
+  const __m128d i1 = _mm_and_pd(_mm_and_pd(xy, xz), one);
+  const __m128d j1 = _mm_and_pd(_mm_andnot_pd(xy, yz), one);
+  const __m128d k1 = _mm_andnot_pd(_mm_or_pd(xz, yz), one);
+  const __m128d i2 = _mm_and_pd(_mm_or_pd(xy, xz), one);
+  const __m128d j2 = _mm_andnot_pd(_mm_andnot_pd(yz, xy), one);
+  const __m128d k2 = _mm_andnot_pd(_mm_and_pd(xz, yz), one);
+
+  __m128d x[4], y[4], z[4];
+  x[0] = x0;
+  y[0] = y0;
+  z[0] = z0;
+  x[1] = _mm_add_pd(_mm_sub_pd(x0, i1), G3);
+  y[1] = _mm_add_pd(_mm_sub_pd(y0, j1), G3);
+  z[1] = _mm_add_pd(_mm_sub_pd(z0, k1), G3);
+  x[2] = _mm_add_pd(_mm_sub_pd(x0, i2), _mm_set1_pd(2.0 / 6.0));
+  y[2] = _mm_add_pd(_mm_sub_pd(y0, j2), _mm_set1_pd(2.0 / 6.0));
+  z[2] = _mm_add_pd(_mm_sub_pd(z0, k2), _mm_set1_pd(2.0 / 6.0));
+  x[3] = _mm_add_pd(_mm_sub_pd(x0, one), _mm_set1_pd(3.0 / 6.0));
+  y[3] = _mm_add_pd(_mm_sub_pd(y0, one), _mm_set1_pd(3.0 / 6.0));
+  z[3] = _mm_add_pd(_mm_sub_pd(z0, one), _mm_set1_pd(3.0 / 6.0));
+
+  // hashed gradient indices of the four simplex corners, per lane
+  const int mxy = _mm_movemask_pd(xy), mxz = _mm_movemask_pd(xz), myz = _mm_movemask_pd(yz);
+  double iv[2], jv[2], kv[2];
+  _mm_storeu_pd(iv, i);
+  _mm_storeu_pd(jv, j);
+  _mm_storeu_pd(kv, k);
+  const int *g[4][2];
+  for(int l = 0; l < 2; l++)
+  {
+    const int ii = (int)iv[l] & 255;
+    const int jj = (int)jv[l] & 255;
+    const int kk = (int)kv[l] & 255;
+    const int bxy = (mxy >> l) & 1, bxz = (mxz >> l) & 1, byz = (myz >> l) & 1;
+    const int li1 = bxy & bxz, lj1 = !bxy & byz, lk1 = !bxz & !byz;
+    const int li2 = bxy | bxz, lj2 = !bxy | byz, lk2 = !bxz | !byz;
+    g[0][l] = grad3[perm[ii + perm[jj + perm[kk]]] % 12];
+    g[1][l] = grad3[perm[ii + li1 + perm[jj + lj1 + perm[kk + lk1]]] % 12];
+    g[2][l] = grad3[perm[ii + li2 + perm[jj + lj2 + perm[kk + lk2]]] % 12];
+    g[3][l] = grad3[perm[ii + 1 + perm[jj + 1 + perm[kk + 1]]] % 12];
+  }
+
+  // contributions from the four corners, clamping t at zero is the same as dropping the corner
+  __m128d n = zero;
+  for(int c = 0; c < 4; c++)
+  {
+    const __m128d dot = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set_pd(g[c][1][0], g[c][0][0]), x[c]),
+                                              _mm_mul_pd(_mm_set_pd(g[c][1][1], g[c][0][1]), y[c])),
+                                   _mm_mul_pd(_mm_set_pd(g[c][1][2], g[c][0][2]), z[c]));
+    __m128d tc = _mm_sub_pd(_mm_sub_pd(_mm_sub_pd(_mm_set1_pd(0.6), _mm_mul_pd(x[c], x[c])),
+                                       _mm_mul_pd(y[c], y[c])),
+                            _mm_mul_pd(z[c], z[c]));
+    tc = _mm_max_pd(tc, zero);
+    tc = _mm_mul_pd(tc, tc);
+    n = _mm_add_pd(n, _mm_mul_pd(_mm_mul_pd(tc, tc), dot));
+  }
+  return _mm_mul_pd(_mm_set1_pd(32.0), n);
+}
+#endif
+
 
 #define PRIME_LEVELS 4
 // static uint64_t _low_primes[PRIME_LEVELS] ={ 12503,14029,15649, 11369 };
@@ -354,13 +447,37 @@ static double _simplex_2d_noise(double x, double y, uint32_t octaves, double per
 
   for(uint32_t o = 0; o < octaves; o++)
   {
-    total += (_simplex_noise(x * f / z, y * f / z, o) * a);
+    // frequency and amplitude are scaled by o, so the second octave has no weight at all
+    if(a != 0.0) total += (_simplex_noise(x * f / z, y * f / z, o) * a);
     f = 2 * o;
     a = persistance * o;
   }
   return total;
 }
 
+#if defined(__SSE2__)
+static __m128d _simplex_2d_noise_sse2(const __m128d x, const __m128d y, uint32_t octaves, double persistance,
+                                      double z)
+{
+  double f = 1, a = 1;
+  __m128d total = _mm_setzero_pd();
+  const __m128d zv = _mm_set1_pd(z);
+
+  for(uint32_t o = 0; o < octaves; o++)
+  {
+    if(a != 0.0)
+    {
+      const __m128d fv = _mm_set1_pd(f);
+      const __m128d n = _simplex_noise_sse2(_mm_div_pd(_mm_mul_pd(x, fv), zv), _mm_div_pd(_mm_mul_pd(y, fv), zv), o);
+      total = _mm_add_pd(total, _mm_mul_pd(n, _mm_set1_pd(a)));
+    }
+    f = 2 * o;
+    a = persistance * o;
+  }
+  return total;
+}
+#endif
+
 static float paper_resp(float exposure, float mb, float gp)
 {
   float density;
@@ -455,6 +572,65 @@ static unsigned int _hash_string(char *s)
   return h;
 }
 
+// noise for the pixels i0..i1-1 of row j of the roi
+static void _grain_noise_row(float *const noise, const int i0, const int i1, const int j,
+                             const dt_iop_roi_t *const roi_out, const double wd, const unsigned int hash,
+                             const int filter, const double filtermul, const double octaves, const double zoom)
+{
+  // calculate x, y in a resolution independent way:
+  // wx,wy: worldspace in full image pixel coords:
+  // x, y: normalized to shorter side of image, so with pixel aspect = 1.
+  const double y = ((roi_out->y + j) / roi_out->scale) / wd;
+  // rank-1 lattice for the downsampling if zoomed out a lot
+  const float fib1 = 34.0, fib2 = 21.0;
+  int i = i0;
+#if defined(__SSE2__)
+  for(; i < i1 - 1; i += 2)
+  {
+    const __m128d x
+        = _mm_set_pd(((roi_out->x + i + 1) / roi_out->scale) / wd, ((roi_out->x + i) / roi_out->scale) / wd);
+    const __m128d yv = _mm_set1_pd(y);
+    __m128d n = _mm_setzero_pd();
+    if(filter)
+    {
+      for(int l = 0; l < fib2; l++)
+      {
+        float px = l / fib2, py = l * (fib1 / fib2);
+        py -= (int)py;
+        float dx = px * filtermul, dy = py * filtermul;
+        const __m128d xl = _mm_add_pd(_mm_add_pd(x, _mm_set1_pd(dx)), _mm_set1_pd(hash));
+        const __m128d yl = _mm_add_pd(yv, _mm_set1_pd(dy));
+        n = _mm_add_pd(n, _mm_mul_pd(_mm_set1_pd(1.0 / fib2), _simplex_2d_noise_sse2(xl, yl, octaves, 1.0, zoom)));
+      }
+    }
+    else
+      n = _simplex_2d_noise_sse2(_mm_add_pd(x, _mm_set1_pd(hash)), yv, octaves, 1.0, zoom);
+    _mm_storel_pi((__m64 *)(noise + i), _mm_cvtpd_ps(n));
+  }
+#endif
+  for(; i < i1; i++)
+  {
+    const double x = ((roi_out->x + i) / roi_out->scale) / wd;
+    //  double noise=_perlin_2d_noise(x, y, octaves,0.25, zoom)*1.5;
+    double n = 0.0;
+    if(filter)
+    {
+      for(int l = 0; l < fib2; l++)
+      {
+        float px = l / fib2, py = l * (fib1 / fib2);
+        py -= (int)py;
+        float dx = px * filtermul, dy = py * filtermul;
+        n += (1.0 / fib2) * _simplex_2d_noise(x + dx + hash, y + dy, octaves, 1.0, zoom);
+      }
+    }
+    else
+    {
+      n = _simplex_2d_noise(x + hash, y, octaves, 1.0, zoom);
+    }
+    noise[i] = n;
+  }
+}
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
              void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
@@ -473,6 +649,28 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   // filter width depends on world space (i.e. reverse wd norm and roi->scale, as well as buffer input to
   // pixelpipe iscale)
   const double filtermul = piece->iscale / (roi_out->scale * wd);
+
+  // the noise of a pixel only depends on its world space position and the things below, not on strength
+  // and midtones bias. as long as these stay the same, the part of the last noise field which overlaps the
+  // current roi is reused (changing the strength, panning at the same zoom).
+  const double key[5] = { hash, zoom, wd, filtermul, roi_out->scale };
+  const float *const old = data->noise;
+  const dt_iop_roi_t old_roi = data->noise_roi;
+  const int reuse = old && !memcmp(key, data->noise_key, sizeof(key)) && old_roi.scale == roi_out->scale;
+  // overlap of the old roi, in coordinates of the current one
+  const int ox0 = reuse ? CLAMPS(old_roi.x - roi_out->x, 0, roi_out->width) : 0;
+  const int ox1 = reuse ? CLAMPS(old_roi.x + old_roi.width - roi_out->x, ox0, roi_out->width) : 0;
+  const int oy0 = reuse ? CLAMPS(old_roi.y - roi_out->y, 0, roi_out->height) : 0;
+  const int oy1 = reuse ? CLAMPS(old_roi.y + old_roi.height - roi_out->y, oy0, roi_out->height) : 0;
+
+  float *const noise = dt_alloc_align(64, sizeof(float) * roi_out->width * roi_out->height);
+  if(!noise)
+  {
+    fprintf(stderr, "Error allocating memory for the noise in: grain module\n");
+    memcpy(ovoid, ivoid, sizeof(float) * ch * roi_out->width * roi_out->height);
+    return;
+  }
+
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(data, hash)
 #endif
@@ -480,36 +678,22 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   {
     float *in = ((float *)ivoid) + (size_t)roi_out->width * j * ch;
     float *out = ((float *)ovoid) + (size_t)roi_out->width * j * ch;
-    for(int i = 0; i < roi_out->width; i++)
+    float *const nrow = noise + (size_t)roi_out->width * j;
+
+    if(j >= oy0 && j < oy1 && ox0 < ox1)
     {
-      // calculate x, y in a resolution independent way:
-      // wx,wy: worldspace in full image pixel coords:
-      double wx = (roi_out->x + i) / roi_out->scale;
-      double wy = (roi_out->y + j) / roi_out->scale;
-      // x, y: normalized to shorter side of image, so with pixel aspect = 1.
-      // printf("scale %f\n", wd);
-      double x = wx / wd;
-      double y = wy / wd;
-      //  double noise=_perlin_2d_noise(x, y, octaves,0.25, zoom)*1.5;
-      double noise = 0.0;
-      if(filter)
-      {
-        // if zoomed out a lot, use rank-1 lattice downsampling
-        const float fib1 = 34.0, fib2 = 21.0;
-        for(int l = 0; l < fib2; l++)
-        {
-          float px = l / fib2, py = l * (fib1 / fib2);
-          py -= (int)py;
-          float dx = px * filtermul, dy = py * filtermul;
-          noise += (1.0 / fib2) * _simplex_2d_noise(x + dx + hash, y + dy, octaves, 1.0, zoom);
-        }
-      }
-      else
-      {
-        noise = _simplex_2d_noise(x + hash, y, octaves, 1.0, zoom);
-      }
+      const float *const orow
+          = old + (size_t)old_roi.width * (roi_out->y + j - old_roi.y) + roi_out->x - old_roi.x;
+      _grain_noise_row(nrow, 0, ox0, j, roi_out, wd, hash, filter, filtermul, octaves, zoom);
+      memcpy(nrow + ox0, orow + ox0, sizeof(float) * (ox1 - ox0));
+      _grain_noise_row(nrow, ox1, roi_out->width, j, roi_out, wd, hash, filter, filtermul, octaves, zoom);
+    }
+    else
+      _grain_noise_row(nrow, 0, roi_out->width, j, roi_out, wd, hash, filter, filtermul, octaves, zoom);
 
-      out[0] = in[0] + dt_lut_lookup_2d_1c(data->grain_lut, (noise * strength) * GRAIN_LIGHTNESS_STRENGTH_SCALE, in[0] / 100.0f);
+    for(int i = 0; i < roi_out->width; i++)
+    {
+      out[0] = in[0] + dt_lut_lookup_2d_1c(data->grain_lut, (nrow[i] * strength) * GRAIN_LIGHTNESS_STRENGTH_SCALE, in[0] / 100.0f);
       out[1] = in[1];
       out[2] = in[2];
       out[3] = in[3];
@@ -518,6 +702,11 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
       in += ch;
     }
   }
+
+  dt_free_align(data->noise);
+  data->noise = noise;
+  data->noise_roi = *roi_out;
+  memcpy(data->noise_key, key, sizeof(key));
 }
 
 static void scale_callback(GtkWidget *slider, gpointer user_data)
@@ -569,6 +758,8 @@ void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pi
 
 void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
+  dt_iop_grain_data_t *d = (dt_iop_grain_data_t *)piece->data;
+  dt_free_align(d->noise);
   free(piece->data);
   piece->data = NULL;
 }
@@ -258,6 +258,18 @@ static inline int max_i(int a, int b)
   return a > b ? a : b;
 }
 
+// minimum of two floats, cheaper than fminf as NaNs need no special treatment
+static inline float min_f(float a, float b)
+{
+  return a < b ? a : b;
+}
+
+// maximum of two floats, cheaper than fmaxf as NaNs need no special treatment
+static inline float max_f(float a, float b)
+{
+  return a > b ? a : b;
+}
+
 // swap two floats
 static inline void swap_f(float a, float b)
 {
@@ -274,35 +286,32 @@ static inline void pointer_swap_f(float *a, float *b)
   *b = t;
 }
 
-// swap two pointers
-static inline void swap_pointer_f(float *a, float *b)
-{
-  float *t = a;
-  a = b;
-  b = t;
-}
-
 // calculate the one-dimensional moving average over a window of size 2*w+1
-// input array x has stride 1, output array y has stride stride_y
-static inline void box_mean_1d(int N, const float *x, float *y, size_t stride_y, int w)
-{
-  float m = 0, n_box = 0;
+// the N elements are vectors of lanes floats, element i of input array x starts at
+// x + i * stride_x and element i of output array y starts at y + i * stride_y,
+// m holds the lanes running sums
+static inline void box_mean_1d(int N, const float *x, size_t stride_x, float *y, size_t stride_y, int lanes, int w,
+                               float *m)
+{
+  float n_box = 0;
+  for(int l = 0; l < lanes; l++) m[l] = 0;
   for(int i = 0, i_end = min_i(w + 1, N); i < i_end; i++)
   {
-    m += x[i];
+    for(int l = 0; l < lanes; l++) m[l] += x[i * stride_x + l];
     n_box++;
   }
   for(int i = 0; i < N; i++)
   {
-    y[i * stride_y] = m / n_box;
+    const float norm = 1.f / n_box;
+    for(int l = 0; l < lanes; l++) y[i * stride_y + l] = m[l] * norm;
     if(i - w >= 0)
     {
-      m -= x[i - w];
+      for(int l = 0; l < lanes; l++) m[l] -= x[(i - w) * stride_x + l];
       n_box--;
     }
     if(i + w + 1 < N)
     {
-      m += x[i + w + 1];
+      for(int l = 0; l < lanes; l++) m[l] += x[(i + w + 1) * stride_x + l];
       n_box++;
     }
   }
@@ -313,45 +322,68 @@ static inline void box_mean_1d(int N, const float *x, float *y, size_t stride_y,
 // this function is always called from a OpenMP thread, thus no parallelization
 static void box_mean(gray_image img1, gray_image img2, int w)
 {
-  gray_image img2_bak;
-  if(img1.data == img2.data)
+  // the vertical pass runs over strips of this many columns at once
+  const int strip = 16;
+  const size_t buf_size = max_i(img1.width, strip * img1.height);
+  float *const buf = dt_alloc_align(64, sizeof(float) * (buf_size + strip));
+  float *const m = buf + buf_size;
+  for(int i1 = 0; i1 < img1.height; i1++)
   {
-    img2_bak = new_gray_image(max_i(img2.width, img2.height), 1);
-    for(int i1 = 0; i1 < img2.height; i1++)
-    {
-      memcpy(img2_bak.data, img2.data + (size_t)i1 * img2.width, sizeof(float) * img2.width);
-      box_mean_1d(img2.width, img2_bak.data, img2.data + (size_t)i1 * img2.width, 1, w);
-    }
+    memcpy(buf, img1.data + (size_t)i1 * img1.width, sizeof(float) * img1.width);
+    box_mean_1d(img1.width, buf, 1, img2.data + (size_t)i1 * img2.width, 1, 1, w, m);
   }
-  else
+  for(int i0 = 0; i0 < img1.width; i0 += strip)
   {
+    const int lanes = min_i(strip, img1.width - i0);
     for(int i1 = 0; i1 < img1.height; i1++)
-      box_mean_1d(img1.width, img1.data + (size_t)i1 * img1.width, img2.data + (size_t)i1 * img2.width, 1, w);
-    img2_bak = new_gray_image(1, img2.height);
-  }
-  for(int i0 = 0; i0 < img1.width; i0++)
-  {
-    for(int i1 = 0; i1 < img1.height; i1++) img2_bak.data[i1] = img2.data[i0 + (size_t)i1 * img2.width];
-    box_mean_1d(img1.height, img2_bak.data, img2.data + i0, img1.width, w);
+      memcpy(buf + (size_t)i1 * lanes, img2.data + i0 + (size_t)i1 * img2.width, sizeof(float) * lanes);
+    box_mean_1d(img1.height, buf, lanes, img2.data + i0, img2.width, lanes, w, m);
   }
-  free_gray_image(&img2_bak);
+  dt_free_align(buf);
 }
 
 // calculate the one-dimensional moving maximum over a window of size 2*w+1
-// input array x has stride 1, output array y has stride stride_y
-static inline void box_max_1d(int N, const float *x, float *y, size_t stride_y, int w)
-{
-  float m = -(INFINITY);
-  for(int i = 0, i_end = min_i(w + 1, N); i < i_end; i++) m = fmaxf(x[i], m);
-  for(int i = 0; i < N; i++)
+// using the van Herk/Gil-Werman algorithm, which needs three comparisons per
+// element independent of w: within blocks of size 2*w+1 of the input padded by w
+// elements on both sides, g holds the running maximum from the start of the block
+// and h the one to the end of the block, every window covers the tail of one block
+// and the head of the next.
+// the N elements are vectors of lanes floats, element i of input array x starts at
+// x + i * stride_x and element i of output array y starts at y + i * stride_y.
+// scratch needs room for (2 * (N + 2*w) + 1) * lanes floats, x and y may be identical.
+static inline void box_max_1d(int N, const float *x, size_t stride_x, float *y, size_t stride_y, int lanes, int w,
+                              float *scratch)
+{
+  const int k = 2 * w + 1, M = N + 2 * w;
+  float *const g = scratch, *const h = scratch + (size_t)M * lanes, *const pad = h + (size_t)M * lanes;
+  for(int l = 0; l < lanes; l++) pad[l] = -(INFINITY);
+  // the input padded by w elements on both sides
+#define PADDED(j) ((j) < w || (j) >= N + w ? pad : x + ((j) - w) * stride_x)
+  for(int b = 0; b < M; b += k)
   {
-    y[i * stride_y] = m;
-    if(i - w >= 0 && x[i - w] == m)
+    const int b_end = min_i(b + k, M);
+    const float *p = PADDED(b);
+    for(int l = 0; l < lanes; l++) g[(size_t)b * lanes + l] = p[l];
+    for(int j = b + 1; j < b_end; j++)
+    {
+      p = PADDED(j);
+      float *const gj = g + (size_t)j * lanes;
+      for(int l = 0; l < lanes; l++) gj[l] = max_f(gj[l - lanes], p[l]);
+    }
+    p = PADDED(b_end - 1);
+    for(int l = 0; l < lanes; l++) h[(size_t)(b_end - 1) * lanes + l] = p[l];
+    for(int j = b_end - 2; j >= b; j--)
     {
-      m = -(INFINITY);
-      for(int j = max_i(i - w + 1, 0), j_end = min_i(i + w + 2, N); j < j_end; j++) m = fmaxf(x[j], m);
+      p = PADDED(j);
+      float *const hj = h + (size_t)j * lanes;
+      for(int l = 0; l < lanes; l++) hj[l] = max_f(hj[l + lanes], p[l]);
     }
-    if(i + w + 1 < N) m = fmaxf(x[i + w + 1], m);
+  }
+#undef PADDED
+  for(int i = 0; i < N; i++)
+  {
+    const float *const hi = h + (size_t)i * lanes, *const gi = g + (size_t)(i + 2 * w) * lanes;
+    for(int l = 0; l < lanes; l++) y[i * stride_y + l] = max_f(hi[l], gi[l]);
   }
 }
 
@@ -359,70 +391,65 @@ static inline void box_max_1d(int N, const float *x, float *y, size_t stride_y,
 // does the calculation in-place if input and ouput images are identical
 static void box_max(const gray_image img1, const gray_image img2, const int w)
 {
-  gray_image img2_bak;
-  if(img1.data == img2.data)
-  {
+  // the vertical pass runs over strips of this many columns at once
+  const int strip = 16;
+  const size_t scratch_size = (2 * (size_t)(max_i(img1.width, img1.height) + 2 * w) + 1) * strip;
 #ifdef _OPENMP
-#pragma omp parallel default(none) private(img2_bak)
+#pragma omp parallel default(none)
 #endif
-    {
-      img2_bak = new_gray_image(img2.width, 1);
-#ifdef _OPENMP
-#pragma omp for
-#endif
-      for(int i1 = 0; i1 < img2.height; i1++)
-      {
-        memcpy(img2_bak.data, img2.data + (size_t)i1 * img2.width, sizeof(float) * img2.width);
-        box_max_1d(img2.width, img2_bak.data, img2.data + (size_t)i1 * img2.width, 1, w);
-      }
-      free_gray_image(&img2_bak);
-    }
-  }
-  else
   {
+    float *const scratch = dt_alloc_align(64, sizeof(float) * scratch_size);
 #ifdef _OPENMP
-#pragma omp parallel default(none) private(img2_bak)
-#endif
-    {
-#ifdef _OPENMP
-#pragma omp for
-#endif
-      for(int i1 = 0; i1 < img1.height; i1++)
-        box_max_1d(img1.width, img1.data + (size_t)i1 * img1.width, img2.data + (size_t)i1 * img2.width, 1, w);
-    }
-  }
-#ifdef _OPENMP
-#pragma omp parallel default(none) private(img2_bak)
+#pragma omp for schedule(static)
 #endif
-  {
-    img2_bak = new_gray_image(1, img2.height);
+    for(int i1 = 0; i1 < img1.height; i1++)
+      box_max_1d(img1.width, img1.data + (size_t)i1 * img1.width, 1, img2.data + (size_t)i1 * img2.width, 1, 1, w,
+                 scratch);
 #ifdef _OPENMP
-#pragma omp for
+#pragma omp for schedule(static)
 #endif
-    for(int i0 = 0; i0 < img1.width; i0++)
-    {
-      for(int i1 = 0; i1 < img1.height; i1++) img2_bak.data[i1] = img2.data[i0 + (size_t)i1 * img2.width];
-      box_max_1d(img1.height, img2_bak.data, img2.data + i0, img1.width, w);
-    }
-    free_gray_image(&img2_bak);
+    for(int i0 = 0; i0 < img1.width; i0 += strip)
+      box_max_1d(img1.height, img2.data + i0, img2.width, img2.data + i0, img2.width,
+                 min_i(strip, img1.width - i0), w, scratch);
+    dt_free_align(scratch);
   }
 }
 
 // calculate the one-dimensional moving minimum over a window of size 2*w+1
-// input array x has stride 1, output array y has stride stride_y
-static inline void box_min_1d(int N, const float *x, float *y, size_t stride_y, int w)
-{
-  float m = INFINITY;
-  for(int i = 0, i_end = min_i(w + 1, N); i < i_end; i++) m = fminf(x[i], m);
-  for(int i = 0; i < N; i++)
+// using the van Herk/Gil-Werman algorithm, see box_max_1d
+static inline void box_min_1d(int N, const float *x, size_t stride_x, float *y, size_t stride_y, int lanes, int w,
+                              float *scratch)
+{
+  const int k = 2 * w + 1, M = N + 2 * w;
+  float *const g = scratch, *const h = scratch + (size_t)M * lanes, *const pad = h + (size_t)M * lanes;
+  for(int l = 0; l < lanes; l++) pad[l] = INFINITY;
+  // the input padded by w elements on both sides
+#define PADDED(j) ((j) < w || (j) >= N + w ? pad : x + ((j) - w) * stride_x)
+  for(int b = 0; b < M; b += k)
   {
-    y[i * stride_y] = m;
-    if(i - w >= 0 && x[i - w] == m)
+    const int b_end = min_i(b + k, M);
+    const float *p = PADDED(b);
+    for(int l = 0; l < lanes; l++) g[(size_t)b * lanes + l] = p[l];
+    for(int j = b + 1; j < b_end; j++)
     {
-      m = INFINITY;
-      for(int j = max_i(i - w + 1, 0), j_end = min_i(i + w + 2, N); j < j_end; j++) m = fminf(x[j], m);
+      p = PADDED(j);
+      float *const gj = g + (size_t)j * lanes;
+      for(int l = 0; l < lanes; l++) gj[l] = min_f(gj[l - lanes], p[l]);
     }
-    if(i + w + 1 < N) m = fminf(x[i + w + 1], m);
+    p = PADDED(b_end - 1);
+    for(int l = 0; l < lanes; l++) h[(size_t)(b_end - 1) * lanes + l] = p[l];
+    for(int j = b_end - 2; j >= b; j--)
+    {
+      p = PADDED(j);
+      float *const hj = h + (size_t)j * lanes;
+      for(int l = 0; l < lanes; l++) hj[l] = min_f(hj[l + lanes], p[l]);
+    }
+  }
+#undef PADDED
+  for(int i = 0; i < N; i++)
+  {
+    const float *const hi = h + (size_t)i * lanes, *const gi = g + (size_t)(i + 2 * w) * lanes;
+    for(int l = 0; l < lanes; l++) y[i * stride_y + l] = min_f(hi[l], gi[l]);
   }
 }
 
@@ -430,52 +457,27 @@ static inline void box_min_1d(int N, const float *x, float *y, size_t stride_y,
 // does the calculation in-place if input and ouput images are identical
 static void box_min(const gray_image img1, const gray_image img2, const int w)
 {
-  gray_image img2_bak;
-  if(img1.data == img2.data)
-  {
-#ifdef _OPENMP
-#pragma omp parallel default(none) private(img2_bak)
-#endif
-    {
-      img2_bak = new_gray_image(img2.width, 1);
+  // the vertical pass runs over strips of this many columns at once
+  const int strip = 16;
+  const size_t scratch_size = (2 * (size_t)(max_i(img1.width, img1.height) + 2 * w) + 1) * strip;
 #ifdef _OPENMP
-#pragma omp for
+#pragma omp parallel default(none)
 #endif
-      for(int i1 = 0; i1 < img2.height; i1++)
-      {
-        memcpy(img2_bak.data, img2.data + (size_t)i1 * img2.width, sizeof(float) * img2.width);
-        box_min_1d(img2.width, img2_bak.data, img2.data + (size_t)i1 * img2.width, 1, w);
-      }
-      free_gray_image(&img2_bak);
-    }
-  }
-  else
   {
+    float *const scratch = dt_alloc_align(64, sizeof(float) * scratch_size);
 #ifdef _OPENMP
-#pragma omp parallel default(none) private(img2_bak)
-#endif
-    {
-#ifdef _OPENMP
-#pragma omp for
-#endif
-      for(int i1 = 0; i1 < img1.height; i1++)
-        box_min_1d(img1.width, img1.data + (size_t)i1 * img1.width, img2.data + (size_t)i1 * img2.width, 1, w);
-    }
-  }
-#ifdef _OPENMP
-#pragma omp parallel default(none) private(img2_bak)
+#pragma omp for schedule(static)
 #endif
-  {
-    img2_bak = new_gray_image(1, img2.height);
+    for(int i1 = 0; i1 < img1.height; i1++)
+      box_min_1d(img1.width, img1.data + (size_t)i1 * img1.width, 1, img2.data + (size_t)i1 * img2.width, 1, 1, w,
+                 scratch);
 #ifdef _OPENMP
 #pragma omp for schedule(static)
 #endif
-    for(int i0 = 0; i0 < img1.width; i0++)
-    {
-      for(int i1 = 0; i1 < img1.height; i1++) img2_bak.data[i1] = img2.data[i0 + (size_t)i1 * img2.width];
-      box_min_1d(img1.height, img2_bak.data, img2.data + i0, img1.width, w);
-    }
-    free_gray_image(&img2_bak);
+    for(int i0 = 0; i0 < img1.width; i0 += strip)
+      box_min_1d(img1.height, img2.data + i0, img2.width, img2.data + i0, img2.width,
+                 min_i(strip, img1.width - i0), w, scratch);
+    dt_free_align(scratch);
   }
 }
 
@@ -526,37 +528,17 @@ static void guided_filter_tiling(const_rgb_image imgg, gray_image img, gray_imag
   const int width = source.right - source.left;
   const int height = source.upper - source.lower;
   const size_t size = (size_t)width * height;
-  gray_image imgg_mean_r = new_gray_image(width, height);
-  gray_image imgg_mean_g = new_gray_image(width, height);
-  gray_image imgg_mean_b = new_gray_image(width, height);
-  gray_image img_mean = new_gray_image(width, height);
-  for(int j_imgg = source.lower; j_imgg < source.upper; j_imgg++)
-  {
-    size_t k = (size_t)(j_imgg - source.lower) * width;
-    size_t l = source.left + (size_t)j_imgg * imgg.width;
-    for(int i_imgg = source.left; i_imgg < source.right; i_imgg++, k++, l++)
-    {
-      const float *pixel = imgg.data + l * imgg.stride;
-      imgg_mean_r.data[k] = pixel[0];
-      imgg_mean_g.data[k] = pixel[1];
-      imgg_mean_b.data[k] = pixel[2];
-      img_mean.data[k] = img.data[l];
-    }
-  }
-  box_mean(imgg_mean_r, imgg_mean_r, w);
-  box_mean(imgg_mean_g, imgg_mean_g, w);
-  box_mean(imgg_mean_b, imgg_mean_b, w);
-  box_mean(img_mean, img_mean, w);
-  gray_image cov_imgg_img_r = new_gray_image(width, height);
-  gray_image cov_imgg_img_g = new_gray_image(width, height);
-  gray_image cov_imgg_img_b = new_gray_image(width, height);
-  gray_image var_imgg_rr, var_imgg_rg, var_imgg_rb, var_imgg_gg, var_imgg_gb, var_imgg_bb;
-  var_imgg_rr = new_gray_image(width, height);
-  var_imgg_gg = new_gray_image(width, height);
-  var_imgg_bb = new_gray_image(width, height);
-  var_imgg_rg = new_gray_image(width, height);
-  var_imgg_rb = new_gray_image(width, height);
-  var_imgg_gb = new_gray_image(width, height);
+  // all planes of the tile in one block, the coefficients a_r, a_g, a_b and b
+  // are computed in place of the covariances and of the mean of img
+  float *const planes = dt_alloc_align(64, sizeof(float) * 13 * size);
+  gray_image plane[13];
+  for(int k = 0; k < 13; k++) plane[k] = (gray_image){ planes + k * size, width, height };
+  float *const imgg_mean_r = plane[0].data, *const imgg_mean_g = plane[1].data, *const imgg_mean_b = plane[2].data;
+  float *const img_mean = plane[3].data;
+  float *const cov_imgg_img_r = plane[4].data, *const cov_imgg_img_g = plane[5].data;
+  float *const cov_imgg_img_b = plane[6].data;
+  float *const var_imgg_rr = plane[7].data, *const var_imgg_rg = plane[8].data, *const var_imgg_rb = plane[9].data;
+  float *const var_imgg_gg = plane[10].data, *const var_imgg_gb = plane[11].data, *const var_imgg_bb = plane[12].data;
   for(int j_imgg = source.lower; j_imgg < source.upper; j_imgg++)
   {
     size_t k = (size_t)(j_imgg - source.lower) * width;
@@ -564,120 +546,74 @@ static void guided_filter_tiling(const_rgb_image imgg, gray_image img, gray_imag
     for(int i_imgg = source.left; i_imgg < source.right; i_imgg++, k++, l++)
     {
       const float *pixel = imgg.data + l * imgg.stride;
-      cov_imgg_img_r.data[k] = pixel[0] * img.data[l];
-      cov_imgg_img_g.data[k] = pixel[1] * img.data[l];
-      cov_imgg_img_b.data[k] = pixel[2] * img.data[l];
-      var_imgg_rr.data[k] = pixel[0] * pixel[0];
-      var_imgg_rg.data[k] = pixel[0] * pixel[1];
-      var_imgg_rb.data[k] = pixel[0] * pixel[2];
-      var_imgg_gg.data[k] = pixel[1] * pixel[1];
-      var_imgg_gb.data[k] = pixel[1] * pixel[2];
-      var_imgg_bb.data[k] = pixel[2] * pixel[2];
+      imgg_mean_r[k] = pixel[0];
+      imgg_mean_g[k] = pixel[1];
+      imgg_mean_b[k] = pixel[2];
+      img_mean[k] = img.data[l];
+      cov_imgg_img_r[k] = pixel[0] * img.data[l];
+      cov_imgg_img_g[k] = pixel[1] * img.data[l];
+      cov_imgg_img_b[k] = pixel[2] * img.data[l];
+      var_imgg_rr[k] = pixel[0] * pixel[0];
+      var_imgg_rg[k] = pixel[0] * pixel[1];
+      var_imgg_rb[k] = pixel[0] * pixel[2];
+      var_imgg_gg[k] = pixel[1] * pixel[1];
+      var_imgg_gb[k] = pixel[1] * pixel[2];
+      var_imgg_bb[k] = pixel[2] * pixel[2];
     }
   }
-  box_mean(cov_imgg_img_r, cov_imgg_img_r, w);
-  box_mean(cov_imgg_img_g, cov_imgg_img_g, w);
-  box_mean(cov_imgg_img_b, cov_imgg_img_b, w);
-  box_mean(var_imgg_rr, var_imgg_rr, w);
-  box_mean(var_imgg_rg, var_imgg_rg, w);
-  box_mean(var_imgg_rb, var_imgg_rb, w);
-  box_mean(var_imgg_gg, var_imgg_gg, w);
-  box_mean(var_imgg_gb, var_imgg_gb, w);
-  box_mean(var_imgg_bb, var_imgg_bb, w);
+  for(int k = 0; k < 13; k++) box_mean(plane[k], plane[k], w);
+  float *const a_r = cov_imgg_img_r, *const a_g = cov_imgg_img_g, *const a_b = cov_imgg_img_b;
+  float *const b = img_mean;
+  // no branches and no loop carried dependencies, such that the compiler can vectorize
   for(size_t i = 0; i < size; i++)
   {
-    cov_imgg_img_r.data[i] -= imgg_mean_r.data[i] * img_mean.data[i];
-    cov_imgg_img_g.data[i] -= imgg_mean_g.data[i] * img_mean.data[i];
-    cov_imgg_img_b.data[i] -= imgg_mean_b.data[i] * img_mean.data[i];
-    var_imgg_rr.data[i] -= imgg_mean_r.data[i] * imgg_mean_r.data[i] - eps;
-    var_imgg_rg.data[i] -= imgg_mean_r.data[i] * imgg_mean_g.data[i];
-    var_imgg_rb.data[i] -= imgg_mean_r.data[i] * imgg_mean_b.data[i];
-    var_imgg_gg.data[i] -= imgg_mean_g.data[i] * imgg_mean_g.data[i] - eps;
-    var_imgg_gb.data[i] -= imgg_mean_g.data[i] * imgg_mean_b.data[i];
-    var_imgg_bb.data[i] -= imgg_mean_b.data[i] * imgg_mean_b.data[i] - eps;
-  }
-  gray_image a_r = new_gray_image(width, height);
-  gray_image a_g = new_gray_image(width, height);
-  gray_image a_b = new_gray_image(width, height);
-  gray_image b = img_mean;
-  for(int i1 = 0; i1 < height; i1++)
-  {
-    size_t i = (size_t)i1 * width;
-    for(int i0 = 0; i0 < width; i0++)
-    {
-      // solve linear system of equations of size 3x3 via Cramer's rule
-      float Sigma[3][3]; // symmetric coefficient matrix
-      Sigma[0][0] = var_imgg_rr.data[i];
-      Sigma[0][1] = var_imgg_rg.data[i];
-      Sigma[0][2] = var_imgg_rb.data[i];
-      Sigma[1][1] = var_imgg_gg.data[i];
-      Sigma[1][2] = var_imgg_gb.data[i];
-      Sigma[2][2] = var_imgg_bb.data[i];
-      rgb_pixel cov_imgg_img;
-      cov_imgg_img[0] = cov_imgg_img_r.data[i];
-      cov_imgg_img[1] = cov_imgg_img_g.data[i];
-      cov_imgg_img[2] = cov_imgg_img_b.data[i];
-      float det0 = Sigma[0][0] * (Sigma[1][1] * Sigma[2][2] - Sigma[1][2] * Sigma[1][2])
-                   - Sigma[0][1] * (Sigma[0][1] * Sigma[2][2] - Sigma[0][2] * Sigma[1][2])
-                   + Sigma[0][2] * (Sigma[0][1] * Sigma[1][2] - Sigma[0][2] * Sigma[1][1]);
-      if(fabsf(det0) > 4.f * FLT_EPSILON)
-      {
-        float det1 = cov_imgg_img[0] * (Sigma[1][1] * Sigma[2][2] - Sigma[1][2] * Sigma[1][2])
-                     - Sigma[0][1] * (cov_imgg_img[1] * Sigma[2][2] - cov_imgg_img[2] * Sigma[1][2])
-                     + Sigma[0][2] * (cov_imgg_img[1] * Sigma[1][2] - cov_imgg_img[2] * Sigma[1][1]);
-        float det2 = Sigma[0][0] * (cov_imgg_img[1] * Sigma[2][2] - cov_imgg_img[2] * Sigma[1][2])
-                     - cov_imgg_img[0] * (Sigma[0][1] * Sigma[2][2] - Sigma[0][2] * Sigma[1][2])
-                     + Sigma[0][2] * (Sigma[0][1] * cov_imgg_img[2] - Sigma[0][2] * cov_imgg_img[1]);
-        float det3 = Sigma[0][0] * (Sigma[1][1] * cov_imgg_img[2] - Sigma[1][2] * cov_imgg_img[1])
-                     - Sigma[0][1] * (Sigma[0][1] * cov_imgg_img[2] - Sigma[0][2] * cov_imgg_img[1])
-                     + cov_imgg_img[0] * (Sigma[0][1] * Sigma[1][2] - Sigma[0][2] * Sigma[1][1]);
-        a_r.data[i] = det1 / det0;
-        a_g.data[i] = det2 / det0;
-        a_b.data[i] = det3 / det0;
-      }
-      else
-      {
-        // linear system is singular
-        a_r.data[i] = 0;
-        a_g.data[i] = 0;
-        a_b.data[i] = 0;
-      }
-      b.data[i] -= a_r.data[i] * imgg_mean_r.data[i];
-      b.data[i] -= a_g.data[i] * imgg_mean_g.data[i];
-      b.data[i] -= a_b.data[i] * imgg_mean_b.data[i];
-      ++i;
-    }
+    // solve linear system of equations of size 3x3 via Cramer's rule
+    float Sigma[3][3]; // symmetric coefficient matrix
+    Sigma[0][0] = var_imgg_rr[i] - (imgg_mean_r[i] * imgg_mean_r[i] - eps);
+    Sigma[0][1] = var_imgg_rg[i] - imgg_mean_r[i] * imgg_mean_g[i];
+    Sigma[0][2] = var_imgg_rb[i] - imgg_mean_r[i] * imgg_mean_b[i];
+    Sigma[1][1] = var_imgg_gg[i] - (imgg_mean_g[i] * imgg_mean_g[i] - eps);
+    Sigma[1][2] = var_imgg_gb[i] - imgg_mean_g[i] * imgg_mean_b[i];
+    Sigma[2][2] = var_imgg_bb[i] - (imgg_mean_b[i] * imgg_mean_b[i] - eps);
+    rgb_pixel cov_imgg_img;
+    cov_imgg_img[0] = cov_imgg_img_r[i] - imgg_mean_r[i] * img_mean[i];
+    cov_imgg_img[1] = cov_imgg_img_g[i] - imgg_mean_g[i] * img_mean[i];
+    cov_imgg_img[2] = cov_imgg_img_b[i] - imgg_mean_b[i] * img_mean[i];
+    const float det0 = Sigma[0][0] * (Sigma[1][1] * Sigma[2][2] - Sigma[1][2] * Sigma[1][2])
+                       - Sigma[0][1] * (Sigma[0][1] * Sigma[2][2] - Sigma[0][2] * Sigma[1][2])
+                       + Sigma[0][2] * (Sigma[0][1] * Sigma[1][2] - Sigma[0][2] * Sigma[1][1]);
+    const float det1 = cov_imgg_img[0] * (Sigma[1][1] * Sigma[2][2] - Sigma[1][2] * Sigma[1][2])
+                       - Sigma[0][1] * (cov_imgg_img[1] * Sigma[2][2] - cov_imgg_img[2] * Sigma[1][2])
+                       + Sigma[0][2] * (cov_imgg_img[1] * Sigma[1][2] - cov_imgg_img[2] * Sigma[1][1]);
+    const float det2 = Sigma[0][0] * (cov_imgg_img[1] * Sigma[2][2] - cov_imgg_img[2] * Sigma[1][2])
+                       - cov_imgg_img[0] * (Sigma[0][1] * Sigma[2][2] - Sigma[0][2] * Sigma[1][2])
+                       + Sigma[0][2] * (Sigma[0][1] * cov_imgg_img[2] - Sigma[0][2] * cov_imgg_img[1]);
+    const float det3 = Sigma[0][0] * (Sigma[1][1] * cov_imgg_img[2] - Sigma[1][2] * cov_imgg_img[1])
+                       - Sigma[0][1] * (Sigma[0][1] * cov_imgg_img[2] - Sigma[0][2] * cov_imgg_img[1])
+                       + cov_imgg_img[0] * (Sigma[0][1] * Sigma[1][2] - Sigma[0][2] * Sigma[1][1]);
+    // linear system is singular if det0 vanishes
+    const int regular = fabsf(det0) > 4.f * FLT_EPSILON;
+    const float det = regular ? det0 : 1.f;
+    a_r[i] = regular ? det1 / det : 0.f;
+    a_g[i] = regular ? det2 / det : 0.f;
+    a_b[i] = regular ? det3 / det : 0.f;
+    b[i] -= a_r[i] * imgg_mean_r[i];
+    b[i] -= a_g[i] * imgg_mean_g[i];
+    b[i] -= a_b[i] * imgg_mean_b[i];
   }
-  box_mean(a_r, a_r, w);
-  box_mean(a_g, a_g, w);
-  box_mean(a_b, a_b, w);
-  box_mean(b, b, w);
-  for(int j_imgg = source.lower; j_imgg < source.upper; j_imgg++)
+  for(int k = 3; k < 7; k++) box_mean(plane[k], plane[k], w);
+  // only the target region is written, the margins of the source region are covered by the neighbouring tiles
+  for(int j_imgg = target.lower; j_imgg < target.upper; j_imgg++)
   {
-    size_t k = (size_t)(j_imgg - source.lower) * width;
-    size_t l = source.left + (size_t)j_imgg * imgg.width;
-    for(int i_imgg = source.left; i_imgg < source.right; i_imgg++, k++, l++)
+    size_t k = (size_t)(j_imgg - source.lower) * width + target.left - source.left;
+    size_t l = target.left + (size_t)j_imgg * imgg.width;
+    for(int i_imgg = target.left; i_imgg < target.right; i_imgg++, k++, l++)
     {
       const float *pixel = imgg.data + l * imgg.stride;
-      img_out.data[l] = a_r.data[k] * pixel[0] + a_g.data[k] * pixel[1] + a_b.data[k] * pixel[2] + b.data[k];
+      img_out.data[l] = a_r[k] * pixel[0] + a_g[k] * pixel[1] + a_b[k] * pixel[2] + b[k];
     }
   }
-  free_gray_image(&a_r);
-  free_gray_image(&a_g);
-  free_gray_image(&a_b);
-  free_gray_image(&var_imgg_rr);
-  free_gray_image(&var_imgg_rg);
-  free_gray_image(&var_imgg_rb);
-  free_gray_image(&var_imgg_gg);
-  free_gray_image(&var_imgg_gb);
-  free_gray_image(&var_imgg_bb);
-  free_gray_image(&cov_imgg_img_r);
-  free_gray_image(&cov_imgg_img_g);
-  free_gray_image(&cov_imgg_img_b);
-  free_gray_image(&img_mean);
-  free_gray_image(&imgg_mean_r);
-  free_gray_image(&imgg_mean_g);
-  free_gray_image(&imgg_mean_b);
+  dt_free_align(planes);
 }
 
 // partition the array [first, last) using the pivot value val, i.e.,
@@ -715,11 +651,11 @@ void quick_select(float *first, float *nth, float *last)
     float *p1 = first;
     float *pivot = first + (last - first) / 2;
     float *p3 = last - 1;
-    if(!(*p1 < *pivot)) swap_pointer_f(p1, pivot);
-    if(!(*p1 < *p3)) swap_pointer_f(p1, p3);
-    if(!(*pivot < *p3)) swap_pointer_f(pivot, p3);
+    if(!(*p1 < *pivot)) pointer_swap_f(p1, pivot);
+    if(!(*p1 < *p3)) pointer_swap_f(p1, p3);
+    if(!(*pivot < *p3)) pointer_swap_f(pivot, p3);
     pointer_swap_f(pivot, last - 1); // move pivot to end
-    partition(first, last - 1, *(last - 1));
+    pivot = partition(first, last - 1, *(last - 1));
     pointer_swap_f(last - 1, pivot); // move pivot to its final place
     if(nth == pivot)
       break;
@@ -730,6 +666,136 @@ void quick_select(float *first, float *nth, float *last)
   }
 }
 
+// bin of the finite value x in a histogram of bins bins over [lo, lo + bins / scale]
+static inline int histogram_bin(const float x, const float lo, const double scale, const int bins)
+{
+  return max_i(min_i((int)(((double)x - lo) * scale), bins - 1), 0);
+}
+
+// select_nth() the plain way: copy the values with key[i] >= key_min and quick_select among them
+static float select_nth_copy(const float *const x, const float *const key, const float key_min,
+                             const size_t size, const size_t nth, const float fallback)
+{
+  float *const values = dt_alloc_align(64, sizeof(float) * size);
+  if(!values) return fallback;
+  size_t n = 0;
+  for(size_t i = 0; i < size; i++)
+    if(!key || key[i] >= key_min) values[n++] = x[i];
+  float result = fallback;
+  if(n > 0)
+  {
+    const size_t k = MIN(nth, n - 1);
+    quick_select(values, values + k, values + n);
+    result = values[k];
+  }
+  dt_free_align(values);
+  return result;
+}
+
+// return the nth smallest (counting from zero) of the values x[i] with key[i] >= key_min,
+// or of all values if key is NULL, same as quick_select over these values would do.
+// a histogram of the values narrows the search down to the values of a single bin,
+// which are searched the same way again if there are still many of them, or else
+// handed to quick_select. the histograms are computed in parallel
+// over fixed chunks of the input, such that every chunk knows where to put its values
+// of the selected bin. inputs with non-finite values are left to select_nth_copy(),
+// as well as anything that can not be binned.
+static float select_nth(const float *const x, const float *const key, const float key_min, const size_t size,
+                        const size_t nth)
+{
+  float lo = INFINITY, hi = -(INFINITY);
+  size_t non_finite = 0;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static) reduction(min : lo) reduction(max : hi) \
+    reduction(+ : non_finite)
+#endif
+  for(size_t i = 0; i < size; i++)
+    if(!key || key[i] >= key_min)
+    {
+      if(isfinite(x[i]))
+      {
+        lo = fminf(x[i], lo);
+        hi = fmaxf(x[i], hi);
+      }
+      else
+        non_finite++;
+    }
+  if(non_finite) return select_nth_copy(x, key, key_min, size, nth, lo);
+  if(!(hi > lo)) return lo;
+
+  const int bins = 4096;
+  // in double precision, such that neither the range of huge values nor the scale of tiny ones overflows
+  const double scale = bins / ((double)hi - lo);
+  if(!isfinite(scale) || !(scale > 0.0f)) return select_nth_copy(x, key, key_min, size, nth, lo);
+  const int chunks = dt_get_num_threads();
+  const size_t chunk_size = (size + chunks - 1) / chunks;
+  size_t *const hist = calloc((size_t)(bins + 1) * chunks, sizeof(size_t));
+  if(!hist) return select_nth_copy(x, key, key_min, size, nth, lo);
+  size_t *const offset = hist + (size_t)bins * chunks;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int c = 0; c < chunks; c++)
+  {
+    size_t *const h = hist + (size_t)c * bins;
+    for(size_t i = c * chunk_size, i_end = MIN(size, (c + 1) * chunk_size); i < i_end; i++)
+      if((!key || key[i] >= key_min) && isfinite(x[i])) h[histogram_bin(x[i], lo, scale, bins)]++;
+  }
+
+  // find the bin of the nth value
+  size_t below = 0, in_bin = 0;
+  int bin = 0;
+  for(; bin < bins; bin++)
+  {
+    in_bin = 0;
+    for(int c = 0; c < chunks; c++) in_bin += hist[(size_t)c * bins + bin];
+    if(below + in_bin > nth) break;
+    below += in_bin;
+  }
+  if(bin == bins)
+  {
+    // there are less than nth + 1 values
+    free(hist);
+    return hi;
+  }
+  size_t o = 0;
+  for(int c = 0; c < chunks; c++)
+  {
+    offset[c] = o;
+    o += hist[(size_t)c * bins + bin];
+  }
+
+  // gather the values of this bin and select among them
+  float *const values = dt_alloc_align(64, sizeof(float) * in_bin);
+  if(!values)
+  {
+    free(hist);
+    return select_nth_copy(x, key, key_min, size, nth, lo);
+  }
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(bin) schedule(static)
+#endif
+  for(int c = 0; c < chunks; c++)
+  {
+    size_t k = offset[c];
+    for(size_t i = c * chunk_size, i_end = MIN(size, (c + 1) * chunk_size); i < i_end; i++)
+      if((!key || key[i] >= key_min) && isfinite(x[i]) && histogram_bin(x[i], lo, scale, bins) == bin)
+        values[k++] = x[i];
+  }
+  float result;
+  // recurse only while the bin still narrows the values down
+  if(in_bin > bins / 4 && in_bin < size)
+    result = select_nth(values, NULL, 0.f, in_bin, nth - below);
+  else
+  {
+    quick_select(values, values + (nth - below), values + in_bin);
+    result = values[nth - below];
+  }
+  dt_free_align(values);
+  free(hist);
+  return result;
+}
+
 // calculate diffusive ambient light and the maximal depth in the image
 // depth is estimaged by the local amount of haze and given in units of the
 // characteristic haze depth, i.e., the distance over which object light is
@@ -745,36 +811,33 @@ static float ambient_light(const const_rgb_image img, int w1, rgb_pixel *pA0)
   gray_image dark_ch = new_gray_image(width, height);
   dark_channel(img, dark_ch, w1);
   // determine the brightest pixels among the most hazy pixels
-  gray_image bright_hazy = new_gray_image(width, height);
-  copy_gray_image(dark_ch, bright_hazy);
-  size_t p = size * dark_channel_quantil;
-  quick_select(bright_hazy.data, bright_hazy.data + p, bright_hazy.data + size);
-  const float crit_haze_level = bright_hazy.data[p];
+  const float crit_haze_level = select_nth(dark_ch.data, NULL, 0.f, size, size * dark_channel_quantil);
+  gray_image bright = new_gray_image(width, height);
+  float *const brightness = bright.data;
+  const float *const data = dark_ch.data;
   size_t N_most_hazy = 0;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static) reduction(+ : N_most_hazy)
+#endif
   for(size_t i = 0; i < size; i++)
-    if(dark_ch.data[i] >= crit_haze_level)
-    {
-      const float *pixel_in = img.data + i * img.stride;
-      // next line prevents parallelization via OpenMP
-      bright_hazy.data[N_most_hazy] = pixel_in[0] + pixel_in[1] + pixel_in[2];
-      N_most_hazy++;
-    }
-  p = N_most_hazy * bright_quantil;
-  quick_select(bright_hazy.data, bright_hazy.data + p, bright_hazy.data + N_most_hazy);
-  const float crit_brightness = bright_hazy.data[p];
-  free_gray_image(&bright_hazy);
+  {
+    const float *pixel_in = img.data + i * img.stride;
+    brightness[i] = pixel_in[0] + pixel_in[1] + pixel_in[2];
+    if(data[i] >= crit_haze_level) N_most_hazy++;
+  }
+  const float crit_brightness
+      = select_nth(brightness, data, crit_haze_level, size, (size_t)(N_most_hazy * bright_quantil));
   // average over the brightest pixels among the most hazy pixels to
   // estimate the diffusive ambient light
   float A0_r = 0, A0_g = 0, A0_b = 0;
   size_t N_bright_hazy = 0;
-  const float *const data = dark_ch.data;
 #ifdef _OPENMP
 #pragma omp parallel for default(none) schedule(static) reduction(+ : N_bright_hazy, A0_r, A0_g, A0_b)
 #endif
   for(size_t i = 0; i < size; i++)
   {
     const float *pixel_in = img.data + i * img.stride;
-    if((data[i] >= crit_haze_level) && (pixel_in[0] + pixel_in[1] + pixel_in[2] >= crit_brightness))
+    if((data[i] >= crit_haze_level) && (brightness[i] >= crit_brightness))
     {
       A0_r += pixel_in[0];
       A0_g += pixel_in[1];
@@ -786,6 +849,7 @@ static float ambient_light(const const_rgb_image img, int w1, rgb_pixel *pA0)
   (*pA0)[1] = A0_g / N_bright_hazy;
   (*pA0)[2] = A0_b / N_bright_hazy;
   free_gray_image(&dark_ch);
+  free_gray_image(&bright);
   // the critical haze level is at dark_channel_quantil (not 100%) to be insensitive
   // to extrime outliners, compensate for that by some factor slighly larger than
   // unity when calculating the maximal image depth
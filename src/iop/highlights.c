@@ -268,6 +268,34 @@ void tiling_callback(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t
   }
 }
 
+/* flag the rows holding at least one pixel at or above thrs, returns whether there are any. most images have
+ * only few clipped regions, so the expensive reconstruction can skip everything else. */
+static int rows_clipped(const float *const in, const int width, const int height, const float thrs,
+                        uint8_t *const flags)
+{
+  int any = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) reduction(| : any)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    const float *const row = in + (size_t)width * j;
+    float m = -FLT_MAX;
+    int i = 0;
+#if defined(__SSE__)
+    __m128 mv = _mm_set1_ps(-FLT_MAX);
+    for(; i <= width - 4; i += 4) mv = _mm_max_ps(mv, _mm_loadu_ps(row + i));
+    mv = _mm_max_ps(mv, _mm_movehl_ps(mv, mv));
+    mv = _mm_max_ss(mv, _mm_shuffle_ps(mv, mv, 1));
+    m = _mm_cvtss_f32(mv);
+#endif
+    for(; i < width; i++) m = MAX(m, row[i]);
+    flags[j] = (m >= thrs);
+    any |= flags[j];
+  }
+  return any;
+}
+
 /* interpolate value for a pixel, ideal via ratio to nearby pixel */
 static inline float interp_pix_xtrans(const int ratio_next,
                                       const ssize_t offset_next,
@@ -534,103 +562,200 @@ static inline void interpolate_color(const void *const ivoid, void *const ovoid,
 #define SQRT3 1.7320508075688772935274463415058723669L
 #define SQRT12 3.4641016151377545870548926830117447339L // 2*SQRT3
 
-static void process_lch_bayer(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
-                              void *const ovoid, const dt_iop_roi_t *const roi_in,
-                              const dt_iop_roi_t *const roi_out, const float clip)
+/* reconstruct the colour of a clipped 2x2 bayer block in LCh, return the channel c of it */
+static inline float lch_bayer_block(const float R, const float Gmin, const float Gmax, const float B,
+                                    const float clip, const int c)
 {
-  const uint32_t filters = piece->pipe->dsc.filters;
+  const float Ro = MIN(R, clip);
+  const float Go = MIN(Gmin, clip);
+  const float Bo = MIN(B, clip);
 
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic) default(none)
-#endif
-  for(int j = 0; j < roi_out->height; j++)
+  const float L = (R + Gmax + B) / 3.0f;
+
+  float C = SQRT3 * (R - Gmax);
+  float H = 2.0f * B - Gmax - R;
+
+  const float Co = SQRT3 * (Ro - Go);
+  const float Ho = 2.0f * Bo - Go - Ro;
+
+  if(R != Gmax && Gmax != B)
   {
-    float *out = (float *)ovoid + (size_t)roi_out->width * j;
-    float *in = (float *)ivoid + (size_t)roi_out->width * j;
+    const float ratio = sqrtf((Co * Co + Ho * Ho) / (C * C + H * H));
+    C *= ratio;
+    H *= ratio;
+  }
+
+  /*
+   * backtransform proof, sage:
+   *
+   * R,G,B,L,C,H = var('R,G,B,L,C,H')
+   * solve([L==(R+G+B)/3, C==sqrt(3)*(R-G), H==2*B-G-R], R, G, B)
+   *
+   * result:
+   * [[R == 1/6*sqrt(3)*C - 1/6*H + L, G == -1/6*sqrt(3)*C - 1/6*H + L, B == 1/3*H + L]]
+   */
+  const float RGB[3] = { L - H / 6.0f + C / SQRT12, L - H / 6.0f - C / SQRT12, L + H / 3.0f };
+  return RGB[c];
+}
 
-    for(int i = 0; i < roi_out->width; i++, in++, out++)
+/* same for any 2x2 pattern, sorting the samples of the block starting at (i, j) by their colour */
+static inline float lch_block_generic(const float *const in, const int width, const int i, const int j,
+                                      const dt_iop_roi_t *const roi_out, const uint32_t filters,
+                                      const float clip)
+{
+  int clipped = 0;
+
+  // sample 1 bayer block. thus we will have 2 green values.
+  float R = 0.0f, Gmin = FLT_MAX, Gmax = -FLT_MAX, B = 0.0f;
+  for(int jj = 0; jj <= 1; jj++)
+  {
+    for(int ii = 0; ii <= 1; ii++)
     {
-      if(i == roi_out->width - 1 || j == roi_out->height - 1)
+      const float val = in[(size_t)jj * width + ii];
+
+      clipped = (clipped || (val > clip));
+
+      const int c = FC(j + jj + roi_out->y, i + ii + roi_out->x, filters);
+      switch(c)
       {
-        // fast path for border
-        out[0] = MIN(clip, in[0]);
+        case 0:
+          R = val;
+          break;
+        case 1:
+          Gmin = MIN(Gmin, val);
+          Gmax = MAX(Gmax, val);
+          break;
+        case 2:
+          B = val;
+          break;
       }
-      else
-      {
-        int clipped = 0;
-
-        // sample 1 bayer block. thus we will have 2 green values.
-        float R = 0.0f, Gmin = FLT_MAX, Gmax = -FLT_MAX, B = 0.0f;
-        for(int jj = 0; jj <= 1; jj++)
-        {
-          for(int ii = 0; ii <= 1; ii++)
-          {
-            const float val = in[(size_t)jj * roi_out->width + ii];
+    }
+  }
 
-            clipped = (clipped || (val > clip));
+  if(!clipped) return in[0];
+  return lch_bayer_block(R, Gmin, Gmax, B, clip, FC(j + roi_out->y, i + roi_out->x, filters));
+}
 
-            const int c = FC(j + jj + roi_out->y, i + ii + roi_out->x, filters);
-            switch(c)
-            {
-              case 0:
-                R = val;
-                break;
-              case 1:
-                Gmin = MIN(Gmin, val);
-                Gmax = MAX(Gmax, val);
-                break;
-              case 2:
-                B = val;
-                break;
-            }
-          }
-        }
+static void process_lch_bayer(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
+                              void *const ovoid, const dt_iop_roi_t *const roi_in,
+                              const dt_iop_roi_t *const roi_out, const float clip)
+{
+  const uint32_t filters = piece->pipe->dsc.filters;
+  const int width = roi_out->width;
+  const int height = roi_out->height;
+  const float *const input = (const float *const)ivoid;
+  float *const output = (float *const)ovoid;
+
+  // nothing above the clipping threshold, nothing to reconstruct
+  uint8_t *const rows = malloc(height);
+  if(!rows_clipped(input, width, height, clip, rows))
+  {
+    memcpy(output, input, sizeof(float) * width * height);
+    free(rows);
+    return;
+  }
 
-        if(clipped)
+  // for plain 2x2 bayer patterns each block has one red, two green and one blue sample. look up their
+  // offsets for the four possible block origins once, instead of switching over the colours per pixel.
+  int bayer = (filters == (filters & 0xff) * 0x01010101u);
+  int offs[2][2][4] = { { { 0 } } };
+  int own[2][2] = { { 0 } };
+  for(int py = 0; py < 2; py++)
+    for(int px = 0; px < 2; px++)
+    {
+      int cnt[4] = { 0 };
+      for(int jj = 0; jj <= 1; jj++)
+        for(int ii = 0; ii <= 1; ii++)
         {
-          const float Ro = MIN(R, clip);
-          const float Go = MIN(Gmin, clip);
-          const float Bo = MIN(B, clip);
-
-          const float L = (R + Gmax + B) / 3.0f;
-
-          float C = SQRT3 * (R - Gmax);
-          float H = 2.0f * B - Gmax - R;
+          // stored as red, green, green, blue
+          const int c = FC(py + jj, px + ii, filters);
+          const int o = jj * width + ii;
+          if(c == 0)
+            offs[py][px][0] = o;
+          else if(c == 1 && cnt[1] < 2)
+            offs[py][px][1 + cnt[1]] = o;
+          else if(c == 2)
+            offs[py][px][3] = o;
+          cnt[c]++;
+        }
+      if(cnt[0] != 1 || cnt[1] != 2 || cnt[2] != 1) bayer = 0;
+      own[py][px] = FC(py, px, filters);
+    }
 
-          const float Co = SQRT3 * (Ro - Go);
-          const float Ho = 2.0f * Bo - Go - Ro;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) default(none) shared(offs, own, bayer)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    float *out = output + (size_t)width * j;
+    const float *in = input + (size_t)width * j;
 
-          if(R != Gmax && Gmax != B)
-          {
-            const float ratio = sqrtf((Co * Co + Ho * Ho) / (C * C + H * H));
-            C *= ratio;
-            H *= ratio;
-          }
+    if(j == height - 1 || (!rows[j] && !rows[j + 1]))
+    {
+      // no clipped block starts in this row, the border is only clipped
+      if(j == height - 1 && rows[j])
+        for(int i = 0; i < width; i++) out[i] = MIN(clip, in[i]);
+      else
+        memcpy(out, in, sizeof(float) * width);
+      continue;
+    }
 
-          float RGB[3] = { 0.0f, 0.0f, 0.0f };
+    const int py = (j + roi_out->y) & 1;
+    int i = 0;
+#if defined(__SSE__)
+    // test four blocks at once, usually none of them is clipped
+    const __m128 clipm = _mm_set1_ps(clip);
+    for(; i < width - 4; i += 4)
+    {
+      const __m128 m0 = _mm_max_ps(_mm_loadu_ps(in + i), _mm_loadu_ps(in + i + 1));
+      const __m128 m1 = _mm_max_ps(_mm_loadu_ps(in + width + i), _mm_loadu_ps(in + width + i + 1));
+      const int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_max_ps(m0, m1), clipm));
+      if(!mask)
+      {
+        _mm_storeu_ps(out + i, _mm_loadu_ps(in + i));
+        continue;
+      }
+      for(int k = 0; k < 4; k++)
+      {
+        const float *const b = in + i + k;
+        const int px = (i + k + roi_out->x) & 1;
+        const int *const o = offs[py][px];
+        if(!(mask & (1 << k)))
+          out[i + k] = b[0];
+        else if(bayer)
+          out[i + k] = lch_bayer_block(b[o[0]], MIN(b[o[1]], b[o[2]]), MAX(b[o[1]], b[o[2]]), b[o[3]], clip,
+                                       own[py][px]);
+        else
+          out[i + k] = lch_block_generic(b, width, i + k, j, roi_out, filters, clip);
+      }
+    }
+#endif
 
-          /*
-           * backtransform proof, sage:
-           *
-           * R,G,B,L,C,H = var('R,G,B,L,C,H')
-           * solve([L==(R+G+B)/3, C==sqrt(3)*(R-G), H==2*B-G-R], R, G, B)
-           *
-           * result:
-           * [[R == 1/6*sqrt(3)*C - 1/6*H + L, G == -1/6*sqrt(3)*C - 1/6*H + L, B == 1/3*H + L]]
-           */
-          RGB[0] = L - H / 6.0f + C / SQRT12;
-          RGB[1] = L - H / 6.0f - C / SQRT12;
-          RGB[2] = L + H / 3.0f;
+    for(; i < width; i++)
+    {
+      if(i == width - 1)
+      {
+        // fast path for border
+        out[i] = MIN(clip, in[i]);
+        continue;
+      }
 
-          out[0] = RGB[FC(j + roi_out->y, i + roi_out->x, filters)];
-        }
+      if(bayer)
+      {
+        const float *const b = in + i;
+        const int *const o = offs[py][(i + roi_out->x) & 1];
+        if((b[0] > clip) || (b[1] > clip) || (b[width] > clip) || (b[width + 1] > clip))
+          out[i] = lch_bayer_block(b[o[0]], MIN(b[o[1]], b[o[2]]), MAX(b[o[1]], b[o[2]]), b[o[3]], clip,
+                                   own[py][(i + roi_out->x) & 1]);
         else
-        {
-          out[0] = in[0];
-        }
+          out[i] = b[0];
       }
+      else
+        out[i] = lch_block_generic(in + i, width, i, j, roi_out, filters, clip);
     }
   }
+
+  free(rows);
 }
 
 static void process_lch_xtrans(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
@@ -639,6 +764,10 @@ static void process_lch_xtrans(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pi
 {
   const uint8_t(*const xtrans)[6] = (const uint8_t(*const)[6])piece->pipe->dsc.xtrans;
 
+  // only rows with clipped pixels up to two rows away need the reconstruction
+  uint8_t *const rows = malloc(roi_in->height);
+  const int any = rows_clipped((const float *)ivoid, roi_in->width, roi_in->height, clip, rows);
+
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic) default(none)
 #endif
@@ -647,6 +776,14 @@ static void process_lch_xtrans(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pi
     float *out = (float *)ovoid + (size_t)roi_out->width * j;
     float *in = (float *)ivoid + (size_t)roi_in->width * j;
 
+    int dirty = 0;
+    for(int jj = MAX(j - 2, 0); any && jj <= MIN(j + 2, roi_out->height - 1); jj++) dirty |= rows[jj];
+    if(!dirty)
+    {
+      memcpy(out, in, sizeof(float) * roi_out->width);
+      continue;
+    }
+
     // bit vector used as ring buffer to remember clipping of current
     // and last two columns, checking current pixel and its vertical
     // neighbors
@@ -760,6 +897,8 @@ static void process_lch_xtrans(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pi
       in++;
     }
   }
+
+  free(rows);
 }
 
 #undef SQRT3
@@ -879,7 +1018,28 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
                                0.987 * data->clip * piece->pipe->dsc.processed_maximum[1],
                                0.987 * data->clip * piece->pipe->dsc.processed_maximum[2], clip };
 
-      if(filters == 9u)
+      // unclipped pixels are passed through unchanged, so start from a copy of the input and run the
+      // passes only along the rows and columns which hold clipped pixels
+      const float thrs = fminf(clips[0], fminf(clips[1], clips[2])) - 1e-5f;
+      uint8_t *const rows = malloc(roi_in->height);
+      uint8_t *const cols = calloc(roi_in->width, sizeof(uint8_t));
+      const int any = rows_clipped((const float *)ivoid, roi_in->width, roi_in->height, thrs, rows);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none)
+#endif
+      for(int j = 0; j < roi_out->height; j++)
+        memcpy((float *)ovoid + (size_t)roi_out->width * j, (const float *)ivoid + (size_t)roi_in->width * j,
+               sizeof(float) * roi_out->width);
+
+      for(int j = 0; any && j < roi_out->height; j++)
+      {
+        if(!rows[j]) continue;
+        const float *const in = (const float *)ivoid + (size_t)roi_in->width * j;
+        for(int i = 0; i < roi_out->width; i++) cols[i] |= (in[i] >= thrs);
+      }
+
+      if(any && filters == 9u)
       {
         const uint8_t(*const xtrans)[6] = (const uint8_t(*const)[6])piece->pipe->dsc.xtrans;
 #ifdef _OPENMP
@@ -887,6 +1047,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 #endif
         for(int j = 0; j < roi_out->height; j++)
         {
+          if(!rows[j]) continue;
           interpolate_color_xtrans(ivoid, ovoid, roi_in, roi_out, 0, 1, j, clips, xtrans, 0);
           interpolate_color_xtrans(ivoid, ovoid, roi_in, roi_out, 0, -1, j, clips, xtrans, 1);
         }
@@ -895,17 +1056,19 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 #endif
         for(int i = 0; i < roi_out->width; i++)
         {
+          if(!cols[i]) continue;
           interpolate_color_xtrans(ivoid, ovoid, roi_in, roi_out, 1, 1, i, clips, xtrans, 2);
           interpolate_color_xtrans(ivoid, ovoid, roi_in, roi_out, 1, -1, i, clips, xtrans, 3);
         }
       }
-      else
+      else if(any)
       {
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic) default(none) shared(data, piece)
 #endif
         for(int j = 0; j < roi_out->height; j++)
         {
+          if(!rows[j]) continue;
           interpolate_color(ivoid, ovoid, roi_out, 0, 1, j, clips, filters, 0);
           interpolate_color(ivoid, ovoid, roi_out, 0, -1, j, clips, filters, 1);
         }
@@ -916,10 +1079,13 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
 #endif
         for(int i = 0; i < roi_out->width; i++)
         {
+          if(!cols[i]) continue;
           interpolate_color(ivoid, ovoid, roi_out, 1, 1, i, clips, filters, 2);
           interpolate_color(ivoid, ovoid, roi_out, 1, -1, i, clips, filters, 3);
         }
       }
+      free(rows);
+      free(cols);
       break;
     }
     case DT_IOP_HIGHLIGHTS_LCH:
@@ -24,6 +24,8 @@
 #include "config.h"
 #endif
 #include "bauhaus/bauhaus.h"
+#include "common/file_location.h"
+#include "control/conf.h"
 #include "control/control.h"
 #include "develop/imageop.h"
 #include "develop/imageop_math.h"
@@ -32,11 +34,15 @@
 #include "gui/gtk.h"
 #include "iop/iop_api.h"
 
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <stdlib.h>
 
 DT_MODULE_INTROSPECTION(1, dt_iop_hotpixels_params_t)
 
+// full detection is rerun once a defect map has been used for this many images
+#define HOTPIXELS_MAP_RESCAN 50
+
 typedef struct dt_iop_hotpixels_params_t
 {
   float strength;
@@ -63,8 +69,44 @@ typedef struct dt_iop_hotpixels_data_t
   float multiplier;
   gboolean permissive;
   gboolean markfixed;
+  gboolean defect_map;
+  char map_key[256];
+  int32_t map_generation; // map generation the image is bound to, -1 if no map is used
 } dt_iop_hotpixels_data_t;
 
+/* hot pixels of a sensor are stable over a shoot. with the defect map enabled, the sites
+ * detected in a full frame scan are remembered per camera model, iso and detection parameters,
+ * so following images only need to test these sites instead of the whole sensor. exif does not
+ * tell bodies of the same model apart, so these share their maps.
+ *
+ * to keep the output of an image independent of the order images are processed in, each image
+ * is bound to one map generation for good: the current one if that is learnt and has served less
+ * than HOTPIXELS_MAP_RESCAN images, or else a new one which is learnt from a full scan of the
+ * image itself and thus gives the same result as full detection. */
+typedef struct dt_iop_hotpixels_map_t
+{
+  int32_t generation;
+  int32_t width;      // sensor size, 0 as long as the generation is not learnt
+  int32_t height;
+  int32_t num;        // number of hot sites
+  uint32_t *pos;      // their sensor positions, y * width + x
+} dt_iop_hotpixels_map_t;
+
+typedef struct dt_iop_hotpixels_camera_t
+{
+  char key[256];        // camera, iso and detection parameters
+  int32_t generations;  // number of map generations
+  int32_t served;       // images bound to the last one
+  GHashTable *images;   // image id -> generation + 1
+  GList *maps;          // generations looked up so far
+} dt_iop_hotpixels_camera_t;
+
+typedef struct dt_iop_hotpixels_global_data_t
+{
+  dt_pthread_mutex_t lock;
+  GList *cameras;
+} dt_iop_hotpixels_global_data_t;
+
 const char *name()
 {
   return _("hot pixels");
@@ -101,34 +143,19 @@ void connect_key_accels(dt_iop_module_t *self)
  * correcting pairs of hot pixels in adjacent sites. Replacement using
  * the maximum produces fewer artifacts when inadvertently replacing
  * non-hot pixels.
- * This is the Bayer sensor variant. */
-static int process_bayer(const dt_iop_hotpixels_data_t *data,
-                         const void *const ivoid, void *const ovoid,
-                         const dt_iop_roi_t *const roi_out)
+ * This is the Bayer sensor variant, for a single site. Returns 1 if it was fixed. */
+static inline int fix_bayer(const dt_iop_hotpixels_data_t *data, const float *const in, float *const out,
+                            const int col, const int width)
 {
-  const float threshold = data->threshold;
   const float multiplier = data->multiplier;
-  const gboolean markfixed = data->markfixed;
   const int min_neighbours = data->permissive ? 3 : 4;
-  const int width = roi_out->width;
   const int widthx2 = width * 2;
-  int fixed = 0;
-
-#ifdef _OPENMP
-#pragma omp parallel for default(none) reduction(+ : fixed) schedule(static)
-#endif
-  for(int row = 2; row < roi_out->height - 2; row++)
+  float mid = *in * multiplier;
+  if(*in > data->threshold)
   {
-    const float *in = (float *)ivoid + (size_t)width * row + 2;
-    float *out = (float *)ovoid + (size_t)width * row + 2;
-    for(int col = 2; col < width - 2; col++, in++, out++)
-    {
-      float mid = *in * multiplier;
-      if(*in > threshold)
-      {
-        int count = 0;
-        float maxin = 0.0;
-        float other;
+    int count = 0;
+    float maxin = 0.0;
+    float other;
 #define TESTONE(OFFSET)                                                                                      \
   other = in[OFFSET];                                                                                        \
   if(mid > other)                                                                                            \
@@ -136,36 +163,50 @@ static int process_bayer(const dt_iop_hotpixels_data_t *data,
     count++;                                                                                                 \
     if(other > maxin) maxin = other;                                                                         \
   }
-        TESTONE(-2);
-        TESTONE(-widthx2);
-        TESTONE(+2);
-        TESTONE(+widthx2);
+    TESTONE(-2);
+    TESTONE(-widthx2);
+    TESTONE(+2);
+    TESTONE(+widthx2);
 #undef TESTONE
-        if(count >= min_neighbours)
-        {
-          *out = maxin;
-          fixed++;
-          if(markfixed)
-          {
-            for(int i = -2; i >= -10 && i >= -col; i -= 2) out[i] = *in;
-            for(int i = 2; i <= 10 && i < width - col; i += 2) out[i] = *in;
-          }
-        }
+    if(count >= min_neighbours)
+    {
+      *out = maxin;
+      if(data->markfixed)
+      {
+        for(int i = -2; i >= -10 && i >= -col; i -= 2) out[i] = *in;
+        for(int i = 2; i <= 10 && i < width - col; i += 2) out[i] = *in;
       }
+      return 1;
     }
   }
+  return 0;
+}
+
+static int process_bayer(const dt_iop_hotpixels_data_t *data,
+                         const void *const ivoid, void *const ovoid,
+                         const dt_iop_roi_t *const roi_out)
+{
+  const int width = roi_out->width;
+  int fixed = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) reduction(+ : fixed) schedule(static)
+#endif
+  for(int row = 2; row < roi_out->height - 2; row++)
+  {
+    const float *in = (float *)ivoid + (size_t)width * row + 2;
+    float *out = (float *)ovoid + (size_t)width * row + 2;
+    for(int col = 2; col < width - 2; col++, in++, out++) fixed += fix_bayer(data, in, out, col, width);
+  }
 
   return fixed;
 }
 
-/* X-Trans sensor equivalent of process_bayer(). */
-static int process_xtrans(const dt_iop_hotpixels_data_t *data,
-                          const void *const ivoid, void *const ovoid,
-                          const dt_iop_roi_t *const roi_out, const uint8_t (*const xtrans)[6])
+/* for each cell of the X-Trans sensor array, pre-calculate a list of the x/y
+ * offsets of the four radially nearest pixels of the same color */
+static void xtrans_offsets(int offsets[6][6][4][2], const dt_iop_roi_t *const roi_out,
+                           const uint8_t (*const xtrans)[6])
 {
-  // for each cell of sensor array, pre-calculate, a list of the x/y
-  // offsets of the four radially nearest pixels of the same color
-  int offsets[6][6][4][2];
   // increasing offsets from pixel to find nearest like-colored pixels
   const int search[20][2] = { { -1, 0 },
                               { 1, 0 },
@@ -203,87 +244,329 @@ static int process_xtrans(const dt_iop_hotpixels_data_t *data,
       }
     }
   }
+}
 
-  const float threshold = data->threshold;
+/* X-Trans sensor equivalent of fix_bayer(). */
+static inline int fix_xtrans(const dt_iop_hotpixels_data_t *data, const float *const in, float *const out,
+                             const int row, const int col, const int (*const offsets)[2],
+                             const dt_iop_roi_t *const roi_out, const uint8_t (*const xtrans)[6])
+{
   const float multiplier = data->multiplier;
-  const gboolean markfixed = data->markfixed;
   const int min_neighbours = data->permissive ? 3 : 4;
   const int width = roi_out->width;
-  int fixed = 0;
-
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(offsets) reduction(+ : fixed) schedule(static)
-#endif
-  for(int row = 2; row < roi_out->height - 2; row++)
+  float mid = *in * multiplier;
+  if(*in > data->threshold)
   {
-    const float *in = (float *)ivoid + (size_t)width * row + 2;
-    float *out = (float *)ovoid + (size_t)width * row + 2;
-    for(int col = 2; col < width - 2; col++, in++, out++)
+    int count = 0;
+    float maxin = 0.0;
+    for(int n = 0; n < 4; ++n)
+    {
+      int xx = offsets[n][0];
+      int yy = offsets[n][1];
+      float other = *(in + xx + yy * (size_t)width);
+      if(mid > other)
+      {
+        count++;
+        if(other > maxin) maxin = other;
+      }
+    }
+    // NOTE: it seems that detecting by 2 neighbors would help for extreme cases
+    if(count >= min_neighbours)
     {
-      float mid = *in * multiplier;
-      if(*in > threshold)
+      *out = maxin;
+      if(data->markfixed)
       {
-        int count = 0;
-        float maxin = 0.0;
-        for(int n = 0; n < 4; ++n)
+        const uint8_t c = FCxtrans(row, col, roi_out, xtrans);
+        for(int i = -2; i >= -10 && i >= -col; --i)
         {
-          int xx = offsets[row % 6][col % 6][n][0];
-          int yy = offsets[row % 6][col % 6][n][1];
-          float other = *(in + xx + yy * (size_t)width);
-          if(mid > other)
+          if(c == FCxtrans(row, col+i, roi_out, xtrans))
           {
-            count++;
-            if(other > maxin) maxin = other;
+            out[i] = *in;
           }
         }
-        // NOTE: it seems that detecting by 2 neighbors would help for extreme cases
-        if(count >= min_neighbours)
+        for(int i = 2; i <= 10 && i < width - col; ++i)
         {
-          *out = maxin;
-          fixed++;
-          if(markfixed)
+          if(c == FCxtrans(row, col+i, roi_out, xtrans))
           {
-            const uint8_t c = FCxtrans(row, col, roi_out, xtrans);
-            for(int i = -2; i >= -10 && i >= -col; --i)
-            {
-              if(c == FCxtrans(row, col+i, roi_out, xtrans))
-              {
-                out[i] = *in;
-              }
-            }
-            for(int i = 2; i <= 10 && i < width - col; ++i)
-            {
-              if(c == FCxtrans(row, col+i, roi_out, xtrans))
-              {
-                out[i] = *in;
-              }
-            }
+            out[i] = *in;
           }
         }
       }
+      return 1;
     }
   }
+  return 0;
+}
+
+static int process_xtrans(const dt_iop_hotpixels_data_t *data,
+                          const void *const ivoid, void *const ovoid,
+                          const dt_iop_roi_t *const roi_out, const uint8_t (*const xtrans)[6])
+{
+  int offsets[6][6][4][2];
+  xtrans_offsets(offsets, roi_out, xtrans);
+
+  const int width = roi_out->width;
+  int fixed = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(offsets) reduction(+ : fixed) schedule(static)
+#endif
+  for(int row = 2; row < roi_out->height - 2; row++)
+  {
+    const float *in = (float *)ivoid + (size_t)width * row + 2;
+    float *out = (float *)ovoid + (size_t)width * row + 2;
+    for(int col = 2; col < width - 2; col++, in++, out++)
+      fixed += fix_xtrans(data, in, out, row, col, (const int(*)[2])offsets[row % 6][col % 6], roi_out, xtrans);
+  }
 
   return fixed;
 }
 
+/* same tests as process_bayer() and process_xtrans(), but only on the sites listed in the defect
+ * map, which are given in sensor coordinates. */
+static int process_map(const dt_iop_hotpixels_data_t *data, const dt_iop_hotpixels_map_t *map,
+                       const void *const ivoid, void *const ovoid, const dt_iop_roi_t *const roi_out,
+                       const uint8_t (*const xtrans)[6])
+{
+  int offsets[6][6][4][2];
+  if(xtrans) xtrans_offsets(offsets, roi_out, xtrans);
+
+  const int width = roi_out->width;
+  int fixed = 0;
+  for(int k = 0; k < map->num; k++)
+  {
+    const int row = map->pos[k] / map->width - roi_out->y;
+    const int col = map->pos[k] % map->width - roi_out->x;
+    if(row < 2 || row >= roi_out->height - 2 || col < 2 || col >= width - 2) continue;
+    const float *in = (float *)ivoid + (size_t)width * row + col;
+    float *out = (float *)ovoid + (size_t)width * row + col;
+    if(xtrans)
+      fixed += fix_xtrans(data, in, out, row, col, (const int(*)[2])offsets[row % 6][col % 6], roi_out, xtrans);
+    else
+      fixed += fix_bayer(data, in, out, col, width);
+  }
+  return fixed;
+}
+
+// index of a camera if generation < 0, else the map of that generation
+static gchar *map_filename(const char *key, const int generation)
+{
+  char cachedir[PATH_MAX] = { 0 };
+  dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+  gchar *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, key, -1);
+  gchar *filename = generation < 0 ? g_strdup_printf("%s/hotpixels/%s.idx", cachedir, md5)
+                                   : g_strdup_printf("%s/hotpixels/%s.%d.map", cachedir, md5, generation);
+  g_free(md5);
+  return filename;
+}
+
+static FILE *map_open_write(const char *key, const int generation)
+{
+  gchar *filename = map_filename(key, generation);
+  gchar *dirname = g_path_get_dirname(filename);
+  g_mkdir_with_parents(dirname, 0700);
+  g_free(dirname);
+  FILE *f = g_fopen(filename, "wb");
+  if(!f) fprintf(stderr, "[hotpixels] failed to write defect map `%s'\n", filename);
+  g_free(filename);
+  return f;
+}
+
+static void map_free(gpointer data)
+{
+  dt_iop_hotpixels_map_t *map = (dt_iop_hotpixels_map_t *)data;
+  free(map->pos);
+  free(map);
+}
+
+static void camera_free(gpointer data)
+{
+  dt_iop_hotpixels_camera_t *camera = (dt_iop_hotpixels_camera_t *)data;
+  g_hash_table_destroy(camera->images);
+  g_list_free_full(camera->maps, map_free);
+  free(camera);
+}
+
+// the index is the key, the number of generations and pairs of image id and generation
+static void camera_save(const dt_iop_hotpixels_camera_t *camera)
+{
+  FILE *f = map_open_write(camera->key, -1);
+  if(!f) return;
+  fwrite(camera->key, sizeof(camera->key), 1, f);
+  fwrite(&camera->generations, sizeof(int32_t), 1, f);
+  GHashTableIter iter;
+  gpointer imgid, generation;
+  g_hash_table_iter_init(&iter, camera->images);
+  while(g_hash_table_iter_next(&iter, &imgid, &generation))
+  {
+    const int32_t pair[2] = { GPOINTER_TO_INT(imgid), GPOINTER_TO_INT(generation) - 1 };
+    fwrite(pair, sizeof(pair), 1, f);
+  }
+  fclose(f);
+}
+
+// returns the camera with this key, read from its index the first time. gd->lock has to be held.
+static dt_iop_hotpixels_camera_t *camera_get(dt_iop_hotpixels_global_data_t *gd, const char *key)
+{
+  for(GList *iter = gd->cameras; iter; iter = g_list_next(iter))
+    if(!strcmp(((dt_iop_hotpixels_camera_t *)iter->data)->key, key))
+      return (dt_iop_hotpixels_camera_t *)iter->data;
+
+  dt_iop_hotpixels_camera_t *camera = (dt_iop_hotpixels_camera_t *)calloc(1, sizeof(dt_iop_hotpixels_camera_t));
+  g_strlcpy(camera->key, key, sizeof(camera->key));
+  camera->images = g_hash_table_new(g_direct_hash, g_direct_equal);
+  gd->cameras = g_list_prepend(gd->cameras, camera);
+
+  // a missing or broken index starts the camera from scratch
+  gchar *filename = map_filename(key, -1);
+  FILE *f = g_fopen(filename, "rb");
+  g_free(filename);
+  if(!f) return camera;
+  char file_key[sizeof(camera->key)];
+  int32_t generations, pair[2];
+  if(fread(file_key, sizeof(file_key), 1, f) == 1 && !strncmp(file_key, key, sizeof(file_key))
+     && fread(&generations, sizeof(int32_t), 1, f) == 1 && generations >= 0)
+  {
+    camera->generations = generations;
+    while(fread(pair, sizeof(pair), 1, f) == 1)
+      if(pair[1] >= 0 && pair[1] < generations)
+      {
+        g_hash_table_insert(camera->images, GINT_TO_POINTER(pair[0]), GINT_TO_POINTER(pair[1] + 1));
+        if(pair[1] == generations - 1) camera->served++;
+      }
+  }
+  fclose(f);
+  return camera;
+}
+
+// returns the map of a generation, read from disk the first time. gd->lock has to be held.
+static dt_iop_hotpixels_map_t *map_get(dt_iop_hotpixels_camera_t *camera, const int generation)
+{
+  for(GList *iter = camera->maps; iter; iter = g_list_next(iter))
+    if(((dt_iop_hotpixels_map_t *)iter->data)->generation == generation)
+      return (dt_iop_hotpixels_map_t *)iter->data;
+
+  // a generation without a (valid) file is remembered as not learnt
+  dt_iop_hotpixels_map_t *map = (dt_iop_hotpixels_map_t *)calloc(1, sizeof(dt_iop_hotpixels_map_t));
+  map->generation = generation;
+  camera->maps = g_list_prepend(camera->maps, map);
+
+  gchar *filename = map_filename(camera->key, generation);
+  FILE *f = g_fopen(filename, "rb");
+  g_free(filename);
+  if(!f) return map;
+  int32_t header[3];
+  if(fread(header, sizeof(header), 1, f) == 1 && header[0] > 0 && header[1] > 0 && header[2] >= 0)
+  {
+    uint32_t *pos = (uint32_t *)malloc(sizeof(uint32_t) * MAX(1, header[2]));
+    int valid = pos && fread(pos, sizeof(uint32_t), header[2], f) == (size_t)header[2];
+    for(int k = 0; valid && k < header[2]; k++) valid = pos[k] < (uint32_t)header[0] * header[1];
+    if(valid)
+    {
+      map->width = header[0];
+      map->height = header[1];
+      map->num = header[2];
+      map->pos = pos;
+    }
+    else
+      free(pos);
+  }
+  fclose(f);
+  return map;
+}
+
+// binds an image to its map generation, see dt_iop_hotpixels_map_t. gd->lock has to be held.
+static int camera_bind(dt_iop_hotpixels_camera_t *camera, const int imgid)
+{
+  const int bound = GPOINTER_TO_INT(g_hash_table_lookup(camera->images, GINT_TO_POINTER(imgid)));
+  if(bound) return bound - 1;
+
+  int generation = camera->generations - 1;
+  if(generation < 0 || !map_get(camera, generation)->width || camera->served >= HOTPIXELS_MAP_RESCAN)
+  {
+    // this image learns a new generation
+    generation = camera->generations++;
+    camera->served = 0;
+  }
+  camera->served++;
+  g_hash_table_insert(camera->images, GINT_TO_POINTER(imgid), GINT_TO_POINTER(generation + 1));
+  camera_save(camera);
+  return generation;
+}
+
+// remember the sites fixed by a full frame scan as the map of a generation which is not learnt yet
+static void map_learn(dt_iop_hotpixels_global_data_t *gd, const dt_iop_hotpixels_data_t *data,
+                      const float *const in, const float *const out, const int width, const int height)
+{
+  // fixed sites are the only ones that changed, as there are no markers in pipes using the map.
+  // nans never compare equal, but are not hot pixels.
+  int num = 0;
+  for(size_t k = 0; k < (size_t)width * height; k++) num += !(in[k] == out[k]) && isfinite(in[k]);
+  uint32_t *pos = (uint32_t *)malloc(sizeof(uint32_t) * MAX(1, num));
+  if(!pos) return;
+  num = 0;
+  for(size_t k = 0; k < (size_t)width * height; k++)
+    if(!(in[k] == out[k]) && isfinite(in[k])) pos[num++] = k;
+
+  dt_pthread_mutex_lock(&gd->lock);
+  dt_iop_hotpixels_map_t *map = map_get(camera_get(gd, data->map_key), data->map_generation);
+  if(map->width)
+  {
+    // learnt in the meantime, by another pipe of the same image
+    free(pos);
+    dt_pthread_mutex_unlock(&gd->lock);
+    return;
+  }
+  map->pos = pos;
+  map->num = num;
+  map->width = width;
+  map->height = height;
+  FILE *f = map_open_write(data->map_key, data->map_generation);
+  if(f)
+  {
+    const int32_t header[3] = { width, height, num };
+    if(fwrite(header, sizeof(header), 1, f) != 1 || fwrite(pos, sizeof(uint32_t), num, f) != (size_t)num)
+      fprintf(stderr, "[hotpixels] failed to write defect map of `%s'\n", data->map_key);
+    fclose(f);
+  }
+  dt_pthread_mutex_unlock(&gd->lock);
+}
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
              void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
   dt_iop_hotpixels_gui_data_t *g = (dt_iop_hotpixels_gui_data_t *)self->gui_data;
+  dt_iop_hotpixels_global_data_t *gd = (dt_iop_hotpixels_global_data_t *)self->data;
   const dt_iop_hotpixels_data_t *data = (dt_iop_hotpixels_data_t *)piece->data;
+  const uint8_t(*const xtrans)[6]
+      = piece->pipe->dsc.filters == 9u ? (const uint8_t(*const)[6])piece->pipe->dsc.xtrans : NULL;
 
   // The processing loop should output only a few pixels, so just copy everything first
   memcpy(ovoid, ivoid, (size_t)roi_out->width * roi_out->height * sizeof(float));
 
-  int fixed;
-  if(piece->pipe->dsc.filters == 9u)
+  // the defect map is in sensor coordinates, so it only applies to unscaled buffers
+  const int use_map = data->defect_map && piece->iscale == 1.0f && roi_out->scale == 1.0f;
+  const int width = piece->buf_in.width, height = piece->buf_in.height;
+
+  int fixed = -1;
+  if(use_map && data->map_generation >= 0)
   {
-    fixed = process_xtrans(data, ivoid, ovoid, roi_out, (const uint8_t(*const)[6])piece->pipe->dsc.xtrans);
+    dt_pthread_mutex_lock(&gd->lock);
+    const dt_iop_hotpixels_map_t *map = map_get(camera_get(gd, data->map_key), data->map_generation);
+    if(map->width == width && map->height == height) fixed = process_map(data, map, ivoid, ovoid, roi_out, xtrans);
+    dt_pthread_mutex_unlock(&gd->lock);
   }
-  else
+
+  if(fixed < 0)
   {
-    fixed = process_bayer(data, ivoid, ovoid, roi_out);
+    if(xtrans)
+      fixed = process_xtrans(data, ivoid, ovoid, roi_out, xtrans);
+    else
+      fixed = process_bayer(data, ivoid, ovoid, roi_out);
+
+    if(use_map && data->map_generation >= 0 && roi_out->x == 0 && roi_out->y == 0 && roi_out->width == width
+       && roi_out->height == height)
+      map_learn(gd, data, (const float *)ivoid, (const float *)ovoid, width, height);
   }
 
   if(g != NULL && self->dev->gui_attached && piece->pipe->type == DT_DEV_PIXELPIPE_FULL)
@@ -311,9 +594,26 @@ end:
   memcpy(module->default_params, &tmp, sizeof(dt_iop_hotpixels_params_t));
 }
 
-void init(dt_iop_module_t *module)
+void init_global(dt_iop_module_so_t *module)
+{
+  dt_iop_hotpixels_global_data_t *gd
+      = (dt_iop_hotpixels_global_data_t *)malloc(sizeof(dt_iop_hotpixels_global_data_t));
+  dt_pthread_mutex_init(&gd->lock, NULL);
+  gd->cameras = NULL;
+  module->data = gd;
+}
+
+void cleanup_global(dt_iop_module_so_t *module)
 {
+  dt_iop_hotpixels_global_data_t *gd = (dt_iop_hotpixels_global_data_t *)module->data;
+  g_list_free_full(gd->cameras, camera_free);
+  dt_pthread_mutex_destroy(&gd->lock);
+  free(module->data);
   module->data = NULL;
+}
+
+void init(dt_iop_module_t *module)
+{
   module->params = calloc(1, sizeof(dt_iop_hotpixels_params_t));
   module->default_params = calloc(1, sizeof(dt_iop_hotpixels_params_t));
   module->default_enabled = 0;
@@ -326,8 +626,6 @@ void cleanup(dt_iop_module_t *module)
 {
   free(module->params);
   module->params = NULL;
-  free(module->data);
-  module->data = NULL;
 }
 
 void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *params, dt_dev_pixelpipe_t *pipe,
@@ -341,6 +639,24 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *params, dt_dev
   d->permissive = p->permissive;
   d->markfixed = p->markfixed && (pipe->type != DT_DEV_PIXELPIPE_EXPORT)
                  && (pipe->type != DT_DEV_PIXELPIPE_THUMBNAIL);
+  // markers would end up in the map, so don't use it while they are shown
+  d->defect_map = dt_conf_get_bool("plugins/darkroom/hotpixels/defect_map") && !d->markfixed;
+  snprintf(d->map_key, sizeof(d->map_key), "%s %s iso %d threshold %g strength %g%s", pipe->image.camera_maker,
+           pipe->image.camera_model, (int)pipe->image.exif_iso, p->threshold, p->strength,
+           p->permissive ? " permissive" : "");
+  d->map_generation = -1;
+  // the map is in sensor coordinates, so only pipes on the full input can use it
+  if(d->defect_map && pipe->iscale == 1.0f && (pipe->image.flags & DT_IMAGE_RAW))
+  {
+    dt_iop_hotpixels_global_data_t *gd = (dt_iop_hotpixels_global_data_t *)self->data;
+    dt_pthread_mutex_lock(&gd->lock);
+    d->map_generation = camera_bind(camera_get(gd, d->map_key), pipe->image.id);
+    dt_pthread_mutex_unlock(&gd->lock);
+    // the output depends on the map the image is bound to, which is not in the params
+    uint64_t hash = 5381 + d->map_generation;
+    for(const char *c = d->map_key; *c; c++) hash = ((hash << 5) + hash) ^ *c;
+    piece->hash = hash;
+  }
   if(!(pipe->image.flags & DT_IMAGE_RAW) || p->strength == 0.0) piece->enabled = 0;
 }
 
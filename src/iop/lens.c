@@ -125,8 +125,15 @@ typedef struct dt_iop_lensfun_data_t
   float distance;
   lfLensType target_geom;
   gboolean do_nan_checks;
+  // coarse map of the distorted coordinates at the scale it was computed for, see _lens_map_get()
+  float *map;
+  int map_width, map_height;
+  float map_orig_w, map_orig_h;
 } dt_iop_lensfun_data_t;
 
+// distance in pixels between two samples of the cached coordinate map
+#define LENS_MAP_STEP 8
+
 const char *name()
 {
   return _("lens correction");
@@ -329,10 +336,85 @@ static char *_lens_sanitize(const char *orig_lens)
   }
 }
 
+/*
+ * lensfun evaluates its distortion and tca models for every single pixel, on every run of the pipe.
+ * these are smooth, so the coordinates of every LENS_MAP_STEP-th pixel of the full image at the
+ * current scale are kept with the pipe data instead and bilinearly interpolated. the map stays
+ * valid while panning and over all tiles, commit_params() drops it. geometry conversions may
+ * return NaN outside of their valid area, which would smear over whole map cells, so these are
+ * still evaluated per pixel.
+ */
+static void _lens_map_free(dt_iop_lensfun_data_t *d)
+{
+  dt_free_align(d->map);
+  d->map = NULL;
+}
+
+static const float *_lens_map_get(dt_iop_lensfun_data_t *d, lfModifier *modifier, const float orig_w,
+                                  const float orig_h)
+{
+  if(d->do_nan_checks) return NULL;
+  if(d->map && d->map_orig_w == orig_w && d->map_orig_h == orig_h) return d->map;
+
+  _lens_map_free(d);
+  // one more sample than needed on each side, rois may be rounded up beyond orig_w x orig_h
+  const int mw = (int)(orig_w / LENS_MAP_STEP) + 3;
+  const int mh = (int)(orig_h / LENS_MAP_STEP) + 3;
+  float *map = dt_alloc_align(16, sizeof(float) * 2 * 3 * mw * mh);
+  if(!map) return NULL;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(map, modifier) schedule(static)
+#endif
+  for(int j = 0; j < mh; j++)
+    for(int i = 0; i < mw; i++)
+      lf_modifier_apply_subpixel_geometry_distortion(modifier, i * LENS_MAP_STEP, j * LENS_MAP_STEP, 1, 1,
+                                                     map + (size_t)2 * 3 * (j * mw + i));
+
+  d->map = map;
+  d->map_width = mw;
+  d->map_height = mh;
+  d->map_orig_w = orig_w;
+  d->map_orig_h = orig_h;
+  return map;
+}
+
+// same as lf_modifier_apply_subpixel_geometry_distortion() for one row, using the map if there is one
+static void _lens_map_row(const dt_iop_lensfun_data_t *const d, const float *const map, lfModifier *modifier,
+                          const int x, const int y, const int width, float *buf)
+{
+  if(!map)
+  {
+    lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, width, 1, buf);
+    return;
+  }
+
+  const int mw = d->map_width;
+  const float fy = y * (1.0f / LENS_MAP_STEP);
+  const int j = CLAMP((int)floorf(fy), 0, d->map_height - 2);
+  const float wy = fy - j;
+  const float *const row0 = map + (size_t)2 * 3 * mw * j;
+  const float *const row1 = row0 + (size_t)2 * 3 * mw;
+
+  for(int k = 0; k < width; k++, buf += 6)
+  {
+    const float fx = (x + k) * (1.0f / LENS_MAP_STEP);
+    const int i = CLAMP((int)floorf(fx), 0, mw - 2);
+    const float wx = fx - i;
+    const float *const p0 = row0 + 6 * i, *const p1 = row1 + 6 * i;
+    for(int c = 0; c < 6; c++)
+    {
+      const float top = p0[c] + wx * (p0[c + 6] - p0[c]);
+      const float bot = p1[c] + wx * (p1[c + 6] - p1[c]);
+      buf[c] = top + wy * (bot - top);
+    }
+  }
+}
+
 void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid, void *const ovoid,
              const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
-  const dt_iop_lensfun_data_t *const d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_data_t *const d = (dt_iop_lensfun_data_t *)piece->data;
   dt_iop_lensfun_gui_data_t *g = (dt_iop_lensfun_gui_data_t *)self->gui_data;
 
   const int ch = piece->colors;
@@ -366,6 +448,7 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       // acquire temp memory for distorted pixel coords
       const size_t bufsize = (size_t)roi_out->width * 2 * 3;
       void *buf = dt_alloc_align(16, bufsize * dt_get_num_threads() * sizeof(float));
+      const float *const map = _lens_map_get(d, modifier, orig_w, orig_h);
 
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(buf, modifier) schedule(static)
@@ -373,8 +456,7 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       for(int y = 0; y < roi_out->height; y++)
       {
         float *bufptr = ((float *)buf) + (size_t)bufsize * dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, bufptr);
+        _lens_map_row(d, map, modifier, roi_out->x, roi_out->y + y, roi_out->width, bufptr);
 
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y * roi_out->width * ch;
@@ -461,6 +543,7 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       // acquire temp memory for distorted pixel coords
       const size_t buf2size = (size_t)roi_out->width * 2 * 3;
       void *buf2 = dt_alloc_align(16, buf2size * sizeof(float) * dt_get_num_threads());
+      const float *const map = _lens_map_get(d, modifier, orig_w, orig_h);
 
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(buf2, buf, modifier) schedule(static)
@@ -468,8 +551,7 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       for(int y = 0; y < roi_out->height; y++)
       {
         float *buf2ptr = ((float *)buf2) + (size_t)buf2size * dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, buf2ptr);
+        _lens_map_row(d, map, modifier, roi_out->x, roi_out->y + y, roi_out->width, buf2ptr);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y * roi_out->width * ch;
         for(int x = 0; x < roi_out->width; x++, buf2ptr += 6, out += ch)
@@ -613,14 +695,14 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
     // reverse direction (useful for renderings)
     if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
+      const float *const map = _lens_map_get(d, modifier, orig_w, orig_h);
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(tmpbuf, d, modifier) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, pi);
+        _lens_map_row(d, map, modifier, roi_out->x, roi_out->y + y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -722,14 +804,14 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
 
     if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
+      const float *const map = _lens_map_get(d, modifier, orig_w, orig_h);
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(tmpbuf, d, modifier) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, pi);
+        _lens_map_row(d, map, modifier, roi_out->x, roi_out->y + y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -1026,6 +1108,7 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
   d->distance = p->distance;
   d->target_geom = p->target_geom;
   d->do_nan_checks = TRUE;
+  _lens_map_free(d);
 
   /*
    * there are certain situations when LensFun can return NAN coordinated.
@@ -1056,6 +1139,7 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     lf_lens_destroy(d->lens);
     d->lens = NULL;
   }
+  _lens_map_free(d);
   free(piece->data);
   piece->data = NULL;
 }
@@ -49,6 +49,7 @@ DT_MODULE_INTROSPECTION(1, dt_iop_liquify_params_t)
 const int   LOOKUP_OVERSAMPLE = 10;
 const int   INTERPOLATION_POINTS = 100; // when interpolating bezier
 const float STAMP_RELOCATION = 0.1;     // how many radii to move stamp forward when following a path
+const int   MAP_REBUILD = 32;           // incremental updates of a cached distortion map before it is rebuilt
 
 #define CONF_RADIUS "plugins/darkroom/liquify/radius"
 
@@ -238,6 +239,24 @@ typedef struct {
   int warp_kernel;
 } dt_iop_liquify_global_data_t;
 
+// a distortion map kept from one call to the next, together with the warps it
+// was built from. see update_global_distortion_map ().
+
+typedef struct {
+  float complex *map;
+  cairo_rectangle_int_t extent;
+  dt_liquify_warp_t *warps;
+  int num_warps;
+  int updates;      ///< incremental updates since the map was built from scratch
+} dt_liquify_map_cache_t;
+
+typedef struct {
+  dt_iop_liquify_params_t params;
+  dt_liquify_map_cache_t process_map;   ///< used by process () of the pipe only
+  dt_liquify_map_cache_t transform_map; ///< used by distort_transform (), which is also called by the gui
+  dt_pthread_mutex_t lock;              ///< protects transform_map
+} dt_iop_liquify_data_t;
+
 typedef struct {
   dt_pthread_mutex_t lock;
   dt_iop_liquify_params_t params;
@@ -930,7 +949,8 @@ static void build_round_stamp (float complex **pstamp,
   Applies a stamp at a specified position.
 
   Applies a stamp at the position specified by @a point and adds the
-  resulting vector field to the global distortion map @a global_map.
+  resulting vector field to the global distortion map @a global_map,
+  or takes it out again if @a take_out is set.
 
   The global distortion map is a map of relative pixel displacements
   encompassing all our paths.
@@ -940,7 +960,8 @@ static void add_to_global_distortion_map (float complex *global_map,
                                           const cairo_rectangle_int_t *global_map_extent,
                                           const dt_liquify_warp_t *warp,
                                           const float complex *stamp,
-                                          const cairo_rectangle_int_t *stamp_extent)
+                                          const cairo_rectangle_int_t *stamp_extent,
+                                          const gboolean take_out)
 {
   cairo_rectangle_int_t mmext = *stamp_extent;
   mmext.x += (int) round (creal (warp->point));
@@ -962,10 +983,12 @@ static void add_to_global_distortion_map (float complex *global_map,
     float complex *destrow = global_map +
       ((y - global_map_extent->y) * global_map_extent->width);
 
-    for (int x = cmmext.x; x < cmmext.x + cmmext.width; x++)
-    {
-      destrow[x - global_map_extent->x] -= srcrow[x - mmext.x];
-    }
+    if (take_out)
+      for (int x = cmmext.x; x < cmmext.x + cmmext.width; x++)
+        destrow[x - global_map_extent->x] += srcrow[x - mmext.x];
+    else
+      for (int x = cmmext.x; x < cmmext.x + cmmext.width; x++)
+        destrow[x - global_map_extent->x] -= srcrow[x - mmext.x];
   }
 }
 
@@ -1055,9 +1078,21 @@ static void _get_map_extent (const dt_iop_roi_t *roi_out,
   cairo_region_destroy (roi_out_region);
 }
 
+static void add_warp_to_global_distortion_map (float complex *map,
+                                               const cairo_rectangle_int_t *map_extent,
+                                               const dt_liquify_warp_t *warp,
+                                               const gboolean take_out)
+{
+  float complex *stamp = NULL;
+  cairo_rectangle_int_t r;
+  build_round_stamp (&stamp, &r, warp);
+  add_to_global_distortion_map (map, map_extent, warp, stamp, &r, take_out);
+  free ((void *) stamp);
+}
+
 static float complex *create_global_distortion_map (const cairo_rectangle_int_t *map_extent,
-                                                    GList *interpolated,
-                                                    gboolean inverted)
+                                                    const dt_liquify_warp_t *warps,
+                                                    const int num_warps)
 {
   // allocate distortion map big enough to contain all paths
   const int mapsize = map_extent->width * map_extent->height;
@@ -1065,86 +1100,159 @@ static float complex *create_global_distortion_map (const cairo_rectangle_int_t
   memset (map, 0, mapsize * sizeof (float complex));
 
   // build map
-  for (GList *i = interpolated; i != NULL; i = i->next)
-  {
-    const dt_liquify_warp_t *warp = ((dt_liquify_warp_t *) i->data);
-    float complex *stamp = NULL;
-    cairo_rectangle_int_t r;
-    build_round_stamp (&stamp, &r, warp);
-    add_to_global_distortion_map (map, map_extent, warp, stamp, &r);
-    free ((void *) stamp);
-  }
+  for (int k = 0; k < num_warps; k++)
+    add_warp_to_global_distortion_map (map, map_extent, &warps[k], FALSE);
 
-  if (inverted)
-  {
-    float complex * const imap = dt_alloc_align (16, mapsize * sizeof (float complex));
-    memset (imap, 0, mapsize * sizeof (float complex));
+  return map;
+}
 
-    // copy map into imap (inverted map).
-    // imap [ n + dx(map[n]) , n + dy(map[n]) ] = -map[n]
+static float complex *invert_global_distortion_map (const cairo_rectangle_int_t *map_extent,
+                                                    const float complex *map)
+{
+  const int mapsize = map_extent->width * map_extent->height;
+  float complex * const imap = dt_alloc_align (16, mapsize * sizeof (float complex));
+  memset (imap, 0, mapsize * sizeof (float complex));
 
-    #ifdef _OPENMP
-    #pragma omp parallel for schedule (static) default (shared)
-    #endif
+  // copy map into imap (inverted map).
+  // imap [ n + dx(map[n]) , n + dy(map[n]) ] = -map[n]
+
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule (static) default (shared)
+  #endif
 
-    for (int y = 0; y <  map_extent->height; y++)
+  for (int y = 0; y <  map_extent->height; y++)
+  {
+    const float complex *row = map + y * map_extent->width;
+    for (int x = 0; x < map_extent->width; x++)
     {
-      const float complex *row = map + y * map_extent->width;
-      for (int x = 0; x < map_extent->width; x++)
-      {
-        const float complex d = *(row + x);
-        // compute new position (nx,ny) given the displacement d
-        const int nx = x + (int)creal(d);
-        const int ny = y + (int)cimag(d);
-
-        // if the point falls into the extent, set it
-        if (nx>0 && nx<map_extent->width && ny>0 && ny<map_extent->height)
-          imap[nx + ny * map_extent->width] = -d;
-      }
+      const float complex d = *(row + x);
+      // compute new position (nx,ny) given the displacement d
+      const int nx = x + (int)creal(d);
+      const int ny = y + (int)cimag(d);
+
+      // if the point falls into the extent, set it
+      if (nx>0 && nx<map_extent->width && ny>0 && ny<map_extent->height)
+        imap[nx + ny * map_extent->width] = -d;
     }
+  }
 
-    dt_free_align ((void *) map);
-
-    // now just do a pass to avoid gap with a displacement of zero, note that we do not need high
-    // precision here as the inverted distortion mask is only used to compute a final displacement
-    // of points.
+  // now just do a pass to avoid gap with a displacement of zero, note that we do not need high
+  // precision here as the inverted distortion mask is only used to compute a final displacement
+  // of points.
 
-    #ifdef _OPENMP
-    #pragma omp parallel for schedule (dynamic) default (shared)
-    #endif
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule (dynamic) default (shared)
+  #endif
 
-    for (int y = 0; y <  map_extent->height; y++)
+  for (int y = 0; y <  map_extent->height; y++)
+  {
+    float complex *row = imap + y * map_extent->width;
+    float complex last[2] = { 0, 0 };
+    for (int x = 0; x < map_extent->width / 2 + 1; x++)
     {
-      float complex *row = imap + y * map_extent->width;
-      float complex last[2] = { 0, 0 };
-      for (int x = 0; x < map_extent->width / 2 + 1; x++)
+      float complex *cl = row + x;
+      float complex *cr = row + map_extent->width - x;
+      if (x!=0)
       {
-        float complex *cl = row + x;
-        float complex *cr = row + map_extent->width - x;
-        if (x!=0)
-        {
-          if (*cl == 0) *cl = last[0];
-          if (*cr == 0) *cr = last[1];
-        }
-        last[0] = *cl; last[1] = *cr;
+        if (*cl == 0) *cl = last[0];
+        if (*cr == 0) *cr = last[1];
       }
+      last[0] = *cl; last[1] = *cr;
     }
+  }
+
+  return imap;
+}
+
+static gboolean warp_equal (const dt_liquify_warp_t *a, const dt_liquify_warp_t *b)
+{
+  return a->point == b->point && a->strength == b->strength && a->radius == b->radius
+    && a->control1 == b->control1 && a->control2 == b->control2
+    && a->type == b->type && a->status == b->status;
+}
+
+/*
+  Brings the distortion map in @a cache up to date with the warps in
+  @a interpolated and returns it.  The map is owned by the cache.
+
+  The map is the sum of the stamps of all warps.  As long as the extent
+  does not change, only the warps that differ from the last call have
+  their stamps taken out and put back in.  When a single path is dragged
+  around, all warps before and after it in the list stay the same, so
+  we compare the heads and tails of the old and new lists.  Every
+  MAP_REBUILD updates the map is built from scratch, so rounding errors
+  cannot add up.
+*/
+
+static const float complex *update_global_distortion_map (dt_liquify_map_cache_t *cache,
+                                                          const cairo_rectangle_int_t *map_extent,
+                                                          GList *interpolated)
+{
+  const int num_warps = g_list_length (interpolated);
+  dt_liquify_warp_t *warps = malloc (sizeof (dt_liquify_warp_t) * MAX (num_warps, 1));
+  int k = 0;
+  for (GList *i = interpolated; i != NULL; i = i->next)
+    warps[k++] = *((dt_liquify_warp_t *) i->data);
 
-    map = imap;
+  const gboolean reuse = cache->map != NULL && cache->updates < MAP_REBUILD
+    && cache->extent.x == map_extent->x && cache->extent.y == map_extent->y
+    && cache->extent.width == map_extent->width && cache->extent.height == map_extent->height;
+
+  int head = 0, tail = 0;
+  if (reuse)
+  {
+    const int common = MIN (num_warps, cache->num_warps);
+    while (head < common && warp_equal (&warps[head], &cache->warps[head]))
+      head++;
+    while (tail < common - head
+           && warp_equal (&warps[num_warps - 1 - tail], &cache->warps[cache->num_warps - 1 - tail]))
+      tail++;
   }
+  const int removed = cache->num_warps - head - tail;
+  const int added = num_warps - head - tail;
 
-  return map;
+  if (reuse && removed + added < num_warps)
+  {
+    for (k = head; k < cache->num_warps - tail; k++)
+      add_warp_to_global_distortion_map (cache->map, map_extent, &cache->warps[k], TRUE);
+    for (k = head; k < num_warps - tail; k++)
+      add_warp_to_global_distortion_map (cache->map, map_extent, &warps[k], FALSE);
+    if (removed + added > 0)
+      cache->updates++;
+  }
+  else
+  {
+    // nothing to keep, or less work to start over
+    dt_free_align ((void *) cache->map);
+    cache->map = create_global_distortion_map (map_extent, warps, num_warps);
+    cache->extent = *map_extent;
+    cache->updates = 0;
+  }
+
+  free (cache->warps);
+  cache->warps = warps;
+  cache->num_warps = num_warps;
+  return cache->map;
+}
+
+static void free_global_distortion_map (dt_liquify_map_cache_t *cache)
+{
+  dt_free_align ((void *) cache->map);
+  free (cache->warps);
+  memset (cache, 0, sizeof (dt_liquify_map_cache_t));
 }
 
-static float complex *build_global_distortion_map (struct dt_iop_module_t *module,
-                                                   const dt_dev_pixelpipe_iop_t *piece,
-                                                   const dt_iop_roi_t *roi_in,
-                                                   const dt_iop_roi_t *roi_out,
-                                                   cairo_rectangle_int_t *map_extent)
+static const float complex *build_global_distortion_map (struct dt_iop_module_t *module,
+                                                         const dt_dev_pixelpipe_iop_t *piece,
+                                                         const dt_iop_roi_t *roi_in,
+                                                         const dt_iop_roi_t *roi_out,
+                                                         cairo_rectangle_int_t *map_extent)
 {
+  dt_iop_liquify_data_t *d = (dt_iop_liquify_data_t *) piece->data;
+
   // copy params
   dt_iop_liquify_params_t copy_params;
-  memcpy(&copy_params, (dt_iop_liquify_params_t *)piece->data, sizeof(dt_iop_liquify_params_t));
+  memcpy(&copy_params, &d->params, sizeof(dt_iop_liquify_params_t));
 
   distort_paths_raw_to_piece (module, piece->pipe, roi_in->scale, &copy_params);
 
@@ -1152,7 +1260,7 @@ static float complex *build_global_distortion_map (struct dt_iop_module_t *modul
 
   _get_map_extent (roi_out, interpolated, map_extent);
 
-  float complex *map = create_global_distortion_map(map_extent, interpolated, FALSE);
+  const float complex *map = update_global_distortion_map (&d->process_map, map_extent, interpolated);
 
   g_list_free_full (interpolated, free);
   return map;
@@ -1183,7 +1291,7 @@ void modify_roi_in (struct dt_iop_module_t *module,
 
   // copy params
   dt_iop_liquify_params_t copy_params;
-  memcpy(&copy_params, (dt_iop_liquify_params_t*)piece->data, sizeof(dt_iop_liquify_params_t));
+  memcpy(&copy_params, &((dt_iop_liquify_data_t *)piece->data)->params, sizeof(dt_iop_liquify_params_t));
 
   distort_paths_raw_to_piece (module, piece->pipe, roi_in->scale, &copy_params);
 
@@ -1248,7 +1356,8 @@ static int _distort_xtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pi
   {
     // create the distortion map for this extent
 
-    GList *interpolated = interpolate_paths ((dt_iop_liquify_params_t *)piece->data);
+    dt_iop_liquify_data_t *d = (dt_iop_liquify_data_t *) piece->data;
+    GList *interpolated = interpolate_paths (&d->params);
 
     // we need to adjust the extent to be the union enclosing all the points (currently in extent) and
     // the warps that are in (possibly partly) in this same region.
@@ -1256,11 +1365,12 @@ static int _distort_xtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pi
     dt_iop_roi_t roi_in = { .x = extent.x, .y = extent.y, .width = extent.width, .height = extent.height };
     _get_map_extent (&roi_in, interpolated, &extent);
 
-    float complex *map = create_global_distortion_map (&extent, interpolated, inverted);
+    dt_pthread_mutex_lock (&d->lock);
+    const float complex *map = update_global_distortion_map (&d->transform_map, &extent, interpolated);
+    float complex *imap = inverted ? invert_global_distortion_map (&extent, map) : NULL;
+    if (imap) map = imap;
     g_list_free_full (interpolated, free);
 
-    if (map == NULL) return 0;
-
     const int map_size =  extent.width * extent.height;
     const int x_last = extent.x + extent.width;
     const int y_last = extent.y + extent.height;
@@ -1282,7 +1392,8 @@ static int _distort_xtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *pi
       }
     }
 
-    dt_free_align ((void *) map);
+    dt_pthread_mutex_unlock (&d->lock);
+    dt_free_align ((void *) imap);
   }
 
   return 1;
@@ -1321,7 +1432,7 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
   // 2. build the distortion map
 
   cairo_rectangle_int_t map_extent;
-  float complex *map = build_global_distortion_map (module, piece, roi_in, roi_out, &map_extent);
+  const float complex *map = build_global_distortion_map (module, piece, roi_in, roi_out, &map_extent);
   if (map == NULL)
     return;
 
@@ -1329,8 +1440,6 @@ void process(struct dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, cons
 
   if (map_extent.width != 0 && map_extent.height != 0)
     apply_global_distortion_map (module, piece, in, out, roi_in, roi_out, map, &map_extent);
-
-  dt_free_align ((void *) map);
 }
 
 #ifdef HAVE_OPENCL
@@ -1500,7 +1609,6 @@ int process_cl (struct dt_iop_module_t *module,
   if (map_extent.width != 0 && map_extent.height != 0)
     err = apply_global_distortion_map_cl (module, piece, dev_in, dev_out, roi_in, roi_out, map, &map_extent);
 
-  dt_free_align ((void *) map);
   if (err != CL_SUCCESS) goto error;
 
   return TRUE;
@@ -1551,24 +1659,32 @@ void cleanup (dt_iop_module_t *module)
 
 void init_pipe (struct dt_iop_module_t *module, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
-  piece->data = malloc (module->params_size);
+  dt_iop_liquify_data_t *d = (dt_iop_liquify_data_t *) calloc (1, sizeof (dt_iop_liquify_data_t));
+  dt_pthread_mutex_init (&d->lock, NULL);
+  piece->data = d;
   module->commit_params (module, module->default_params, pipe, piece);
 }
 
 void cleanup_pipe (struct dt_iop_module_t *module, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
+  dt_iop_liquify_data_t *d = (dt_iop_liquify_data_t *) piece->data;
+  free_global_distortion_map (&d->process_map);
+  free_global_distortion_map (&d->transform_map);
+  dt_pthread_mutex_destroy (&d->lock);
   free (piece->data);
   piece->data = NULL;
 }
 
-/* commit is the synch point between core and gui, so it copies params to pipe data. */
+/* commit is the synch point between core and gui, so it copies params to pipe data.
+   the cached distortion maps stay, they are updated by comparing warps. */
 
 void commit_params (struct dt_iop_module_t *module,
                     dt_iop_params_t *params,
                     dt_dev_pixelpipe_t *pipe,
                     dt_dev_pixelpipe_iop_t *piece)
 {
-  memcpy (piece->data, params, module->params_size);
+  dt_iop_liquify_data_t *d = (dt_iop_liquify_data_t *) piece->data;
+  memcpy (&d->params, params, module->params_size);
 }
 
 // calculate the dot product of 2 vectors.
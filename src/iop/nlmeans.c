@@ -33,6 +33,9 @@
 #if defined(__SSE__)
 #include <xmmintrin.h>
 #endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 #define BLOCKSIZE                                                                                            \
@@ -156,6 +159,27 @@ static float gh(const float f, const float sharpness)
   // return 1.0f/(1.0f + fabsf(f)*spread);
 }
 
+// sum of the 2P+1 patch distances around i, clamped to the first/last full window
+static inline float window_sum(const float *const s, const int i, const int P, const int width)
+{
+  const int c = CLAMPS(i, P, width - 1 - P);
+  float sum = 0.0f;
+  for(int k = c - P; k <= c + P; k++) sum += s[k];
+  return sum;
+}
+
+#if defined(__SSE2__)
+static inline __m128 gh_sse(const __m128 f, const float sharpness)
+{
+  // same as fast_mexp2f() for four values
+  const __m128 i1 = _mm_set1_ps((float)0x3f800000u);
+  const __m128 i2 = _mm_set1_ps((float)0x3f000000u);
+  const __m128 k0 = _mm_add_ps(i1, _mm_mul_ps(_mm_mul_ps(f, _mm_set1_ps(sharpness)), _mm_sub_ps(i2, i1)));
+  const __m128 valid = _mm_cmpge_ps(k0, _mm_set1_ps((float)0x800000u));
+  return _mm_and_ps(valid, _mm_castsi128_ps(_mm_cvttps_epi32(k0)));
+}
+#endif
+
 #ifdef HAVE_OPENCL
 static int bucket_next(unsigned int *state, unsigned int max)
 {
@@ -372,6 +396,9 @@ void tiling_callback(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t
   return;
 }
 
+// rows per band, small enough to keep the output of a band in cache while going through all shifts
+#define NLMEANS_BAND 32
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
              void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
@@ -403,91 +430,96 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   // we want to sum up weights in col[3], so need to init to 0:
   memset(ovoid, 0x0, (size_t)sizeof(float) * roi_out->width * roi_out->height * 4);
 
-  // for each shift vector
-  for(int kj = -K; kj <= K; kj++)
-  {
-    for(int ki = -K; ki <= K; ki++)
-    {
-      int inited_slide = 0;
-// don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else
-// we will add up errors)
-// do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more
-// memory
+  // go through the image in bands of rows. every band is taken through all shift vectors
+  // while its part of the output is still in cache, in one parallel region for all of them.
+  const int num_bands = (roi_out->height + NLMEANS_BAND - 1) / NLMEANS_BAND;
 #ifdef _OPENMP
-#pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, Sa)
+#pragma omp parallel for schedule(dynamic) default(none) shared(Sa)
 #endif
-      for(int j = 0; j < roi_out->height; j++)
+  for(int band = 0; band < num_bands; band++)
+  {
+    float *S = Sa + (size_t)dt_get_thread_num() * roi_out->width;
+    const int band_end = MIN(roi_out->height, (band + 1) * NLMEANS_BAND);
+    // for each shift vector
+    for(int kj = -K; kj <= K; kj++)
+    {
+      for(int ki = -K; ki <= K; ki++)
       {
-        if(j + kj < 0 || j + kj >= roi_out->height) continue;
-        float *S = Sa + (size_t)dt_get_thread_num() * roi_out->width;
-        const float *ins = ((float *)ivoid) + 4 * ((size_t)roi_in->width * (j + kj) + ki);
-        float *out = ((float *)ovoid) + 4 * (size_t)roi_out->width * j;
-
-        const int Pm = MIN(MIN(P, j + kj), j);
-        const int PM = MIN(MIN(P, roi_out->height - 1 - j - kj), roi_out->height - 1 - j);
-        // first line of every thread
-        // TODO: also every once in a while to assert numerical precision!
-        if(!inited_slide)
+        int inited_slide = 0;
+        // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only,
+        // or else we will add up errors). it is started over at the top of every band.
+        for(int j = band * NLMEANS_BAND; j < band_end; j++)
         {
-          // sum up a line
-          memset(S, 0x0, sizeof(float) * roi_out->width);
-          for(int jj = -Pm; jj <= PM; jj++)
+          if(j + kj < 0 || j + kj >= roi_out->height) continue;
+          const float *ins = ((float *)ivoid) + 4 * ((size_t)roi_in->width * (j + kj) + ki);
+          float *out = ((float *)ovoid) + 4 * (size_t)roi_out->width * j;
+
+          const int Pm = MIN(MIN(P, j + kj), j);
+          const int PM = MIN(MIN(P, roi_out->height - 1 - j - kj), roi_out->height - 1 - j);
+          // first line of every band
+          // TODO: also every once in a while to assert numerical precision!
+          if(!inited_slide)
           {
-            int i = MAX(0, -ki);
-            float *s = S + i;
-            const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + jj);
-            const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + jj + kj) + ki);
-            const int last = roi_out->width + MIN(0, -ki);
-            for(; i < last; i++, inp += 4, inps += 4, s++)
+            // sum up a line
+            memset(S, 0x0, sizeof(float) * roi_out->width);
+            for(int jj = -Pm; jj <= PM; jj++)
             {
-              for(int k = 0; k < 3; k++) s[0] += (inp[k] - inps[k]) * (inp[k] - inps[k]) * norm2[k];
+              int i = MAX(0, -ki);
+              float *s = S + i;
+              const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + jj);
+              const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + jj + kj) + ki);
+              const int last = roi_out->width + MIN(0, -ki);
+              for(; i < last; i++, inp += 4, inps += 4, s++)
+              {
+                for(int k = 0; k < 3; k++) s[0] += (inp[k] - inps[k]) * (inp[k] - inps[k]) * norm2[k];
+              }
             }
+            // only reuse this if we had a full stripe
+            if(Pm == P && PM == P) inited_slide = 1;
           }
-          // only reuse this if we had a full stripe
-          if(Pm == P && PM == P) inited_slide = 1;
-        }
 
-        // sliding window for this line:
-        float *s = S;
-        float slide = 0.0f;
-        // sum up the first -P..P
-        for(int i = 0; i < 2 * P + 1; i++) slide += s[i];
-        for(int i = 0; i < roi_out->width; i++, s++, ins += 4, out += 4)
-        {
-          if(i - P > 0 && i + P < roi_out->width) slide += s[P] - s[-P - 1];
-          if(i + ki >= 0 && i + ki < roi_out->width)
+          // sliding window for this line:
+          float *s = S;
+          float slide = 0.0f;
+          // sum up the first -P..P
+          for(int i = 0; i < 2 * P + 1; i++) slide += s[i];
+          for(int i = 0; i < roi_out->width; i++, s++, ins += 4, out += 4)
           {
-            const float iv[4] = { ins[0], ins[1], ins[2], 1.0f };
+            if(i - P > 0 && i + P < roi_out->width) slide += s[P] - s[-P - 1];
+            if(i + ki >= 0 && i + ki < roi_out->width)
+            {
+              const float iv[4] = { ins[0], ins[1], ins[2], 1.0f };
 #if defined(_OPENMP) && defined(OPENMP_SIMD_)
 #pragma omp SIMD()
 #endif
-            for(size_t c = 0; c < 4; c++)
-            {
-              out[c] += iv[c] * gh(slide, sharpness);
+              for(size_t c = 0; c < 4; c++)
+              {
+                out[c] += iv[c] * gh(slide, sharpness);
+              }
             }
           }
-        }
-        if(inited_slide && j + P + 1 + MAX(0, kj) < roi_out->height)
-        {
-          // sliding window in j direction:
-          int i = MAX(0, -ki);
-          s = S + i;
-          const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + P + 1);
-          const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + P + 1 + kj) + ki);
-          const float *inm = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j - P);
-          const float *inms = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j - P + kj) + ki);
-          const int last = roi_out->width + MIN(0, -ki);
-          for(; i < last; i++, inp += 4, inps += 4, inm += 4, inms += 4, s++)
+          if(inited_slide && j + P + 1 + MAX(0, kj) < roi_out->height)
           {
-            float stmp = s[0];
-            for(int k = 0; k < 3; k++)
-              stmp += ((inp[k] - inps[k]) * (inp[k] - inps[k]) - (inm[k] - inms[k]) * (inm[k] - inms[k]))
-                      * norm2[k];
-            s[0] = stmp;
+            // sliding window in j direction:
+            int i = MAX(0, -ki);
+            s = S + i;
+            const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + P + 1);
+            const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + P + 1 + kj) + ki);
+            const float *inm = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j - P);
+            const float *inms = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j - P + kj) + ki);
+            const int last = roi_out->width + MIN(0, -ki);
+            for(; i < last; i++, inp += 4, inps += 4, inm += 4, inms += 4, s++)
+            {
+              float stmp = s[0];
+              for(int k = 0; k < 3; k++)
+                stmp += ((inp[k] - inps[k]) * (inp[k] - inps[k]) - (inm[k] - inms[k]) * (inm[k] - inms[k]))
+                        * norm2[k];
+              s[0] = stmp;
+            }
           }
+          else
+            inited_slide = 0;
         }
-        else
-          inited_slide = 0;
       }
     }
   }
@@ -516,7 +548,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
   if(piece->pipe->mask_display) dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
 }
 
-#if defined(__SSE__)
+#if defined(__SSE2__)
 /** process, all real work is done here. */
 void process_sse2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
                   void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
@@ -543,144 +575,154 @@ void process_sse2(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
   float nL = 1.0f / max_L, nC = 1.0f / max_C;
   const float norm2[4] = { nL * nL, nC * nC, nC * nC, 1.0f };
 
-  float *Sa = dt_alloc_align(64, (size_t)sizeof(float) * roi_out->width * dt_get_num_threads());
+  // per thread: patch distances of the current line, followed by the resulting weights
+  float *Sa = dt_alloc_align(64, (size_t)sizeof(float) * 2 * roi_out->width * dt_get_num_threads());
   // we want to sum up weights in col[3], so need to init to 0:
   memset(ovoid, 0x0, (size_t)sizeof(float) * roi_out->width * roi_out->height * 4);
 
-  // for each shift vector
-  for(int kj = -K; kj <= K; kj++)
-  {
-    for(int ki = -K; ki <= K; ki++)
-    {
-      int inited_slide = 0;
-// don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else
-// we will add up errors)
-// do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more
-// memory
+  // go through the image in bands of rows. every band is taken through all shift vectors
+  // while its part of the output is still in cache, in one parallel region for all of them.
+  const int num_bands = (roi_out->height + NLMEANS_BAND - 1) / NLMEANS_BAND;
 #ifdef _OPENMP
-#pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, Sa)
+#pragma omp parallel for schedule(dynamic) default(none) shared(Sa)
 #endif
-      for(int j = 0; j < roi_out->height; j++)
+  for(int band = 0; band < num_bands; band++)
+  {
+    float *S = Sa + (size_t)2 * dt_get_thread_num() * roi_out->width;
+    float *const w = S + roi_out->width;
+    const int band_end = MIN(roi_out->height, (band + 1) * NLMEANS_BAND);
+    // for each shift vector
+    for(int kj = -K; kj <= K; kj++)
+    {
+      for(int ki = -K; ki <= K; ki++)
       {
-        if(j + kj < 0 || j + kj >= roi_out->height) continue;
-        float *S = Sa + (size_t)dt_get_thread_num() * roi_out->width;
-        const float *ins = ((float *)ivoid) + 4 * ((size_t)roi_in->width * (j + kj) + ki);
-        float *out = ((float *)ovoid) + 4 * (size_t)roi_out->width * j;
-
-        const int Pm = MIN(MIN(P, j + kj), j);
-        const int PM = MIN(MIN(P, roi_out->height - 1 - j - kj), roi_out->height - 1 - j);
-        // first line of every thread
-        // TODO: also every once in a while to assert numerical precision!
-        if(!inited_slide)
+        int inited_slide = 0;
+        // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only,
+        // or else we will add up errors). it is started over at the top of every band.
+        for(int j = band * NLMEANS_BAND; j < band_end; j++)
         {
-          // sum up a line
-          memset(S, 0x0, sizeof(float) * roi_out->width);
-          for(int jj = -Pm; jj <= PM; jj++)
+          if(j + kj < 0 || j + kj >= roi_out->height) continue;
+          const float *ins = ((float *)ivoid) + 4 * ((size_t)roi_in->width * (j + kj) + ki);
+          float *out = ((float *)ovoid) + 4 * (size_t)roi_out->width * j;
+
+          const int Pm = MIN(MIN(P, j + kj), j);
+          const int PM = MIN(MIN(P, roi_out->height - 1 - j - kj), roi_out->height - 1 - j);
+          // first line of every band
+          // TODO: also every once in a while to assert numerical precision!
+          if(!inited_slide)
           {
-            int i = MAX(0, -ki);
-            float *s = S + i;
-            const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + jj);
-            const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + jj + kj) + ki);
-            const int last = roi_out->width + MIN(0, -ki);
-            for(; i < last; i++, inp += 4, inps += 4, s++)
+            // sum up a line
+            memset(S, 0x0, sizeof(float) * roi_out->width);
+            for(int jj = -Pm; jj <= PM; jj++)
             {
-              for(int k = 0; k < 3; k++) s[0] += (inp[k] - inps[k]) * (inp[k] - inps[k]) * norm2[k];
+              int i = MAX(0, -ki);
+              float *s = S + i;
+              const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + jj);
+              const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + jj + kj) + ki);
+              const int last = roi_out->width + MIN(0, -ki);
+              for(; i < last; i++, inp += 4, inps += 4, s++)
+              {
+                for(int k = 0; k < 3; k++) s[0] += (inp[k] - inps[k]) * (inp[k] - inps[k]) * norm2[k];
+              }
             }
+            // only reuse this if we had a full stripe
+            if(Pm == P && PM == P) inited_slide = 1;
           }
-          // only reuse this if we had a full stripe
-          if(Pm == P && PM == P) inited_slide = 1;
-        }
 
-        // sliding window for this line:
-        float *s = S;
-        float slide = 0.0f;
-        // sum up the first -P..P
-        for(int i = 0; i < 2 * P + 1; i++) slide += s[i];
-        for(int i = 0; i < roi_out->width; i++)
-        {
-          if(i - P > 0 && i + P < roi_out->width) slide += s[P] - s[-P - 1];
-          if(i + ki >= 0 && i + ki < roi_out->width)
+          // weights for this line. instead of sliding along the line, the window around every
+          // pixel is summed up directly, four pixels at a time. at the borders the window is
+          // clamped to the first/last full one.
+          const int i0 = MAX(0, -ki), i1 = MIN(roi_out->width, roi_out->width - ki);
+          const int m0 = MIN(MAX(i0, P), i1), m1 = MAX(MIN(i1, roi_out->width - P), m0);
+          const int mv = m0 + ((m1 - m0) & ~3);
+          for(int i = i0; i < m0; i++) w[i] = gh(window_sum(S, i, P, roi_out->width), sharpness);
+          for(int i = m0; i < mv; i += 4)
           {
-            const __m128 iv = { ins[0], ins[1], ins[2], 1.0f };
-            _mm_store_ps(out, _mm_load_ps(out) + iv * _mm_set1_ps(gh(slide, sharpness)));
+            __m128 sum = _mm_loadu_ps(S + i - P);
+            for(int k = 1 - P; k <= P; k++) sum = _mm_add_ps(sum, _mm_loadu_ps(S + i + k));
+            _mm_storeu_ps(w + i, gh_sse(sum, sharpness));
           }
-          s++;
-          ins += 4;
-          out += 4;
-        }
-        if(inited_slide && j + P + 1 + MAX(0, kj) < roi_out->height)
-        {
-          // sliding window in j direction:
-          int i = MAX(0, -ki);
-          s = S + i;
-          const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + P + 1);
-          const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + P + 1 + kj) + ki);
-          const float *inm = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j - P);
-          const float *inms = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j - P + kj) + ki);
-          const int last = roi_out->width + MIN(0, -ki);
-          for(; ((intptr_t)s & 0xf) != 0 && i < last; i++, inp += 4, inps += 4, inm += 4, inms += 4, s++)
+          for(int i = mv; i < i1; i++) w[i] = gh(window_sum(S, i, P, roi_out->width), sharpness);
+
+          for(int i = i0; i < i1; i++)
           {
-            float stmp = s[0];
-            for(int k = 0; k < 3; k++)
-              stmp += ((inp[k] - inps[k]) * (inp[k] - inps[k]) - (inm[k] - inms[k]) * (inm[k] - inms[k]))
-                      * norm2[k];
-            s[0] = stmp;
+            const __m128 iv = { ins[4 * i], ins[4 * i + 1], ins[4 * i + 2], 1.0f };
+            _mm_store_ps(out + 4 * i, _mm_load_ps(out + 4 * i) + iv * _mm_set1_ps(w[i]));
           }
-          /* Process most of the line 4 pixels at a time */
-          for(; i < last - 4; i += 4, inp += 16, inps += 16, inm += 16, inms += 16, s += 4)
+          if(inited_slide && j + P + 1 + MAX(0, kj) < roi_out->height)
           {
-            __m128 sv = _mm_load_ps(s);
-            const __m128 inp1 = _mm_load_ps(inp) - _mm_load_ps(inps);
-            const __m128 inp2 = _mm_load_ps(inp + 4) - _mm_load_ps(inps + 4);
-            const __m128 inp3 = _mm_load_ps(inp + 8) - _mm_load_ps(inps + 8);
-            const __m128 inp4 = _mm_load_ps(inp + 12) - _mm_load_ps(inps + 12);
+            // sliding window in j direction:
+            int i = MAX(0, -ki);
+            float *s = S + i;
+            const float *inp = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j + P + 1);
+            const float *inps = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j + P + 1 + kj) + ki);
+            const float *inm = ((float *)ivoid) + 4 * i + 4 * (size_t)roi_in->width * (j - P);
+            const float *inms = ((float *)ivoid) + 4 * i + 4 * ((size_t)roi_in->width * (j - P + kj) + ki);
+            const int last = roi_out->width + MIN(0, -ki);
+            for(; ((intptr_t)s & 0xf) != 0 && i < last; i++, inp += 4, inps += 4, inm += 4, inms += 4, s++)
+            {
+              float stmp = s[0];
+              for(int k = 0; k < 3; k++)
+                stmp += ((inp[k] - inps[k]) * (inp[k] - inps[k]) - (inm[k] - inms[k]) * (inm[k] - inms[k]))
+                        * norm2[k];
+              s[0] = stmp;
+            }
+            /* Process most of the line 4 pixels at a time */
+            for(; i < last - 4; i += 4, inp += 16, inps += 16, inm += 16, inms += 16, s += 4)
+            {
+              __m128 sv = _mm_load_ps(s);
+              const __m128 inp1 = _mm_load_ps(inp) - _mm_load_ps(inps);
+              const __m128 inp2 = _mm_load_ps(inp + 4) - _mm_load_ps(inps + 4);
+              const __m128 inp3 = _mm_load_ps(inp + 8) - _mm_load_ps(inps + 8);
+              const __m128 inp4 = _mm_load_ps(inp + 12) - _mm_load_ps(inps + 12);
 
-            const __m128 inp12lo = _mm_unpacklo_ps(inp1, inp2);
-            const __m128 inp34lo = _mm_unpacklo_ps(inp3, inp4);
-            const __m128 inp12hi = _mm_unpackhi_ps(inp1, inp2);
-            const __m128 inp34hi = _mm_unpackhi_ps(inp3, inp4);
+              const __m128 inp12lo = _mm_unpacklo_ps(inp1, inp2);
+              const __m128 inp34lo = _mm_unpacklo_ps(inp3, inp4);
+              const __m128 inp12hi = _mm_unpackhi_ps(inp1, inp2);
+              const __m128 inp34hi = _mm_unpackhi_ps(inp3, inp4);
 
-            const __m128 inpv0 = _mm_movelh_ps(inp12lo, inp34lo);
-            sv += inpv0 * inpv0 * _mm_set1_ps(norm2[0]);
+              const __m128 inpv0 = _mm_movelh_ps(inp12lo, inp34lo);
+              sv += inpv0 * inpv0 * _mm_set1_ps(norm2[0]);
 
-            const __m128 inpv1 = _mm_movehl_ps(inp34lo, inp12lo);
-            sv += inpv1 * inpv1 * _mm_set1_ps(norm2[1]);
+              const __m128 inpv1 = _mm_movehl_ps(inp34lo, inp12lo);
+              sv += inpv1 * inpv1 * _mm_set1_ps(norm2[1]);
 
-            const __m128 inpv2 = _mm_movelh_ps(inp12hi, inp34hi);
-            sv += inpv2 * inpv2 * _mm_set1_ps(norm2[2]);
+              const __m128 inpv2 = _mm_movelh_ps(inp12hi, inp34hi);
+              sv += inpv2 * inpv2 * _mm_set1_ps(norm2[2]);
 
-            const __m128 inm1 = _mm_load_ps(inm) - _mm_load_ps(inms);
-            const __m128 inm2 = _mm_load_ps(inm + 4) - _mm_load_ps(inms + 4);
-            const __m128 inm3 = _mm_load_ps(inm + 8) - _mm_load_ps(inms + 8);
-            const __m128 inm4 = _mm_load_ps(inm + 12) - _mm_load_ps(inms + 12);
+              const __m128 inm1 = _mm_load_ps(inm) - _mm_load_ps(inms);
+              const __m128 inm2 = _mm_load_ps(inm + 4) - _mm_load_ps(inms + 4);
+              const __m128 inm3 = _mm_load_ps(inm + 8) - _mm_load_ps(inms + 8);
+              const __m128 inm4 = _mm_load_ps(inm + 12) - _mm_load_ps(inms + 12);
 
-            const __m128 inm12lo = _mm_unpacklo_ps(inm1, inm2);
-            const __m128 inm34lo = _mm_unpacklo_ps(inm3, inm4);
-            const __m128 inm12hi = _mm_unpackhi_ps(inm1, inm2);
-            const __m128 inm34hi = _mm_unpackhi_ps(inm3, inm4);
+              const __m128 inm12lo = _mm_unpacklo_ps(inm1, inm2);
+              const __m128 inm34lo = _mm_unpacklo_ps(inm3, inm4);
+              const __m128 inm12hi = _mm_unpackhi_ps(inm1, inm2);
+              const __m128 inm34hi = _mm_unpackhi_ps(inm3, inm4);
 
-            const __m128 inmv0 = _mm_movelh_ps(inm12lo, inm34lo);
-            sv -= inmv0 * inmv0 * _mm_set1_ps(norm2[0]);
+              const __m128 inmv0 = _mm_movelh_ps(inm12lo, inm34lo);
+              sv -= inmv0 * inmv0 * _mm_set1_ps(norm2[0]);
 
-            const __m128 inmv1 = _mm_movehl_ps(inm34lo, inm12lo);
-            sv -= inmv1 * inmv1 * _mm_set1_ps(norm2[1]);
+              const __m128 inmv1 = _mm_movehl_ps(inm34lo, inm12lo);
+              sv -= inmv1 * inmv1 * _mm_set1_ps(norm2[1]);
 
-            const __m128 inmv2 = _mm_movelh_ps(inm12hi, inm34hi);
-            sv -= inmv2 * inmv2 * _mm_set1_ps(norm2[2]);
+              const __m128 inmv2 = _mm_movelh_ps(inm12hi, inm34hi);
+              sv -= inmv2 * inmv2 * _mm_set1_ps(norm2[2]);
 
-            _mm_store_ps(s, sv);
-          }
-          for(; i < last; i++, inp += 4, inps += 4, inm += 4, inms += 4, s++)
-          {
-            float stmp = s[0];
-            for(int k = 0; k < 3; k++)
-              stmp += ((inp[k] - inps[k]) * (inp[k] - inps[k]) - (inm[k] - inms[k]) * (inm[k] - inms[k]))
-                      * norm2[k];
-            s[0] = stmp;
+              _mm_store_ps(s, sv);
+            }
+            for(; i < last; i++, inp += 4, inps += 4, inm += 4, inms += 4, s++)
+            {
+              float stmp = s[0];
+              for(int k = 0; k < 3; k++)
+                stmp += ((inp[k] - inps[k]) * (inp[k] - inps[k]) - (inm[k] - inms[k]) * (inm[k] - inms[k]))
+                        * norm2[k];
+              s[0] = stmp;
+            }
           }
+          else
+            inited_slide = 0;
         }
-        else
-          inited_slide = 0;
       }
     }
   }
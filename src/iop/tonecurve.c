@@ -496,6 +496,8 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     piece->request_histogram |= (DT_REQUEST_ON);
   else
     piece->request_histogram &= ~(DT_REQUEST_ON);
+  // the histogram is only drawn behind the curve
+  piece->request_histogram |= DT_REQUEST_SUBSAMPLE;
 
   for(int ch = 0; ch < ch_max; ch++)
   {
@@ -38,11 +38,16 @@
 #include <librsvg/rsvg-cairo.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "common/file_location.h"
 #include "common/metadata.h"
 #include "common/utility.h"
 
 #define CLIP(x) ((x < 0) ? 0.0 : (x > 1.0) ? 1.0 : x)
+#define WATERMARK_CACHE_SIZE 4
 DT_MODULE_INTROSPECTION(4, dt_iop_watermark_params_t)
 
 // gchar *checksum = g_compute_checksum_for_data(G_CHECKSUM_MD5,data,length);
@@ -93,6 +98,31 @@ typedef struct dt_iop_watermark_data_t
   char font[64];
 } dt_iop_watermark_data_t;
 
+// the watermark rendered for one placement in one roi, cropped to its non transparent part
+typedef struct dt_iop_watermark_raster_t
+{
+  gchar *svgdoc;         // the expanded svg document
+  cairo_matrix_t matrix; // transformation it was rendered with
+  int width, height;     // size of the roi
+  int x, y, w, h;        // bounding box of the non transparent pixels within the roi
+  guint8 *pixels;        // premultiplied cairo ARGB32 pixels of the bounding box, 4 * w bytes per row
+  int users;             // number of pipes blending it right now
+  int cached;            // still referenced by the cache
+  uint64_t used;         // last use, to evict the least recently used one
+} dt_iop_watermark_raster_t;
+
+// exporting a batch renders the same document over and over, so the last parsed svg and the
+// last few rasterized overlays are shared by all pipes
+typedef struct dt_iop_watermark_global_data_t
+{
+  dt_pthread_mutex_t lock;
+  gchar *svgdoc;
+  RsvgHandle *svg;
+  RsvgDimensionData dimension;
+  dt_iop_watermark_raster_t *raster[WATERMARK_CACHE_SIZE];
+  uint64_t clock;
+} dt_iop_watermark_global_data_t;
+
 typedef struct dt_iop_watermark_gui_data_t
 {
   GtkWidget *watermarks;                             // watermark
@@ -772,54 +802,224 @@ static gchar *_watermark_get_svgdoc(dt_iop_module_t *self, dt_iop_watermark_data
   return svgdoc;
 }
 
-void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
-             void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
+static void _raster_free(dt_iop_watermark_raster_t *r)
 {
-  dt_iop_watermark_data_t *data = (dt_iop_watermark_data_t *)piece->data;
-  float *in = (float *)ivoid;
-  float *out = (float *)ovoid;
-  const int ch = piece->colors;
-  double angle = (M_PI / 180) * -data->rotate;
+  if(!r) return;
+  g_free(r->svgdoc);
+  free(r->pixels);
+  free(r);
+}
 
-  /* Load svg if not loaded */
-  gchar *svgdoc = _watermark_get_svgdoc(self, data, &piece->pipe->image);
-  if(!svgdoc)
+// look up the overlay of svgdoc rendered with matrix for a roi of the given size, gd->lock must be held
+static dt_iop_watermark_raster_t *_raster_find(dt_iop_watermark_global_data_t *gd, const gchar *svgdoc,
+                                               const cairo_matrix_t *matrix, const int width, const int height)
+{
+  for(int k = 0; k < WATERMARK_CACHE_SIZE; k++)
   {
-    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
-    return;
+    dt_iop_watermark_raster_t *r = gd->raster[k];
+    if(r && r->width == width && r->height == height && !memcmp(&r->matrix, matrix, sizeof(cairo_matrix_t))
+       && !strcmp(r->svgdoc, svgdoc))
+      return r;
   }
+  return NULL;
+}
 
-  /* create the rsvghandle from parsed svg data */
-  GError *error = NULL;
-  RsvgHandle *svg = rsvg_handle_new_from_data((const guint8 *)svgdoc, strlen(svgdoc), &error);
-  g_free(svgdoc);
-  if(!svg || error)
+// replace the least recently used overlay nobody is blending, gd->lock must be held
+static void _raster_insert(dt_iop_watermark_global_data_t *gd, dt_iop_watermark_raster_t *r)
+{
+  int slot = -1;
+  for(int k = 0; k < WATERMARK_CACHE_SIZE; k++)
   {
-    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
-    return;
+    if(!gd->raster[k])
+    {
+      slot = k;
+      break;
+    }
+    if(gd->raster[k]->users) continue;
+    if(slot < 0 || gd->raster[k]->used < gd->raster[slot]->used) slot = k;
   }
+  if(slot < 0) return;
+
+  _raster_free(gd->raster[slot]);
+  gd->raster[slot] = r;
+  r->cached = 1;
+}
 
+// render the svg into a surface of the roi and keep the non transparent part
+static dt_iop_watermark_raster_t *_raster_render(RsvgHandle *svg, const gchar *svgdoc, const cairo_matrix_t *matrix,
+                                                 const int width, const int height)
+{
   /* setup stride for performance */
-  int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, roi_out->width);
+  const int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
 
   /* create cairo memory surface */
-  guint8 *image = (guint8 *)g_malloc0_n(roi_out->height, stride);
-  cairo_surface_t *surface = cairo_image_surface_create_for_data(image, CAIRO_FORMAT_ARGB32, roi_out->width,
-                                                                 roi_out->height, stride);
+  guint8 *image = (guint8 *)g_malloc0_n(height, stride);
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(image, CAIRO_FORMAT_ARGB32, width, height, stride);
   if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
   {
     //   fprintf(stderr,"Cairo surface error: %s\n",cairo_status_to_string(cairo_surface_status(surface)));
+    cairo_surface_destroy(surface);
     g_free(image);
-    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
-    return;
+    return NULL;
   }
 
   /* create cairo context and setup transformation/scale */
   cairo_t *cr = cairo_create(surface);
+  cairo_set_matrix(cr, matrix);
 
-  /* get the dimension of svg */
-  RsvgDimensionData dimension;
-  rsvg_handle_get_dimensions(svg, &dimension);
+  /* render svg into surface*/
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+  rsvg_handle_render_cairo(svg, cr);
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+
+  cairo_destroy(cr);
+
+  /* ensure that all operations on surface finishing up */
+  cairo_surface_flush(surface);
+
+  dt_iop_watermark_raster_t *r = (dt_iop_watermark_raster_t *)calloc(1, sizeof(dt_iop_watermark_raster_t));
+  r->svgdoc = g_strdup(svgdoc);
+  r->matrix = *matrix;
+  r->width = width;
+  r->height = height;
+
+  /* bounding box of everything the watermark covers */
+  int x0 = width, x1 = -1, y0 = height, y1 = -1;
+  for(int j = 0; j < height; j++)
+  {
+    const guint8 *sd = image + (size_t)j * stride;
+    for(int i = 0; i < width; i++)
+      if(sd[4 * i + 3])
+      {
+        x0 = MIN(x0, i);
+        x1 = MAX(x1, i);
+        y0 = MIN(y0, j);
+        y1 = j;
+      }
+  }
+
+  if(x1 >= x0)
+  {
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0 + 1;
+    r->h = y1 - y0 + 1;
+    r->pixels = (guint8 *)malloc((size_t)4 * r->w * r->h);
+    for(int j = 0; j < r->h; j++)
+      memcpy(r->pixels + (size_t)4 * j * r->w, image + (size_t)(j + y0) * stride + 4 * x0, (size_t)4 * r->w);
+  }
+
+  cairo_surface_destroy(surface);
+  g_free(image);
+  return r;
+}
+
+// blend the overlay r onto in, outside its bounding box the input is copied
+static void _raster_blend(const float *const in, float *const out, const dt_iop_watermark_raster_t *const r,
+                          const float opacity, const int ch)
+{
+  const int width = r->width;
+  const int height = r->height;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    const float *inp = in + (size_t)ch * j * width;
+    float *outp = out + (size_t)ch * j * width;
+
+    if(j < r->y || j >= r->y + r->h)
+    {
+      memcpy(outp, inp, sizeof(float) * ch * width);
+      continue;
+    }
+
+    memcpy(outp, inp, sizeof(float) * ch * r->x);
+    memcpy(outp + (size_t)ch * (r->x + r->w), inp + (size_t)ch * (r->x + r->w),
+           sizeof(float) * ch * (width - r->x - r->w));
+
+    const guint8 *sd = r->pixels + (size_t)4 * (j - r->y) * r->w;
+    inp += (size_t)ch * r->x;
+    outp += (size_t)ch * r->x;
+    int i = 0;
+
+#if defined(__SSE2__)
+    if(ch == 4)
+    {
+      /* svg uses a premultiplied alpha, so only use opacity for the blending.
+         cairo stores BGRA, the alpha channel of the image is passed through. */
+      const float o = opacity / 255.0f;
+      const __m128 colour = _mm_set_ps(0.0f, o, o, o);
+      const __m128 one = _mm_set1_ps(1.0f);
+      const __m128i zero = _mm_setzero_si128();
+      for(; i < r->w; i++, inp += 4, outp += 4, sd += 4)
+      {
+        int px;
+        memcpy(&px, sd, sizeof(int));
+        const __m128i p16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(px), zero);
+        const __m128 bgra = _mm_cvtepi32_ps(_mm_unpacklo_epi16(p16, zero));
+        const __m128 rgba = _mm_shuffle_ps(bgra, bgra, _MM_SHUFFLE(3, 0, 1, 2));
+        const __m128 alpha = _mm_mul_ps(_mm_shuffle_ps(bgra, bgra, _MM_SHUFFLE(3, 3, 3, 3)), colour);
+        _mm_store_ps(outp, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(one, alpha), _mm_load_ps(inp)),
+                                      _mm_mul_ps(rgba, colour)));
+      }
+    }
+#endif
+
+    for(; i < r->w; i++, inp += ch, outp += ch, sd += 4)
+    {
+      const float alpha = (sd[3] / 255.0f) * opacity;
+      /* svg uses a premultiplied alpha, so only use opacity for the blending */
+      outp[0] = ((1.0f - alpha) * inp[0]) + (opacity * (sd[2] / 255.0f));
+      outp[1] = ((1.0f - alpha) * inp[1]) + (opacity * (sd[1] / 255.0f));
+      outp[2] = ((1.0f - alpha) * inp[2]) + (opacity * (sd[0] / 255.0f));
+      outp[3] = inp[3];
+    }
+  }
+}
+
+void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
+             void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
+{
+  dt_iop_watermark_data_t *data = (dt_iop_watermark_data_t *)piece->data;
+  dt_iop_watermark_global_data_t *gd = (dt_iop_watermark_global_data_t *)self->data;
+  const int ch = piece->colors;
+  double angle = (M_PI / 180) * -data->rotate;
+
+  /* Load svg if not loaded */
+  gchar *svgdoc = _watermark_get_svgdoc(self, data, &piece->pipe->image);
+  if(!svgdoc)
+  {
+    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
+    return;
+  }
+
+  dt_pthread_mutex_lock(&gd->lock);
+
+  /* create the rsvghandle from parsed svg data, unless we already have it */
+  if(!gd->svg || strcmp(gd->svgdoc, svgdoc))
+  {
+    GError *error = NULL;
+    RsvgHandle *svg = rsvg_handle_new_from_data((const guint8 *)svgdoc, strlen(svgdoc), &error);
+    if(!svg || error)
+    {
+      dt_pthread_mutex_unlock(&gd->lock);
+      if(svg) g_object_unref(svg);
+      if(error) g_error_free(error);
+      g_free(svgdoc);
+      memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
+      return;
+    }
+    if(gd->svg) g_object_unref(gd->svg);
+    g_free(gd->svgdoc);
+    gd->svg = svg;
+    gd->svgdoc = g_strdup(svgdoc);
+
+    /* get the dimension of svg */
+    rsvg_handle_get_dimensions(svg, &gd->dimension);
+  }
+  const RsvgDimensionData dimension = gd->dimension;
 
   //  width/height of current (possibly cropped) image
   const float iw = piece->buf_in.width;
@@ -924,63 +1124,57 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     tx = iw - svg_width - bX;
 
   // translate to position
-  cairo_translate(cr, -roi_in->x, -roi_in->y);
+  cairo_matrix_t matrix;
+  cairo_matrix_init_translate(&matrix, -roi_in->x, -roi_in->y);
 
   // add translation for the given value in GUI (xoffset,yoffset)
   tx += data->xoffset * wbase;
   ty += data->yoffset * hbase;
 
-  cairo_translate(cr, tx * roi_out->scale, ty * roi_out->scale);
+  cairo_matrix_translate(&matrix, tx * roi_out->scale, ty * roi_out->scale);
 
   // compute the center of the svg to rotate from the center
   float cX = svg_width / 2.0 * roi_out->scale;
   float cY = svg_height / 2.0 * roi_out->scale;
 
-  cairo_translate(cr, cX, cY);
-  cairo_rotate(cr, angle);
-  cairo_translate(cr, -cX, -cY);
+  cairo_matrix_translate(&matrix, cX, cY);
+  cairo_matrix_rotate(&matrix, angle);
+  cairo_matrix_translate(&matrix, -cX, -cY);
 
   // now set proper scale for the watermark itself
-  cairo_scale(cr, scale, scale);
+  cairo_matrix_scale(&matrix, scale, scale);
 
-  /* render svg into surface*/
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  rsvg_handle_render_cairo(svg, cr);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  /* render the watermark unless we have it for this placement already */
+  dt_iop_watermark_raster_t *r = _raster_find(gd, svgdoc, &matrix, roi_out->width, roi_out->height);
+  if(!r)
+  {
+    r = _raster_render(gd->svg, svgdoc, &matrix, roi_out->width, roi_out->height);
+    if(r) _raster_insert(gd, r);
+  }
+  if(r)
+  {
+    r->users++;
+    r->used = ++gd->clock;
+  }
 
-  cairo_destroy(cr);
+  dt_pthread_mutex_unlock(&gd->lock);
+  g_free(svgdoc);
 
-  /* ensure that all operations on surface finishing up */
-  cairo_surface_flush(surface);
+  if(!r)
+  {
+    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
+    return;
+  }
 
   /* render surface on output */
-  guint8 *sd = image;
-  float opacity = data->opacity / 100.0;
-  /*
-  #ifdef _OPENMP
-    #pragma omp parallel for default(none) shared(in, out,sd,opacity) schedule(static)
-  #endif
-  */
-  for(int j = 0; j < roi_out->height; j++)
-    for(int i = 0; i < roi_out->width; i++)
-    {
-      float alpha = (sd[3] / 255.0) * opacity;
-      /* svg uses a premultiplied alpha, so only use opacity for the blending */
-      out[0] = ((1.0 - alpha) * in[0]) + (opacity * (sd[2] / 255.0));
-      out[1] = ((1.0 - alpha) * in[1]) + (opacity * (sd[1] / 255.0));
-      out[2] = ((1.0 - alpha) * in[2]) + (opacity * (sd[0] / 255.0));
-      out[3] = in[3];
-
-      out += ch;
-      in += ch;
-      sd += 4;
-    }
-
+  _raster_blend((const float *)ivoid, (float *)ovoid, r, data->opacity / 100.0f, ch);
 
   /* clean up */
-  cairo_surface_destroy(surface);
-  g_object_unref(svg);
-  g_free(image);
+  dt_pthread_mutex_lock(&gd->lock);
+  r->users--;
+  const int drop = !r->cached && !r->users;
+  dt_pthread_mutex_unlock(&gd->lock);
+  if(drop) _raster_free(r);
 }
 
 static void watermark_callback(GtkWidget *tb, gpointer user_data)
@@ -1241,6 +1435,25 @@ void gui_update(struct dt_iop_module_t *self)
   gtk_font_button_set_font_name(GTK_FONT_BUTTON(g->fontsel), p->font);
 }
 
+void init_global(dt_iop_module_so_t *module)
+{
+  dt_iop_watermark_global_data_t *gd
+      = (dt_iop_watermark_global_data_t *)calloc(1, sizeof(dt_iop_watermark_global_data_t));
+  dt_pthread_mutex_init(&gd->lock, NULL);
+  module->data = gd;
+}
+
+void cleanup_global(dt_iop_module_so_t *module)
+{
+  dt_iop_watermark_global_data_t *gd = (dt_iop_watermark_global_data_t *)module->data;
+  for(int k = 0; k < WATERMARK_CACHE_SIZE; k++) _raster_free(gd->raster[k]);
+  if(gd->svg) g_object_unref(gd->svg);
+  g_free(gd->svgdoc);
+  dt_pthread_mutex_destroy(&gd->lock);
+  free(module->data);
+  module->data = NULL;
+}
+
 void init(dt_iop_module_t *module)
 {
   module->params = calloc(1, sizeof(dt_iop_watermark_params_t));